@@ -0,0 +1,495 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+// Run the programs in the tests directory (including the tcp-sack and tcp-port-80 packet
+// filters) and report, as JSON, the time that it takes to load and validate them, to JIT them
+// and to execute them with the interpreter and with the code JIT'd in each mode.
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_bench_assembler.h"
+
+using ubpf_vm_up = std::unique_ptr<ubpf_vm, decltype(&ubpf_destroy)>;
+using bench_clock = std::chrono::steady_clock;
+
+struct test_program
+{
+    std::string name;
+    std::vector<ebpf_inst> instructions;
+    std::vector<uint8_t> memory;
+    std::optional<uint64_t> expected_result;
+};
+
+static void
+usage(const char* name)
+{
+    std::cerr << "usage: " << name << " [--min-time MS] [--samples COUNT] [--filter TEXT] [--output PATH] [TESTS_DIRECTORY]"
+              << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Runs the programs in TESTS_DIRECTORY (and its subdirectories) whose name contains TEXT and" << std::endl;
+    std::cerr << "writes a JSON report to PATH (default: stdout). Each execution time is the average over at" << std::endl;
+    std::cerr << "least MS (default: 10) milliseconds of runs; load and compile times are the median of COUNT" << std::endl;
+    std::cerr << "(default: 25) samples." << std::endl;
+}
+
+static std::vector<uint8_t>
+parse_memory(const std::vector<std::string>& lines)
+{
+    // Like the Python test framework, ignore hexdump prefixes (e.g., "0x0010:").
+    std::vector<uint8_t> memory;
+    for (std::string line : lines) {
+        size_t colon = line.rfind(':');
+        if (colon != std::string::npos) {
+            line.erase(0, colon + 1);
+        }
+        std::string digits;
+        for (char c : line) {
+            if (std::isxdigit(static_cast<unsigned char>(c))) {
+                digits += c;
+            } else {
+                digits.clear();
+            }
+            if (digits.size() == 2) {
+                memory.push_back(static_cast<uint8_t>(std::stoul(digits, nullptr, 16)));
+                digits.clear();
+            }
+        }
+    }
+    return memory;
+}
+
+/**
+ * @brief Read the programs in the tests directory and its subdirectories.
+ *
+ * Tests that expect an error (or that exercise reloading) are skipped, as are those that
+ * cannot be assembled.
+ *
+ * @param[in] directory The directory that contains the .data files.
+ * @param[in] filter Only the tests whose name contains this text are read.
+ * @return The programs, sorted by name.
+ */
+static std::vector<test_program>
+read_test_programs(const std::filesystem::path& directory, const std::string& filter)
+{
+    std::vector<test_program> programs;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(directory)) {
+        if (entry.path().extension() != ".data") {
+            continue;
+        }
+        std::string name = std::filesystem::relative(entry.path(), directory).replace_extension().generic_string();
+        if (name.find(filter) == std::string::npos) {
+            continue;
+        }
+
+        auto sections = read_sections(entry.path());
+        if (sections.count("error") || sections.count("errror") || sections.count("reload") ||
+            sections.count("unload") || sections.count("no jit")) {
+            continue;
+        }
+
+        test_program program{name, {}, {}, {}};
+        try {
+            if (sections.count("raw")) {
+                for (const std::string& line : sections["raw"]) {
+                    uint64_t encoded = parse_number(line);
+                    ebpf_inst inst;
+                    std::memcpy(&inst, &encoded, sizeof(inst));
+                    program.instructions.push_back(inst);
+                }
+            } else if (sections.count("asm")) {
+                program.instructions = assembler().assemble(sections["asm"]);
+            }
+            if (sections.count("mem")) {
+                program.memory = parse_memory(sections["mem"]);
+            }
+            if (sections.count("result") && !sections["result"].empty()) {
+                program.expected_result = parse_number(sections["result"][0]);
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Skipping " << name << ": " << e.what() << std::endl;
+            continue;
+        }
+        if (!program.instructions.empty()) {
+            programs.push_back(std::move(program));
+        }
+    }
+
+    std::sort(programs.begin(), programs.end(), [](const test_program& left, const test_program& right) {
+        return left.name < right.name;
+    });
+    return programs;
+}
+
+// The helpers that the test programs call (see register_functions in vm/test.c).
+
+static uint64_t
+gather_bytes(uint8_t a, uint8_t b, uint8_t c, uint8_t d, uint8_t e)
+{
+    return ((uint64_t)a << 32) | ((uint32_t)b << 24) | ((uint32_t)c << 16) | ((uint16_t)d << 8) | e;
+}
+
+static void*
+memfrob_helper(void* s, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        static_cast<char*>(s)[i] ^= 42;
+    }
+    return s;
+}
+
+static void
+trash_registers()
+{
+    // The tests use this helper to check that the JIT'd code preserves its registers across
+    // calls; the compiler already clobbers the caller-saved registers freely.
+}
+
+static uint32_t
+sqrti(uint32_t x)
+{
+    return static_cast<uint32_t>(std::sqrt(x));
+}
+
+static uint64_t
+strcmp_helper(const char* a, const char* b)
+{
+    return static_cast<uint64_t>(static_cast<int64_t>(std::strcmp(a, b)));
+}
+
+static uint64_t
+unwind(uint64_t i)
+{
+    return i;
+}
+
+static int
+discard_error(FILE* stream, const char* format, ...)
+{
+    (void)stream;
+    (void)format;
+    return 0;
+}
+
+static ubpf_vm_up
+create_vm()
+{
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    if (!vm) {
+        throw std::runtime_error("out of memory");
+    }
+    ubpf_register(vm.get(), 0, "gather_bytes", reinterpret_cast<external_function_t>(gather_bytes));
+    ubpf_register(vm.get(), 1, "memfrob", reinterpret_cast<external_function_t>(memfrob_helper));
+    ubpf_register(vm.get(), 2, "trash_registers", reinterpret_cast<external_function_t>(trash_registers));
+    ubpf_register(vm.get(), 3, "sqrti", reinterpret_cast<external_function_t>(sqrti));
+    ubpf_register(vm.get(), 4, "strcmp_ext", reinterpret_cast<external_function_t>(strcmp_helper));
+    ubpf_register(vm.get(), 5, "unwind", reinterpret_cast<external_function_t>(unwind));
+    ubpf_set_unwind_function_index(vm.get(), 5);
+    ubpf_set_error_print(vm.get(), discard_error);
+    return vm;
+}
+
+static bool
+load(ubpf_vm* vm, const test_program& program)
+{
+    char* error = nullptr;
+    int result = ubpf_load(
+        vm, program.instructions.data(), static_cast<uint32_t>(program.instructions.size() * sizeof(ebpf_inst)), &error);
+    free(error);
+    return result == 0;
+}
+
+static double
+elapsed_ns(bench_clock::time_point start)
+{
+    return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+}
+
+static double
+median(std::vector<double> samples)
+{
+    std::sort(samples.begin(), samples.end());
+    size_t middle = samples.size() / 2;
+    return samples.size() % 2 ? samples[middle] : (samples[middle - 1] + samples[middle]) / 2;
+}
+
+/**
+ * @brief Measure the average time of a run, doubling the number of runs until they take at
+ * least min_time.
+ */
+template <typename run_fn>
+static double
+time_runs(run_fn run, std::chrono::nanoseconds min_time)
+{
+    volatile uint64_t sink = run();
+    for (uint64_t runs = 1;; runs *= 2) {
+        bench_clock::time_point start = bench_clock::now();
+        for (uint64_t i = 0; i < runs; i++) {
+            sink = run();
+        }
+        double total = elapsed_ns(start);
+        if (total >= min_time.count()) {
+            (void)sink;
+            return total / runs;
+        }
+    }
+}
+
+struct jit_measurement
+{
+    double compile_ns;
+    size_t code_bytes;
+    double exec_ns;
+};
+
+struct program_measurement
+{
+    double load_ns;
+    double interpreter_exec_ns;
+    std::optional<jit_measurement> jit[2];
+};
+
+static const JitMode jit_modes[2] = {BasicJitMode, ExtendedJitMode};
+static const char* jit_mode_names[2] = {"basic_jit", "extended_jit"};
+
+static std::optional<program_measurement>
+measure(const test_program& program, size_t samples, std::chrono::nanoseconds min_time)
+{
+    program_measurement measurement{};
+    std::vector<uint8_t> memory = program.memory;
+    uint8_t* mem = memory.empty() ? nullptr : memory.data();
+    alignas(16) static uint8_t stack[UBPF_EBPF_STACK_SIZE];
+
+    // Results are checked on a fresh copy of the memory, as some programs modify it.
+    auto check = [&](const char* engine, uint64_t result) {
+        std::copy(program.memory.begin(), program.memory.end(), memory.begin());
+        if (program.expected_result && result != *program.expected_result) {
+            std::cerr << "Skipping " << program.name << ": the " << engine << " returned 0x" << std::hex << result
+                      << " instead of 0x" << *program.expected_result << std::dec << std::endl;
+            return false;
+        }
+        return true;
+    };
+
+    std::vector<double> load_samples;
+    for (size_t i = 0; i < samples; i++) {
+        ubpf_vm_up vm = create_vm();
+        bench_clock::time_point start = bench_clock::now();
+        if (!load(vm.get(), program)) {
+            // Some tests (e.g., jmp) only check the disassembler and do not hold valid programs.
+            return std::nullopt;
+        }
+        load_samples.push_back(elapsed_ns(start));
+    }
+    measurement.load_ns = median(load_samples);
+
+    ubpf_vm_up vm = create_vm();
+    load(vm.get(), program);
+    // Others (e.g., ldx) only check the disassembler and access memory that they are not given.
+    uint64_t result = 0;
+    if (ubpf_exec(vm.get(), mem, memory.size(), &result) != 0 || !check("interpreter", result)) {
+        return std::nullopt;
+    }
+    measurement.interpreter_exec_ns = time_runs(
+        [&]() {
+            uint64_t value = 0;
+            ubpf_exec(vm.get(), mem, memory.size(), &value);
+            return value;
+        },
+        min_time);
+
+    for (int mode = 0; mode < 2; mode++) {
+        std::vector<double> compile_samples;
+        ubpf_vm_up jit_vm(nullptr, ubpf_destroy);
+        for (size_t i = 0; i < samples; i++) {
+            jit_vm = create_vm();
+            load(jit_vm.get(), program);
+            char* error = nullptr;
+            bench_clock::time_point start = bench_clock::now();
+            ubpf_jit_ex_fn fn = ubpf_compile_ex(jit_vm.get(), &error, jit_modes[mode]);
+            compile_samples.push_back(elapsed_ns(start));
+            free(error);
+            if (!fn) {
+                jit_vm.reset();
+                break;
+            }
+        }
+        if (!jit_vm) {
+            // The JIT does not support this platform or this program.
+            continue;
+        }
+
+        char* error = nullptr;
+        ubpf_jit_ex_fn fn = ubpf_compile_ex(jit_vm.get(), &error, jit_modes[mode]);
+        // The memory stats report the pages to which the code is mapped, so translate it again for its size.
+        std::vector<uint8_t> code(65536);
+        size_t code_bytes = code.size();
+        if (ubpf_translate_ex(jit_vm.get(), code.data(), &code_bytes, &error, jit_modes[mode]) != 0) {
+            free(error);
+            code_bytes = 0;
+        }
+
+        auto run = [&]() {
+            if (jit_modes[mode] == BasicJitMode) {
+                return reinterpret_cast<ubpf_jit_fn>(fn)(mem, memory.size());
+            }
+            return fn(mem, memory.size(), stack, sizeof(stack));
+        };
+        if (!check(jit_mode_names[mode], run())) {
+            return std::nullopt;
+        }
+        measurement.jit[mode] = jit_measurement{median(compile_samples), code_bytes, time_runs(run, min_time)};
+    }
+    return measurement;
+}
+
+static void
+write_report(
+    std::ostream& out,
+    const std::vector<std::pair<const test_program*, program_measurement>>& measurements,
+    std::chrono::nanoseconds min_time,
+    size_t samples)
+{
+    auto number = [&](double value) { out << std::fixed << std::setprecision(1) << value; };
+
+    // Summarize each execution time across programs with its geometric mean, which weighs
+    // a regression of the same factor the same on every program.
+    auto geometric_mean = [&](auto get) {
+        double log_sum = 0;
+        size_t count = 0;
+        for (const auto& [program, measurement] : measurements) {
+            std::optional<double> value = get(measurement);
+            if (value && *value > 0) {
+                log_sum += std::log(*value);
+                count++;
+            }
+        }
+        return count ? std::exp(log_sum / count) : 0.0;
+    };
+
+    out << "{" << std::endl;
+#if defined(__x86_64__) || defined(_M_X64)
+    out << "  \"architecture\": \"x86_64\"," << std::endl;
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    out << "  \"architecture\": \"arm64\"," << std::endl;
+#else
+    out << "  \"architecture\": \"unknown\"," << std::endl;
+#endif
+    out << "  \"min_time_ns\": " << min_time.count() << "," << std::endl;
+    out << "  \"samples\": " << samples << "," << std::endl;
+    out << "  \"summary\": {" << std::endl;
+    out << "    \"programs\": " << measurements.size() << "," << std::endl;
+    out << "    \"load_ns_geomean\": ";
+    number(geometric_mean([](const program_measurement& m) { return std::optional<double>(m.load_ns); }));
+    out << "," << std::endl << "    \"interpreter_exec_ns_geomean\": ";
+    number(geometric_mean([](const program_measurement& m) { return std::optional<double>(m.interpreter_exec_ns); }));
+    for (int mode = 0; mode < 2; mode++) {
+        out << "," << std::endl << "    \"" << jit_mode_names[mode] << "_compile_ns_geomean\": ";
+        number(geometric_mean([&](const program_measurement& m) {
+            return m.jit[mode] ? std::optional<double>(m.jit[mode]->compile_ns) : std::nullopt;
+        }));
+        out << "," << std::endl << "    \"" << jit_mode_names[mode] << "_exec_ns_geomean\": ";
+        number(geometric_mean([&](const program_measurement& m) {
+            return m.jit[mode] ? std::optional<double>(m.jit[mode]->exec_ns) : std::nullopt;
+        }));
+    }
+    out << std::endl << "  }," << std::endl;
+
+    out << "  \"programs\": [";
+    for (size_t i = 0; i < measurements.size(); i++) {
+        const auto& [program, measurement] = measurements[i];
+        out << (i ? "," : "") << std::endl << "    {" << std::endl;
+        out << "      \"name\": \"" << program->name << "\"," << std::endl;
+        out << "      \"instructions\": " << program->instructions.size() << "," << std::endl;
+        out << "      \"load_ns\": ";
+        number(measurement.load_ns);
+        out << "," << std::endl << "      \"interpreter_exec_ns\": ";
+        number(measurement.interpreter_exec_ns);
+        for (int mode = 0; mode < 2; mode++) {
+            const std::optional<jit_measurement>& jit = measurement.jit[mode];
+            out << "," << std::endl << "      \"" << jit_mode_names[mode] << "\": ";
+            if (!jit) {
+                out << "null";
+                continue;
+            }
+            out << "{\"compile_ns\": ";
+            number(jit->compile_ns);
+            out << ", \"code_bytes\": " << jit->code_bytes << ", \"exec_ns\": ";
+            number(jit->exec_ns);
+            out << "}";
+        }
+        out << std::endl << "    }";
+    }
+    out << std::endl << "  ]" << std::endl << "}" << std::endl;
+}
+
+int
+main(int argc, char** argv)
+{
+    std::chrono::nanoseconds min_time = std::chrono::milliseconds(10);
+    size_t samples{25};
+    std::string filter;
+    std::string output;
+    std::filesystem::path directory{UBPF_TESTS_DIRECTORY};
+
+    for (int i = 1; i < argc; i++) {
+        std::string argument{argv[i]};
+        if (argument == "--min-time" && i + 1 < argc) {
+            min_time = std::chrono::milliseconds(std::stoull(argv[++i]));
+        } else if (argument == "--samples" && i + 1 < argc) {
+            samples = std::max<size_t>(1, std::stoull(argv[++i]));
+        } else if (argument == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (argument == "--output" && i + 1 < argc) {
+            output = argv[++i];
+        } else if (argument == "-h" || argument == "--help" || argument.rfind("-", 0) == 0) {
+            usage(argv[0]);
+            return argument == "-h" || argument == "--help" ? 0 : 1;
+        } else {
+            directory = argument;
+        }
+    }
+
+    std::vector<test_program> programs = read_test_programs(directory, filter);
+    std::vector<std::pair<const test_program*, program_measurement>> measurements;
+    for (const test_program& program : programs) {
+        std::optional<program_measurement> measurement = measure(program, samples, min_time);
+        if (measurement) {
+            measurements.emplace_back(&program, *measurement);
+        }
+    }
+    if (measurements.empty()) {
+        std::cerr << "No programs to benchmark found in " << directory << std::endl;
+        return 1;
+    }
+
+    if (output.empty()) {
+        write_report(std::cout, measurements, min_time, samples);
+        return 0;
+    }
+    std::ofstream report(output);
+    write_report(report, measurements, min_time, samples);
+    return report ? 0 : 1;
+}
@@ -0,0 +1,321 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+// Read the test data files and assemble their programs, for the benchmarks that run them.
+
+#pragma once
+
+#include <cctype>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+}
+
+/**
+ * @brief Split a test data file into its sections, resolving the sections that refer to
+ * another file (e.g., `-- asm @ tcp-sack.asm`). Comments (from # to the end of the line)
+ * and blank lines are dropped.
+ */
+static std::map<std::string, std::vector<std::string>>
+read_sections(const std::filesystem::path& path)
+{
+    std::map<std::string, std::vector<std::string>> sections;
+    std::ifstream data(path);
+    std::string line;
+    std::string section;
+    while (std::getline(data, line)) {
+        line = line.substr(0, line.find('#'));
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        if (line.empty()) {
+            continue;
+        }
+        if (line.rfind("--", 0) != 0) {
+            if (!section.empty()) {
+                sections[section].push_back(line);
+            }
+            continue;
+        }
+
+        section = line.substr(2);
+        section.erase(0, section.find_first_not_of(" \t"));
+        size_t link = section.find('@');
+        if (link == std::string::npos) {
+            sections[section];
+            continue;
+        }
+        std::string linked_path = section.substr(link + 1);
+        linked_path.erase(0, linked_path.find_first_not_of(" \t"));
+        section.erase(section.find_last_not_of(" \t", link - 1) + 1);
+        std::ifstream linked(path.parent_path() / linked_path);
+        std::vector<std::string>& lines = sections[section];
+        while (std::getline(linked, line)) {
+            line = line.substr(0, line.find('#'));
+            line.erase(line.find_last_not_of(" \t\r") + 1);
+            if (!line.empty()) {
+                lines.push_back(line);
+            }
+        }
+        section.clear();
+    }
+    return sections;
+}
+
+static std::string
+trim(const std::string& text)
+{
+    size_t begin = text.find_first_not_of(" \t");
+    if (begin == std::string::npos) {
+        return {};
+    }
+    return text.substr(begin, text.find_last_not_of(" \t") + 1 - begin);
+}
+
+static uint64_t
+parse_number(const std::string& text)
+{
+    std::string digits = trim(text);
+    bool negative = !digits.empty() && digits[0] == '-';
+    if (!digits.empty() && (digits[0] == '-' || digits[0] == '+')) {
+        digits.erase(0, 1);
+    }
+    size_t parsed = 0;
+    uint64_t value = std::stoull(digits, &parsed, 0);
+    if (parsed != digits.size()) {
+        throw std::invalid_argument("invalid number " + text);
+    }
+    return negative ? 0 - value : value;
+}
+
+/**
+ * @brief A minimal assembler for the syntax of the test data files: that of ubpf/assembler.py
+ * plus the labels (as jump targets and as targets of `call local`) that bpf_conformance accepts.
+ *
+ * The Python assembler requires parcon, which the benchmarks cannot count on.
+ */
+class assembler
+{
+  public:
+    std::vector<ebpf_inst>
+    assemble(const std::vector<std::string>& lines)
+    {
+        std::vector<std::string> statements;
+        for (const std::string& line : lines) {
+            std::istringstream stream(line);
+            std::string statement;
+            while (std::getline(stream, statement, ';')) {
+                statement = trim(statement);
+                if (!statement.empty()) {
+                    statements.push_back(statement);
+                }
+            }
+        }
+
+        // The first pass finds the PC of each label, the second encodes the instructions.
+        for (int pass = 0; pass < 2; pass++) {
+            instructions.clear();
+            for (const std::string& statement : statements) {
+                if (statement.back() == ':') {
+                    labels[trim(statement.substr(0, statement.size() - 1))] = instructions.size();
+                    continue;
+                }
+                size_t space = statement.find_first_of(" \t");
+                std::string mnemonic = statement.substr(0, space);
+                std::vector<std::string> operands;
+                if (space != std::string::npos) {
+                    std::istringstream stream(statement.substr(space));
+                    std::string operand;
+                    while (std::getline(stream, operand, ',')) {
+                        operands.push_back(trim(operand));
+                    }
+                }
+                encode(mnemonic, operands, pass == 1);
+            }
+        }
+        return instructions;
+    }
+
+  private:
+    std::map<std::string, size_t> labels;
+    std::vector<ebpf_inst> instructions;
+
+    void
+    emit(uint8_t opcode, uint8_t dst, uint8_t src, int16_t offset, int32_t imm)
+    {
+        ebpf_inst inst{};
+        inst.opcode = opcode;
+        inst.dst = dst;
+        inst.src = src;
+        inst.offset = offset;
+        inst.imm = imm;
+        instructions.push_back(inst);
+    }
+
+    static bool
+    is_register(const std::string& operand)
+    {
+        return operand.rfind("%r", 0) == 0 || (operand.size() > 1 && operand[0] == 'r' && std::isdigit(operand[1]));
+    }
+
+    static uint8_t
+    parse_register(const std::string& operand)
+    {
+        if (!is_register(operand)) {
+            throw std::invalid_argument("expected a register, found " + operand);
+        }
+        uint64_t number = parse_number(operand.substr(operand[0] == '%' ? 2 : 1));
+        if (number > 10) {
+            throw std::invalid_argument("invalid register " + operand);
+        }
+        return static_cast<uint8_t>(number);
+    }
+
+    // Parse [%rN], [%rN+offset] or [%rN-offset].
+    static std::pair<uint8_t, int16_t>
+    parse_memory_reference(const std::string& operand)
+    {
+        if (operand.size() < 3 || operand.front() != '[' || operand.back() != ']') {
+            throw std::invalid_argument("expected a memory reference, found " + operand);
+        }
+        std::string inside = operand.substr(1, operand.size() - 2);
+        size_t sign = inside.find_first_of("+-");
+        int16_t offset = sign == std::string::npos ? 0 : static_cast<int16_t>(parse_number(inside.substr(sign)));
+        return {parse_register(trim(inside.substr(0, sign))), offset};
+    }
+
+    // Resolve the target of a jump (an offset like +3 or a label) relative to the next instruction.
+    int32_t
+    parse_target(const std::string& operand, bool resolve) const
+    {
+        if (!operand.empty() && (operand[0] == '+' || operand[0] == '-')) {
+            return static_cast<int32_t>(parse_number(operand));
+        }
+        if (!resolve) {
+            return 0;
+        }
+        auto label = labels.find(operand);
+        if (label == labels.end()) {
+            throw std::invalid_argument("unknown label " + operand);
+        }
+        return static_cast<int32_t>(label->second) - static_cast<int32_t>(instructions.size() + 1);
+    }
+
+    void
+    encode(const std::string& mnemonic, const std::vector<std::string>& operands, bool resolve)
+    {
+        static const std::map<std::string, uint8_t> alu_ops = {
+            {"add", 0x0},
+            {"sub", 0x1},
+            {"mul", 0x2},
+            {"div", 0x3},
+            {"or", 0x4},
+            {"and", 0x5},
+            {"lsh", 0x6},
+            {"rsh", 0x7},
+            {"neg", 0x8},
+            {"mod", 0x9},
+            {"xor", 0xa},
+            {"mov", 0xb},
+            {"arsh", 0xc}};
+        static const std::map<std::string, uint8_t> jmp_ops = {
+            {"jeq", 0x1},
+            {"jgt", 0x2},
+            {"jge", 0x3},
+            {"jset", 0x4},
+            {"jne", 0x5},
+            {"jsgt", 0x6},
+            {"jsge", 0x7},
+            {"jlt", 0xa},
+            {"jle", 0xb},
+            {"jslt", 0xc},
+            {"jsle", 0xd}};
+        static const std::map<std::string, uint8_t> sizes = {{"w", EBPF_SIZE_W}, {"h", EBPF_SIZE_H}, {"b", EBPF_SIZE_B}, {"dw", EBPF_SIZE_DW}};
+
+        auto expect_operands = [&](size_t count) {
+            if (operands.size() != count) {
+                throw std::invalid_argument("wrong number of operands for " + mnemonic);
+            }
+        };
+
+        std::string base = mnemonic;
+        uint8_t cls = EBPF_CLS_ALU64;
+        uint8_t jmp_cls = EBPF_CLS_JMP;
+        if (base.size() > 2 && base.compare(base.size() - 2, 2, "32") == 0 &&
+            (alu_ops.count(base.substr(0, base.size() - 2)) || jmp_ops.count(base.substr(0, base.size() - 2)))) {
+            base.erase(base.size() - 2);
+            cls = EBPF_CLS_ALU;
+            jmp_cls = EBPF_CLS_JMP32;
+        }
+
+        if (base == "neg") {
+            expect_operands(1);
+            emit(cls | EBPF_ALU_OP_NEG, parse_register(operands[0]), 0, 0, 0);
+        } else if (alu_ops.count(base)) {
+            expect_operands(2);
+            uint8_t opcode = cls | (alu_ops.at(base) << 4);
+            if (is_register(operands[1])) {
+                emit(opcode | EBPF_SRC_REG, parse_register(operands[0]), parse_register(operands[1]), 0, 0);
+            } else {
+                emit(opcode, parse_register(operands[0]), 0, 0, static_cast<int32_t>(parse_number(operands[1])));
+            }
+        } else if ((base.rfind("le", 0) == 0 || base.rfind("be", 0) == 0) && base.size() == 4) {
+            expect_operands(1);
+            uint8_t opcode = base[0] == 'l' ? EBPF_OP_LE : EBPF_OP_BE;
+            emit(opcode, parse_register(operands[0]), 0, 0, static_cast<int32_t>(parse_number(base.substr(2))));
+        } else if (jmp_ops.count(base)) {
+            expect_operands(3);
+            uint8_t opcode = jmp_cls | (jmp_ops.at(base) << 4);
+            int16_t offset = static_cast<int16_t>(parse_target(operands[2], resolve));
+            if (is_register(operands[1])) {
+                emit(opcode | EBPF_SRC_REG, parse_register(operands[0]), parse_register(operands[1]), offset, 0);
+            } else {
+                emit(opcode, parse_register(operands[0]), 0, offset, static_cast<int32_t>(parse_number(operands[1])));
+            }
+        } else if (base == "ja") {
+            expect_operands(1);
+            emit(EBPF_OP_JA, 0, 0, static_cast<int16_t>(parse_target(operands[0], resolve)), 0);
+        } else if (base == "exit") {
+            expect_operands(0);
+            emit(EBPF_OP_EXIT, 0, 0, 0, 0);
+        } else if (base == "call") {
+            expect_operands(1);
+            if (operands[0].rfind("local ", 0) == 0) {
+                emit(EBPF_OP_CALL, 0, 1, 0, parse_target(trim(operands[0].substr(6)), resolve));
+            } else {
+                emit(EBPF_OP_CALL, 0, 0, 0, static_cast<int32_t>(parse_number(operands[0])));
+            }
+        } else if (base == "lddw") {
+            expect_operands(2);
+            uint64_t value = parse_number(operands[1]);
+            emit(EBPF_OP_LDDW, parse_register(operands[0]), 0, 0, static_cast<int32_t>(value));
+            emit(0, 0, 0, 0, static_cast<int32_t>(value >> 32));
+        } else if (base.rfind("ldx", 0) == 0 && sizes.count(base.substr(3))) {
+            expect_operands(2);
+            auto [src, offset] = parse_memory_reference(operands[1]);
+            emit(EBPF_CLS_LDX | EBPF_MODE_MEM | sizes.at(base.substr(3)), parse_register(operands[0]), src, offset, 0);
+        } else if (base.rfind("stx", 0) == 0 && sizes.count(base.substr(3))) {
+            expect_operands(2);
+            auto [dst, offset] = parse_memory_reference(operands[0]);
+            emit(EBPF_CLS_STX | EBPF_MODE_MEM | sizes.at(base.substr(3)), dst, parse_register(operands[1]), offset, 0);
+        } else if (base.rfind("st", 0) == 0 && sizes.count(base.substr(2))) {
+            expect_operands(2);
+            auto [dst, offset] = parse_memory_reference(operands[0]);
+            emit(
+                EBPF_CLS_ST | EBPF_MODE_MEM | sizes.at(base.substr(2)),
+                dst,
+                0,
+                offset,
+                static_cast<int32_t>(parse_number(operands[1])));
+        } else {
+            throw std::invalid_argument("unknown instruction " + mnemonic);
+        }
+    }
+};
@@ -0,0 +1,222 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+// Measure the cost of calling a helper (with 0 to 5 arguments) through each of the ways that
+// uBPF dispatches calls: the interpreter's direct call of the registered helper and its call of
+// the external dispatcher, and the JIT'd code's calls through the helper table and through the
+// external dispatcher with the DynamicDispatch and StaticDispatch strategies. The report (JSON)
+// says whether the JIT'd code uses retpolines (see UBPF_DISABLE_RETPOLINES); compare a report
+// from a build with them to one from a build without them.
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+using ubpf_vm_up = std::unique_ptr<ubpf_vm, decltype(&ubpf_destroy)>;
+using bench_clock = std::chrono::steady_clock;
+
+static const int32_t calls_per_run = 1000;
+static const int max_arguments = 5;
+
+static void
+usage(const char* name)
+{
+    std::cerr << "usage: " << name << " [--min-time MS] [--output PATH]" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Writes, as JSON, the time per helper call through each dispatch path to PATH (default:" << std::endl;
+    std::cerr << "stdout). Each time is the average over at least MS (default: 50) milliseconds of runs." << std::endl;
+}
+
+static uint64_t
+helper(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, void* cookie)
+{
+    (void)p1;
+    (void)p2;
+    (void)p3;
+    (void)p4;
+    (void)cookie;
+    return p0;
+}
+
+static uint64_t
+dispatcher(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, unsigned int idx, void* cookie)
+{
+    return idx == 0 ? helper(p0, p1, p2, p3, p4, cookie) : 0;
+}
+
+static bool
+validate(unsigned int idx, const struct ubpf_vm* vm)
+{
+    (void)vm;
+    return idx == 0;
+}
+
+/**
+ * @brief Build a program that calls helper 0 calls_per_run times, passing it the given number of
+ * arguments. Without a call, the program runs the same loop (to measure its overhead).
+ */
+static std::vector<ebpf_inst>
+call_loop(int arguments, bool call)
+{
+    std::vector<ebpf_inst> program{{EBPF_OP_MOV64_IMM, 6, 0, 0, calls_per_run}};
+    for (int argument = 1; argument <= arguments; argument++) {
+        program.push_back({EBPF_OP_MOV64_IMM, static_cast<uint8_t>(argument), 0, 0, argument});
+    }
+    if (call) {
+        program.push_back({EBPF_OP_CALL, 0, 0, 0, 0});
+    } else {
+        program.push_back({EBPF_OP_MOV64_IMM, 0, 0, 0, 0});
+    }
+    program.push_back({EBPF_OP_SUB64_IMM, 6, 0, 0, 1});
+    program.push_back({EBPF_OP_JNE_IMM, 6, 0, static_cast<int16_t>(-(arguments + 3)), 0});
+    program.push_back({EBPF_OP_EXIT, 0, 0, 0, 0});
+    return program;
+}
+
+struct dispatch_path
+{
+    const char* name;
+    bool call;
+    bool use_dispatcher;
+    bool jit;
+    DispatchStrategy strategy;
+};
+
+static const dispatch_path dispatch_paths[] = {
+    {"interpreter_no_call", false, false, false, DynamicDispatch},
+    {"interpreter_helper", true, false, false, DynamicDispatch},
+    {"interpreter_dispatcher", true, true, false, DynamicDispatch},
+    {"jit_no_call", false, false, true, DynamicDispatch},
+    {"jit_dynamic_helper_table", true, false, true, DynamicDispatch},
+    {"jit_dynamic_dispatcher", true, true, true, DynamicDispatch},
+    {"jit_static_helper_table", true, false, true, StaticDispatch},
+    {"jit_static_dispatcher", true, true, true, StaticDispatch},
+};
+
+/**
+ * @brief Measure the average time of a call (i.e., of an iteration of the loop), doubling the
+ * number of runs until they take at least min_time.
+ *
+ * @return The time per call in nanoseconds, a negative number if the path is not available or
+ * NaN if the program computes the wrong result.
+ */
+static double
+measure(const dispatch_path& path, int arguments, std::chrono::nanoseconds min_time)
+{
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    if (path.use_dispatcher) {
+        ubpf_register_external_dispatcher(vm.get(), dispatcher, validate);
+    } else {
+        ubpf_register(vm.get(), 0, "helper", reinterpret_cast<external_function_t>(helper));
+    }
+    ubpf_set_dispatch_strategy(vm.get(), path.strategy);
+
+    std::vector<ebpf_inst> program = call_loop(arguments, path.call);
+    char* error = nullptr;
+    if (ubpf_load(vm.get(), program.data(), static_cast<uint32_t>(program.size() * sizeof(ebpf_inst)), &error) != 0) {
+        std::cerr << "Failed to load the program for " << path.name << ": " << error << std::endl;
+        free(error);
+        return -1;
+    }
+
+    ubpf_jit_fn fn = nullptr;
+    if (path.jit && (fn = ubpf_compile(vm.get(), &error)) == nullptr) {
+        // The JIT does not support this platform.
+        free(error);
+        return -1;
+    }
+
+    auto run = [&]() {
+        uint64_t result = 0;
+        if (fn) {
+            result = fn(nullptr, 0);
+        } else {
+            ubpf_exec(vm.get(), nullptr, 0, &result);
+        }
+        return result;
+    };
+
+    // The helper returns its first argument (and the loop without a call returns 0).
+    volatile uint64_t sink = run();
+    if (sink != (path.call && arguments > 0 ? 1u : 0u)) {
+        std::cerr << path.name << " returned the wrong result with " << arguments << " arguments." << std::endl;
+        return std::nan("");
+    }
+    for (uint64_t runs = 1;; runs *= 2) {
+        bench_clock::time_point start = bench_clock::now();
+        for (uint64_t i = 0; i < runs; i++) {
+            sink = run();
+        }
+        double total = std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+        if (total >= min_time.count()) {
+            (void)sink;
+            return total / runs / calls_per_run;
+        }
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    std::chrono::nanoseconds min_time = std::chrono::milliseconds(50);
+    std::string output;
+
+    for (int i = 1; i < argc; i++) {
+        std::string argument{argv[i]};
+        if (argument == "--min-time" && i + 1 < argc) {
+            min_time = std::chrono::milliseconds(std::stoull(argv[++i]));
+        } else if (argument == "--output" && i + 1 < argc) {
+            output = argv[++i];
+        } else {
+            usage(argv[0]);
+            return argument == "-h" || argument == "--help" ? 0 : 1;
+        }
+    }
+
+    std::ofstream file;
+    if (!output.empty()) {
+        file.open(output);
+    }
+    std::ostream& out = output.empty() ? std::cout : file;
+
+    out << "{" << std::endl;
+#if defined(UBPF_DISABLE_RETPOLINES)
+    out << "  \"retpolines\": false," << std::endl;
+#else
+    out << "  \"retpolines\": true," << std::endl;
+#endif
+    out << "  \"calls_per_run\": " << calls_per_run << "," << std::endl;
+    out << "  \"ns_per_call_by_argument_count\": {";
+    bool first = true;
+    bool correct = true;
+    for (const dispatch_path& path : dispatch_paths) {
+        out << (first ? "" : ",") << std::endl << "    \"" << path.name << "\": [";
+        first = false;
+        for (int arguments = 0; arguments <= max_arguments; arguments++) {
+            double ns = measure(path, arguments, min_time);
+            out << (arguments ? ", " : "");
+            correct &= !std::isnan(ns);
+            if (ns < 0 || std::isnan(ns)) {
+                out << "null";
+            } else {
+                out << std::fixed << std::setprecision(2) << ns;
+            }
+        }
+        out << "]";
+    }
+    out << std::endl << "  }" << std::endl << "}" << std::endl;
+    return out && correct ? 0 : 1;
+}
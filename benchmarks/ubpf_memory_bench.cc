@@ -0,0 +1,254 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+// Load many copies of the programs in the tests directory into simultaneously live VMs and
+// report the memory used per VM (as reported by ubpf_get_memory_stats and, where available,
+// by the operating system).
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_bench_assembler.h"
+
+using ubpf_vm_up = std::unique_ptr<ubpf_vm, decltype(&ubpf_destroy)>;
+
+struct test_program
+{
+    std::string name;
+    std::vector<ebpf_inst> instructions;
+};
+
+static void
+usage(const char* name)
+{
+    std::cerr << "usage: " << name << " [--vms COUNT] [--budget BYTES] [--no-jit] [TESTS_DIRECTORY]" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Loads COUNT (default: 10000) VMs with the programs in TESTS_DIRECTORY (and its subdirectories)" << std::endl;
+    std::cerr << "and reports the memory used per VM. Fails if a VM uses more than BYTES." << std::endl;
+}
+
+/**
+ * @brief A stand-in for the helpers that the test programs call (see register_functions in
+ * vm/test.c): the programs are loaded and JIT'd, never run.
+ */
+static uint64_t
+unused_helper(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t)
+{
+    return 0;
+}
+
+static ubpf_vm_up
+create_vm()
+{
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    if (vm) {
+        for (unsigned int index : {0, 1, 2, 3, 4, 5}) {
+            ubpf_register(vm.get(), index, "unused_helper", unused_helper);
+        }
+    }
+    return vm;
+}
+
+/**
+ * @brief Read the programs in the tests directory and its subdirectories.
+ *
+ * Tests that expect an error (or that exercise reloading) are skipped, as are those that
+ * cannot be assembled or loaded.
+ *
+ * @param[in] directory The directory that contains the .data files.
+ * @return The programs, sorted by name.
+ */
+static std::vector<test_program>
+read_test_programs(const std::filesystem::path& directory)
+{
+    std::vector<test_program> programs;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(directory)) {
+        if (entry.path().extension() != ".data") {
+            continue;
+        }
+        std::string name = std::filesystem::relative(entry.path(), directory).replace_extension().generic_string();
+
+        auto sections = read_sections(entry.path());
+        if (sections.count("error") || sections.count("errror") || sections.count("reload") ||
+            sections.count("unload") || sections.count("no jit")) {
+            continue;
+        }
+
+        test_program program{name, {}};
+        try {
+            if (sections.count("raw")) {
+                for (const std::string& line : sections["raw"]) {
+                    uint64_t encoded = parse_number(line);
+                    ebpf_inst inst;
+                    std::memcpy(&inst, &encoded, sizeof(inst));
+                    program.instructions.push_back(inst);
+                }
+            } else if (sections.count("asm")) {
+                program.instructions = assembler().assemble(sections["asm"]);
+            }
+        } catch (const std::exception&) {
+            continue;
+        }
+        if (program.instructions.empty()) {
+            continue;
+        }
+
+        // Some tests (e.g., jmp) only check the disassembler and do not hold valid programs.
+        ubpf_vm_up vm = create_vm();
+        char* error = nullptr;
+        if (!vm || ubpf_load(
+                       vm.get(),
+                       program.instructions.data(),
+                       static_cast<uint32_t>(program.instructions.size() * sizeof(ebpf_inst)),
+                       &error) != 0) {
+            free(error);
+            continue;
+        }
+        programs.push_back(std::move(program));
+    }
+
+    std::sort(programs.begin(), programs.end(), [](const test_program& left, const test_program& right) {
+        return left.name < right.name;
+    });
+    return programs;
+}
+
+/**
+ * @brief Read a memory statistic (in KB) of this process from /proc/self/status.
+ *
+ * @param[in] name The name of the statistic (e.g., VmRSS).
+ * @return The value of the statistic or 0 if it is not available on this platform.
+ */
+static uint64_t
+process_memory_kb(const std::string& name)
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind(name + ":", 0) == 0) {
+            std::istringstream value(line.substr(name.size() + 1));
+            uint64_t kb{};
+            value >> kb;
+            return kb;
+        }
+    }
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    size_t vm_count{10000};
+    size_t budget{0};
+    bool jit{true};
+    std::filesystem::path directory{UBPF_TESTS_DIRECTORY};
+
+    for (int i = 1; i < argc; i++) {
+        std::string argument{argv[i]};
+        if (argument == "--vms" && i + 1 < argc) {
+            vm_count = std::stoull(argv[++i]);
+        } else if (argument == "--budget" && i + 1 < argc) {
+            budget = std::stoull(argv[++i]);
+        } else if (argument == "--no-jit") {
+            jit = false;
+        } else if (argument == "-h" || argument == "--help" || argument.rfind("-", 0) == 0) {
+            usage(argv[0]);
+            return argument == "-h" || argument == "--help" ? 0 : 1;
+        } else {
+            directory = argument;
+        }
+    }
+
+    std::vector<test_program> programs = read_test_programs(directory);
+    if (programs.empty() || vm_count == 0) {
+        std::cerr << "No programs found in " << directory << std::endl;
+        return 1;
+    }
+
+    uint64_t resident_before = process_memory_kb("VmRSS");
+
+    std::vector<ubpf_vm_up> vms;
+    vms.reserve(vm_count);
+    ubpf_memory_stats totals{};
+    for (size_t i = 0; i < vm_count; i++) {
+        const test_program& program = programs[i % programs.size()];
+        ubpf_vm_up vm = create_vm();
+        char* error = nullptr;
+        if (!vm || ubpf_load(
+                       vm.get(),
+                       program.instructions.data(),
+                       static_cast<uint32_t>(program.instructions.size() * sizeof(ebpf_inst)),
+                       &error) != 0) {
+            std::cerr << "Failed to load " << program.name << ": " << (error ? error : "out of memory") << std::endl;
+            free(error);
+            return 1;
+        }
+        if (jit && ubpf_compile(vm.get(), &error) == nullptr) {
+            std::cerr << "Failed to compile " << program.name << ": " << error << std::endl;
+            free(error);
+            return 1;
+        }
+
+        ubpf_memory_stats stats;
+        ubpf_get_memory_stats(vm.get(), &stats);
+        totals.vm_bytes += stats.vm_bytes;
+        totals.instruction_bytes += stats.instruction_bytes;
+        totals.int_func_bytes += stats.int_func_bytes;
+        totals.ext_func_bytes += stats.ext_func_bytes;
+        totals.ext_func_name_bytes += stats.ext_func_name_bytes;
+        totals.local_func_bytes += stats.local_func_bytes;
+        totals.jit_bytes += stats.jit_bytes;
+        totals.memory_region_table_bytes += stats.memory_region_table_bytes;
+        totals.data_section_bytes += stats.data_section_bytes;
+        totals.kfunc_bytes += stats.kfunc_bytes;
+        totals.runtime_stats_bytes += stats.runtime_stats_bytes;
+        totals.total_bytes += stats.total_bytes;
+        vms.push_back(std::move(vm));
+    }
+
+    uint64_t resident_kb = process_memory_kb("VmRSS") - resident_before;
+
+    std::cout << vm_count << " VMs running " << programs.size() << " test programs"
+              << (jit ? " (JIT'd)" : "") << ", bytes per VM:" << std::endl;
+    auto report = [&](const char* name, size_t bytes) {
+        std::cout << "  " << std::left << std::setw(20) << name << std::right << std::setw(10) << bytes / vm_count
+                  << std::endl;
+    };
+    report("vm", totals.vm_bytes);
+    report("instructions", totals.instruction_bytes);
+    report("int_funcs", totals.int_func_bytes);
+    report("ext_funcs", totals.ext_func_bytes);
+    report("ext_func_names", totals.ext_func_name_bytes);
+    report("local_funcs", totals.local_func_bytes);
+    report("jit", totals.jit_bytes);
+    report("memory_regions", totals.memory_region_table_bytes);
+    report("data_sections", totals.data_section_bytes);
+    report("kfuncs", totals.kfunc_bytes);
+    report("runtime_stats", totals.runtime_stats_bytes);
+    report("total", totals.total_bytes);
+    if (resident_kb) {
+        report("resident", resident_kb * 1024);
+    }
+
+    if (budget && totals.total_bytes / vm_count > budget) {
+        std::cerr << "Each VM uses more than the budgeted " << budget << " bytes." << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -15,6 +15,7 @@ endif()
 option(UBPF_DISABLE_RETPOLINES "Disable retpoline security on indirect calls and jumps")
 option(UBPF_ENABLE_INSTALL "Set to true to enable the install targets")
 option(UBPF_ENABLE_TESTS "Set to true to enable tests")
+option(UBPF_ENABLE_BENCHMARKS "Set to true to enable benchmarks (also enabled by UBPF_ENABLE_TESTS)")
 option(UBPF_ENABLE_PACKAGE "Set to true to enable packaging")
 option(UBPF_SKIP_EXTERNAL "Set to true to skip external projects")
 option(UBPF_INSTALL_GIT_HOOKS "Set to true to install git hooks" ON)
@@ -83,16 +83,6 @@ static uint64_t helper_task_create(uint64_t id, uint64_t r2, uint64_t r3, uint64
     return -1;
 }
 
-static uint64_t relocation_handler(void *user_data, const uint8_t *data, uint64_t data_size, const char *symbol_name, uint64_t symbol_offset, uint64_t symbol_size) {
-    void *mem = malloc(data_size);
-    if (!mem) {
-        ESP_LOGE(TAG, "Failed to allocate memory for relocation");
-        return 0;
-    }
-    memcpy(mem, data, data_size);
-    return (uint64_t)(uintptr_t)mem + symbol_offset;
-}
-
 // --- API ---
 
 void ubpf_esp32_register_program(int id, const void *code, size_t code_len, const char *name) {
@@ -131,8 +121,9 @@ struct ubpf_vm *ubpf_esp32_create(void) {
     ubpf_register(vm, UBPF_HELPER_NVS_SET, "nvs_set", helper_nvs_set);
     ubpf_register(vm, UBPF_HELPER_NVS_GET, "nvs_get", helper_nvs_get);
     ubpf_register(vm, UBPF_HELPER_TASK_CREATE, "task_create", helper_task_create);
-    
-    ubpf_register_data_relocation(vm, NULL, relocation_handler);
+
+    // Without a data relocation function, the VM instantiates the program's .data, .rodata and .bss
+    // once (when it loads the program) and frees them with the VM.
 
     return vm;
 }
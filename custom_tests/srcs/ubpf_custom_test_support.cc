@@ -137,3 +137,210 @@ bool get_program_string(int argc, char **argv, std::string &program_string, std:
 
     return true;
 }
+
+#if defined(UBPF_HAS_ELF_H)
+std::vector<uint8_t>
+ebpf_inst_to_bytes(const std::vector<ebpf_inst> &instructions)
+{
+    std::vector<uint8_t> bytes(instructions.size() * sizeof(ebpf_inst));
+    memcpy(bytes.data(), instructions.data(), bytes.size());
+    return bytes;
+}
+
+std::vector<uint8_t>
+build_elf_object(const std::vector<elf_test_section> &sections,
+                 const std::vector<elf_test_symbol> &symbols,
+                 const std::vector<elf_test_relocation> &relocations)
+{
+    std::vector<elf_test_section> all_sections{{"", SHT_NULL, 0, {}}};
+    all_sections.insert(all_sections.end(), sections.begin(), sections.end());
+
+    auto section_index = [&](const std::string &name) -> uint16_t {
+        for (size_t i = 1; i < all_sections.size(); i++)
+        {
+            if (all_sections[i].name == name)
+            {
+                return static_cast<uint16_t>(i);
+            }
+        }
+        return SHN_UNDEF;
+    };
+    auto symbol_index = [&](const std::string &name) -> uint32_t {
+        for (size_t i = 0; i < symbols.size(); i++)
+        {
+            if (symbols[i].name == name)
+            {
+                return static_cast<uint32_t>(i + 1);
+            }
+        }
+        return 0;
+    };
+
+    // The string table holds the names of the sections and of the symbols.
+    std::vector<uint8_t> strtab{0};
+    auto add_string = [&](const std::string &string) -> uint32_t {
+        uint32_t offset = static_cast<uint32_t>(strtab.size());
+        strtab.insert(strtab.end(), string.begin(), string.end());
+        strtab.push_back(0);
+        return offset;
+    };
+
+    std::vector<std::pair<size_t, size_t>> rel_links;
+    for (const auto &section : sections)
+    {
+        std::vector<uint8_t> data;
+        for (const auto &relocation : relocations)
+        {
+            if (relocation.section != section.name)
+            {
+                continue;
+            }
+            Elf64_Rel rel{relocation.offset, ELF64_R_INFO(symbol_index(relocation.symbol), relocation.type)};
+            data.insert(data.end(), reinterpret_cast<uint8_t *>(&rel), reinterpret_cast<uint8_t *>(&rel + 1));
+        }
+        if (!data.empty())
+        {
+            rel_links.push_back({all_sections.size(), section_index(section.name)});
+            all_sections.push_back({".rel" + section.name, SHT_REL, 0, data});
+        }
+    }
+    size_t symtab_index = all_sections.size();
+
+    std::vector<uint8_t> symtab(sizeof(Elf64_Sym), 0);
+    for (const auto &symbol : symbols)
+    {
+        Elf64_Sym sym{};
+        sym.st_name = add_string(symbol.name);
+        sym.st_info = ELF64_ST_INFO(STB_GLOBAL, symbol.type);
+        sym.st_shndx = symbol.section.empty() ? SHN_UNDEF : section_index(symbol.section);
+        sym.st_value = symbol.value;
+        sym.st_size = symbol.size;
+        symtab.insert(symtab.end(), reinterpret_cast<uint8_t *>(&sym), reinterpret_cast<uint8_t *>(&sym + 1));
+    }
+    all_sections.push_back({".symtab", SHT_SYMTAB, 0, symtab});
+    size_t strtab_index = all_sections.size();
+    all_sections.push_back({".strtab", SHT_STRTAB, 0, {}});
+
+    std::vector<Elf64_Shdr> headers(all_sections.size());
+    for (size_t i = 1; i < all_sections.size(); i++)
+    {
+        headers[i].sh_name = add_string(all_sections[i].name);
+        headers[i].sh_type = all_sections[i].type;
+        headers[i].sh_flags = all_sections[i].flags;
+    }
+    all_sections[strtab_index].data = strtab;
+    headers[symtab_index].sh_link = static_cast<uint32_t>(strtab_index);
+    headers[symtab_index].sh_info = 1;
+    headers[symtab_index].sh_entsize = sizeof(Elf64_Sym);
+    for (const auto &[rel, target] : rel_links)
+    {
+        headers[rel].sh_link = static_cast<uint32_t>(symtab_index);
+        headers[rel].sh_info = static_cast<uint32_t>(target);
+        headers[rel].sh_entsize = sizeof(Elf64_Rel);
+    }
+
+    // The file is the ELF header, the contents of the sections (each aligned on 8 bytes) and the section headers.
+    std::vector<uint8_t> file(sizeof(Elf64_Ehdr), 0);
+    for (size_t i = 1; i < all_sections.size(); i++)
+    {
+        file.resize((file.size() + 7) & ~size_t{7});
+        headers[i].sh_offset = file.size();
+        headers[i].sh_size = all_sections[i].data.size();
+        headers[i].sh_addralign = 8;
+        if (all_sections[i].type != SHT_NOBITS)
+        {
+            file.insert(file.end(), all_sections[i].data.begin(), all_sections[i].data.end());
+        }
+    }
+    file.resize((file.size() + 7) & ~size_t{7});
+
+    Elf64_Ehdr ehdr{};
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+    ehdr.e_type = ET_REL;
+    ehdr.e_machine = EM_BPF;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_shoff = file.size();
+    ehdr.e_shentsize = sizeof(Elf64_Shdr);
+    ehdr.e_shnum = static_cast<uint16_t>(headers.size());
+    ehdr.e_shstrndx = static_cast<uint16_t>(strtab_index);
+    memcpy(file.data(), &ehdr, sizeof(ehdr));
+
+    file.insert(file.end(), reinterpret_cast<uint8_t *>(headers.data()),
+                reinterpret_cast<uint8_t *>(headers.data() + headers.size()));
+    return file;
+}
+#endif
+
+void
+btf_test_builder::add_words(const std::vector<uint32_t> &words)
+{
+    types.insert(types.end(), reinterpret_cast<const uint8_t *>(words.data()),
+                 reinterpret_cast<const uint8_t *>(words.data() + words.size()));
+}
+
+uint32_t
+btf_test_builder::add_string(const std::string &string)
+{
+    uint32_t offset = static_cast<uint32_t>(strings.size());
+    strings.insert(strings.end(), string.begin(), string.end());
+    strings.push_back(0);
+    return offset;
+}
+
+uint32_t
+btf_test_builder::add_int(const std::string &name, uint32_t size)
+{
+    // BTF_KIND_INT (1), followed by the encoding, offset and number of bits.
+    add_words({add_string(name), 1u << 24, size, size * 8});
+    return next_id++;
+}
+
+uint32_t
+btf_test_builder::add_struct(const std::string &name, uint32_t size, const std::vector<btf_test_member> &members,
+                             bool is_union)
+{
+    // BTF_KIND_STRUCT (4) or BTF_KIND_UNION (5), followed by the members.
+    uint32_t kind = is_union ? 5 : 4;
+    add_words({name.empty() ? 0 : add_string(name), (kind << 24) | static_cast<uint32_t>(members.size()), size});
+    for (const auto &member : members)
+    {
+        add_words({member.name.empty() ? 0 : add_string(member.name), member.type, member.bit_offset});
+    }
+    return next_id++;
+}
+
+std::vector<uint8_t>
+btf_test_builder::build_ext(const std::string &section, const std::vector<btf_test_core_relocation> &relocations)
+{
+    // The header (without function and line information), then the record size and a single block of relocations.
+    std::vector<uint32_t> words{0x0001eb9f, 32, 0, 0, 0, 0, 0, 0};
+    words.push_back(16);
+    words.push_back(add_string(section));
+    words.push_back(static_cast<uint32_t>(relocations.size()));
+    for (const auto &relocation : relocations)
+    {
+        words.insert(words.end(), {relocation.insn_off, relocation.type_id, add_string(relocation.access),
+                                   relocation.kind});
+    }
+    words[7] = static_cast<uint32_t>((words.size() - 8) * sizeof(uint32_t));
+    std::vector<uint8_t> ext(words.size() * sizeof(uint32_t));
+    memcpy(ext.data(), words.data(), ext.size());
+    return ext;
+}
+
+std::vector<uint8_t>
+btf_test_builder::build() const
+{
+    std::vector<uint32_t> header{0x0001eb9f, 24, 0, static_cast<uint32_t>(types.size()),
+                                 static_cast<uint32_t>(types.size()), static_cast<uint32_t>(strings.size())};
+    std::vector<uint8_t> btf(header.size() * sizeof(uint32_t));
+    memcpy(btf.data(), header.data(), btf.size());
+    btf.insert(btf.end(), types.begin(), types.end());
+    btf.insert(btf.end(), strings.begin(), strings.end());
+    return btf;
+}
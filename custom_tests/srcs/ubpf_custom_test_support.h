@@ -14,6 +14,14 @@ extern "C"
 #include "ubpf.h"
 }
 
+#if defined(UBPF_HAS_ELF_H)
+#if defined(UBPF_HAS_ELF_H_COMPAT)
+#include <libelf.h>
+#else
+#include <elf.h>
+#endif
+#endif
+
 #define UNREFERENCED_PARAMETER (void)
 
 /**
@@ -67,3 +75,120 @@ bool ubpf_setup_custom_test(ubpf_vm_up &vm,
  * @return false If there was a problem obtaining the program string.
  */
 bool get_program_string(int argc, char **argv, std::string &program_string, std::string &error);
+
+#if defined(UBPF_HAS_ELF_H)
+/**
+ * @brief A section of an ELF file built by build_elf_object. The data of a SHT_NOBITS section only gives its size.
+ */
+struct elf_test_section
+{
+    std::string name;
+    uint32_t type;
+    uint64_t flags;
+    std::vector<uint8_t> data;
+};
+
+/**
+ * @brief A symbol of an ELF file built by build_elf_object. An empty section name makes the symbol undefined.
+ */
+struct elf_test_symbol
+{
+    std::string name;
+    uint8_t type;
+    std::string section;
+    uint64_t value;
+    uint64_t size;
+};
+
+/**
+ * @brief A relocation (of the given type, against the named symbol) of an ELF file built by build_elf_object.
+ */
+struct elf_test_relocation
+{
+    std::string section;
+    uint64_t offset;
+    std::string symbol;
+    uint32_t type;
+};
+
+/**
+ * @brief Convert a vector of ebpf_inst to the contents of a code section.
+ *
+ * @param[in] instructions Vector of ebpf_inst.
+ * @return Vector of bytes.
+ */
+std::vector<uint8_t>
+ebpf_inst_to_bytes(const std::vector<ebpf_inst> &instructions);
+
+/**
+ * @brief Build a relocatable (eBPF) ELF file like the ones that Clang produces.
+ *
+ * Besides the given sections, the file has a .rel section for each section with relocations, a
+ * symbol table and a string table (for both the section and symbol names).
+ *
+ * @param[in] sections The sections of the file.
+ * @param[in] symbols The symbols of the file.
+ * @param[in] relocations The relocations of the file.
+ * @return The contents of the file.
+ */
+std::vector<uint8_t>
+build_elf_object(const std::vector<elf_test_section> &sections,
+                 const std::vector<elf_test_symbol> &symbols,
+                 const std::vector<elf_test_relocation> &relocations);
+#endif
+
+/**
+ * @brief A member of a struct or union built by btf_test_builder.
+ */
+struct btf_test_member
+{
+    std::string name; ///< Empty for an anonymous member.
+    uint32_t type;
+    uint32_t bit_offset;
+};
+
+/**
+ * @brief A CO-RE relocation of the .BTF.ext section built by btf_test_builder::build_ext.
+ */
+struct btf_test_core_relocation
+{
+    uint32_t insn_off;
+    uint32_t type_id;
+    std::string access;
+    uint32_t kind;
+};
+
+/**
+ * @brief Build BTF (the contents of a .BTF section) and the CO-RE relocations (in a .BTF.ext section) against it.
+ *
+ * Each add_ function returns the ID of the type that it adds.
+ */
+class btf_test_builder
+{
+  public:
+    uint32_t
+    add_int(const std::string &name, uint32_t size);
+
+    uint32_t
+    add_struct(const std::string &name, uint32_t size, const std::vector<btf_test_member> &members, bool is_union = false);
+
+    uint32_t
+    add_string(const std::string &string);
+
+    /**
+     * @brief Build the .BTF.ext section (whose strings are added to the BTF, so it must be built first).
+     */
+    std::vector<uint8_t>
+    build_ext(const std::string &section, const std::vector<btf_test_core_relocation> &relocations);
+
+    std::vector<uint8_t>
+    build() const;
+
+  private:
+    std::vector<uint8_t> types;
+    std::vector<uint8_t> strings{0};
+    uint32_t next_id{1};
+
+    void
+    add_words(const std::vector<uint32_t> &words);
+};
@@ -0,0 +1,143 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+#if defined(UBPF_HAS_ELF_H)
+// The kinds of CO-RE relocations that the program uses.
+const uint32_t field_byte_offset = 0;
+const uint32_t field_exists = 2;
+const uint32_t type_size = 9;
+
+/**
+ * @brief Add the integer types (with IDs 1 to 4) that both definitions of packet_context use.
+ */
+static void
+add_integers(btf_test_builder& builder)
+{
+    builder.add_int("unsigned char", 1);
+    builder.add_int("unsigned short", 2);
+    builder.add_int("unsigned int", 4);
+    builder.add_int("unsigned long long", 8);
+}
+#endif
+
+int
+main()
+{
+#if defined(UBPF_HAS_ELF_H)
+    // The program's definition of the context:
+    // struct packet_context { u32 length; u16 port; u8 flags; u64 id; u32 legacy; };
+    btf_test_builder local;
+    add_integers(local);
+    uint32_t local_context = local.add_struct(
+        "packet_context", 24, {{"length", 3, 0}, {"port", 2, 32}, {"flags", 1, 48}, {"id", 4, 64}, {"legacy", 3, 128}});
+
+    // The host's definition, in which the fields moved, port is in an anonymous union and legacy is gone:
+    // struct packet_context { u64 id; u32 length; u32 extra; union { u16 port; u16 dst_port; }; u8 flags; u64 more; };
+    btf_test_builder host;
+    add_integers(host);
+    uint32_t port_union = host.add_struct("", 2, {{"port", 2, 0}, {"dst_port", 2, 0}}, true);
+    host.add_struct(
+        "packet_context",
+        32,
+        {{"id", 4, 0}, {"length", 3, 64}, {"extra", 3, 96}, {"", port_union, 128}, {"flags", 1, 144}, {"more", 4, 192}});
+    std::vector<uint8_t> host_btf = host.build();
+
+    // Return length + port + flags + id + (1000 if legacy exists) + sizeof(struct packet_context).
+    std::vector<ebpf_inst> xdp{
+        {EBPF_OP_LDXW, 0, 1, 0, 0},
+        {EBPF_OP_LDXH, 2, 1, 4, 0},
+        {EBPF_OP_ADD64_REG, 0, 2, 0, 0},
+        {EBPF_OP_LDXB, 2, 1, 6, 0},
+        {EBPF_OP_ADD64_REG, 0, 2, 0, 0},
+        {EBPF_OP_LDXDW, 2, 1, 8, 0},
+        {EBPF_OP_ADD64_REG, 0, 2, 0, 0},
+        {EBPF_OP_MOV64_IMM, 2, 0, 0, 1},
+        {EBPF_OP_MUL64_IMM, 2, 0, 0, 1000},
+        {EBPF_OP_ADD64_REG, 0, 2, 0, 0},
+        {EBPF_OP_MOV64_IMM, 3, 0, 0, 24},
+        {EBPF_OP_ADD64_REG, 0, 3, 0, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    const uint32_t size = sizeof(ebpf_inst);
+    std::vector<uint8_t> ext = local.build_ext(
+        "xdp",
+        {{0 * size, local_context, "0:0", field_byte_offset},
+         {1 * size, local_context, "0:1", field_byte_offset},
+         {3 * size, local_context, "0:2", field_byte_offset},
+         {5 * size, local_context, "0:3", field_byte_offset},
+         {7 * size, local_context, "0:4", field_exists},
+         {10 * size, local_context, "0", type_size}});
+    std::vector<elf_test_section> sections{
+        {"xdp", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, ebpf_inst_to_bytes(xdp)},
+        {".BTF", SHT_PROGBITS, 0, local.build()},
+        {".BTF.ext", SHT_PROGBITS, 0, ext},
+    };
+    std::vector<elf_test_symbol> symbols{{"xdp_prog", STT_FUNC, "xdp", 0, xdp.size() * size}};
+    std::vector<uint8_t> elf = build_elf_object(sections, symbols, {});
+
+    // Without the host's BTF, the loader cannot relocate the program.
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    char* error = nullptr;
+    if (ubpf_load_elf_ex(vm.get(), elf.data(), elf.size(), "xdp_prog", &error) == 0) {
+        std::cerr << "Loaded a program with CO-RE relocations without a host BTF" << std::endl;
+        return 1;
+    }
+    free(error);
+    error = nullptr;
+
+    if (ubpf_register_btf(vm.get(), host_btf.data(), host_btf.size(), &error) != 0) {
+        std::cerr << "Failed to register the host BTF: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    if (ubpf_load_elf_ex(vm.get(), elf.data(), elf.size(), "xdp_prog", &error) != 0) {
+        std::cerr << "Failed to load the ELF file: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+
+    // A context with the host's layout.
+    std::vector<uint8_t> context(32);
+    const uint64_t id = 0x100000000;
+    const uint32_t length = 1500;
+    const uint16_t port = 443;
+    const uint8_t flags = 7;
+    memcpy(&context[0], &id, sizeof(id));
+    memcpy(&context[8], &length, sizeof(length));
+    memcpy(&context[16], &port, sizeof(port));
+    memcpy(&context[18], &flags, sizeof(flags));
+    const uint64_t expected = length + port + flags + id + 32;
+
+    uint64_t result{};
+    if (ubpf_exec(vm.get(), context.data(), context.size(), &result) != 0 || result != expected) {
+        std::cerr << "The interpreter returned " << result << " instead of " << expected << std::endl;
+        return 1;
+    }
+    ubpf_jit_fn jit_fn = ubpf_compile(vm.get(), &error);
+    if (jit_fn == nullptr) {
+        std::cerr << "Failed to compile: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    if (jit_fn(context.data(), context.size()) != expected) {
+        std::cerr << "The JIT'd code returned the wrong result" << std::endl;
+        return 1;
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,183 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+#if defined(UBPF_HAS_ELF_H)
+static bool
+check_interpreter(ubpf_vm* vm, const std::string& name, uint64_t expected)
+{
+    uint64_t result{};
+    if (ubpf_exec(vm, nullptr, 0, &result) != 0 || result != expected) {
+        std::cerr << name << ": the interpreter returned " << result << " instead of " << expected << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static uint64_t
+run(ubpf_vm* vm)
+{
+    uint64_t result{};
+    ubpf_exec(vm, nullptr, 0, &result);
+    return result;
+}
+
+static ubpf_vm_up
+load_program(ubpf_elf_object* object, const char* name)
+{
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    char* error = nullptr;
+    if (ubpf_elf_object_load(object, vm.get(), ubpf_elf_object_find_program(object, name), &error) != 0) {
+        std::cerr << "Failed to load " << name << ": " << error << std::endl;
+        free(error);
+        vm.reset();
+    }
+    return vm;
+}
+#endif
+
+int
+main()
+{
+#if defined(UBPF_HAS_ELF_H)
+    // xdp_prog increments counter (in .data, initially 5) and zeroed (in .bss) by 1 and 2 and returns their sum
+    // plus the second byte of the string in .rodata ('e'). rodata_address and counter_address return the addresses
+    // of .rodata and counter, and write_rodata tries to write to .rodata.
+    std::vector<ebpf_inst> xdp{
+        {EBPF_OP_LDDW, 1, 0, 0, 0},
+        {0, 0, 0, 0, 0},
+        {EBPF_OP_LDXW, 0, 1, 0, 0},
+        {EBPF_OP_ADD64_IMM, 0, 0, 0, 1},
+        {EBPF_OP_STXW, 1, 0, 0, 0},
+        {EBPF_OP_LDDW, 2, 0, 0, 0},
+        {0, 0, 0, 0, 0},
+        {EBPF_OP_LDXDW, 3, 2, 0, 0},
+        {EBPF_OP_ADD64_IMM, 3, 0, 0, 2},
+        {EBPF_OP_STXDW, 2, 3, 0, 0},
+        {EBPF_OP_ADD64_REG, 0, 3, 0, 0},
+        // Like clang, refer to the string through the section symbol, with the offset in the instruction.
+        {EBPF_OP_LDDW, 4, 0, 0, 1},
+        {0, 0, 0, 0, 0},
+        {EBPF_OP_LDXB, 5, 4, 0, 0},
+        {EBPF_OP_ADD64_REG, 0, 5, 0, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+        // rodata_address (16)
+        {EBPF_OP_LDDW, 0, 0, 0, 0},
+        {0, 0, 0, 0, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+        // counter_address (19)
+        {EBPF_OP_LDDW, 0, 0, 0, 0},
+        {0, 0, 0, 0, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+        // write_rodata (22)
+        {EBPF_OP_LDDW, 1, 0, 0, 0},
+        {0, 0, 0, 0, 0},
+        {EBPF_OP_STB, 1, 0, 0, 'j'},
+        {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    const uint64_t code = SHF_ALLOC | SHF_EXECINSTR;
+    const uint64_t size = sizeof(ebpf_inst);
+    std::vector<elf_test_section> sections{
+        {"xdp", SHT_PROGBITS, code, ebpf_inst_to_bytes(xdp)},
+        {".rodata", SHT_PROGBITS, SHF_ALLOC, {'h', 'e', 'l', 'l', 'o', 0}},
+        {".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, {5, 0, 0, 0}},
+        {".bss", SHT_NOBITS, SHF_ALLOC | SHF_WRITE, std::vector<uint8_t>(8)},
+    };
+    std::vector<elf_test_symbol> symbols{
+        {"xdp_prog", STT_FUNC, "xdp", 0, 16 * size},
+        {"rodata_address", STT_FUNC, "xdp", 16 * size, 3 * size},
+        {"counter_address", STT_FUNC, "xdp", 19 * size, 3 * size},
+        {"write_rodata", STT_FUNC, "xdp", 22 * size, 5 * size},
+        {".rodata", STT_SECTION, ".rodata", 0, 0},
+        {"counter", STT_OBJECT, ".data", 0, 4},
+        {"zeroed", STT_OBJECT, ".bss", 0, 8},
+    };
+    std::vector<elf_test_relocation> relocations{
+        {"xdp", 0 * size, "counter", R_BPF_64_64},
+        {"xdp", 5 * size, "zeroed", R_BPF_64_64},
+        {"xdp", 11 * size, ".rodata", R_BPF_64_64},
+        {"xdp", 16 * size, ".rodata", R_BPF_64_64},
+        {"xdp", 19 * size, "counter", R_BPF_64_64},
+        {"xdp", 22 * size, ".rodata", R_BPF_64_64},
+    };
+    std::vector<uint8_t> elf = build_elf_object(sections, symbols, relocations);
+
+    // Without a data relocation function, the VM instantiates the data sections, whose contents persist across runs
+    // (with the interpreter and the JIT alike).
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    char* error = nullptr;
+    if (ubpf_load_elf_ex(vm.get(), elf.data(), elf.size(), "xdp_prog", &error) != 0) {
+        std::cerr << "Failed to load the ELF file: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    if (!check_interpreter(vm.get(), "first run", 6 + 2 + 'e') ||
+        !check_interpreter(vm.get(), "second run", 7 + 4 + 'e')) {
+        return 1;
+    }
+    ubpf_jit_fn jit_fn = ubpf_compile(vm.get(), &error);
+    if (jit_fn == nullptr) {
+        std::cerr << "Failed to compile: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    if (jit_fn(nullptr, 0) != 8 + 6 + 'e') {
+        std::cerr << "The JIT'd code did not see the data written by the interpreter" << std::endl;
+        return 1;
+    }
+
+    // Each VM that loads a program of an object gets its own writable data sections but shares the read-only ones.
+    ubpf_elf_object* object = ubpf_elf_object_open(vm.get(), elf.data(), elf.size(), &error);
+    if (object == nullptr) {
+        std::cerr << "Failed to open the ELF object: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    ubpf_vm_up counter_vm1 = load_program(object, "counter_address");
+    ubpf_vm_up counter_vm2 = load_program(object, "counter_address");
+    ubpf_vm_up rodata_vm1 = load_program(object, "rodata_address");
+    ubpf_vm_up rodata_vm2 = load_program(object, "rodata_address");
+    ubpf_vm_up write_vm = load_program(object, "write_rodata");
+    ubpf_vm_up xdp_vm = load_program(object, "xdp_prog");
+    ubpf_elf_object_close(object);
+    if (!counter_vm1 || !counter_vm2 || !rodata_vm1 || !rodata_vm2 || !write_vm || !xdp_vm) {
+        return 1;
+    }
+    if (run(counter_vm1.get()) == run(counter_vm2.get())) {
+        std::cerr << "Two VMs share their writable data sections" << std::endl;
+        return 1;
+    }
+    uint64_t rodata = run(rodata_vm1.get());
+    rodata_vm1.reset();
+    if (run(rodata_vm2.get()) != rodata || *reinterpret_cast<const char*>(rodata) != 'h') {
+        std::cerr << "Two VMs do not share their read-only data sections" << std::endl;
+        return 1;
+    }
+    if (!check_interpreter(xdp_vm.get(), "run from the object", 6 + 2 + 'e')) {
+        return 1;
+    }
+
+    // The read-only data sections are only loaded from.
+    uint64_t result{};
+    if (ubpf_exec(write_vm.get(), nullptr, 0, &result) == 0) {
+        std::cerr << "The program wrote to .rodata" << std::endl;
+        return 1;
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,93 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+#if defined(UBPF_HAS_ELF_H)
+static uint64_t
+add_two(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    UNREFERENCED_PARAMETER(p1);
+    UNREFERENCED_PARAMETER(p2);
+    UNREFERENCED_PARAMETER(p3);
+    UNREFERENCED_PARAMETER(p4);
+    return p0 + 2;
+}
+#endif
+
+int
+main()
+{
+#if defined(UBPF_HAS_ELF_H)
+    // Like an object built with -ffunction-sections: each function is in its own section. Each function f<i> (but
+    // the first) adds 1 to r1 and returns add_two(r1); the first function, f0, passes r1 through all of them.
+    const int function_count{200};
+    const uint64_t code = SHF_ALLOC | SHF_EXECINSTR;
+    std::vector<elf_test_section> sections;
+    std::vector<elf_test_symbol> symbols;
+    std::vector<elf_test_relocation> relocations;
+    std::vector<ebpf_inst> main_function{{EBPF_OP_MOV64_IMM, 1, 0, 0, 0}};
+    for (int i = 1; i < function_count; i++) {
+        std::string name = "f" + std::to_string(i);
+        relocations.push_back({".text.f0", main_function.size() * sizeof(ebpf_inst), name, R_BPF_64_32});
+        main_function.push_back({EBPF_OP_CALL, 0, 1, 0, -1});
+        main_function.push_back({EBPF_OP_MOV64_REG, 1, 0, 0, 0});
+
+        std::vector<ebpf_inst> function{
+            {EBPF_OP_ADD64_IMM, 1, 0, 0, 1},
+            {EBPF_OP_CALL, 0, 0, 0, -1},
+            {EBPF_OP_EXIT, 0, 0, 0, 0},
+        };
+        relocations.push_back({".text." + name, 1 * sizeof(ebpf_inst), "add_two", R_BPF_64_32});
+        sections.push_back({".text." + name, SHT_PROGBITS, code, ebpf_inst_to_bytes(function)});
+        symbols.push_back({name, STT_FUNC, ".text." + name, 0, function.size() * sizeof(ebpf_inst)});
+    }
+    main_function.push_back({EBPF_OP_MOV64_REG, 0, 1, 0, 0});
+    main_function.push_back({EBPF_OP_EXIT, 0, 0, 0, 0});
+    sections.push_back({".text.f0", SHT_PROGBITS, code, ebpf_inst_to_bytes(main_function)});
+    symbols.push_back({"f0", STT_FUNC, ".text.f0", 0, main_function.size() * sizeof(ebpf_inst)});
+    symbols.push_back({"add_two", STT_NOTYPE, "", 0, 0});
+    std::vector<uint8_t> elf = build_elf_object(sections, symbols, relocations);
+
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    ubpf_register(vm.get(), 3, "add_two", as_external_function_t(reinterpret_cast<void*>(add_two)));
+    char* error = nullptr;
+    if (ubpf_load_elf_ex(vm.get(), elf.data(), elf.size(), "f0", &error) != 0) {
+        std::cerr << "Failed to load the ELF file: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+
+    const uint64_t expected = 3 * (function_count - 1);
+    uint64_t interp_result{};
+    if (ubpf_exec(vm.get(), nullptr, 0, &interp_result) != 0 || interp_result != expected) {
+        std::cerr << "The interpreter returned " << interp_result << " instead of " << expected << std::endl;
+        return 1;
+    }
+    ubpf_jit_fn jit_fn = ubpf_compile(vm.get(), &error);
+    if (jit_fn == nullptr) {
+        std::cerr << "Failed to compile: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    uint64_t jit_result = jit_fn(nullptr, 0);
+    if (jit_result != expected) {
+        std::cerr << "The JIT'd code returned " << jit_result << " instead of " << expected << std::endl;
+        return 1;
+    }
+#endif
+    return 0;
+}
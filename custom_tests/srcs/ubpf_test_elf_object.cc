@@ -0,0 +1,218 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+#if defined(UBPF_HAS_ELF_H)
+static uint64_t
+double_it(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    UNREFERENCED_PARAMETER(p1);
+    UNREFERENCED_PARAMETER(p2);
+    UNREFERENCED_PARAMETER(p3);
+    UNREFERENCED_PARAMETER(p4);
+    return p0 * 2;
+}
+
+static ubpf_vm_up
+create_vm()
+{
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    ubpf_register(vm.get(), 1, "double_it", as_external_function_t(reinterpret_cast<void*>(double_it)));
+    return vm;
+}
+
+/**
+ * @brief Run the program loaded in the VM with the interpreter and the JIT and check that both return the expected
+ * value.
+ */
+static bool
+check_result(ubpf_vm* vm, const std::string& name, uint64_t expected)
+{
+    uint64_t interp_result{};
+    if (ubpf_exec(vm, nullptr, 0, &interp_result) != 0 || interp_result != expected) {
+        std::cerr << name << ": the interpreter returned " << interp_result << " instead of " << expected << std::endl;
+        return false;
+    }
+
+    char* error = nullptr;
+    ubpf_jit_fn jit_fn = ubpf_compile(vm, &error);
+    if (jit_fn == nullptr) {
+        std::cerr << name << ": failed to compile: " << error << std::endl;
+        free(error);
+        return false;
+    }
+    uint64_t jit_result = jit_fn(nullptr, 0);
+    if (jit_result != expected) {
+        std::cerr << name << ": the JIT'd code returned " << jit_result << " instead of " << expected << std::endl;
+        return false;
+    }
+    return true;
+}
+#endif
+
+int
+main()
+{
+#if defined(UBPF_HAS_ELF_H)
+    // .text: add_one returns r1 + 1.
+    std::vector<ebpf_inst> text{
+        {EBPF_OP_MOV64_REG, 0, 1, 0, 0},
+        {EBPF_OP_ADD64_IMM, 0, 0, 0, 1},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    // xdp: xdp_prog returns add_one(20) + 100 and xdp_second returns double_it(1).
+    std::vector<ebpf_inst> xdp{
+        {EBPF_OP_MOV64_IMM, 1, 0, 0, 20},
+        {EBPF_OP_CALL, 0, 1, 0, -1},
+        {EBPF_OP_ADD64_IMM, 0, 0, 0, 100},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+        {EBPF_OP_MOV64_IMM, 1, 0, 0, 1},
+        {EBPF_OP_CALL, 0, 0, 0, -1},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    // tc: tc_prog returns add_one(41).
+    std::vector<ebpf_inst> tc{
+        {EBPF_OP_MOV64_IMM, 1, 0, 0, 41},
+        {EBPF_OP_CALL, 0, 1, 0, -1},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+
+    const uint64_t code = SHF_ALLOC | SHF_EXECINSTR;
+    std::vector<uint8_t> elf = build_elf_object(
+        {
+            {".text", SHT_PROGBITS, code, ebpf_inst_to_bytes(text)},
+            {"xdp", SHT_PROGBITS, code, ebpf_inst_to_bytes(xdp)},
+            {"tc", SHT_PROGBITS, code, ebpf_inst_to_bytes(tc)},
+        },
+        {
+            {"add_one", STT_FUNC, ".text", 0, 3 * sizeof(ebpf_inst)},
+            {"xdp_prog", STT_FUNC, "xdp", 0, 4 * sizeof(ebpf_inst)},
+            {"xdp_second", STT_FUNC, "xdp", 4 * sizeof(ebpf_inst), 3 * sizeof(ebpf_inst)},
+            {"tc_prog", STT_FUNC, "tc", 0, 3 * sizeof(ebpf_inst)},
+            {"double_it", STT_NOTYPE, "", 0, 0},
+        },
+        {
+            {"xdp", 1 * sizeof(ebpf_inst), "add_one", R_BPF_64_32},
+            {"xdp", 5 * sizeof(ebpf_inst), "double_it", R_BPF_64_32},
+            {"tc", 1 * sizeof(ebpf_inst), "add_one", R_BPF_64_32},
+        });
+
+    struct expected_program
+    {
+        std::string name;
+        std::string section;
+        uint64_t result;
+        size_t num_insts; ///< The instructions of the program and of the functions that it calls.
+    };
+    const std::vector<expected_program> expected_programs{
+        {"add_one", ".text", 1, 3},
+        {"xdp_prog", "xdp", 121, 7},
+        {"xdp_second", "xdp", 2, 3},
+        {"tc_prog", "tc", 42, 6},
+    };
+
+    char* error = nullptr;
+    ubpf_vm_up linking_vm = create_vm();
+    std::unique_ptr<ubpf_elf_object, decltype(&ubpf_elf_object_close)> object(
+        ubpf_elf_object_open(linking_vm.get(), elf.data(), elf.size(), &error), ubpf_elf_object_close);
+    if (object == nullptr) {
+        std::cerr << "Failed to open the object: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+
+    if (ubpf_elf_object_program_count(object.get()) != static_cast<int>(expected_programs.size())) {
+        std::cerr << "The object has " << ubpf_elf_object_program_count(object.get()) << " programs" << std::endl;
+        return 1;
+    }
+    if (ubpf_elf_object_find_program(object.get(), nullptr) != 0 ||
+        ubpf_elf_object_find_program(object.get(), "xdp") != 1 ||
+        ubpf_elf_object_find_program(object.get(), "tc") != 3 ||
+        ubpf_elf_object_find_program(object.get(), "xdp_second") != 2 ||
+        ubpf_elf_object_find_program(object.get(), "missing") != -1) {
+        std::cerr << "ubpf_elf_object_find_program found the wrong programs" << std::endl;
+        return 1;
+    }
+
+    // Load every program into several VMs, which outlive the object.
+    std::vector<std::pair<ubpf_vm_up, size_t>> vms;
+    for (int index = 0; index < ubpf_elf_object_program_count(object.get()); index++) {
+        const expected_program& expected = expected_programs[index];
+        if (expected.name != ubpf_elf_object_program_name(object.get(), index) ||
+            expected.section != ubpf_elf_object_program_section(object.get(), index)) {
+            std::cerr << "Program " << index << " is " << ubpf_elf_object_program_name(object.get(), index) << " in "
+                      << ubpf_elf_object_program_section(object.get(), index) << std::endl;
+            return 1;
+        }
+        for (int copy = 0; copy < 3; copy++) {
+            ubpf_vm_up vm = create_vm();
+            if (ubpf_elf_object_load(object.get(), vm.get(), index, &error) != 0) {
+                std::cerr << "Failed to load " << expected.name << ": " << error << std::endl;
+                free(error);
+                return 1;
+            }
+            ubpf_memory_stats stats{};
+            ubpf_get_memory_stats(vm.get(), &stats);
+            if (stats.instruction_bytes != expected.num_insts * sizeof(ebpf_inst)) {
+                std::cerr << expected.name << " was loaded with " << stats.instruction_bytes / sizeof(ebpf_inst)
+                          << " instructions instead of " << expected.num_insts << std::endl;
+                return 1;
+            }
+            vms.emplace_back(std::move(vm), index);
+        }
+    }
+    object.reset();
+
+    for (auto& [vm, index] : vms) {
+        if (!check_result(vm.get(), expected_programs[index].name, expected_programs[index].result)) {
+            return 1;
+        }
+    }
+
+    // ubpf_load_elf and ubpf_load_elf_ex load the same programs.
+    ubpf_vm_up default_vm = create_vm();
+    ubpf_vm_up named_vm = create_vm();
+    if (ubpf_load_elf(default_vm.get(), elf.data(), elf.size(), &error) != 0 ||
+        ubpf_load_elf_ex(named_vm.get(), elf.data(), elf.size(), "tc_prog", &error) != 0) {
+        std::cerr << "Failed to load the ELF file: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    if (!check_result(default_vm.get(), "ubpf_load_elf", 1) ||
+        !check_result(named_vm.get(), "ubpf_load_elf_ex", 42)) {
+        return 1;
+    }
+
+    // ubpf_load_elf_fd loads the same program from a file.
+    std::unique_ptr<FILE, decltype(&fclose)> file(tmpfile(), fclose);
+    if (file == nullptr || fwrite(elf.data(), 1, elf.size(), file.get()) != elf.size() || fflush(file.get()) != 0) {
+        std::cerr << "Failed to write the ELF file" << std::endl;
+        return 1;
+    }
+    ubpf_vm_up file_vm = create_vm();
+    if (ubpf_load_elf_fd(file_vm.get(), fileno(file.get()), "xdp", &error) != 0) {
+        std::cerr << "Failed to load the ELF file from its file descriptor: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    if (!check_result(file_vm.get(), "ubpf_load_elf_fd", 121)) {
+        return 1;
+    }
+#endif
+    return 0;
+}
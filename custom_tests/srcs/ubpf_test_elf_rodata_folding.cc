@@ -0,0 +1,128 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+#if defined(UBPF_HAS_ELF_H)
+/**
+ * @brief Run the program with the interpreter, recording a trace, and return the length of the trace (which grows
+ * with each value that the program loads from memory other than its stack).
+ */
+static size_t
+traced_length(ubpf_vm* vm, uint64_t expected)
+{
+    std::vector<uint8_t> trace(4096);
+    size_t trace_length{};
+    uint64_t result{};
+    if (ubpf_exec_traced(vm, nullptr, 0, &result, trace.data(), trace.size(), &trace_length) != 0 ||
+        result != expected) {
+        std::cerr << "The interpreter returned " << result << " instead of " << expected << std::endl;
+        return 0;
+    }
+    return trace_length;
+}
+#endif
+
+int
+main()
+{
+#if defined(UBPF_HAS_ELF_H)
+    // A table in .rodata: a word, a half word, a byte, a double word that does not fit in an immediate and one
+    // that does.
+    std::vector<uint8_t> table(24);
+    const uint32_t word = 0x12345678;
+    const uint16_t half_word = 0xbeef;
+    const uint8_t byte = 0x7f;
+    const uint64_t large = 0x1122334455667788;
+    const int64_t small = -128;
+    memcpy(&table[0], &word, sizeof(word));
+    memcpy(&table[4], &half_word, sizeof(half_word));
+    memcpy(&table[6], &byte, sizeof(byte));
+    memcpy(&table[8], &large, sizeof(large));
+    memcpy(&table[16], &small, sizeof(small));
+
+    // The loads from the table before the jump target are folded into moves, but for the one of the large double
+    // word. After the jump target, r1 may (as far as the loader knows) hold another value, so the load stays.
+    std::vector<ebpf_inst> xdp{
+        {EBPF_OP_LDDW, 1, 0, 0, 0},
+        {0, 0, 0, 0, 0},
+        {EBPF_OP_LDXW, 0, 1, 0, 0},
+        {EBPF_OP_LDXH, 2, 1, 4, 0},
+        {EBPF_OP_ADD64_REG, 0, 2, 0, 0},
+        {EBPF_OP_LDXB, 2, 1, 6, 0},
+        {EBPF_OP_ADD64_REG, 0, 2, 0, 0},
+        {EBPF_OP_LDXDW, 2, 1, 16, 0},
+        {EBPF_OP_ADD64_REG, 0, 2, 0, 0},
+        {EBPF_OP_LDXDW, 2, 1, 8, 0},
+        {EBPF_OP_RSH64_IMM, 2, 0, 0, 56},
+        {EBPF_OP_ADD64_REG, 0, 2, 0, 0},
+        {EBPF_OP_JA, 0, 0, 0, 0},
+        {EBPF_OP_LDXW, 3, 1, 0, 0},
+        {EBPF_OP_ADD64_REG, 0, 3, 0, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    std::vector<elf_test_section> sections{
+        {"xdp", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, ebpf_inst_to_bytes(xdp)},
+        {".rodata", SHT_PROGBITS, SHF_ALLOC, table},
+    };
+    std::vector<elf_test_symbol> symbols{
+        {"xdp_prog", STT_FUNC, "xdp", 0, xdp.size() * sizeof(ebpf_inst)},
+        {"table", STT_OBJECT, ".rodata", 0, table.size()},
+    };
+    std::vector<elf_test_relocation> relocations{{"xdp", 0, "table", R_BPF_64_64}};
+    std::vector<uint8_t> elf = build_elf_object(sections, symbols, relocations);
+
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    char* error = nullptr;
+    if (ubpf_load_elf_ex(vm.get(), elf.data(), elf.size(), "xdp_prog", &error) != 0) {
+        std::cerr << "Failed to load the ELF file: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    const uint64_t expected = word + half_word + byte + small + (large >> 56) + word;
+    size_t folded_length = traced_length(vm.get(), expected);
+    if (folded_length == 0) {
+        return 1;
+    }
+    ubpf_jit_fn jit_fn = ubpf_compile(vm.get(), &error);
+    if (jit_fn == nullptr) {
+        std::cerr << "Failed to compile: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    if (jit_fn(nullptr, 0) != expected) {
+        std::cerr << "The JIT'd code returned the wrong result" << std::endl;
+        return 1;
+    }
+
+    // A program without loads gives the length of a trace without values.
+    ubpf_vm_up empty_vm(ubpf_create(), ubpf_destroy);
+    std::vector<ebpf_inst> empty{{EBPF_OP_MOV64_IMM, 0, 0, 0, 0}, {EBPF_OP_EXIT, 0, 0, 0, 0}};
+    if (ubpf_load(empty_vm.get(), empty.data(), static_cast<uint32_t>(empty.size() * sizeof(ebpf_inst)), &error) !=
+        0) {
+        std::cerr << "Failed to load the program: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    size_t empty_length = traced_length(empty_vm.get(), 0);
+    if (folded_length != empty_length + sizeof(large) + sizeof(word)) {
+        std::cerr << "The program loaded " << folded_length - empty_length << " bytes instead of "
+                  << sizeof(large) + sizeof(word) << std::endl;
+        return 1;
+    }
+#endif
+    return 0;
+}
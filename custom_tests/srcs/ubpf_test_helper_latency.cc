@@ -0,0 +1,135 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+// The minimum duration of a call to the slow helper.
+static const std::chrono::microseconds helper_duration{50};
+
+static uint64_t
+slow_helper(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, void* cookie)
+{
+    UNREFERENCED_PARAMETER(p1);
+    UNREFERENCED_PARAMETER(p2);
+    UNREFERENCED_PARAMETER(p3);
+    UNREFERENCED_PARAMETER(p4);
+    auto end = std::chrono::steady_clock::now() + helper_duration;
+    while (std::chrono::steady_clock::now() < end) {
+    }
+    return p0 + *static_cast<uint64_t*>(cookie);
+}
+
+/**
+ * @brief Check the latency histogram of the slow helper.
+ *
+ * @param[in] vm The VM whose helper was measured.
+ * @param[in] calls The expected number of calls.
+ * @param[in] mode The mode of execution (for error messages).
+ * @return True if the histogram is plausible; false, otherwise.
+ */
+static bool
+check_latency(ubpf_vm_up& vm, uint64_t calls, const std::string& mode)
+{
+    ubpf_helper_latency latency{};
+    if (ubpf_get_helper_latency(vm.get(), 3, &latency) != 0) {
+        std::cerr << mode << ": failed to get the latency of the helper." << std::endl;
+        return false;
+    }
+    if (latency.name == nullptr || strcmp(latency.name, "slow_helper") != 0) {
+        std::cerr << mode << ": the helper is not named." << std::endl;
+        return false;
+    }
+    if (latency.call_count != calls) {
+        std::cerr << mode << ": measured " << latency.call_count << " calls instead of " << calls << "." << std::endl;
+        return false;
+    }
+
+    // Allow for some error in the conversion of the tick counter to nanoseconds.
+    uint64_t minimum_ns = std::chrono::nanoseconds(helper_duration).count() * 8 / 10;
+    uint64_t median_ns = ubpf_helper_latency_percentile(&latency, 50);
+    if (median_ns < minimum_ns || latency.max_ns < median_ns || latency.total_ns < calls * minimum_ns) {
+        std::cerr << mode << ": implausible latency (median " << median_ns << " ns, max " << latency.max_ns
+                  << " ns, total " << latency.total_ns << " ns)." << std::endl;
+        return false;
+    }
+
+    ubpf_helper_latency other{};
+    if (ubpf_get_helper_latency(vm.get(), 1, &other) != 0 || other.call_count != 0 ||
+        ubpf_helper_latency_percentile(&other, 99) != 0) {
+        std::cerr << mode << ": measured calls to a helper that was never called." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int
+main()
+{
+    // r1 = 1; call 3; exit (the helper returns its first argument plus the value to which the
+    // context points).
+    std::vector<ebpf_inst> program{
+        {EBPF_OP_MOV64_IMM, 1, 0, 0, 1},
+        {EBPF_OP_CALL, 0, 0, 0, 3},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    const uint64_t runs = 10;
+    uint64_t memory = 41;
+
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    if (ubpf_toggle_helper_latency(vm.get(), true) != 0) {
+        std::cerr << "Failed to enable the measurement of helper latency." << std::endl;
+        return 1;
+    }
+    if (ubpf_register(vm.get(), 3, "slow_helper", as_external_function_t((void*)slow_helper)) != 0) {
+        std::cerr << "Failed to register the helper." << std::endl;
+        return 1;
+    }
+
+    char* error = nullptr;
+    if (ubpf_load(vm.get(), program.data(), static_cast<uint32_t>(program.size() * sizeof(ebpf_inst)), &error) != 0) {
+        std::cerr << "Failed to load program: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+
+    for (uint64_t run = 0; run < runs; run++) {
+        uint64_t result{};
+        if (ubpf_exec(vm.get(), &memory, sizeof(memory), &result) != 0 || result != 42) {
+            std::cerr << "Interpreted program returned the wrong result." << std::endl;
+            return 1;
+        }
+    }
+    if (!check_latency(vm, runs, "Interpreter")) {
+        return 1;
+    }
+
+    ubpf_jit_fn jit_fn = ubpf_compile(vm.get(), &error);
+    if (jit_fn == nullptr) {
+        std::cerr << "Failed to compile program: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    for (uint64_t run = 0; run < runs; run++) {
+        if (jit_fn(&memory, sizeof(memory)) != 42) {
+            std::cerr << "JIT'd program returned the wrong result." << std::endl;
+            return 1;
+        }
+    }
+    if (!check_latency(vm, 2 * runs, "JIT")) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,149 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+/**
+ * @brief Load the program into a fresh VM with the given instruction limit.
+ */
+static ubpf_vm_up
+load_with_limit(const std::vector<ebpf_inst>& program, uint32_t limit)
+{
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    char* error = nullptr;
+    if (ubpf_set_instruction_limit(vm.get(), limit, nullptr) != 0 ||
+        ubpf_load(vm.get(), program.data(), static_cast<uint32_t>(program.size() * sizeof(ebpf_inst)), &error) != 0) {
+        std::cerr << "Failed to load the program: " << (error ? error : "") << std::endl;
+        free(error);
+        vm.reset();
+    }
+    return vm;
+}
+
+/**
+ * @brief Check the bound that the VM found for the program (0 for none).
+ */
+static bool
+check_bound(const std::string& name, const std::vector<ebpf_inst>& program, uint32_t expected)
+{
+    ubpf_vm_up vm = load_with_limit(program, 0);
+    uint32_t bound{};
+    if (!vm || ubpf_get_instruction_bound(vm.get(), &bound) != (expected != 0) || bound != expected) {
+        std::cerr << name << ": the bound is " << bound << " instead of " << expected << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Translate the program with the given instruction limit and return the size of the machine code.
+ */
+static size_t
+translated_size(const std::vector<ebpf_inst>& program, uint32_t limit)
+{
+    ubpf_vm_up vm = load_with_limit(program, limit);
+    std::vector<uint8_t> buffer(65536);
+    size_t size = buffer.size();
+    char* error = nullptr;
+    if (!vm || ubpf_translate(vm.get(), buffer.data(), &size, &error) != 0) {
+        std::cerr << "Failed to translate the program: " << (error ? error : "") << std::endl;
+        free(error);
+        return 0;
+    }
+    return size;
+}
+
+int
+main()
+{
+    // r0 = 0; if (r1 != 0) r0 += 20; r0 = f(r0) + 1; where f(x) = x + 100. Without memory, the program executes
+    // 7 of the 9 instructions on its longest path.
+    std::vector<ebpf_inst> branch_and_call{
+        {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+        {EBPF_OP_JEQ_IMM, 1, 0, 2, 0},
+        {EBPF_OP_ADD64_IMM, 0, 0, 0, 10},
+        {EBPF_OP_ADD64_IMM, 0, 0, 0, 10},
+        {EBPF_OP_CALL, 0, 1, 0, 2},
+        {EBPF_OP_ADD64_IMM, 0, 0, 0, 1},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+        {EBPF_OP_ADD64_IMM, 0, 0, 0, 100},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    // A backward jump that does not close a loop: r0 = 1; goto a; b: r0 += 2; return r0; a: r0 += 1; goto b;
+    std::vector<ebpf_inst> backward_jump{
+        {EBPF_OP_MOV64_IMM, 0, 0, 0, 1},
+        {EBPF_OP_JA, 0, 0, 2, 0},
+        {EBPF_OP_ADD64_IMM, 0, 0, 0, 2},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+        {EBPF_OP_ADD64_IMM, 0, 0, 0, 1},
+        {EBPF_OP_JA, 0, 0, -4, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    // r0 = 0; do { r0 += 1; } while (r0 < 10); return r0;
+    std::vector<ebpf_inst> loop{
+        {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+        {EBPF_OP_ADD64_IMM, 0, 0, 0, 1},
+        {EBPF_OP_JLT_IMM, 0, 0, -2, 10},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    // A program that calls itself.
+    std::vector<ebpf_inst> recursion{
+        {EBPF_OP_CALL, 0, 1, 0, -1},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+
+    if (!check_bound("branch and call", branch_and_call, 9) || !check_bound("backward jump", backward_jump, 6) ||
+        !check_bound("loop", loop, 0) || !check_bound("recursion", recursion, 0)) {
+        return 1;
+    }
+
+    // The program runs without checks when the limit is at least the bound and with them otherwise, in which case
+    // the interpreter still stops it at exactly the limit.
+    for (auto [limit, succeeds] : std::vector<std::pair<uint32_t, bool>>{{0, true}, {9, true}, {7, true}, {6, false}}) {
+        ubpf_vm_up vm = load_with_limit(branch_and_call, limit);
+        uint64_t result{};
+        if (!vm || (ubpf_exec(vm.get(), nullptr, 0, &result) == 0) != succeeds || (succeeds && result != 101)) {
+            std::cerr << "With a limit of " << limit << ", the program " << (succeeds ? "failed" : "succeeded")
+                      << " (result: " << result << ")" << std::endl;
+            return 1;
+        }
+        char* error = nullptr;
+        ubpf_jit_fn jit_fn = succeeds ? ubpf_compile(vm.get(), &error) : nullptr;
+        if (succeeds && (jit_fn == nullptr || jit_fn(nullptr, 0) != 101)) {
+            std::cerr << "With a limit of " << limit << ", the JIT'd program failed: " << (error ? error : "")
+                      << std::endl;
+            free(error);
+            return 1;
+        }
+    }
+
+    // JIT'd code keeps no instruction budget for a program that cannot exceed the limit, even if it jumps backward.
+    size_t unlimited = translated_size(backward_jump, 0);
+    size_t within_limit = translated_size(backward_jump, 6);
+    size_t over_limit = translated_size(backward_jump, 5);
+    if (unlimited == 0 || within_limit != unlimited || over_limit <= unlimited) {
+        std::cerr << "The program was JIT'd into " << unlimited << ", " << within_limit << " and " << over_limit
+                  << " bytes without a limit, within it and over it" << std::endl;
+        return 1;
+    }
+    ubpf_vm_up vm = load_with_limit(backward_jump, 6);
+    uint64_t result{};
+    if (!vm || ubpf_exec(vm.get(), nullptr, 0, &result) != 0 || result != 4) {
+        std::cerr << "The program with a backward jump returned " << result << " instead of 4" << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,146 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+static void
+count_instructions(
+    void* context,
+    int program_counter,
+    const uint64_t registers[16],
+    const uint8_t* stack_start,
+    size_t stack_length,
+    uint64_t register_mask,
+    const uint8_t* stack_mask_start)
+{
+    UNREFERENCED_PARAMETER(program_counter);
+    UNREFERENCED_PARAMETER(registers);
+    UNREFERENCED_PARAMETER(stack_start);
+    UNREFERENCED_PARAMETER(stack_length);
+    UNREFERENCED_PARAMETER(register_mask);
+    UNREFERENCED_PARAMETER(stack_mask_start);
+    (*static_cast<int*>(context))++;
+}
+
+static ubpf_vm_up
+load_program(const std::vector<ebpf_inst>& program)
+{
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    char* error = nullptr;
+    if (ubpf_load(vm.get(), program.data(), static_cast<uint32_t>(program.size() * sizeof(ebpf_inst)), &error) != 0) {
+        std::cerr << "Failed to load the program: " << error << std::endl;
+        free(error);
+        vm.reset();
+    }
+    return vm;
+}
+
+/**
+ * @brief Check whether the program runs successfully (and, if so, its result) with the VM's current settings.
+ */
+static bool
+check_run(ubpf_vm* vm, const std::string& settings, void* mem, size_t mem_len, bool succeeds, uint64_t expected)
+{
+    uint64_t result{};
+    bool succeeded = ubpf_exec(vm, mem, mem_len, &result) == 0;
+    if (succeeded != succeeds || (succeeds && result != expected)) {
+        std::cerr << settings << ": the program " << (succeeded ? "succeeded" : "failed") << " (result: " << result
+                  << ")" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int
+main()
+{
+    // Each setting that changes after the program is loaded selects the interpreter that performs the checks that it
+    // calls for.
+    std::vector<ebpf_inst> uninitialized{{EBPF_OP_MOV64_REG, 0, 3, 0, 0}, {EBPF_OP_EXIT, 0, 0, 0, 0}};
+    ubpf_vm_up vm = load_program(uninitialized);
+    if (!vm || !check_run(vm.get(), "no undefined behavior checks", nullptr, 0, true, 0)) {
+        return 1;
+    }
+    ubpf_toggle_undefined_behavior_check(vm.get(), true);
+    if (!check_run(vm.get(), "undefined behavior checks", nullptr, 0, false, 0)) {
+        return 1;
+    }
+    ubpf_toggle_undefined_behavior_check(vm.get(), false);
+    if (!check_run(vm.get(), "undefined behavior checks turned off", nullptr, 0, true, 0)) {
+        return 1;
+    }
+
+    // The program loads the double word after the memory that it is given.
+    std::vector<ebpf_inst> out_of_bounds{{EBPF_OP_LDXDW, 0, 1, 8, 0}, {EBPF_OP_EXIT, 0, 0, 0, 0}};
+    uint64_t memory[2]{1, 2};
+    vm = load_program(out_of_bounds);
+    if (!vm || !check_run(vm.get(), "bounds checks", memory, sizeof(memory[0]), false, 0)) {
+        return 1;
+    }
+    ubpf_toggle_bounds_check(vm.get(), false);
+    if (!check_run(vm.get(), "no bounds checks", memory, sizeof(memory[0]), true, memory[1])) {
+        return 1;
+    }
+    int instructions = 0;
+    ubpf_register_debug_fn(vm.get(), &instructions, count_instructions);
+    if (!check_run(vm.get(), "debug function", memory, sizeof(memory[0]), true, memory[1]) || instructions != 2) {
+        std::cerr << "The debug function was called " << instructions << " times instead of 2" << std::endl;
+        return 1;
+    }
+    ubpf_register_debug_fn(vm.get(), nullptr, nullptr);
+    if (!check_run(vm.get(), "debug function removed", memory, sizeof(memory[0]), true, memory[1]) ||
+        instructions != 2) {
+        std::cerr << "The debug function was called after it was removed" << std::endl;
+        return 1;
+    }
+    ubpf_toggle_bounds_check(vm.get(), true);
+    if (!check_run(vm.get(), "bounds checks turned on", memory, sizeof(memory[0]), false, 0)) {
+        return 1;
+    }
+
+    // r0 = 0; do { r0 += 1; } while (r0 < 10); return r0;
+    std::vector<ebpf_inst> loop{
+        {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+        {EBPF_OP_ADD64_IMM, 0, 0, 0, 1},
+        {EBPF_OP_JLT_IMM, 0, 0, -2, 10},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    vm = load_program(loop);
+    if (!vm) {
+        return 1;
+    }
+    ubpf_set_instruction_limit(vm.get(), 5, nullptr);
+    if (!check_run(vm.get(), "instruction limit", nullptr, 0, false, 0)) {
+        return 1;
+    }
+    ubpf_set_instruction_limit(vm.get(), 0, nullptr);
+    if (!check_run(vm.get(), "no instruction limit", nullptr, 0, true, 10)) {
+        return 1;
+    }
+
+    // The body of the loop is a basic block that runs 10 times for each run of the program while it is profiled (the
+    // counts are kept while the profiler is off).
+    uint64_t count{};
+    if (ubpf_toggle_profiling(vm.get(), true) != 0 || !check_run(vm.get(), "profiling", nullptr, 0, true, 10) ||
+        ubpf_toggle_profiling(vm.get(), false) != 0 ||
+        !check_run(vm.get(), "profiling turned off", nullptr, 0, true, 10) ||
+        ubpf_toggle_profiling(vm.get(), true) != 0 || ubpf_get_profile_count(vm.get(), 1, &count) != 0 ||
+        count != 10) {
+        std::cerr << "The body of the loop was counted " << count << " times instead of 10" << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
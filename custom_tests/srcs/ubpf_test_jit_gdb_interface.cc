@@ -0,0 +1,154 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <elf.h>
+#endif
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+// The GDB JIT compilation interface (see "JIT Compilation Interface" in the GDB manual).
+struct jit_code_entry
+{
+    jit_code_entry* next_entry;
+    jit_code_entry* prev_entry;
+    const char* symfile_addr;
+    uint64_t symfile_size;
+};
+
+struct jit_descriptor
+{
+    uint32_t version;
+    uint32_t action_flag;
+    jit_code_entry* relevant_entry;
+    jit_code_entry* first_entry;
+};
+
+extern "C" jit_descriptor __jit_debug_descriptor;
+
+/**
+ * @brief Find a section of an ELF object by name.
+ *
+ * @param[in] object The ELF object.
+ * @param[in] name The name of the section.
+ * @return The header of the section or nullptr if there is no such section.
+ */
+static const Elf64_Shdr*
+find_section(const char* object, const std::string& name)
+{
+    auto header = reinterpret_cast<const Elf64_Ehdr*>(object);
+    auto sections = reinterpret_cast<const Elf64_Shdr*>(object + header->e_shoff);
+    const char* names = object + sections[header->e_shstrndx].sh_offset;
+    for (int i = 0; i < header->e_shnum; i++) {
+        if (name == names + sections[i].sh_name) {
+            return &sections[i];
+        }
+    }
+    return nullptr;
+}
+#endif
+
+int
+main()
+{
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+    // r0 = 1; r1 = 2; return r0 + r1;
+    std::vector<ebpf_inst> program{
+        {EBPF_OP_MOV64_IMM, 0, 0, 0, 1},
+        {EBPF_OP_LDDW, 1, 0, 0, 2},
+        {0, 0, 0, 0, 0},
+        {EBPF_OP_ADD64_REG, 0, 1, 0, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    if (ubpf_set_jit_perf_output(vm.get(), JitGdbInterface, "gdb_test") != 0) {
+        std::cerr << "Failed to enable the GDB JIT interface." << std::endl;
+        return 1;
+    }
+
+    char* error = nullptr;
+    if (ubpf_load(vm.get(), program.data(), static_cast<uint32_t>(program.size() * sizeof(ebpf_inst)), &error) != 0) {
+        std::cerr << "Failed to load program: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    ubpf_jit_fn jit_fn = ubpf_compile(vm.get(), &error);
+    if (jit_fn == nullptr) {
+        std::cerr << "Failed to compile program: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    if (jit_fn(nullptr, 0) != 3) {
+        std::cerr << "JIT'd program returned the wrong result." << std::endl;
+        return 1;
+    }
+
+    jit_code_entry* entry = __jit_debug_descriptor.first_entry;
+    if (entry == nullptr || __jit_debug_descriptor.relevant_entry != entry || __jit_debug_descriptor.action_flag != 1) {
+        std::cerr << "The JIT'd code was not registered." << std::endl;
+        return 1;
+    }
+
+    // The object describes the JIT'd code in place ...
+    const char* object = entry->symfile_addr;
+    const Elf64_Shdr* text = find_section(object, ".text");
+    if (std::memcmp(object, ELFMAG, SELFMAG) != 0 || text == nullptr ||
+        text->sh_addr != reinterpret_cast<uintptr_t>(jit_fn)) {
+        std::cerr << "The ELF object does not describe the JIT'd code." << std::endl;
+        return 1;
+    }
+
+    // ... with a symbol for the program ...
+    const Elf64_Shdr* symtab = find_section(object, ".symtab");
+    const Elf64_Shdr* strtab = find_section(object, ".strtab");
+    bool found = false;
+    for (size_t i = 0; symtab && strtab && i < symtab->sh_size / sizeof(Elf64_Sym); i++) {
+        auto symbol = reinterpret_cast<const Elf64_Sym*>(object + symtab->sh_offset) + i;
+        found |= ELF64_ST_TYPE(symbol->st_info) == STT_FUNC && symbol->st_size == text->sh_size &&
+                 std::string(object + strtab->sh_offset + symbol->st_name) == "ubpf:gdb_test";
+    }
+    if (!found) {
+        std::cerr << "The ELF object has no symbol for the program." << std::endl;
+        return 1;
+    }
+
+    // ... its line table and call frame information.
+    for (const char* name : {".debug_info", ".debug_abbrev", ".debug_line", ".eh_frame"}) {
+        const Elf64_Shdr* section = find_section(object, name);
+        if (section == nullptr || section->sh_size == 0) {
+            std::cerr << "The ELF object has no " << name << " section." << std::endl;
+            return 1;
+        }
+    }
+
+    // Releasing the JIT'd code withdraws its registration.
+    vm.reset();
+    if (__jit_debug_descriptor.first_entry != nullptr || __jit_debug_descriptor.action_flag != 2) {
+        std::cerr << "The JIT'd code was not unregistered." << std::endl;
+        return 1;
+    }
+#else
+    // Elsewhere, the JIT'd code cannot be described to the GDB JIT interface.
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    if (ubpf_set_jit_perf_output(vm.get(), JitGdbInterface, "gdb_test") == 0) {
+        std::cerr << "Enabled the GDB JIT interface on a platform that does not support it." << std::endl;
+        return 1;
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,167 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+/**
+ * @brief Load the given program into a fresh VM with the given instruction limit, JIT compile it
+ * and execute it.
+ *
+ * @param[in] program_string The program to execute.
+ * @param[in] limit The instruction limit.
+ * @param[out] result The value returned by the JIT'd program.
+ * @return True if the program could be loaded, compiled and executed; false, otherwise.
+ */
+static bool
+run_jitted_with_limit(const std::string& program_string, uint32_t limit, uint64_t& result)
+{
+    ubpf_jit_fn jit_fn;
+    std::string error{};
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+
+    if (!ubpf_setup_custom_test(
+            vm,
+            program_string,
+            custom_test_fixup_cb{[limit](ubpf_vm_up& vm, std::string& error) {
+                if (ubpf_set_instruction_limit(vm.get(), limit, nullptr) < 0) {
+                    error = "Could not set the instruction limit.";
+                    return false;
+                }
+                return true;
+            }},
+            jit_fn,
+            error)) {
+        std::cerr << "Problem setting up custom test: " << error << std::endl;
+        return false;
+    }
+
+    result = jit_fn(nullptr, 0);
+    return true;
+}
+
+/**
+ * @brief Load the given program into a fresh VM without an instruction limit, JIT compile and execute it, then set
+ * the limit, compile it again and execute the result.
+ *
+ * @param[in] program_string The program to execute.
+ * @param[in] limit The instruction limit to set after the program is first compiled.
+ * @param[out] before The value returned by the program JIT'd without a limit.
+ * @param[out] after The value returned by the program JIT'd with the limit.
+ * @return True if the program could be loaded, compiled and executed; false, otherwise.
+ */
+static bool
+run_jitted_before_and_after_limit(const std::string& program_string, uint32_t limit, uint64_t& before, uint64_t& after)
+{
+    ubpf_jit_fn jit_fn;
+    std::string error{};
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+
+    if (!ubpf_setup_custom_test(vm, program_string, std::nullopt, jit_fn, error)) {
+        std::cerr << "Problem setting up custom test: " << error << std::endl;
+        return false;
+    }
+    before = jit_fn(nullptr, 0);
+
+    char* errmsg = nullptr;
+    if (ubpf_set_instruction_limit(vm.get(), limit, nullptr) < 0 ||
+        (jit_fn = ubpf_compile(vm.get(), &errmsg)) == nullptr) {
+        std::cerr << "Could not compile the program with the limit: " << (errmsg ? errmsg : "") << std::endl;
+        free(errmsg);
+        return false;
+    }
+    after = jit_fn(nullptr, 0);
+    return true;
+}
+
+int
+main()
+{
+    // mov %r0, 0
+    // loop: add %r0, 1
+    // ja loop
+    // exit
+    std::string runaway_loop{"b7 00 00 00 00 00 00 00 07 00 00 00 01 00 00 00 05 00 fe ff 00 00 00 00 "
+                             "95 00 00 00 00 00 00 00"};
+    // mov %r0, 0
+    // loop: add %r0, 1
+    // jlt %r0, 10, loop
+    // exit
+    std::string bounded_loop{"b7 00 00 00 00 00 00 00 07 00 00 00 01 00 00 00 a5 00 fe ff 0a 00 00 00 "
+                             "95 00 00 00 00 00 00 00"};
+    // mov %r0, 0
+    // loop: add %r0, 1
+    // jlt %r0, 100, loop
+    // exit
+    std::string hundred_iterations{"b7 00 00 00 00 00 00 00 07 00 00 00 01 00 00 00 a5 00 fe ff 64 00 00 00 "
+                                   "95 00 00 00 00 00 00 00"};
+    // call local 1
+    // exit
+    // mov %r0, 1
+    // exit
+    std::string local_call{"85 10 00 00 01 00 00 00 95 00 00 00 00 00 00 00 b7 00 00 00 01 00 00 00 "
+                           "95 00 00 00 00 00 00 00"};
+    // call local 0
+    // exit
+    std::string runaway_recursion{"85 10 00 00 ff ff ff ff 95 00 00 00 00 00 00 00"};
+    // mov %r0, 1
+    // exit
+    std::string loop_free{"b7 00 00 00 01 00 00 00 95 00 00 00 00 00 00 00"};
+
+    uint64_t result{};
+
+    if (!run_jitted_with_limit(runaway_loop, 1000, result) || result != UINT64_MAX) {
+        std::cerr << "A runaway loop was not stopped by the instruction limit (result: " << result << ")." << std::endl;
+        return 1;
+    }
+
+    if (!run_jitted_with_limit(bounded_loop, 1000, result) || result != 10) {
+        std::cerr << "A bounded loop gave the wrong result (result: " << result << ")." << std::endl;
+        return 1;
+    }
+
+    if (!run_jitted_with_limit(bounded_loop, 5, result) || result != UINT64_MAX) {
+        std::cerr << "A bounded loop was not stopped by a small instruction limit (result: " << result << ")."
+                  << std::endl;
+        return 1;
+    }
+
+    if (!run_jitted_with_limit(runaway_recursion, 1000, result) || result != UINT64_MAX) {
+        std::cerr << "A runaway recursion was not stopped by the instruction limit (result: " << result << ")."
+                  << std::endl;
+        return 1;
+    }
+
+    if (!run_jitted_with_limit(loop_free, 1, result) || result != 1) {
+        std::cerr << "A loop-free program gave the wrong result (result: " << result << ")." << std::endl;
+        return 1;
+    }
+
+    // A limit that is set after the program was compiled applies once it is compiled again, also to a program that
+    // was compiled without a budget because it could not exceed the previous limit.
+    uint64_t before{};
+    if (!run_jitted_before_and_after_limit(hundred_iterations, 10, before, result) || before != 100 ||
+        result != UINT64_MAX) {
+        std::cerr << "A limit set after compiling a loop was not enforced (results: " << before << ", " << result
+                  << ")." << std::endl;
+        return 1;
+    }
+    if (!run_jitted_before_and_after_limit(local_call, 1, before, result) || before != 1 || result != UINT64_MAX) {
+        std::cerr << "A limit set after compiling a local call was not enforced (results: " << before << ", " << result
+                  << ")." << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
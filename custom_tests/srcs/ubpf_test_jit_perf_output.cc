@@ -0,0 +1,120 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+/**
+ * @brief Read the contents of a file.
+ *
+ * @param[in] path The path of the file.
+ * @return The contents of the file (empty if the file cannot be read).
+ */
+static std::string
+read_file(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+int
+main()
+{
+#if defined(__linux__)
+    char directory[] = "/tmp/ubpf_jit_perf_XXXXXX";
+    if (mkdtemp(directory) == nullptr || setenv("JITDUMPDIR", directory, 1) != 0) {
+        std::cerr << "Failed to create the jitdump directory." << std::endl;
+        return 1;
+    }
+
+    std::vector<ebpf_inst> program{
+        {EBPF_OP_MOV64_IMM, 0, 0, 0, 1},
+        {EBPF_OP_LDDW, 1, 0, 0, 2},
+        {0, 0, 0, 0, 0},
+        {EBPF_OP_ADD64_REG, 0, 1, 0, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    if (ubpf_set_jit_perf_output(vm.get(), JitPerfMap | JitPerfDump, "perf_test") != 0) {
+        std::cerr << "Failed to enable the perf output." << std::endl;
+        return 1;
+    }
+
+    char* error = nullptr;
+    if (ubpf_load(vm.get(), program.data(), static_cast<uint32_t>(program.size() * sizeof(ebpf_inst)), &error) != 0) {
+        std::cerr << "Failed to load program: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    ubpf_jit_fn jit_fn = ubpf_compile(vm.get(), &error);
+    if (jit_fn == nullptr) {
+        std::cerr << "Failed to compile program: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    if (jit_fn(nullptr, 0) != 3) {
+        std::cerr << "JIT'd program returned the wrong result." << std::endl;
+        return 1;
+    }
+
+    // The perf map names the JIT'd code.
+    std::ostringstream address;
+    address << std::hex << reinterpret_cast<uintptr_t>(jit_fn) << " ";
+    std::string map = read_file("/tmp/perf-" + std::to_string(getpid()) + ".map");
+    bool found = false;
+    std::istringstream lines(map);
+    for (std::string line; std::getline(lines, line);) {
+        found |= line.rfind(address.str(), 0) == 0 && line.find(" ubpf:perf_test") != std::string::npos;
+    }
+    if (!found) {
+        std::cerr << "The perf map does not describe the JIT'd code:" << std::endl << map;
+        return 1;
+    }
+
+    // The jitdump file holds a code load record for the JIT'd code ...
+    std::string dump = read_file(std::string(directory) + "/jit-" + std::to_string(getpid()) + ".dump");
+    uint32_t magic{};
+    if (dump.size() < sizeof(magic) || (std::memcpy(&magic, dump.data(), sizeof(magic)), magic) != 0x4A695444 ||
+        dump.find("ubpf:perf_test") == std::string::npos) {
+        std::cerr << "The jitdump file does not describe the JIT'd code." << std::endl;
+        return 1;
+    }
+
+    // ... and a line table that refers to the listing of the program (in which the second
+    // half of the lddw occupies its own line).
+    std::string listing_path = std::string(directory) + "/ubpf-" + std::to_string(getpid()) + "-0-perf_test.ebpf";
+    std::string listing = read_file(listing_path);
+    if (dump.find(listing_path) == std::string::npos ||
+        listing != "mov %r0, 0x1\nlddw %r1, 0x2\n; (second half of lddw)\nadd %r0, %r1\nexit\n") {
+        std::cerr << "The listing of the program is wrong:" << std::endl << listing;
+        return 1;
+    }
+
+    unlink(("/tmp/perf-" + std::to_string(getpid()) + ".map").c_str());
+    unlink((std::string(directory) + "/jit-" + std::to_string(getpid()) + ".dump").c_str());
+    unlink(listing_path.c_str());
+    rmdir(directory);
+#endif
+    return 0;
+}
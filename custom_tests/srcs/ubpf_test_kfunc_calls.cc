@@ -0,0 +1,164 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+const uint32_t add_one_id = 1234;
+const uint32_t triple_id = 4321;
+const uint32_t filler_kfuncs = 100;
+
+static uint64_t
+add_one(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    UNREFERENCED_PARAMETER(p1);
+    UNREFERENCED_PARAMETER(p2);
+    UNREFERENCED_PARAMETER(p3);
+    UNREFERENCED_PARAMETER(p4);
+    return p0 + 1;
+}
+
+static uint64_t
+triple(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    UNREFERENCED_PARAMETER(p1);
+    UNREFERENCED_PARAMETER(p2);
+    UNREFERENCED_PARAMETER(p3);
+    UNREFERENCED_PARAMETER(p4);
+    return p0 * 3;
+}
+
+static uint64_t
+filler(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    UNREFERENCED_PARAMETER(p0);
+    UNREFERENCED_PARAMETER(p1);
+    UNREFERENCED_PARAMETER(p2);
+    UNREFERENCED_PARAMETER(p3);
+    UNREFERENCED_PARAMETER(p4);
+    return 0;
+}
+
+/**
+ * @brief Create a VM with more kfuncs (and with larger IDs) than there are helper slots.
+ */
+static ubpf_vm_up
+create_vm()
+{
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    for (uint32_t id = 1; id <= filler_kfuncs; id++) {
+        ubpf_register_kfunc(vm.get(), id, nullptr, filler);
+    }
+    ubpf_register_kfunc(vm.get(), add_one_id, "bpf_add_one", add_one);
+    ubpf_register_kfunc(vm.get(), triple_id, "bpf_triple", triple);
+    return vm;
+}
+
+/**
+ * @brief Check that the program of the VM returns the expected value with the interpreter and the JIT.
+ */
+static bool
+check_result(ubpf_vm* vm, uint64_t expected)
+{
+    uint64_t result{};
+    if (ubpf_exec(vm, nullptr, 0, &result) != 0 || result != expected) {
+        std::cerr << "The interpreter returned " << result << " instead of " << expected << std::endl;
+        return false;
+    }
+    char* error = nullptr;
+    ubpf_jit_fn jit_fn = ubpf_compile(vm, &error);
+    if (jit_fn == nullptr) {
+        std::cerr << "Failed to compile: " << error << std::endl;
+        free(error);
+        return false;
+    }
+    if (jit_fn(nullptr, 0) != expected) {
+        std::cerr << "The JIT'd code returned the wrong result" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int
+main()
+{
+    // ((5 + 1) * 3) + 1
+    std::vector<ebpf_inst> program{
+        {EBPF_OP_MOV64_IMM, 1, 0, 0, 5},
+        {EBPF_OP_CALL, 0, 2, 0, add_one_id},
+        {EBPF_OP_MOV64_REG, 1, 0, 0, 0},
+        {EBPF_OP_CALL, 0, 2, 0, triple_id},
+        {EBPF_OP_MOV64_REG, 1, 0, 0, 0},
+        {EBPF_OP_CALL, 0, 2, 0, add_one_id},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    const uint32_t program_size = static_cast<uint32_t>(program.size() * sizeof(ebpf_inst));
+
+    ubpf_vm_up vm = create_vm();
+    char* error = nullptr;
+    if (ubpf_load(vm.get(), program.data(), program_size, &error) != 0) {
+        std::cerr << "Failed to load the program: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    if (!check_result(vm.get(), 19)) {
+        return 1;
+    }
+
+    // The kfuncs were resolved when the program was loaded.
+    if (ubpf_register_kfunc(vm.get(), add_one_id, "bpf_add_one", triple) == 0) {
+        std::cerr << "Registered a kfunc after loading a program" << std::endl;
+        return 1;
+    }
+
+    // A program may only call registered kfuncs.
+    ubpf_vm_up unregistered_vm = create_vm();
+    program[3].imm = filler_kfuncs + 1;
+    if (ubpf_load(unregistered_vm.get(), program.data(), program_size, &error) == 0) {
+        std::cerr << "Loaded a program that calls a kfunc that is not registered" << std::endl;
+        return 1;
+    }
+    free(error);
+    error = nullptr;
+
+#if defined(UBPF_HAS_ELF_H)
+    // Like clang, call the undefined function with a relocation against its symbol.
+    std::vector<ebpf_inst> xdp{
+        {EBPF_OP_MOV64_IMM, 1, 0, 0, 7},
+        {EBPF_OP_CALL, 0, 1, 0, -1},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    std::vector<elf_test_section> sections{
+        {"xdp", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, ebpf_inst_to_bytes(xdp)},
+    };
+    std::vector<elf_test_symbol> symbols{
+        {"xdp_prog", STT_FUNC, "xdp", 0, xdp.size() * sizeof(ebpf_inst)},
+        {"bpf_triple", STT_FUNC, "", 0, 0},
+    };
+    std::vector<elf_test_relocation> relocations{{"xdp", sizeof(ebpf_inst), "bpf_triple", R_BPF_64_32}};
+    std::vector<uint8_t> elf = build_elf_object(sections, symbols, relocations);
+
+    ubpf_vm_up elf_vm = create_vm();
+    if (ubpf_load_elf_ex(elf_vm.get(), elf.data(), elf.size(), "xdp_prog", &error) != 0) {
+        std::cerr << "Failed to load the ELF file: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    if (!check_result(elf_vm.get(), 21)) {
+        return 1;
+    }
+#endif
+    return 0;
+}
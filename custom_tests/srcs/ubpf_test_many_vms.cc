@@ -0,0 +1,99 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+/**
+ * @brief Read a memory statistic (in KB) of this process from /proc/self/status.
+ *
+ * @param[in] name The name of the statistic (e.g., VmRSS).
+ * @return The value of the statistic or 0 if it is not available on this platform.
+ */
+static uint64_t
+process_memory_kb(const std::string& name)
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind(name + ":", 0) == 0) {
+            std::istringstream value(line.substr(name.size() + 1));
+            uint64_t kb{};
+            value >> kb;
+            return kb;
+        }
+    }
+    return 0;
+}
+
+int
+main()
+{
+    const size_t vm_count{1000};
+    // The per-VM footprint of a small program must not depend on UBPF_MAX_INSTS.
+    const uint64_t max_kb_per_vm{64};
+
+    // A main function that calls a local function that writes to its stack.
+    std::vector<ebpf_inst> program{
+        {EBPF_OP_CALL, 0, 1, 0, 1},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+        {EBPF_OP_STB, 10, 0, -1, 0x11},
+        {EBPF_OP_LDXB, 0, 10, -1, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+
+    uint64_t virtual_before = process_memory_kb("VmSize");
+    uint64_t resident_before = process_memory_kb("VmRSS");
+
+    std::vector<ubpf_vm_up> vms;
+    for (size_t i = 0; i < vm_count; i++) {
+        ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+        char* error = nullptr;
+        if (ubpf_load(vm.get(), program.data(), static_cast<uint32_t>(program.size() * sizeof(ebpf_inst)), &error) !=
+            0) {
+            std::cerr << "Failed to load program: " << error << std::endl;
+            free(error);
+            return 1;
+        }
+
+        ubpf_jit_fn jit_fn = ubpf_compile(vm.get(), &error);
+        if (jit_fn == nullptr) {
+            std::cerr << "Failed to compile program: " << error << std::endl;
+            free(error);
+            return 1;
+        }
+
+        uint64_t interp_result{};
+        if (ubpf_exec(vm.get(), nullptr, 0, &interp_result) != 0 || interp_result != 0x11 ||
+            jit_fn(nullptr, 0) != 0x11) {
+            std::cerr << "Program in VM " << i << " returned the wrong result." << std::endl;
+            return 1;
+        }
+        vms.push_back(std::move(vm));
+    }
+
+    uint64_t virtual_kb_per_vm = (process_memory_kb("VmSize") - virtual_before) / vm_count;
+    uint64_t resident_kb_per_vm = (process_memory_kb("VmRSS") - resident_before) / vm_count;
+    std::cout << vm_count << " VMs: " << virtual_kb_per_vm << " KB virtual and " << resident_kb_per_vm
+              << " KB resident per VM." << std::endl;
+
+    if (virtual_kb_per_vm > max_kb_per_vm) {
+        std::cerr << "Each VM uses more than " << max_kb_per_vm << " KB of memory." << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+static int
+quiet_printf(FILE* stream, const char* format, ...)
+{
+    UNREFERENCED_PARAMETER(stream);
+    UNREFERENCED_PARAMETER(format);
+    return 0;
+}
+
+/**
+ * @brief Execute (with the interpreter) a program that loads the byte at address + offset.
+ *
+ * @param[in] vm The VM in which to execute the program.
+ * @param[in] address The base address of the load.
+ * @param[in] offset The offset of the load.
+ * @param[out] result The loaded byte (when the load passes the bounds check).
+ * @return True if the program executed successfully; false, otherwise.
+ */
+static bool
+load_byte(ubpf_vm_up& vm, const uint8_t* address, int16_t offset, uint64_t& result)
+{
+    uint64_t address_value = reinterpret_cast<uint64_t>(address);
+    std::vector<ebpf_inst> program{
+        {EBPF_OP_LDDW, 2, 0, 0, static_cast<int32_t>(address_value)},
+        {0, 0, 0, 0, static_cast<int32_t>(address_value >> 32)},
+        {EBPF_OP_LDXB, 0, 2, offset, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    char* error = nullptr;
+
+    ubpf_unload_code(vm.get());
+    if (ubpf_load(vm.get(), program.data(), static_cast<uint32_t>(program.size() * sizeof(ebpf_inst)), &error) != 0) {
+        std::cerr << "Failed to load program: " << error << std::endl;
+        free(error);
+        return false;
+    }
+
+    return ubpf_exec(vm.get(), nullptr, 0, &result) == 0;
+}
+
+int
+main()
+{
+    // Sixteen 64-byte regions, each followed by a 64-byte gap that is not registered.
+    const size_t region_count{16};
+    const size_t region_size{64};
+    std::vector<uint8_t> backing(region_count * region_size * 2);
+    std::vector<uint8_t*> regions;
+    for (size_t i = 0; i < region_count; i++) {
+        regions.push_back(backing.data() + i * region_size * 2);
+        std::fill(regions[i], regions[i] + region_size, static_cast<uint8_t>(i));
+    }
+
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    ubpf_set_error_print(vm.get(), quiet_printf);
+
+    // Register the regions out of order to exercise the sorted insertion.
+    for (size_t i = 0; i < regions.size(); i += 2) {
+        if (ubpf_register_memory_region(vm.get(), regions[i], region_size) != 0) {
+            std::cerr << "Failed to register memory region " << i << std::endl;
+            return 1;
+        }
+    }
+    for (size_t i = 1; i < regions.size(); i += 2) {
+        if (ubpf_register_memory_region(vm.get(), regions[i], region_size) != 0) {
+            std::cerr << "Failed to register memory region " << i << std::endl;
+            return 1;
+        }
+    }
+
+    if (ubpf_register_memory_region(vm.get(), regions[3] + 8, 8) == 0) {
+        std::cerr << "Registered a memory region that overlaps another." << std::endl;
+        return 1;
+    }
+    if (ubpf_register_memory_region(vm.get(), regions[3], 0) == 0) {
+        std::cerr << "Registered an empty memory region." << std::endl;
+        return 1;
+    }
+
+    uint64_t result{};
+    for (size_t i = 0; i < regions.size(); i++) {
+        if (!load_byte(vm, regions[i], 63, result) || result != i) {
+            std::cerr << "A load from registered memory region " << i << " failed." << std::endl;
+            return 1;
+        }
+    }
+
+    if (load_byte(vm, regions[5], region_size, result)) {
+        std::cerr << "A load past the end of a registered memory region succeeded." << std::endl;
+        return 1;
+    }
+
+    if (ubpf_unregister_memory_region(vm.get(), regions[7]) != 0) {
+        std::cerr << "Failed to unregister a memory region." << std::endl;
+        return 1;
+    }
+    if (ubpf_unregister_memory_region(vm.get(), regions[7]) == 0) {
+        std::cerr << "Unregistered a memory region twice." << std::endl;
+        return 1;
+    }
+    if (load_byte(vm, regions[7], 0, result)) {
+        std::cerr << "A load from an unregistered memory region succeeded." << std::endl;
+        return 1;
+    }
+    if (!load_byte(vm, regions[8], 0, result) || result != 8) {
+        std::cerr << "A load from a registered memory region failed after unregistering another." << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
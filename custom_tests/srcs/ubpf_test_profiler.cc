@@ -0,0 +1,136 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+/**
+ * @brief Check the number of times that control entered each basic block of the program.
+ *
+ * @param[in] vm The VM whose program is profiled.
+ * @param[in] mode The mode of execution (for error messages).
+ * @return True if the counts match; false, otherwise.
+ */
+static bool
+check_counts(ubpf_vm_up& vm, const std::string& mode)
+{
+    // The basic blocks begin at PC 0, 2 (the loop body) and 5 (the exit).
+    const std::vector<std::pair<uint16_t, uint64_t>> expected{{0, 1}, {2, 10}, {5, 1}};
+    for (const auto& [pc, expected_count] : expected) {
+        uint64_t count{};
+        if (ubpf_get_profile_count(vm.get(), pc, &count) != 0 || count != expected_count) {
+            std::cerr << mode << ": basic block at PC " << pc << " was entered " << count << " times instead of "
+                      << expected_count << " times." << std::endl;
+            return false;
+        }
+    }
+
+    uint64_t count{};
+    if (ubpf_get_profile_count(vm.get(), 3, &count) == 0) {
+        std::cerr << mode << ": PC 3 is not the start of a basic block." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int
+main()
+{
+    // r0 = 0; r1 = 10; do { r0 += 1; r1 -= 1; } while (r1 != 0); return r0;
+    std::vector<ebpf_inst> program{
+        {EBPF_OP_MOV64_IMM, 0, 0, 0, 0},
+        {EBPF_OP_MOV64_IMM, 1, 0, 0, 10},
+        {EBPF_OP_ADD64_IMM, 0, 0, 0, 1},
+        {EBPF_OP_SUB64_IMM, 1, 0, 0, 1},
+        {EBPF_OP_JNE_IMM, 1, 0, -3, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    if (ubpf_toggle_profiling(vm.get(), true) != 0) {
+        std::cerr << "Failed to enable the profiler." << std::endl;
+        return 1;
+    }
+
+    char* error = nullptr;
+    if (ubpf_load(vm.get(), program.data(), static_cast<uint32_t>(program.size() * sizeof(ebpf_inst)), &error) != 0) {
+        std::cerr << "Failed to load program: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+
+    uint64_t result{};
+    if (ubpf_exec(vm.get(), nullptr, 0, &result) != 0 || result != 10) {
+        std::cerr << "Interpreted program returned the wrong result." << std::endl;
+        return 1;
+    }
+    if (!check_counts(vm, "Interpreter")) {
+        return 1;
+    }
+
+    ubpf_reset_profile(vm.get());
+    ubpf_jit_fn jit_fn = ubpf_compile(vm.get(), &error);
+    if (jit_fn == nullptr) {
+        std::cerr << "Failed to compile program: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    if (jit_fn(nullptr, 0) != 10) {
+        std::cerr << "JIT'd program returned the wrong result." << std::endl;
+        return 1;
+    }
+    if (!check_counts(vm, "JIT")) {
+        return 1;
+    }
+
+    // The hottest block (the loop body) is reported first, with its disassembly.
+    FILE* report_file = tmpfile();
+    if (report_file == nullptr || ubpf_dump_profile(vm.get(), report_file, 1) != 0) {
+        std::cerr << "Failed to write the profile report." << std::endl;
+        return 1;
+    }
+    std::string report(static_cast<size_t>(ftell(report_file)), '\0');
+    rewind(report_file);
+    report.resize(fread(report.data(), 1, report.size(), report_file));
+    fclose(report_file);
+
+    for (const char* expected : {"33 instructions executed in 3 basic blocks",
+                                 "block 2-4: 10 entries, 30 instructions",
+                                 "add %r0, 0x1",
+                                 "jne %r1, 0, -3"}) {
+        if (report.find(expected) == std::string::npos) {
+            std::cerr << "The profile report does not contain \"" << expected << "\":" << std::endl << report;
+            return 1;
+        }
+    }
+    if (report.find("exit") != std::string::npos) {
+        std::cerr << "The profile report contains more than one basic block:" << std::endl << report;
+        return 1;
+    }
+
+    // A program JIT'd before the profiler is enabled is JIT'd again with the counters.
+    vm.reset(ubpf_create());
+    if (ubpf_load(vm.get(), program.data(), static_cast<uint32_t>(program.size() * sizeof(ebpf_inst)), &error) != 0 ||
+        ubpf_compile(vm.get(), &error) == nullptr || ubpf_toggle_profiling(vm.get(), true) != 0 ||
+        (jit_fn = ubpf_compile(vm.get(), &error)) == nullptr || jit_fn(nullptr, 0) != 10) {
+        std::cerr << "Failed to run the program JIT'd after the profiler was enabled: " << (error ? error : "")
+                  << std::endl;
+        free(error);
+        return 1;
+    }
+    if (!check_counts(vm, "JIT after enabling the profiler")) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,210 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+static uint64_t
+context_helper(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, void* cookie)
+{
+    UNREFERENCED_PARAMETER(p0);
+    UNREFERENCED_PARAMETER(p1);
+    UNREFERENCED_PARAMETER(p2);
+    UNREFERENCED_PARAMETER(p3);
+    UNREFERENCED_PARAMETER(p4);
+    return *static_cast<uint64_t*>(cookie);
+}
+
+// Helpers are counted whatever their ID.
+static const uint32_t large_helper_id = 0x10000;
+
+/**
+ * @brief Check the runtime statistics of the VM.
+ *
+ * @param[in] vm The VM whose statistics are checked.
+ * @param[in] runs The expected number of runs (each of which calls each helper once and returns 3).
+ * @param[in] mode The mode of execution (for error messages).
+ * @return True if the statistics match; false, otherwise.
+ */
+static bool
+check_stats(ubpf_vm_up& vm, uint64_t runs, const std::string& mode)
+{
+    ubpf_runtime_stats stats{};
+    if (ubpf_get_runtime_stats(vm.get(), &stats) != 0) {
+        std::cerr << mode << ": failed to get the runtime statistics." << std::endl;
+        return false;
+    }
+    if (stats.run_count != runs || stats.error_count != 0) {
+        std::cerr << mode << ": counted " << stats.run_count << " runs (" << stats.error_count << " failed) instead of "
+                  << runs << "." << std::endl;
+        return false;
+    }
+    // The helpers are listed in the order in which the program first calls them.
+    if (stats.helper_count != 2 || stats.helper_ids[0] != 2 || stats.helper_ids[1] != large_helper_id ||
+        stats.helper_names[0] != std::string("context_helper") || stats.helper_names[1] != std::string("large_id")) {
+        std::cerr << mode << ": listed " << stats.helper_count << " helpers instead of 2." << std::endl;
+        return false;
+    }
+    if (stats.helper_call_counts[0] != runs || stats.helper_call_counts[1] != runs) {
+        std::cerr << mode << ": counted " << stats.helper_call_counts[0] << " and " << stats.helper_call_counts[1]
+                  << " helper calls instead of " << runs << "." << std::endl;
+        return false;
+    }
+    if (stats.exit_code_counts[3] != runs || stats.exit_code_counts[0] != 0) {
+        std::cerr << mode << ": counted " << stats.exit_code_counts[3] << " runs that returned 3 instead of " << runs
+                  << "." << std::endl;
+        return false;
+    }
+    if (stats.run_time_ns == 0) {
+        std::cerr << mode << ": the runs took no time." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int
+main()
+{
+    // call 2; call 0x10000; exit (the helpers return the value to which the context points).
+    std::vector<ebpf_inst> program{
+        {EBPF_OP_CALL, 0, 0, 0, 2},
+        {EBPF_OP_CALL, 0, 0, 0, static_cast<int32_t>(large_helper_id)},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    const uint64_t runs = 5;
+    uint64_t memory = 3;
+
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    ubpf_runtime_stats stats{};
+    if (ubpf_get_runtime_stats(vm.get(), &stats) == 0) {
+        std::cerr << "Got runtime statistics that were never enabled." << std::endl;
+        return 1;
+    }
+    if (ubpf_toggle_runtime_stats(vm.get(), true) != 0) {
+        std::cerr << "Failed to enable runtime statistics." << std::endl;
+        return 1;
+    }
+    if (ubpf_register(vm.get(), 2, "context_helper", as_external_function_t((void*)context_helper)) != 0 ||
+        ubpf_register(vm.get(), large_helper_id, "large_id", as_external_function_t((void*)context_helper)) != 0) {
+        std::cerr << "Failed to register the helper." << std::endl;
+        return 1;
+    }
+
+    char* error = nullptr;
+    if (ubpf_load(vm.get(), program.data(), static_cast<uint32_t>(program.size() * sizeof(ebpf_inst)), &error) != 0) {
+        std::cerr << "Failed to load program: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+
+    for (uint64_t run = 0; run < runs; run++) {
+        uint64_t result{};
+        if (ubpf_exec(vm.get(), &memory, sizeof(memory), &result) != 0 || result != memory) {
+            std::cerr << "Interpreted program returned the wrong result." << std::endl;
+            return 1;
+        }
+    }
+    if (!check_stats(vm, runs, "Interpreter")) {
+        return 1;
+    }
+
+    ubpf_jit_fn jit_fn = ubpf_compile(vm.get(), &error);
+    if (jit_fn == nullptr) {
+        std::cerr << "Failed to compile program: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    for (uint64_t run = 0; run < runs; run++) {
+        if (jit_fn(&memory, sizeof(memory)) != memory) {
+            std::cerr << "JIT'd program returned the wrong result." << std::endl;
+            return 1;
+        }
+    }
+    if (!check_stats(vm, 2 * runs, "JIT")) {
+        return 1;
+    }
+
+    // Runs while statistics are disabled are not counted.
+    uint64_t result{};
+    if (ubpf_toggle_runtime_stats(vm.get(), false) != 0 || ubpf_exec(vm.get(), &memory, sizeof(memory), &result) != 0) {
+        std::cerr << "Failed to run the program with runtime statistics disabled." << std::endl;
+        return 1;
+    }
+    if (!check_stats(vm, 2 * runs, "Disabled")) {
+        return 1;
+    }
+
+    // The program is recompiled with the instrumentation when statistics are enabled again.
+    jit_fn = ubpf_compile(vm.get(), &error);
+    if (jit_fn == nullptr || jit_fn(&memory, sizeof(memory)) != memory || !check_stats(vm, 2 * runs, "JIT disabled")) {
+        std::cerr << "Failed to run the program JIT'd without runtime statistics: " << (error ? error : "")
+                  << std::endl;
+        free(error);
+        return 1;
+    }
+    ubpf_toggle_runtime_stats(vm.get(), true);
+    jit_fn = ubpf_compile(vm.get(), &error);
+    for (uint64_t run = 0; jit_fn != nullptr && run < runs; run++) {
+        jit_fn(&memory, sizeof(memory));
+    }
+    if (jit_fn == nullptr || !check_stats(vm, 3 * runs, "JIT enabled again")) {
+        std::cerr << "Failed to recompile the program with runtime statistics: " << (error ? error : "") << std::endl;
+        free(error);
+        return 1;
+    }
+
+    // Each thread that runs the program after another one exited takes over its block.
+    ubpf_memory_stats memory_stats{};
+    size_t runtime_stats_bytes = 0;
+    for (uint64_t thread_index = 0; thread_index < runs; thread_index++) {
+        bool succeeded = false;
+        std::thread thread([&]() {
+            uint64_t thread_result{};
+            succeeded = ubpf_exec(vm.get(), &memory, sizeof(memory), &thread_result) == 0 && thread_result == memory;
+        });
+        thread.join();
+        ubpf_get_memory_stats(vm.get(), &memory_stats);
+        if (!succeeded || (thread_index > 0 && memory_stats.runtime_stats_bytes != runtime_stats_bytes)) {
+            std::cerr << "Thread " << thread_index << ": the runtime statistics grew from " << runtime_stats_bytes
+                      << " to " << memory_stats.runtime_stats_bytes << " bytes." << std::endl;
+            return 1;
+        }
+        runtime_stats_bytes = memory_stats.runtime_stats_bytes;
+    }
+    if (!check_stats(vm, 4 * runs, "Threads")) {
+        return 1;
+    }
+
+    // The helpers of another program start from zero (in the slots in which that program calls them).
+    ubpf_unload_code(vm.get());
+    std::vector<ebpf_inst> other_program{
+        {EBPF_OP_CALL, 0, 0, 0, static_cast<int32_t>(large_helper_id)},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    uint32_t other_program_size = static_cast<uint32_t>(other_program.size() * sizeof(ebpf_inst));
+    if (ubpf_load(vm.get(), other_program.data(), other_program_size, &error) != 0 ||
+        ubpf_exec(vm.get(), &memory, sizeof(memory), &result) != 0) {
+        std::cerr << "Failed to run another program: " << (error ? error : "") << std::endl;
+        free(error);
+        return 1;
+    }
+    ubpf_get_runtime_stats(vm.get(), &stats);
+    if (stats.helper_count != 1 || stats.helper_ids[0] != large_helper_id || stats.helper_call_counts[0] != 1 ||
+        stats.helper_call_counts[1] != 0) {
+        std::cerr << "Another program: counted " << stats.helper_call_counts[0] << " calls to helper "
+                  << stats.helper_ids[0] << " instead of 1." << std::endl;
+        return 1;
+    }
+    return 0;
+}
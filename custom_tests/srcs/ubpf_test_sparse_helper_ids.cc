@@ -0,0 +1,195 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+// Like the numbers of Linux helpers, the IDs are neither small nor contiguous.
+const uint32_t add_id = 113;
+const uint32_t double_id = 0x10000;
+const uint32_t negate_id = 0xfffffff0;
+const uint32_t unused_helpers = 200;
+
+static uint64_t
+add(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    UNREFERENCED_PARAMETER(p2);
+    UNREFERENCED_PARAMETER(p3);
+    UNREFERENCED_PARAMETER(p4);
+    return p0 + p1;
+}
+
+static uint64_t
+double_it(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    UNREFERENCED_PARAMETER(p1);
+    UNREFERENCED_PARAMETER(p2);
+    UNREFERENCED_PARAMETER(p3);
+    UNREFERENCED_PARAMETER(p4);
+    return p0 * 2;
+}
+
+static uint64_t
+triple_it(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    UNREFERENCED_PARAMETER(p1);
+    UNREFERENCED_PARAMETER(p2);
+    UNREFERENCED_PARAMETER(p3);
+    UNREFERENCED_PARAMETER(p4);
+    return p0 * 3;
+}
+
+static uint64_t
+negate(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    UNREFERENCED_PARAMETER(p1);
+    UNREFERENCED_PARAMETER(p2);
+    UNREFERENCED_PARAMETER(p3);
+    UNREFERENCED_PARAMETER(p4);
+    return -p0;
+}
+
+static uint64_t
+unused(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    UNREFERENCED_PARAMETER(p0);
+    UNREFERENCED_PARAMETER(p1);
+    UNREFERENCED_PARAMETER(p2);
+    UNREFERENCED_PARAMETER(p3);
+    UNREFERENCED_PARAMETER(p4);
+    return 0;
+}
+
+static uint64_t
+dispatcher(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, unsigned int idx, void* cookie)
+{
+    UNREFERENCED_PARAMETER(cookie);
+    switch (idx) {
+    case add_id:
+        return add(p0, p1, p2, p3, p4);
+    case double_id:
+        return double_it(p0, p1, p2, p3, p4);
+    case negate_id:
+        return negate(p0, p1, p2, p3, p4);
+    default:
+        return 0;
+    }
+}
+
+static bool
+validate(unsigned int idx, const struct ubpf_vm* vm)
+{
+    UNREFERENCED_PARAMETER(vm);
+    return idx == add_id || idx == double_id || idx == negate_id;
+}
+
+/**
+ * @brief Check that the program of the VM returns the expected value with the interpreter and the JIT.
+ */
+static bool
+check_result(ubpf_vm* vm, uint64_t expected, const char* name)
+{
+    uint64_t result{};
+    if (ubpf_exec(vm, nullptr, 0, &result) != 0 || result != expected) {
+        std::cerr << name << ": the interpreter returned " << result << " instead of " << expected << std::endl;
+        return false;
+    }
+    char* error = nullptr;
+    ubpf_jit_fn jit_fn = ubpf_compile(vm, &error);
+    if (jit_fn == nullptr) {
+        std::cerr << name << ": failed to compile: " << error << std::endl;
+        free(error);
+        return false;
+    }
+    if (jit_fn(nullptr, 0) != expected) {
+        std::cerr << name << ": the JIT'd code returned the wrong result" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int
+main()
+{
+    // -(double(add(5, 7)) + double(1))
+    std::vector<ebpf_inst> program{
+        {EBPF_OP_MOV64_IMM, 1, 0, 0, 5},
+        {EBPF_OP_MOV64_IMM, 2, 0, 0, 7},
+        {EBPF_OP_CALL, 0, 0, 0, static_cast<int32_t>(add_id)},
+        {EBPF_OP_MOV64_REG, 1, 0, 0, 0},
+        {EBPF_OP_CALL, 0, 0, 0, static_cast<int32_t>(double_id)},
+        {EBPF_OP_MOV64_REG, 6, 0, 0, 0},
+        {EBPF_OP_MOV64_IMM, 1, 0, 0, 1},
+        {EBPF_OP_CALL, 0, 0, 0, static_cast<int32_t>(double_id)},
+        {EBPF_OP_ADD64_REG, 0, 6, 0, 0},
+        {EBPF_OP_MOV64_REG, 1, 0, 0, 0},
+        {EBPF_OP_CALL, 0, 0, 0, static_cast<int32_t>(negate_id)},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    const uint32_t program_size = static_cast<uint32_t>(program.size() * sizeof(ebpf_inst));
+
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    for (uint32_t i = 0; i < unused_helpers; i++) {
+        ubpf_register(vm.get(), 1000 + i * 37, "unused", unused);
+    }
+    ubpf_register(vm.get(), add_id, "add", add);
+    ubpf_register(vm.get(), negate_id, "negate", negate);
+    ubpf_register(vm.get(), double_id, "double_it", double_it);
+
+    ubpf_memory_stats before_load{};
+    ubpf_get_memory_stats(vm.get(), &before_load);
+    char* error = nullptr;
+    if (ubpf_load(vm.get(), program.data(), program_size, &error) != 0) {
+        std::cerr << "Failed to load the program: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    if (!check_result(vm.get(), static_cast<uint64_t>(-26), "registered helpers")) {
+        return 1;
+    }
+
+    // The helper table only has a slot for each of the three helpers that the program calls.
+    ubpf_memory_stats after_load{};
+    ubpf_get_memory_stats(vm.get(), &after_load);
+    if (after_load.ext_func_bytes - before_load.ext_func_bytes > 3 * (sizeof(void*) + sizeof(uint32_t))) {
+        std::cerr << "The helper table takes " << after_load.ext_func_bytes - before_load.ext_func_bytes
+                  << " bytes for three helpers" << std::endl;
+        return 1;
+    }
+
+    // Registering a helper that the program calls updates the JIT'd code.
+    if (ubpf_register(vm.get(), double_id, "triple_it", triple_it) != 0) {
+        std::cerr << "Failed to update a helper" << std::endl;
+        return 1;
+    }
+    ubpf_jit_fn jit_fn = ubpf_compile(vm.get(), &error);
+    if (jit_fn == nullptr || jit_fn(nullptr, 0) != static_cast<uint64_t>(-39)) {
+        std::cerr << "The JIT'd code did not call the updated helper" << std::endl;
+        free(error);
+        return 1;
+    }
+
+    // An external dispatcher receives the helpers' IDs.
+    ubpf_vm_up dispatcher_vm(ubpf_create(), ubpf_destroy);
+    ubpf_register_external_dispatcher(dispatcher_vm.get(), dispatcher, validate);
+    if (ubpf_load(dispatcher_vm.get(), program.data(), program_size, &error) != 0) {
+        std::cerr << "Failed to load the program with a dispatcher: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    if (!check_result(dispatcher_vm.get(), static_cast<uint64_t>(-26), "external dispatcher")) {
+        return 1;
+    }
+    return 0;
+}
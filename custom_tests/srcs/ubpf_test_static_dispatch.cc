@@ -0,0 +1,130 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+static uint64_t
+add_helper(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    return p0 + p1 + p2 + p3 + p4;
+}
+
+static uint64_t
+sub_helper(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4)
+{
+    return p0 - p1 - p2 - p3 - p4;
+}
+
+static uint64_t
+dispatcher(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, unsigned int idx, void* cookie)
+{
+    UNREFERENCED_PARAMETER(cookie);
+    return idx == 1 ? p0 * p1 * p2 * p3 * p4 : 0;
+}
+
+static uint64_t
+updated_dispatcher(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, unsigned int idx, void* cookie)
+{
+    UNREFERENCED_PARAMETER(cookie);
+    return idx == 1 ? p0 * p1 * p2 * p3 * p4 + 1 : 0;
+}
+
+static bool
+validate(unsigned int idx, const struct ubpf_vm* vm)
+{
+    UNREFERENCED_PARAMETER(vm);
+    return idx == 1;
+}
+
+int
+main()
+{
+    // return helper_1(2, 3, 4, 5, 6);
+    std::vector<ebpf_inst> program{
+        {EBPF_OP_MOV64_IMM, 1, 0, 0, 2},
+        {EBPF_OP_MOV64_IMM, 2, 0, 0, 3},
+        {EBPF_OP_MOV64_IMM, 3, 0, 0, 4},
+        {EBPF_OP_MOV64_IMM, 4, 0, 0, 5},
+        {EBPF_OP_MOV64_IMM, 5, 0, 0, 6},
+        {EBPF_OP_CALL, 0, 0, 0, 1},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+
+    auto compile = [&](ubpf_vm_up& vm) -> ubpf_jit_fn {
+        char* error = nullptr;
+        if (ubpf_set_dispatch_strategy(vm.get(), StaticDispatch) != 0 ||
+            ubpf_load(vm.get(), program.data(), static_cast<uint32_t>(program.size() * sizeof(ebpf_inst)), &error) !=
+                0) {
+            std::cerr << "Failed to load program: " << (error ? error : "invalid strategy") << std::endl;
+            free(error);
+            return nullptr;
+        }
+        ubpf_jit_fn fn = ubpf_compile(vm.get(), &error);
+        if (!fn) {
+            std::cerr << "Failed to compile program: " << error << std::endl;
+            free(error);
+        }
+        return fn;
+    };
+
+    // Without a dispatcher, the JIT'd code calls the helper from the helper table ...
+    ubpf_vm_up helper_vm(ubpf_create(), ubpf_destroy);
+    ubpf_register(helper_vm.get(), 1, "add_helper", as_external_function_t((void*)add_helper));
+    ubpf_jit_fn helper_fn = compile(helper_vm);
+    if (!helper_fn || helper_fn(nullptr, 0) != 20) {
+        std::cerr << "The helper was not called through the helper table." << std::endl;
+        return 1;
+    }
+
+    // ... which can still be updated ...
+    ubpf_register(helper_vm.get(), 1, "sub_helper", as_external_function_t((void*)sub_helper));
+    if (helper_fn(nullptr, 0) != static_cast<uint64_t>(-16)) {
+        std::cerr << "The updated helper was not called." << std::endl;
+        return 1;
+    }
+
+    // ... but the code cannot start using a dispatcher.
+    if (ubpf_register_external_dispatcher(helper_vm.get(), dispatcher, validate) == 0) {
+        std::cerr << "A dispatcher was registered for code that does not use one." << std::endl;
+        return 1;
+    }
+
+    // With a dispatcher, the JIT'd code calls it without checking for it ...
+    ubpf_vm_up dispatcher_vm(ubpf_create(), ubpf_destroy);
+    ubpf_register_external_dispatcher(dispatcher_vm.get(), dispatcher, validate);
+    ubpf_jit_fn dispatcher_fn = compile(dispatcher_vm);
+    if (!dispatcher_fn || dispatcher_fn(nullptr, 0) != 720) {
+        std::cerr << "The helper was not called through the dispatcher." << std::endl;
+        return 1;
+    }
+
+    // ... which can be replaced ...
+    if (ubpf_register_external_dispatcher(dispatcher_vm.get(), updated_dispatcher, validate) != 0 ||
+        dispatcher_fn(nullptr, 0) != 721) {
+        std::cerr << "The updated dispatcher was not called." << std::endl;
+        return 1;
+    }
+
+    // ... but not removed.
+    if (ubpf_register_external_dispatcher(dispatcher_vm.get(), nullptr, nullptr) == 0) {
+        std::cerr << "The dispatcher was removed from code that requires one." << std::endl;
+        return 1;
+    }
+
+    if (ubpf_set_dispatch_strategy(dispatcher_vm.get(), static_cast<DispatchStrategy>(2)) == 0) {
+        std::cerr << "An invalid dispatch strategy was accepted." << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,208 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include <cstdarg>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+#include "ubpf.h"
+}
+
+#include "ubpf_custom_test_support.h"
+
+struct context
+{
+    uint64_t values[4];
+    uint64_t counter;
+};
+
+// Returns twice its argument plus the number of previous calls (which the program cannot compute).
+static uint64_t
+counting_helper(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, void* cookie)
+{
+    UNREFERENCED_PARAMETER(p1);
+    UNREFERENCED_PARAMETER(p2);
+    UNREFERENCED_PARAMETER(p3);
+    UNREFERENCED_PARAMETER(p4);
+    UNREFERENCED_PARAMETER(cookie);
+    static uint64_t calls = 0;
+    return 2 * p0 + calls++;
+}
+
+// Stores 42 at its argument (which points to the program's stack).
+static uint64_t
+stack_writer(uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, void* cookie)
+{
+    UNREFERENCED_PARAMETER(p1);
+    UNREFERENCED_PARAMETER(p2);
+    UNREFERENCED_PARAMETER(p3);
+    UNREFERENCED_PARAMETER(p4);
+    UNREFERENCED_PARAMETER(cookie);
+    *reinterpret_cast<uint64_t*>(p0) = 42;
+    return 0;
+}
+
+static int
+silent_printf(FILE* stream, const char* format, ...)
+{
+    UNREFERENCED_PARAMETER(stream);
+    UNREFERENCED_PARAMETER(format);
+    return 0;
+}
+
+int
+main()
+{
+    // Sums the helper's results for each of the context's values (copied through the stack)
+    // and adds the counter, which it increments atomically.
+    std::vector<ebpf_inst> program{
+        {EBPF_OP_MOV64_REG, 6, 1, 0, 0},
+        {EBPF_OP_MOV64_IMM, 7, 0, 0, 0},
+        {EBPF_OP_MOV64_IMM, 8, 0, 0, 0},
+        {EBPF_OP_MOV64_REG, 2, 8, 0, 0},
+        {EBPF_OP_LSH64_IMM, 2, 0, 0, 3},
+        {EBPF_OP_ADD64_REG, 2, 6, 0, 0},
+        {EBPF_OP_LDXDW, 3, 2, 0, 0},
+        {EBPF_OP_STXDW, 10, 3, -8, 0},
+        {EBPF_OP_LDXDW, 1, 10, -8, 0},
+        {EBPF_OP_CALL, 0, 0, 0, 1},
+        {EBPF_OP_ADD64_REG, 7, 0, 0, 0},
+        {EBPF_OP_ADD64_IMM, 8, 0, 0, 1},
+        {EBPF_OP_JNE_IMM, 8, 0, -10, 4},
+        {EBPF_OP_MOV64_IMM, 1, 0, 0, 1},
+        {EBPF_OP_ATOMIC_STORE, 6, 1, offsetof(context, counter), EBPF_ALU_OP_ADD | EBPF_ATOMIC_OP_FETCH},
+        {EBPF_OP_ADD64_REG, 7, 1, 0, 0},
+        {EBPF_OP_MOV64_REG, 0, 7, 0, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    const uint32_t program_size = static_cast<uint32_t>(program.size() * sizeof(ebpf_inst));
+    // 2 * (1 + 2 + 3 + 4) + (0 + 1 + 2 + 3) + 100
+    const uint64_t expected_result = 126;
+
+    ubpf_vm_up vm(ubpf_create(), ubpf_destroy);
+    char* error = nullptr;
+    if (ubpf_register(vm.get(), 1, "counting_helper", as_external_function_t((void*)counting_helper)) != 0 ||
+        ubpf_load(vm.get(), program.data(), program_size, &error) != 0) {
+        std::cerr << "Failed to load program: " << (error ? error : "") << std::endl;
+        free(error);
+        return 1;
+    }
+
+    // A buffer that is too small does not stop the run.
+    context ctx{{1, 2, 3, 4}, 100};
+    std::vector<uint8_t> trace(16);
+    size_t trace_length = 1;
+    uint64_t result{};
+    if (ubpf_exec_traced(vm.get(), &ctx, sizeof(ctx), &result, trace.data(), trace.size(), &trace_length) != 0 ||
+        result != expected_result || trace_length != 0) {
+        std::cerr << "The run with a small trace buffer failed." << std::endl;
+        return 1;
+    }
+
+    ctx = {{1, 2, 3, 4}, 100};
+    trace.resize(4096);
+    if (ubpf_exec_traced(vm.get(), &ctx, sizeof(ctx), &result, trace.data(), trace.size(), &trace_length) != 0 ||
+        trace_length == 0) {
+        std::cerr << "The traced run failed." << std::endl;
+        return 1;
+    }
+    trace.resize(trace_length);
+    uint64_t traced_result = result;
+
+    // The replay needs neither the helper nor the context (which no longer holds the values).
+    ctx = {};
+    ubpf_vm_up replay_vm(ubpf_create(), ubpf_destroy);
+    ubpf_toggle_replay_only(replay_vm.get(), true);
+    if (ubpf_load(replay_vm.get(), program.data(), program_size, &error) != 0) {
+        std::cerr << "Failed to load program for replay: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    if (ubpf_replay_trace(replay_vm.get(), trace.data(), trace.size(), &result) != 0 || result != traced_result) {
+        std::cerr << "The replay did not reproduce the traced run." << std::endl;
+        return 1;
+    }
+
+    // A VM that only replays traces does not run programs otherwise.
+    ubpf_set_error_print(replay_vm.get(), silent_printf);
+    if (ubpf_exec(replay_vm.get(), &ctx, sizeof(ctx), &result) == 0) {
+        std::cerr << "A replay-only VM ran the program." << std::endl;
+        return 1;
+    }
+    if (ubpf_compile(replay_vm.get(), &error) != nullptr) {
+        std::cerr << "A replay-only VM compiled the program." << std::endl;
+        return 1;
+    }
+    free(error);
+    error = nullptr;
+    // Nor does it hand out code that was JIT'd before it only replayed traces.
+    if (ubpf_compile(vm.get(), &error) == nullptr) {
+        std::cerr << "Failed to compile the program: " << error << std::endl;
+        free(error);
+        return 1;
+    }
+    ubpf_toggle_replay_only(vm.get(), true);
+    if (ubpf_compile(vm.get(), &error) != nullptr) {
+        std::cerr << "A VM returned the JIT'd program after it was restricted to replaying traces." << std::endl;
+        return 1;
+    }
+    free(error);
+
+    // A trace that does not match the run that the program makes from it is rejected: the
+    // last byte holds the branch directions and the eight bytes before the branches hold the
+    // value that the atomic operation fetched.
+    std::vector<uint8_t> corrupted = trace;
+    corrupted.back() ^= 1;
+    if (ubpf_replay_trace(replay_vm.get(), corrupted.data(), corrupted.size(), &result) == 0) {
+        std::cerr << "The replay followed a branch that the traced run did not take." << std::endl;
+        return 1;
+    }
+    corrupted = trace;
+    corrupted[corrupted.size() - 1 - sizeof(uint64_t)] ^= 1;
+    if (ubpf_replay_trace(replay_vm.get(), corrupted.data(), corrupted.size(), &result) == 0) {
+        std::cerr << "The replay reproduced a different result." << std::endl;
+        return 1;
+    }
+    if (ubpf_replay_trace(replay_vm.get(), trace.data(), trace.size() - 1, &result) == 0) {
+        std::cerr << "The replay accepted a truncated trace." << std::endl;
+        return 1;
+    }
+
+    // The replay takes what a helper wrote to the stack (over what the program stored there) from the trace.
+    std::vector<ebpf_inst> stack_program{
+        {EBPF_OP_STDW, 10, 0, -8, 7},
+        {EBPF_OP_MOV64_REG, 1, 10, 0, 0},
+        {EBPF_OP_ADD64_IMM, 1, 0, 0, -8},
+        {EBPF_OP_CALL, 0, 0, 0, 2},
+        {EBPF_OP_LDXDW, 0, 10, -8, 0},
+        {EBPF_OP_EXIT, 0, 0, 0, 0},
+    };
+    const uint32_t stack_program_size = static_cast<uint32_t>(stack_program.size() * sizeof(ebpf_inst));
+    vm.reset(ubpf_create());
+    trace.resize(4096);
+    if (ubpf_register(vm.get(), 2, "stack_writer", as_external_function_t((void*)stack_writer)) != 0 ||
+        ubpf_load(vm.get(), stack_program.data(), stack_program_size, &error) != 0 ||
+        ubpf_exec_traced(vm.get(), nullptr, 0, &result, trace.data(), trace.size(), &trace_length) != 0 ||
+        result != 42 || trace_length == 0) {
+        std::cerr << "The traced run of the program whose helper writes to the stack failed: " << (error ? error : "")
+                  << std::endl;
+        free(error);
+        return 1;
+    }
+    replay_vm.reset(ubpf_create());
+    ubpf_toggle_replay_only(replay_vm.get(), true);
+    result = 0;
+    if (ubpf_load(replay_vm.get(), stack_program.data(), stack_program_size, &error) != 0 ||
+        ubpf_replay_trace(replay_vm.get(), trace.data(), trace_length, &result) != 0 || result != 42) {
+        std::cerr << "The replay did not reproduce what the helper wrote to the stack: " << (error ? error : "")
+                  << std::endl;
+        free(error);
+        return 1;
+    }
+    return 0;
+}
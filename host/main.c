@@ -1,20 +1,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "ubpf_esp32.h"
 #include "scheduler.h"
 
-// Helper to read file
-static void *read_file(const char *path, size_t *len) {
-    FILE *f = fopen(path, "rb");
-    if (!f) return NULL;
-    fseek(f, 0, SEEK_END);
-    *len = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    void *data = malloc(*len);
-    fread(data, 1, *len, f);
-    fclose(f);
-    return data;
+// Helper to map a file (read-only, since the loader only reads the ELF files)
+static void *map_file(const char *path, size_t *len) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    *len = st.st_size;
+    void *data = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return data == MAP_FAILED ? NULL : data;
 }
 
 int main(int argc, char **argv) {
@@ -31,9 +37,9 @@ int main(int argc, char **argv) {
 
     // Load Code
     size_t init_len, prod_len, cons_len;
-    void *init_code = read_file(argv[1], &init_len);
-    void *prod_code = read_file(argv[2], &prod_len);
-    void *cons_code = read_file(argv[3], &cons_len);
+    void *init_code = map_file(argv[1], &init_len);
+    void *prod_code = map_file(argv[2], &prod_len);
+    void *cons_code = map_file(argv[3], &cons_len);
 
     if (!init_code || !prod_code || !cons_code) {
         fprintf(stderr, "Failed to read BPF files\n");
@@ -55,9 +61,9 @@ int main(int argc, char **argv) {
     // Run Scheduler
     sim_run();
 
-    free(init_code);
-    free(prod_code);
-    free(cons_code);
+    munmap(init_code, init_len);
+    munmap(prod_code, prod_len);
+    munmap(cons_code, cons_len);
 
     return 0;
 }
\ No newline at end of file
@@ -117,13 +117,6 @@ void ubpf_esp32_register_program(int id, const void *code, size_t code_len, cons
     fprintf(stderr, "[ubpf_esp32] Max BPF programs reached\n");
 }
 
-static uint64_t relocation_handler(void *user_data, const uint8_t *data, uint64_t data_size, const char *symbol_name, uint64_t symbol_offset, uint64_t symbol_size) {
-    void *mem = malloc(data_size);
-    if (!mem) return 0;
-    memcpy(mem, data, data_size);
-    return (uint64_t)(uintptr_t)mem + symbol_offset;
-}
-
 void ubpf_esp32_init(void) {
     memset(nvs_store, 0, sizeof(nvs_store));
     nvs_load();
@@ -139,8 +132,9 @@ struct ubpf_vm *ubpf_esp32_create(void) {
     ubpf_register(vm, UBPF_HELPER_NVS_SET, "nvs_set", helper_nvs_set);
     ubpf_register(vm, UBPF_HELPER_NVS_GET, "nvs_get", helper_nvs_get);
     ubpf_register(vm, UBPF_HELPER_TASK_CREATE, "task_create", helper_task_create);
-    
-    ubpf_register_data_relocation(vm, NULL, relocation_handler);
+
+    // Without a data relocation function, the VM instantiates the program's .data, .rodata and .bss
+    // once (when it loads the program) and frees them with the VM.
 
     return vm;
 }
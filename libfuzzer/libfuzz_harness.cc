@@ -10,6 +10,7 @@
 #include <set>
 #include <string>
 #include <sstream>
+#include <sys/mman.h>
 
 #include "libfuzzer_config.h"
 
@@ -72,6 +73,11 @@ private:
       {"UBPF_FUZZER_PRINT_VERIFIER_REPORT", false}, ///< Print verifier report. Useful for debugging.
       {"UBPF_FUZZER_PRINT_EXECUTION_TRACE", false}, ///< Print execution trace, with register state at each step. Useful for
                                                     ///< debugging.
+      {"UBPF_FUZZER_THROUGHPUT", false}, ///< Treat each fuzzer input as a batch of inputs and run them on a reused VM.
+                                         ///< Useful for long running differential fuzzing of the JIT.
+      {"UBPF_FUZZER_CONTINUE_ON_DIVERGENCE", false}, ///< In the throughput mode, count the inputs for which the
+                                                     ///< interpreter and the JIT diverge instead of stopping at the
+                                                     ///< first one.
   };
 } g_ubpf_fuzzer_options;
 
@@ -847,6 +853,313 @@ split_input(const uint8_t* data, std::size_t size, std::vector<uint8_t>& program
     return true;
 }
 
+/**
+ * @brief Counters that the throughput mode keeps about the inputs that it ran, per engine.
+ */
+struct _ubpf_fuzzer_statistics
+{
+    uint64_t batches = 0;
+    uint64_t inputs = 0;                   ///< Inputs found in the batches.
+    uint64_t malformed_inputs = 0;         ///< Inputs that could not be split into a program and memory.
+    uint64_t verifier_rejections = 0;      ///< Programs that the verifier did not accept.
+    uint64_t load_failures = 0;            ///< Programs that ubpf_load rejected.
+    uint64_t interpreter_runs = 0;         ///< Runs of the interpreter.
+    uint64_t interpreter_errors = 0;       ///< Runs of the interpreter that failed (without being fatal).
+    uint64_t jit_runs = 0;                 ///< Runs of the JIT'd code.
+    uint64_t comparisons = 0;              ///< Inputs whose results in both engines were compared.
+    uint64_t return_value_divergences = 0; ///< Inputs for which the engines returned different values.
+    uint64_t memory_divergences = 0;       ///< Inputs for which the engines left different contents in the memory.
+
+    void
+    print(std::ostream& out) const
+    {
+        out << "ubpf_fuzzer: batches: " << batches << " inputs: " << inputs << " malformed: " << malformed_inputs
+            << " rejected: " << verifier_rejections << " load failures: " << load_failures
+            << " interpreter runs: " << interpreter_runs << " interpreter errors: " << interpreter_errors
+            << " jit runs: " << jit_runs << " compared: " << comparisons
+            << " return value divergences: " << return_value_divergences
+            << " memory divergences: " << memory_divergences << std::endl;
+    }
+
+    ~_ubpf_fuzzer_statistics()
+    {
+        if (batches != 0) {
+            print(std::cerr);
+        }
+    }
+} g_ubpf_fuzzer_statistics;
+
+/**
+ * @brief The state that the throughput mode keeps from one input to the next: a VM that is configured once and runs
+ * every input (the previous program is unloaded before the next one is loaded), the buffers that hold an input while
+ * it runs and an executable arena into which the JIT'd code is copied. Neither engine creates a VM or maps memory
+ * per input.
+ */
+class _ubpf_fuzzer_engines
+{
+public:
+    /**
+     * @brief The size of the buffer into which programs are JIT'd (the default size used by ubpf_compile).
+     */
+    static constexpr size_t jit_buffer_size = 65536;
+
+    _ubpf_fuzzer_engines() : vm(ubpf_create(), ubpf_destroy), stack(3 * 4096), jit_buffer(jit_buffer_size)
+    {
+        if (vm == nullptr) {
+            throw std::runtime_error("Failed to create the VM");
+        }
+
+        ubpf_toggle_undefined_behavior_check(vm.get(), true);
+        ubpf_set_error_print(vm.get(), capture_printf);
+        ubpf_toggle_bounds_check(vm.get(), true);
+
+        // Unlike in create_ubpf_vm, the dispatcher is registered before the programs are loaded, so programs that
+        // call the test helpers load too.
+        if (ubpf_register_external_dispatcher(vm.get(), test_helpers_dispatcher, test_helpers_validator) != 0 ||
+            ubpf_set_instruction_limit(vm.get(), 10000, nullptr) != 0 ||
+            ubpf_register_data_bounds_check(vm.get(), &context, bounds_check) != 0) {
+            throw std::runtime_error("Failed to configure the VM");
+        }
+
+        // The debug function is called before every instruction that the interpreter executes, so it is only
+        // registered when it has something to do.
+        if ((g_ubpf_fuzzer_options.get("UBPF_FUZZER_CONSTRAINT_CHECK") ||
+             g_ubpf_fuzzer_options.get("UBPF_FUZZER_PRINT_EXECUTION_TRACE")) &&
+            ubpf_register_debug_fn(vm.get(), &context, ubpf_debug_function) != 0) {
+            throw std::runtime_error("Failed to register the debug function");
+        }
+
+        arena = mmap(0, jit_buffer_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (arena == MAP_FAILED) {
+            throw std::runtime_error("Failed to map the executable arena");
+        }
+    }
+
+    ~_ubpf_fuzzer_engines() { munmap(arena, jit_buffer_size); }
+
+    /**
+     * @brief Run one input in the enabled engines and compare their results.
+     *
+     * @param[in] data The input (in the format described in LLVMFuzzerTestOneInput).
+     * @param[in] size The size of the input.
+     * @retval true The input was run.
+     * @retval false The input was malformed, rejected by the verifier or could not be loaded.
+     * @throws std::runtime_error The engines diverged (unless UBPF_FUZZER_CONTINUE_ON_DIVERGENCE is set) or one of
+     * them failed in a way that is fatal.
+     */
+    bool
+    run(const uint8_t* data, std::size_t size)
+    {
+        g_error_message = "";
+        memory.clear();
+        if (!split_input(data, size, program, memory)) {
+            g_ubpf_fuzzer_statistics.malformed_inputs++;
+            return false;
+        }
+
+        if (g_ubpf_fuzzer_options.get("UBPF_FUZZER_VERIFY_BYTE_CODE") && !verify_bpf_byte_code(program)) {
+            g_ubpf_fuzzer_statistics.verifier_rejections++;
+            return false;
+        }
+
+        char* error_message = nullptr;
+        ubpf_unload_code(vm.get());
+        if (ubpf_load(vm.get(), program.data(), static_cast<uint32_t>(program.size()), &error_message) != 0) {
+            g_error_message += error_message;
+            free(error_message);
+            g_ubpf_fuzzer_statistics.load_failures++;
+            return false;
+        }
+
+        bool interpreter = g_ubpf_fuzzer_options.get("UBPF_FUZZER_INTERPRETER");
+        bool jit = g_ubpf_fuzzer_options.get("UBPF_FUZZER_JIT");
+        uint64_t interpreter_result = 0;
+        bool interpreter_succeeded = false;
+
+        if (interpreter) {
+            interpreter_succeeded = run_interpreter(interpreter_result);
+            if (jit) {
+                // Both engines run with the same context, memory and stack (so that the pointers they compute are
+                // the same); restore the memory that the interpreter may have modified.
+                memory_after_interpreter = memory;
+                std::memcpy(memory.data(), data + sizeof(uint32_t) + program.size(), memory.size());
+            }
+        }
+
+        if (jit) {
+            uint64_t jit_result = run_jit();
+            if (interpreter && interpreter_succeeded) {
+                compare(interpreter_result, jit_result);
+            }
+        }
+
+        return true;
+    }
+
+private:
+    /**
+     * @brief Point the context at the program, memory and stack of the current input.
+     */
+    void
+    reset_context()
+    {
+        context = ubpf_context_from(program, memory, stack);
+    }
+
+    /**
+     * @brief Run the loaded program in the interpreter.
+     *
+     * @param[out] result The value returned by the program.
+     * @retval true The program ran successfully.
+     * @retval false The program failed in a way that is not fatal (see call_ubpf_interpreter).
+     */
+    bool
+    run_interpreter(uint64_t& result)
+    {
+        reset_context();
+        g_ubpf_fuzzer_statistics.interpreter_runs++;
+        if (ubpf_exec_ex(vm.get(), &context, sizeof(context), &result, stack.data(), stack.size()) == 0) {
+            return true;
+        }
+
+        g_ubpf_fuzzer_statistics.interpreter_errors++;
+        for (const auto& error_message : g_error_message_to_ignore) {
+            if (std::regex_search(g_error_message, std::regex(error_message))) {
+                return false;
+            }
+        }
+        if (g_ubpf_fuzzer_options.get("UBPF_FUZZER_VERIFY_BYTE_CODE")) {
+            throw std::runtime_error("Failed to execute program with error: " + g_error_message);
+        }
+        return false;
+    }
+
+    /**
+     * @brief JIT the loaded program into the arena and run it.
+     *
+     * @return The value returned by the program.
+     */
+    uint64_t
+    run_jit()
+    {
+        char* error_message = nullptr;
+        size_t size = jit_buffer.size();
+        if (ubpf_translate_ex(vm.get(), jit_buffer.data(), &size, &error_message, JitMode::ExtendedJitMode) != 0) {
+            std::string error_message_str = error_message ? error_message : "unknown error";
+            free(error_message);
+            throw std::runtime_error("Failed to compile program with error: " + error_message_str);
+        }
+
+        if (mprotect(arena, jit_buffer_size, PROT_READ | PROT_WRITE) != 0) {
+            throw std::runtime_error("Failed to make the executable arena writable");
+        }
+        std::memcpy(arena, jit_buffer.data(), size);
+        if (mprotect(arena, jit_buffer_size, PROT_READ | PROT_EXEC) != 0) {
+            throw std::runtime_error("Failed to make the executable arena executable");
+        }
+
+        reset_context();
+        g_ubpf_fuzzer_statistics.jit_runs++;
+        auto fn = reinterpret_cast<ubpf_jit_ex_fn>(arena);
+        return fn(&context, sizeof(context), stack.data(), stack.size());
+    }
+
+    /**
+     * @brief Compare the results of the interpreter and of the JIT for the current input.
+     *
+     * @param[in] interpreter_result The value returned by the program in the interpreter.
+     * @param[in] jit_result The value returned by the program in the JIT.
+     */
+    void
+    compare(uint64_t interpreter_result, uint64_t jit_result)
+    {
+        g_ubpf_fuzzer_statistics.comparisons++;
+        bool return_value_diverged = interpreter_result != jit_result;
+        bool memory_diverged = memory_after_interpreter != memory;
+        if (!return_value_diverged && !memory_diverged) {
+            return;
+        }
+
+        std::cerr << "interpreter_result: " << std::hex << interpreter_result << std::endl;
+        std::cerr << "jit_result: " << std::hex << jit_result << std::dec << std::endl;
+        if (memory_diverged) {
+            std::cerr << "The interpreter and the JIT left different contents in the memory." << std::endl;
+        }
+        g_ubpf_fuzzer_statistics.return_value_divergences += return_value_diverged;
+        g_ubpf_fuzzer_statistics.memory_divergences += memory_diverged;
+
+        if (!g_ubpf_fuzzer_options.get("UBPF_FUZZER_CONTINUE_ON_DIVERGENCE")) {
+            g_ubpf_fuzzer_statistics.print(std::cerr);
+            throw std::runtime_error(return_value_diverged ? "interpreter_result != jit_result"
+                                                           : "interpreter memory != jit memory");
+        }
+    }
+
+    ubpf_vm_ptr vm;
+    ubpf_context_t context{};
+    std::vector<uint8_t> program;
+    std::vector<uint8_t> memory;
+    std::vector<uint8_t> memory_after_interpreter;
+    std::vector<uint8_t> stack;
+    std::vector<uint8_t> jit_buffer;
+    void* arena = nullptr;
+};
+
+/**
+ * @brief Run a batch of inputs on the reused VM of the throughput mode.
+ *
+ * A batch is a sequence of records, each a 32-bit size followed by that many bytes of input (in the format described in
+ * LLVMFuzzerTestOneInput). A record that runs past the end of the batch ends it.
+ *
+ * @param[in] data Pointer to the batch.
+ * @param[in] size Size of the batch.
+ * @retval -1 The batch does not contain any input that could be run.
+ * @retval 0 At least one input of the batch was run.
+ */
+int
+run_batch(const uint8_t* data, std::size_t size)
+{
+    static _ubpf_fuzzer_engines engines;
+
+    bool ran = false;
+    size_t offset = 0;
+    size_t index = 0;
+    while (size - offset >= sizeof(uint32_t)) {
+        uint32_t record_size;
+        std::memcpy(&record_size, data + offset, sizeof(record_size));
+        offset += sizeof(record_size);
+        if (record_size > size - offset) {
+            break;
+        }
+
+        g_ubpf_fuzzer_statistics.inputs++;
+        uint64_t divergences =
+            g_ubpf_fuzzer_statistics.return_value_divergences + g_ubpf_fuzzer_statistics.memory_divergences;
+        try {
+            ran |= engines.run(data + offset, record_size);
+        } catch (const std::exception&) {
+            std::cerr << "Input " << index << " of the batch (" << record_size << " bytes at offset " << offset
+                      << ") failed." << std::endl;
+            throw;
+        }
+        if (g_ubpf_fuzzer_statistics.return_value_divergences + g_ubpf_fuzzer_statistics.memory_divergences !=
+            divergences) {
+            std::cerr << "Input " << index << " of the batch (" << record_size << " bytes at offset " << offset
+                      << ") diverged." << std::endl;
+        }
+        offset += record_size;
+        index++;
+    }
+
+    g_ubpf_fuzzer_statistics.batches++;
+    uint64_t batches = g_ubpf_fuzzer_statistics.batches;
+    if (batches >= 1024 && (batches & (batches - 1)) == 0) {
+        g_ubpf_fuzzer_statistics.print(std::cerr);
+    }
+
+    return ran ? 0 : -1;
+}
+
 /**
  * @brief Accept an input buffer and size.
  *
@@ -862,6 +1175,10 @@ LLVMFuzzerTestOneInput(const uint8_t* data, std::size_t size) try
     // 32-bit program length
     // program byte
     // test data
+    // In the throughput mode, the fuzzer input is a batch of such inputs (see run_batch).
+    if (g_ubpf_fuzzer_options.get("UBPF_FUZZER_THROUGHPUT")) {
+        return run_batch(data, size);
+    }
 
     std::vector<uint8_t> program;
     std::vector<uint8_t> memory;
@@ -5,7 +5,17 @@
 // the first agument. It then executes the BPF program and prints the
 // value of %r0 at the end of execution.
 // The program is intended to be used with the bpf conformance test suite.
-
+//
+// With --server, the program instead answers a stream of test cases read from stdin
+// (until the end of the stream), with a single VM. Each test case is
+//   uint32_t program_size; uint32_t memory_size; uint8_t program[program_size]; uint8_t memory[memory_size];
+// and each answer is
+//   uint32_t status; uint32_t output_size; char output[output_size];
+// where the status is the exit status and the output is what would have been printed
+// on stdout if the test case had been run by a process of its own. All integers are in
+// the byte order of the host.
+
+#include <cstdio>
 #include <iostream>
 #include <memory>
 #include <vector>
@@ -74,79 +84,69 @@ bytes_to_ebpf_inst(std::vector<uint8_t> bytes)
 }
 
 /**
- * @brief This program reads BPF instructions from stdin and memory contents from
- * the first agument. It then executes the BPF program and prints the
- * value of %r0 at the end of execution.
+ * @brief Memory into which the JIT'd program is copied. It is kept (and only grows) from
+ * one test case to the next.
  */
-int main(int argc, char **argv)
+struct jit_copy_arena
 {
-    bool jit = false; // JIT == true, interpreter == false
-    std::vector<std::string> args(argv, argv + argc);
-    std::string program_string;
-    std::string memory_string;
-
-    // Remove the first argument which is the program name.
-    args.erase(args.begin());
-
-    // First parameter is optional memory contents.
-    if (args.size() > 0 && !args[0].starts_with("--"))
-    {
-        memory_string = args[0];
-        args.erase(args.begin());
-    }
-    if (args.size() > 0 && args[0] == "--program")
+    void *memory{nullptr};
+    size_t size{0};
+
+    /**
+     * @brief Make the arena writable and at least the given size.
+     *
+     * @param[in] required_size The size of the JIT'd program.
+     * @return The arena or nullptr if it could not be allocated.
+     */
+    void *
+    reserve(size_t required_size)
     {
-        args.erase(args.begin());
-        if (args.size() > 0)
-        {
-            program_string = args[0];
-            args.erase(args.begin());
+        if (memory != nullptr && size >= required_size) {
+            return mprotect(memory, size, PROT_READ | PROT_WRITE) == 0 ? memory : nullptr;
         }
+        if (memory != nullptr) {
+            munmap(memory, size);
+        }
+        memory = mmap(0, required_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            memory = nullptr;
+            size = 0;
+            return nullptr;
+        }
+        size = required_size;
+        return memory;
     }
-    if (args.size() > 0 && args[0] == "--jit")
-    {
-        jit = true;
-        args.erase(args.begin());
-    }
-    if (args.size() > 0 && args[0] == "--interpret")
-    {
-        jit = false;
-        args.erase(args.begin());
-    }
-
-    if (args.size() > 0 && args[0].size() > 0)
-    {
-        std::cerr << "Invalid arguments: " << args[0] << std::endl;
-        return 1;
-    }
-
-    if (program_string.empty()) {
-        std::getline(std::cin, program_string);
-    }
+};
 
-    std::vector<ebpf_inst> program = bytes_to_ebpf_inst(base16_decode(program_string));
-    std::vector<uint8_t> memory = base16_decode(memory_string);
+static jit_copy_arena copy_arena;
 
-    std::unique_ptr<ubpf_vm, decltype(&ubpf_destroy)> vm(ubpf_create(), ubpf_destroy);
+/**
+ * @brief Load a test case into the VM, execute it (in every way that uses the selected engine)
+ * and check that every way gives the same result.
+ *
+ * @param[in] vm The VM (with no code loaded) to run the test case in.
+ * @param[in] program The program of the test case.
+ * @param[in] memory The memory given to the program.
+ * @param[in] jit Whether to JIT the program (true) or to interpret it (false).
+ * @param[out] out The stream to which the result (or the reason that the program could not be loaded) is printed.
+ * @return The exit status of the test case.
+ */
+static int
+run_test_case(
+    ubpf_vm *vm, std::vector<ebpf_inst> &program, const std::vector<uint8_t> &memory, bool jit, std::ostream &out)
+{
     char* error = nullptr;
 
-    if (vm == nullptr)
-    {
-        std::cerr << "Failed to create VM" << std::endl;
-        return 1;
-    }
-
-    ubpf_register_external_dispatcher(vm.get(), test_helpers_dispatcher, test_helpers_validater);
-
-    if (ubpf_set_unwind_function_index(vm.get(), 5) != 0)
+    // Earlier test cases may have replaced the dispatcher with indexed helpers.
+    if (ubpf_register_external_dispatcher(vm, test_helpers_dispatcher, test_helpers_validater) != 0)
     {
-        std::cerr << "Failed to set unwind function index" << std::endl;
+        std::cerr << "Failed to register the external dispatcher" << std::endl;
         return 1;
     }
 
-    if (ubpf_load(vm.get(), program.data(), static_cast<uint32_t>(program.size() * sizeof(ebpf_inst)), &error) != 0)
+    if (ubpf_load(vm, program.data(), static_cast<uint32_t>(program.size() * sizeof(ebpf_inst)), &error) != 0)
     {
-        std::cout << "Failed to load code: " << error << std::endl;
+        out << "Failed to load code: " << error << std::endl;
         free(error);
         return 1;
     }
@@ -155,7 +155,7 @@ int main(int argc, char **argv)
     if (jit)
     {
         // Compile the program ...
-        ubpf_jit_fn fn = ubpf_compile(vm.get(), &error);
+        ubpf_jit_fn fn = ubpf_compile(vm, &error);
         if (fn == nullptr)
         {
             std::cerr << "Failed to compile program: " << error << std::endl;
@@ -175,9 +175,9 @@ int main(int argc, char **argv)
         external_dispatcher_result = fn(usable_program_memory_pointer, usable_program_memory.size());
 
         // ... execute original code but with indexed dispatcher to helper functions ...
-        ubpf_register_external_dispatcher(vm.get(), nullptr, test_helpers_validater);
+        ubpf_register_external_dispatcher(vm, nullptr, test_helpers_validater);
         for (auto& [key, value] : helper_functions) {
-            if (ubpf_register(vm.get(), key, "unnamed", value) != 0) {
+            if (ubpf_register(vm, key, "unnamed", value) != 0) {
                 std::cerr << "Failed to register helper function" << std::endl;
                 return 1;
             }
@@ -192,15 +192,18 @@ int main(int argc, char **argv)
         index_helper_result = fn(usable_program_memory_pointer, usable_program_memory.size());
 
         // ... copy the JIT'd program ...
-        auto fn_copy_size = vm->jitted_size * sizeof(char);
-        void *fn_copy = mmap(0, fn_copy_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        fn = ubpf_copy_jit(vm.get(), fn_copy, fn_copy_size, &error);
+        void *fn_copy = copy_arena.reserve(vm->jitted_size * sizeof(char));
+        if (fn_copy == nullptr) {
+            std::cerr << "Failed to allocate memory for a copy of the JIT'd program" << std::endl;
+            return 1;
+        }
+        fn = ubpf_copy_jit(vm, fn_copy, copy_arena.size, &error);
         if (fn == nullptr) {
             std::cerr << "Failed to copy JIT'd program: " << error << std::endl;
             free(error);
             return 1;
         }
-        mprotect(fn_copy, fn_copy_size, PROT_READ | PROT_EXEC);
+        mprotect(fn_copy, copy_arena.size, PROT_READ | PROT_EXEC);
 
         // ... execute the copy of the JIT'd code ...
         uint64_t copy_result;
@@ -211,7 +214,7 @@ int main(int argc, char **argv)
         }
         copy_result = fn(usable_program_memory_pointer, usable_program_memory.size());
 
-        ubpf_jit_ex_fn fn_ex = ubpf_compile_ex(vm.get(), &error, ExtendedJitMode);
+        ubpf_jit_ex_fn fn_ex = ubpf_compile_ex(vm, &error, ExtendedJitMode);
         if (fn_ex == nullptr) {
             std::cerr << "Failed to compile program (extended): " << error << std::endl;
             free(error);
@@ -251,16 +254,16 @@ int main(int argc, char **argv)
             usable_program_memory_pointer = usable_program_memory.data();
         }
 
-        if (ubpf_exec(vm.get(), usable_program_memory_pointer, usable_program_memory.size(), &external_dispatcher_result) != 0)
+        if (ubpf_exec(vm, usable_program_memory_pointer, usable_program_memory.size(), &external_dispatcher_result) != 0)
         {
             std::cerr << "Failed to execute program" << std::endl;
             return 1;
         }
 
         // ... execute original code but with indexed dispatcher to helper functions ...
-        ubpf_register_external_dispatcher(vm.get(), nullptr, test_helpers_validater);
+        ubpf_register_external_dispatcher(vm, nullptr, test_helpers_validater);
         for (auto& [key, value] : helper_functions) {
-            if (ubpf_register(vm.get(), key, "unnamed", value) != 0) {
+            if (ubpf_register(vm, key, "unnamed", value) != 0) {
                 std::cerr << "Failed to register helper function" << std::endl;
                 return 1;
             }
@@ -274,7 +277,7 @@ int main(int argc, char **argv)
         }
 
         uint64_t index_helper_result;
-        if (ubpf_exec(vm.get(), usable_program_memory_pointer, usable_program_memory.size(), &index_helper_result) != 0)
+        if (ubpf_exec(vm, usable_program_memory_pointer, usable_program_memory.size(), &index_helper_result) != 0)
         {
             std::cerr << "Failed to execute program" << std::endl;
             return 1;
@@ -297,7 +300,7 @@ int main(int argc, char **argv)
 
         uint64_t external_memory_index_helper_result;
         if (ubpf_exec_ex(
-                vm.get(),
+                vm,
                 usable_program_memory_pointer,
                 usable_program_memory.size(),
                 &external_memory_index_helper_result,
@@ -318,6 +321,145 @@ int main(int argc, char **argv)
         }
 
     }
-    std::cout << std::hex << external_dispatcher_result << std::endl;
+    out << std::hex << external_dispatcher_result << std::endl;
     return 0;
 }
+
+/**
+ * @brief Read exactly size bytes from stdin.
+ *
+ * @return True if the bytes were read; false, at the end of the stream.
+ */
+static bool
+read_exactly(void *buffer, size_t size)
+{
+    return size == 0 || fread(buffer, 1, size, stdin) == size;
+}
+
+/**
+ * @brief Answer the test cases read from stdin until the end of the stream, with a single VM.
+ *
+ * @param[in] vm The VM to run the test cases in.
+ * @param[in] jit Whether to JIT the programs (true) or to interpret them (false).
+ * @return The exit status of the server.
+ */
+static int
+serve(ubpf_vm *vm, bool jit)
+{
+    uint32_t sizes[2];
+    while (read_exactly(sizes, sizeof(sizes))) {
+        std::vector<uint8_t> program_bytes(sizes[0]);
+        std::vector<uint8_t> memory(sizes[1]);
+        if (!read_exactly(program_bytes.data(), program_bytes.size()) || !read_exactly(memory.data(), memory.size())) {
+            std::cerr << "Truncated test case" << std::endl;
+            return 1;
+        }
+
+        std::vector<ebpf_inst> program = bytes_to_ebpf_inst(program_bytes);
+        std::ostringstream out;
+        uint32_t status = static_cast<uint32_t>(run_test_case(vm, program, memory, jit, out));
+        ubpf_unload_code(vm);
+
+        std::string output = out.str();
+        uint32_t header[2] = {status, static_cast<uint32_t>(output.size())};
+        if (fwrite(header, sizeof(header), 1, stdout) != 1 || fwrite(output.data(), 1, output.size(), stdout) != output.size() ||
+            fflush(stdout) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief This program reads BPF instructions from stdin and memory contents from
+ * the first agument. It then executes the BPF program and prints the
+ * value of %r0 at the end of execution. With --server, it answers a stream of
+ * test cases instead (see the top of this file).
+ */
+int main(int argc, char **argv)
+{
+    bool jit = false; // JIT == true, interpreter == false
+    bool server = false;
+    bool memory_given = false;
+    bool program_given = false;
+    std::vector<std::string> args(argv, argv + argc);
+    std::string program_string;
+    std::string memory_string;
+
+    // Remove the first argument which is the program name.
+    args.erase(args.begin());
+
+    if (args.size() > 0 && args[0] == "--server")
+    {
+        server = true;
+        args.erase(args.begin());
+    }
+
+    // First parameter is optional memory contents.
+    if (args.size() > 0 && !args[0].starts_with("--"))
+    {
+        memory_string = args[0];
+        memory_given = true;
+        args.erase(args.begin());
+    }
+    if (args.size() > 0 && args[0] == "--program")
+    {
+        program_given = true;
+        args.erase(args.begin());
+        if (args.size() > 0)
+        {
+            program_string = args[0];
+            args.erase(args.begin());
+        }
+    }
+    if (args.size() > 0 && args[0] == "--jit")
+    {
+        jit = true;
+        args.erase(args.begin());
+    }
+    if (args.size() > 0 && args[0] == "--interpret")
+    {
+        jit = false;
+        args.erase(args.begin());
+    }
+
+    if (args.size() > 0 && args[0].size() > 0)
+    {
+        std::cerr << "Invalid arguments: " << args[0] << std::endl;
+        return 1;
+    }
+
+    // A server reads the program and the memory of each test case from stdin.
+    if (server && (memory_given || program_given))
+    {
+        std::cerr << "Invalid arguments: --server takes neither the memory nor --program" << std::endl;
+        return 1;
+    }
+
+    if (!server && program_string.empty()) {
+        std::getline(std::cin, program_string);
+    }
+
+    std::unique_ptr<ubpf_vm, decltype(&ubpf_destroy)> vm(ubpf_create(), ubpf_destroy);
+
+    if (vm == nullptr)
+    {
+        std::cerr << "Failed to create VM" << std::endl;
+        return 1;
+    }
+
+    if (ubpf_set_unwind_function_index(vm.get(), 5) != 0)
+    {
+        std::cerr << "Failed to set unwind function index" << std::endl;
+        return 1;
+    }
+
+    if (server)
+    {
+        return serve(vm.get(), jit);
+    }
+
+    std::vector<ebpf_inst> program = bytes_to_ebpf_inst(base16_decode(program_string));
+    std::vector<uint8_t> memory = base16_decode(memory_string);
+    return run_test_case(vm.get(), program, memory, jit, std::cout);
+}
@@ -0,0 +1,140 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+// This program checks the server mode of ubpf_plugin: it pipes a stream of test cases through
+// `ubpf_plugin --server` (with the options given after the path of ubpf_plugin) and checks the
+// status and the output of each answer. It also checks that the server rejects the arguments
+// that only a single test case takes.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "ebpf.h"
+}
+
+struct server_test_case
+{
+    std::string name;
+    std::vector<ebpf_inst> program;
+    std::vector<uint8_t> memory;
+    uint32_t expected_status;
+    std::string expected_output; ///< The expected output or, if the test case fails, its beginning.
+};
+
+/**
+ * @brief Append the bytes of a value (in the byte order of the host) to the stream.
+ */
+static void
+append(std::string& stream, const void* data, size_t size)
+{
+    stream.append(static_cast<const char*>(data), size);
+}
+
+/**
+ * @brief Run a command through the shell.
+ *
+ * @return True if the command exited with status 0.
+ */
+static bool
+run(const std::string& command)
+{
+    std::cerr << "Running: " << command << std::endl;
+    return std::system(command.c_str()) == 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " UBPF_PLUGIN [OPTIONS]" << std::endl;
+        return 1;
+    }
+    std::string plugin = std::string("\"") + argv[1] + "\"";
+    std::string options;
+    for (int i = 2; i < argc; i++) {
+        options += std::string(" ") + argv[i];
+    }
+
+    // The failing test case comes between the others to check that the server goes on after it.
+    std::vector<server_test_case> test_cases{
+        {"mov", {{EBPF_OP_MOV64_IMM, 0, 0, 0, 0x2a}, {EBPF_OP_EXIT, 0, 0, 0, 0}}, {}, 0, "2a\n"},
+        {"invalid", {{0xff, 0, 0, 0, 0}, {EBPF_OP_EXIT, 0, 0, 0, 0}}, {}, 1, "Failed to load code: "},
+        {"memory", {{EBPF_OP_LDXH, 0, 1, 2, 0}, {EBPF_OP_EXIT, 0, 0, 0, 0}}, {0x11, 0x22, 0x33, 0x44}, 0, "4433\n"},
+    };
+
+    std::filesystem::path directory = std::filesystem::temp_directory_path();
+    std::string suffix = std::to_string(std::hash<std::string>{}(options));
+    std::filesystem::path input_path = directory / ("ubpf_plugin_server_test_" + suffix + ".in");
+    std::filesystem::path output_path = directory / ("ubpf_plugin_server_test_" + suffix + ".out");
+
+    std::string input;
+    for (const server_test_case& test_case : test_cases) {
+        uint32_t sizes[2] = {
+            static_cast<uint32_t>(test_case.program.size() * sizeof(ebpf_inst)),
+            static_cast<uint32_t>(test_case.memory.size())};
+        append(input, sizes, sizeof(sizes));
+        append(input, test_case.program.data(), sizes[0]);
+        append(input, test_case.memory.data(), sizes[1]);
+    }
+    std::ofstream(input_path, std::ios::binary) << input;
+
+    std::string redirections = " < \"" + input_path.string() + "\" > \"" + output_path.string() + "\"";
+    if (!run(plugin + " --server" + options + redirections)) {
+        std::cerr << "The server failed" << std::endl;
+        return 1;
+    }
+
+    std::ifstream output_file(output_path, std::ios::binary);
+    std::string output{std::istreambuf_iterator<char>(output_file), std::istreambuf_iterator<char>()};
+    size_t offset = 0;
+    for (const server_test_case& test_case : test_cases) {
+        uint32_t header[2];
+        if (output.size() - offset < sizeof(header)) {
+            std::cerr << test_case.name << ": no answer" << std::endl;
+            return 1;
+        }
+        output.copy(reinterpret_cast<char*>(header), sizeof(header), offset);
+        offset += sizeof(header);
+        if (output.size() - offset < header[1]) {
+            std::cerr << test_case.name << ": truncated answer" << std::endl;
+            return 1;
+        }
+        std::string answer = output.substr(offset, header[1]);
+        offset += header[1];
+
+        bool matches = test_case.expected_status == 0 ? answer == test_case.expected_output
+                                                      : answer.starts_with(test_case.expected_output);
+        if (header[0] != test_case.expected_status || !matches) {
+            std::cerr << test_case.name << ": the server answered " << header[0] << " \"" << answer
+                      << "\" instead of " << test_case.expected_status << " \"" << test_case.expected_output << "\""
+                      << std::endl;
+            return 1;
+        }
+    }
+    if (offset != output.size()) {
+        std::cerr << "The server answered more test cases than it was given" << std::endl;
+        return 1;
+    }
+
+    // The server reads the program and the memory of each test case from stdin.
+    for (const std::string& arguments : {std::string(" 00"), std::string(" --program 95")}) {
+        if (run(plugin + " --server" + arguments + options + redirections)) {
+            std::cerr << "The server accepted" << arguments << std::endl;
+            return 1;
+        }
+    }
+
+    std::filesystem::remove(input_path);
+    std::filesystem::remove(output_path);
+    return 0;
+}
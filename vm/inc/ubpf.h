@@ -167,12 +167,15 @@ extern "C"
 
     /**
      * @brief Register an external function.
-     * The immediate field of a CALL instruction is an index into an array of
-     * functions registered by the user. This API associates a function with
-     * an index.
+     * The immediate field of a CALL instruction is the ID of a function
+     * registered by the user. This API associates a function with an ID, which
+     * may be any 32-bit value (e.g., the number of a Linux helper). When a
+     * program is loaded, the helpers that it calls are gathered in a table of
+     * only those helpers, through which the interpreter and the JIT'd code
+     * call them.
      *
      * @param[in] vm The VM to register the function on.
-     * @param[in] index The index to register the function at.
+     * @param[in] index The ID to register the function with.
      * @param[in] name The human readable name of the function.
      * @param[in] fn The function to register.
      * @retval 0 Success.
@@ -212,6 +215,57 @@ extern "C"
     ubpf_register_external_dispatcher(
         struct ubpf_vm* vm, external_function_dispatcher_t dispatcher, external_function_validate_t validater);
 
+    /**
+     * @brief Register a kfunc: a function that programs call by its BTF ID (a CALL instruction
+     * whose src is 2 and whose immediate field is the ID) rather than by helper index. Any number
+     * of kfuncs may be registered. The kfuncs that a program calls are resolved when it is loaded,
+     * so that the interpreter calls them through a table of only those kfuncs and the JIT'd code
+     * calls them directly (neither goes through the external dispatcher). A call to an
+     * undefined function in an ELF file resolves to the kfunc with its name unless a helper
+     * has that name.
+     *
+     * @param[in] vm The VM to register the kfunc on.
+     * @param[in] btf_id The BTF ID of the kfunc. A kfunc that was registered with the same ID is
+     *                   replaced.
+     * @param[in] name The name of the kfunc (or NULL), which must outlive the VM.
+     * @param[in] fn The kfunc, which is called like a helper.
+     * @retval 0 Success.
+     * @retval -1 Failure (e.g., a program is already loaded).
+     */
+    int
+    ubpf_register_kfunc(struct ubpf_vm* vm, uint32_t btf_id, const char* name, external_function_t fn);
+
+    /**
+     * @brief Enum to describe how JIT'd code finds the helper that a CALL instruction invokes.
+     *
+     * DynamicDispatch checks, at each call, whether an external dispatcher is registered and
+     * otherwise loads the helper from the VM's helper table. The dispatcher can therefore be
+     * registered or removed after the program is JIT'd.
+     *
+     * StaticDispatch commits, when the program is JIT'd, to the cheapest sequence for the
+     * configuration registered at that time: a call through the dispatcher if one is registered
+     * and a direct load from the helper table if not. Helpers can still be re-registered (and the
+     * dispatcher replaced) after the program is JIT'd but a dispatcher can neither be added nor
+     * removed.
+     */
+    enum DispatchStrategy
+    {
+        DynamicDispatch,
+        StaticDispatch
+    };
+
+    /**
+     * @brief Choose how the code subsequently JIT'd for this VM dispatches calls to helpers.
+     * The default is DynamicDispatch. The interpreter is not affected.
+     *
+     * @param[in] vm The VM to configure.
+     * @param[in] strategy The dispatch strategy.
+     * @retval 0 Success.
+     * @retval -1 The strategy is not valid.
+     */
+    int
+    ubpf_set_dispatch_strategy(struct ubpf_vm* vm, enum DispatchStrategy strategy);
+
     /**
      * @brief The type of a stack usage calculator callback function.
      *
@@ -232,8 +286,11 @@ extern "C"
      * The callback's job is to calculate the amount of stack space used by the local function that
      * starts at the given PC.
      *
-     * If the callback returns 0 or there is no callback registered, the eBPF interpreter/JITer
-     * assume that the local function uses the maximum stack available according to the spec (512K).
+     * If there is no callback registered, the stack usage of each local function is inferred
+     * from the deepest r10-relative load or store that it performs (rounded up to 16 bytes).
+     * A function that uses r10 in any other way (e.g., copies it to another register to pass a
+     * stack pointer to a helper) is assumed to use the default amount of stack space
+     * (UBPF_EBPF_LOCAL_FUNCTION_STACK_SIZE).
      *
      * @param[in] vm The VM to register the callback with.
      * @param[in] dispatcher The callback that will be invoked to determine the amount of stack
@@ -320,6 +377,10 @@ extern "C"
      * containing the eBPF bytecodes. This is compatible with the output of
      * Clang.
      *
+     * If no data relocation function is registered (see ubpf_register_data_relocation), the
+     * VM instantiates the data sections (.data, .rodata and .bss) that the program refers to,
+     * once, and frees them when the code is unloaded (or the VM destroyed).
+     *
      * @param[in] vm The VM to load the code into.
      * @param[in] elf A pointer to a copy of an ELF file in memory.
      * @param[in] elf_len The size of the ELF file.
@@ -331,6 +392,134 @@ extern "C"
      */
     int
     ubpf_load_elf_ex(struct ubpf_vm* vm, const void* elf, size_t elf_len, const char* main_section_name, char** errmsg);
+
+    /**
+     * @brief Load code from an ELF file given by its file descriptor.
+     *
+     * The file is mapped read-only (or, where files cannot be mapped, read) and parsed in place;
+     * the main function is linked first, straight into the buffer in which the VM keeps the
+     * instructions, so the program is copied once. See ubpf_load_elf_ex.
+     *
+     * @param[in] vm The VM to load the code into.
+     * @param[in] fd The file descriptor of the ELF file, open for reading. It is not closed.
+     * @param[in] main_function_name The name of the eBPF program's main function (or NULL for the
+     * function at the start of the .text section).
+     * @param[out] errmsg The error message, if any. This should be freed by the caller.
+     * @retval 0 Success.
+     * @retval -1 Failure.
+     */
+    int
+    ubpf_load_elf_fd(struct ubpf_vm* vm, int fd, const char* main_function_name, char** errmsg);
+
+    /**
+     * @brief Load code from an ELF file given by its path. See ubpf_load_elf_fd.
+     *
+     * @param[in] vm The VM to load the code into.
+     * @param[in] path The path of the ELF file.
+     * @param[in] main_function_name The name of the eBPF program's main function (or NULL for the
+     * function at the start of the .text section).
+     * @param[out] errmsg The error message, if any. This should be freed by the caller.
+     * @retval 0 Success.
+     * @retval -1 Failure.
+     */
+    int
+    ubpf_load_elf_file(struct ubpf_vm* vm, const char* path, const char* main_function_name, char** errmsg);
+
+    /**
+     * @brief An ELF file that has been parsed and linked once, from which any of its programs can
+     * be loaded into any number of VMs.
+     */
+    struct ubpf_elf_object;
+
+    /**
+     * @brief Parse an ELF file and link all of its functions.
+     *
+     * The relocations are resolved once, against the given VM: data relocations with its data
+     * relocation function and helper relocations with the helpers registered in it. The VMs
+     * into which programs of the object are loaded must register the same helpers (at the same
+     * indexes). The object does not refer to the ELF file after this call returns.
+     *
+     * Without a data relocation function, the data sections are instantiated by the library:
+     * .rodata once, shared (read-only) by every VM into which a program of the object is loaded,
+     * and .data and .bss once for each of these VMs.
+     *
+     * @param[in] vm The VM against which to resolve the relocations.
+     * @param[in] elf A pointer to a copy of an ELF file in memory.
+     * @param[in] elf_len The size of the ELF file.
+     * @param[out] errmsg The error message, if any. This should be freed by the caller.
+     * @return The object or NULL on failure. It should be freed with ubpf_elf_object_close.
+     */
+    struct ubpf_elf_object*
+    ubpf_elf_object_open(struct ubpf_vm* vm, const void* elf, size_t elf_len, char** errmsg);
+
+    /**
+     * @brief Free an object returned by ubpf_elf_object_open.
+     *
+     * The VMs into which its programs were loaded are not affected.
+     *
+     * @param[in] object The object to free (or NULL).
+     */
+    void
+    ubpf_elf_object_close(struct ubpf_elf_object* object);
+
+    /**
+     * @brief Get the number of programs (i.e., functions) in an object.
+     *
+     * @param[in] object The object.
+     * @return The number of programs, which are numbered from 0.
+     */
+    int
+    ubpf_elf_object_program_count(const struct ubpf_elf_object* object);
+
+    /**
+     * @brief Get the name of a program (i.e., of its function).
+     *
+     * @param[in] object The object.
+     * @param[in] index The number of the program.
+     * @return The name or NULL if there is no such program.
+     */
+    const char*
+    ubpf_elf_object_program_name(const struct ubpf_elf_object* object, int index);
+
+    /**
+     * @brief Get the name of the section that holds a program (e.g., "xdp" for a function
+     * declared with SEC("xdp")).
+     *
+     * @param[in] object The object.
+     * @param[in] index The number of the program.
+     * @return The name or NULL if there is no such program.
+     */
+    const char*
+    ubpf_elf_object_program_section(const struct ubpf_elf_object* object, int index);
+
+    /**
+     * @brief Find a program by name.
+     *
+     * @param[in] object The object.
+     * @param[in] name The name of the function or, failing that, of the section at the start of
+     * which the function is. If NULL, the function at the start of the .text section (the
+     * program that ubpf_load_elf loads).
+     * @return The number of the program or -1 if there is no such program.
+     */
+    int
+    ubpf_elf_object_find_program(const struct ubpf_elf_object* object, const char* name);
+
+    /**
+     * @brief Load a program of an object into a VM.
+     *
+     * Execution starts with the function of the program; the other functions of the object are
+     * loaded after it (in case it calls them). This is what ubpf_load_elf_ex does, without
+     * parsing and linking the ELF file again.
+     *
+     * @param[in] object The object.
+     * @param[in] vm The VM to load the program into.
+     * @param[in] index The number of the program.
+     * @param[out] errmsg The error message, if any. This should be freed by the caller.
+     * @retval 0 Success.
+     * @retval -1 Failure.
+     */
+    int
+    ubpf_elf_object_load(const struct ubpf_elf_object* object, struct ubpf_vm* vm, int index, char** errmsg);
 #endif
 
     /**
@@ -358,6 +547,64 @@ extern "C"
         uint8_t* stack,
         size_t stack_len);
 
+    /**
+     * @brief Execute a BPF program in the VM using the interpreter and record a trace of the
+     * execution from which ubpf_replay_trace can reproduce it.
+     *
+     * The trace holds the values that helpers returned and the values that the program loaded
+     * (or that atomic operations fetched) from memory other than the bytes of its stack that it
+     * stored since it last called a helper, plus one bit per conditional branch. Tracing only the runs of interest (e.g., a sample of
+     * them) keeps its cost off the others.
+     *
+     * @param[in] vm The VM to execute the program in.
+     * @param[in] mem The memory to pass to the program.
+     * @param[in] mem_len The length of the memory.
+     * @param[out] bpf_return_value The value of the r0 register when the program exits.
+     * @param[out] trace The buffer that receives the trace.
+     * @param[in] trace_size The size of the buffer.
+     * @param[out] trace_length The length of the trace, or 0 if the buffer was too small to hold
+     * it (in which case the program still runs to completion).
+     * @retval 0 Success.
+     * @retval -1 Failure.
+     */
+    int
+    ubpf_exec_traced(
+        const struct ubpf_vm* vm,
+        void* mem,
+        size_t mem_len,
+        uint64_t* bpf_return_value,
+        void* trace,
+        size_t trace_size,
+        size_t* trace_length);
+
+    /**
+     * @brief Re-execute a run of a program from its trace (see ubpf_exec_traced), without
+     * calling any helper or accessing any memory other than the program's stack.
+     *
+     * The program loaded into the VM must be the one that was traced. The replay checks that
+     * it takes the same branches and consumes the same values as the traced run.
+     *
+     * @param[in] vm The VM that holds the program.
+     * @param[in] trace The trace.
+     * @param[in] trace_length The length of the trace.
+     * @param[out] bpf_return_value The value of the r0 register when the program exits.
+     * @retval 0 Success (the traced run succeeded and the replay reproduced it).
+     * @retval -1 Failure (the traced run failed or the replay diverged from the trace).
+     */
+    int
+    ubpf_replay_trace(const struct ubpf_vm* vm, const void* trace, size_t trace_length, uint64_t* bpf_return_value);
+
+    /**
+     * @brief Enable or disable replay-only mode: a VM in this mode loads programs whose helpers
+     * are not registered (for offline replay of traces) but only runs them with ubpf_replay_trace.
+     *
+     * @param[in] vm The VM to configure.
+     * @param[in] enable Whether the VM only replays traces.
+     * @return The previous value of the setting.
+     */
+    bool
+    ubpf_toggle_replay_only(struct ubpf_vm* vm, bool enable);
+
     /**
      * @brief Compile a BPF program in the VM to native code.
      *
@@ -447,6 +694,43 @@ extern "C"
     int
     ubpf_translate_ex(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, char** errmsg, enum JitMode jit_mode);
 
+    /**
+     * @brief The ways in which JIT'd code can be described to the Linux perf tool (and debuggers).
+     */
+    enum JitPerfOutput
+    {
+        JitPerfMap = 1,      ///< Append an entry for the JIT'd code to /tmp/perf-<pid>.map.
+        JitPerfDump = 2,     ///< Record the JIT'd code (and a line table of its eBPF PCs) in a jitdump file.
+        JitGdbInterface = 4, ///< Register the JIT'd code through the GDB JIT compilation interface.
+    };
+
+    /**
+     * @brief Describe code subsequently JIT'd by ubpf_compile/ubpf_compile_ex to the Linux perf tool
+     * (and debuggers).
+     *
+     * With JitPerfMap, perf report attributes samples in the JIT'd code to the program (named
+     * "ubpf:<name>"). With JitPerfDump, the JIT'd code is also recorded in jit-<pid>.dump, along
+     * with a line table that maps its native addresses to the eBPF instructions listed in an
+     * accompanying ubpf-<pid>-<index>-<name>.ebpf file. Both files are written to the directory
+     * named by the JITDUMPDIR environment variable (default: /tmp). Use `perf record -k 1` and
+     * `perf inject --jit` so that perf report and perf annotate can use the jitdump file.
+     *
+     * With JitGdbInterface, the JIT'd code is registered (through __jit_debug_register_code) as an
+     * in-memory ELF object with a symbol for the program, a line table whose line N holds the eBPF
+     * instruction at PC N - 1 (of the file <name>.ebpf) and call frame information so that
+     * debuggers (and profilers that use the interface) unwind through JIT'd frames. The
+     * registration is withdrawn when the JIT'd code is released.
+     *
+     * @param[in] vm The VM whose JIT'd code is described.
+     * @param[in] outputs A combination of JitPerfOutput values (0 to disable).
+     * @param[in] name The name of the program in the perf output (default: "program").
+     * @retval 0 Success.
+     * @retval -1 Failure (e.g., JitPerfMap or JitPerfDump on a platform other than Linux, or
+     * JitGdbInterface on a platform other than Linux on x86-64 or ARM64).
+     */
+    int
+    ubpf_set_jit_perf_output(struct ubpf_vm* vm, unsigned int outputs, const char* name);
+
     /**
      * @brief Instruct the uBPF runtime to apply unwind-on-success semantics to a helper function.
      * If the function returns 0, the uBPF runtime will end execution of
@@ -494,6 +778,9 @@ extern "C"
      * @brief Data relocation function that is called by the VM when it encounters a
      * R_BPF_64_64 relocation in the maps section of the ELF file.
      *
+     * It is called for every relocation (so it should not copy the section for each one). If
+     * none is registered, the VM instantiates the data sections itself (see ubpf_load_elf_ex).
+     *
      * @param[in] user_context The user context that was passed to ubpf_register_data_relocation.
      * @param[in] data Pointer to start of the map section.
      * @param[in] data_size Size of the map section.
@@ -520,6 +807,26 @@ extern "C"
     int
     ubpf_register_data_relocation(struct ubpf_vm* vm, void* user_context, ubpf_data_relocation relocation);
 
+    /**
+     * @brief Register the host's BTF (the contents of a .BTF section) that describes the types
+     * that programs access, e.g., their context structures.
+     *
+     * The CO-RE relocations (in the .BTF.ext section) of the ELF files that are loaded afterwards
+     * are resolved against it: the offsets of the fields that the programs access (which were
+     * compiled against their own BTF) are adjusted to the layout of the host's types of the same
+     * names, so that a program runs unchanged with every version of the host. The BTF is copied
+     * and replaces any that was registered before.
+     *
+     * @param[in] vm The VM to register the BTF with.
+     * @param[in] btf The BTF.
+     * @param[in] btf_size The size of the BTF.
+     * @param[out] errmsg The error message, if any. This should be freed by the caller.
+     * @retval 0 Success.
+     * @retval -1 Failure (e.g., the BTF is malformed).
+     */
+    int
+    ubpf_register_btf(struct ubpf_vm* vm, const void* btf, size_t btf_size, char** errmsg);
+
     /**
      * @brief Function that is called by the VM to check if a memory access is within bounds.
      *
@@ -543,6 +850,69 @@ extern "C"
     int
     ubpf_register_data_bounds_check(struct ubpf_vm* vm, void* user_context, ubpf_bounds_check bounds_check);
 
+    /**
+     * @brief Register a region of memory that programs executed by the VM may access.
+     *
+     * When bounds checking is enabled, an access that is not to the program's memory or
+     * stack is allowed if it lies entirely within a registered region. Registered regions
+     * are kept sorted so that checking them takes logarithmic time in the number of regions.
+     * They are consulted before any function registered with ubpf_register_data_bounds_check.
+     *
+     * @param[in] vm The VM to register the region with.
+     * @param[in] address The start of the region.
+     * @param[in] size The size of the region, in bytes.
+     * @retval 0 Success.
+     * @retval -1 Failure (e.g., the region is empty or overlaps a registered region).
+     */
+    int
+    ubpf_register_memory_region(struct ubpf_vm* vm, const void* address, size_t size);
+
+    /**
+     * @brief Unregister a region of memory that was registered with ubpf_register_memory_region.
+     *
+     * @param[in] vm The VM with which the region was registered.
+     * @param[in] address The start of the region.
+     * @retval 0 Success.
+     * @retval -1 Failure (i.e., no registered region starts at address).
+     */
+    int
+    ubpf_unregister_memory_region(struct ubpf_vm* vm, const void* address);
+
+    /**
+     * @brief The memory, in bytes, used by a VM (see ubpf_get_memory_stats).
+     */
+    struct ubpf_memory_stats
+    {
+        size_t vm_bytes;                  ///< The VM itself.
+        size_t instruction_bytes;         ///< The loaded program.
+        size_t int_func_bytes;            ///< The map of instructions that begin local functions.
+        size_t ext_func_bytes;            ///< The registry of helpers and the table of those that the program calls.
+        size_t ext_func_name_bytes;       ///< Unused: the names of the helpers are in their registry.
+        size_t local_func_bytes;          ///< The per-local-function metadata (e.g., stack usage).
+        size_t jit_bytes;                 ///< The JIT'd code (the pages to which it is mapped).
+        size_t memory_region_table_bytes; ///< The registry of memory regions.
+        size_t data_section_bytes;        ///< The data sections of the ELF file (the read-only ones may be shared).
+        size_t kfunc_bytes;               ///< The registry of kfuncs and the table of those that the program calls.
+        size_t runtime_stats_bytes;       ///< The runtime statistics (a block per thread that runs the program).
+        size_t total_bytes;               ///< The sum of all of the above.
+        /**
+         * The size of the (host-owned) memory regions registered with the VM (e.g., relocated
+         * data and maps). Not included in total_bytes because the VM does not allocate them.
+         */
+        size_t registered_region_bytes;
+    };
+
+    /**
+     * @brief Get a breakdown of the memory used by a VM and the program loaded into it.
+     *
+     * @param[in] vm The VM whose memory use is reported.
+     * @param[out] stats The memory used by the VM.
+     * @retval 0 Success.
+     * @retval -1 Failure.
+     */
+    int
+    ubpf_get_memory_stats(const struct ubpf_vm* vm, struct ubpf_memory_stats* stats);
+
     /**
      * @brief Set a size for the buffer allocated to machine code generated during JIT compilation.
      * The JIT compiler allocates a buffer to store the code while it is being generated. The default
@@ -561,7 +931,18 @@ extern "C"
     /**
      * @brief Set the instruction limit for the VM. This is the maximum number
      * of instructions that a program may execute during a call to ubpf_exec.
-     * It has no effect on JIT'd programs.
+     *
+     * JIT'd programs enforce the limit that is in effect when they are compiled. After
+     * the limit changes, ubpf_compile recompiles the program (the function that it
+     * returned before keeps the old limit).
+     * To keep the cost low, JIT'd code only charges the budget at backward jumps
+     * and local calls (programs with neither are compiled without a budget) and it
+     * charges conservatively, so a JIT'd program may exhaust its budget earlier than
+     * the interpreter would. A JIT'd program that exhausts its budget returns UINT64_MAX.
+     *
+     * A program that cannot execute more instructions than the limit (see
+     * ubpf_get_instruction_bound) runs without checking it, in the interpreter and
+     * JIT'd alike.
      *
      * @param[in] vm The VM to set the instruction limit for.
      * @param[in] limit The maximum number of instructions that a program may execute or 0 for no limit.
@@ -572,6 +953,20 @@ extern "C"
     int
     ubpf_set_instruction_limit(struct ubpf_vm* vm, uint32_t limit, uint32_t* previous_limit);
 
+    /**
+     * @brief Get the most instructions that the loaded program can execute in one run.
+     *
+     * The bound is found when the program is loaded, from its control flow graph. Only a
+     * program that has no loops or recursions (and cannot fall off its end) has one.
+     *
+     * @param[in] vm The VM whose program to query.
+     * @param[out] bound The most instructions that the program can execute.
+     * @retval true The program has a bound.
+     * @retval false No program is loaded or it has no known bound.
+     */
+    bool
+    ubpf_get_instruction_bound(const struct ubpf_vm* vm, uint32_t* bound);
+
     /**
      * @brief Enable or disable undefined behavior checks. Undefined behavior includes
      * reading from uninitialized memory or using uninitialized registers. Default is disabled to
@@ -620,6 +1015,165 @@ extern "C"
      */
     int
     ubpf_register_debug_fn(struct ubpf_vm* vm, void* context, ubpf_debug_fn debug_function);
+
+    /**
+     * @brief Enable or disable the basic-block profiler.
+     *
+     * When the profiler is enabled, the interpreter counts how many times control enters each
+     * basic block of the loaded program. Code JIT'd while the profiler is enabled does the same
+     * (by incrementing the same counters). After the profiler is enabled or disabled, ubpf_compile
+     * recompiles the program (the function that it returned before keeps counting or not). The counters are not updated atomically: when the program is executed
+     * concurrently, the counts are approximate.
+     *
+     * @param[in] vm The VM whose program is profiled.
+     * @param[in] enable Enable the profiler if true, disable it if false.
+     * @retval 0 Success.
+     * @retval -1 Failure (the counters could not be allocated).
+     */
+    int
+    ubpf_toggle_profiling(struct ubpf_vm* vm, bool enable);
+
+    /**
+     * @brief Reset the basic-block profiler's counters to zero.
+     *
+     * @param[in] vm The VM whose counters are reset.
+     */
+    void
+    ubpf_reset_profile(struct ubpf_vm* vm);
+
+    /**
+     * @brief Get the number of times that control entered the basic block that begins at the given PC.
+     *
+     * @param[in] vm The VM whose program is profiled.
+     * @param[in] pc The PC of the first instruction of the basic block.
+     * @param[out] count The number of times that control entered the basic block.
+     * @retval 0 Success.
+     * @retval -1 Failure (the profiler is not enabled or no basic block begins at pc).
+     */
+    int
+    ubpf_get_profile_count(const struct ubpf_vm* vm, uint16_t pc, uint64_t* count);
+
+    /**
+     * @brief Write a report of the hottest basic blocks (those in which the most instructions were
+     * executed) of the profiled program, including their disassembly, to a stream.
+     *
+     * @param[in] vm The VM whose program is profiled.
+     * @param[in] stream The stream to which the report is written.
+     * @param[in] max_blocks The maximum number of basic blocks in the report (0 for no limit).
+     * @retval 0 Success.
+     * @retval -1 Failure (e.g., the profiler is not enabled).
+     */
+    int
+    ubpf_dump_profile(const struct ubpf_vm* vm, FILE* stream, uint32_t max_blocks);
+
+#define UBPF_RUNTIME_STATS_HELPERS 64
+#define UBPF_RUNTIME_STATS_EXIT_CODES 16
+
+    /**
+     * @brief A snapshot of the runtime statistics of a VM.
+     */
+    struct ubpf_runtime_stats
+    {
+        uint64_t run_count;   ///< The number of runs of the program (interpreted or JIT'd).
+        uint64_t run_time_ns; ///< The total duration of those runs.
+        uint64_t error_count; ///< The number of (interpreted) runs that failed.
+        /// The number of helpers that the program calls, of which only the first
+        /// UBPF_RUNTIME_STATS_HELPERS (in the order of their first call in the program) are counted.
+        uint32_t helper_count;
+        uint32_t helper_ids[UBPF_RUNTIME_STATS_HELPERS];         ///< The ID of each counted helper.
+        const char* helper_names[UBPF_RUNTIME_STATS_HELPERS];    ///< Its registered name (if any).
+        uint64_t helper_call_counts[UBPF_RUNTIME_STATS_HELPERS]; ///< The number of calls to it.
+        /// The number of runs that returned each value; the last entry counts all larger values.
+        uint64_t exit_code_counts[UBPF_RUNTIME_STATS_EXIT_CODES];
+    };
+
+    /**
+     * @brief Enable or disable the collection of runtime statistics (similar to the kernel's
+     * bpf_stats): the number and duration of runs, the number of calls to each helper and
+     * the histogram of exit codes.
+     *
+     * Each thread that runs the program updates its own counters and runs are timed with the
+     * CPU's timestamp counter. The interpreter checks whether statistics are enabled once per
+     * run (and per helper call). Code JIT'd while statistics are disabled does not contain any
+     * of the instrumentation. After the setting changes, ubpf_compile recompiles the program
+     * (the function that it returned before keeps the old setting).
+     *
+     * @param[in] vm The VM whose statistics are collected.
+     * @param[in] enable Whether to collect statistics.
+     * @retval 0 Success.
+     * @retval -1 Failure (out of memory).
+     */
+    int
+    ubpf_toggle_runtime_stats(struct ubpf_vm* vm, bool enable);
+
+    /**
+     * @brief Take a snapshot of the runtime statistics of a VM (summed over all threads).
+     *
+     * @param[in] vm The VM whose statistics are read.
+     * @param[out] stats The statistics.
+     * @retval 0 Success.
+     * @retval -1 Failure (statistics have never been enabled).
+     */
+    int
+    ubpf_get_runtime_stats(const struct ubpf_vm* vm, struct ubpf_runtime_stats* stats);
+
+#define UBPF_HELPER_LATENCY_BUCKETS 128
+
+    /**
+     * @brief A snapshot of the latency of the calls to one helper.
+     *
+     * The histogram's buckets are in the style of an HDR histogram: each power of two is split
+     * into four buckets, so the limit of a bucket overstates the latency that it counts by at
+     * most 25%.
+     */
+    struct ubpf_helper_latency
+    {
+        const char* name;     ///< The name with which the helper was registered (if any).
+        uint64_t call_count;  ///< The number of calls that were measured.
+        uint64_t total_ns;    ///< The total duration of those calls.
+        uint64_t max_ns;      ///< The duration of the slowest call.
+        uint64_t bucket_counts[UBPF_HELPER_LATENCY_BUCKETS];    ///< The number of calls in each bucket.
+        uint64_t bucket_limits_ns[UBPF_HELPER_LATENCY_BUCKETS]; ///< The longest duration counted in each bucket.
+    };
+
+    /**
+     * @brief Enable or disable the measurement of the latency of each call to a helper (whether
+     * it is called directly or through the external dispatcher). Enabling the measurement also
+     * enables the runtime statistics (see ubpf_toggle_runtime_stats) and, like them, it only
+     * applies to code JIT'd while it is enabled (ubpf_compile recompiles the program after it
+     * changes).
+     *
+     * @param[in] vm The VM whose helpers are measured.
+     * @param[in] enable Whether to measure the latency of helpers.
+     * @retval 0 Success.
+     * @retval -1 Failure (out of memory).
+     */
+    int
+    ubpf_toggle_helper_latency(struct ubpf_vm* vm, bool enable);
+
+    /**
+     * @brief Take a snapshot of the latency of the calls to a helper (summed over all threads).
+     *
+     * @param[in] vm The VM whose helper was measured.
+     * @param[in] index The ID of the helper. Only the helpers that ubpf_get_runtime_stats counts are
+     *                  measured; the histogram of any other helper is empty.
+     * @param[out] latency The latency histogram.
+     * @retval 0 Success.
+     * @retval -1 Failure (runtime statistics have never been enabled).
+     */
+    int
+    ubpf_get_helper_latency(const struct ubpf_vm* vm, unsigned int index, struct ubpf_helper_latency* latency);
+
+    /**
+     * @brief Estimate a percentile of the latency of a helper from its histogram.
+     *
+     * @param[in] latency The latency histogram (see ubpf_get_helper_latency).
+     * @param[in] percentile The percentile (e.g., 99.9).
+     * @return The limit of the bucket that contains the percentile (in ns) or 0 if no call was
+     * measured.
+     */
+    uint64_t
+    ubpf_helper_latency_percentile(const struct ubpf_helper_latency* latency, double percentile);
 #ifdef __cplusplus
 }
 #endif
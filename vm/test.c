@@ -46,6 +46,8 @@ void
 ubpf_set_register_offset(int x);
 static void*
 readfile(const char* path, size_t maxlen, size_t* len);
+static bool
+is_elf_file(const char* path);
 static void
 register_functions(struct ubpf_vm* vm);
 
@@ -93,29 +95,20 @@ do_data_relocation(
     uint64_t symbol_offset,
     uint64_t symbol_size)
 {
-    (void)user_context; // unused
-    (void)symbol_name;  // unused
-    (void)symbol_size;  // unused
+    struct ubpf_vm* vm = user_context;
+    (void)symbol_name; // unused
+    (void)symbol_size; // unused
     if (_global_data == NULL) {
         _global_data = calloc(map_data_size, sizeof(uint8_t));
         _global_data_size = map_data_size;
         memcpy(_global_data, map_data, map_data_size);
+        ubpf_register_memory_region(vm, _global_data, _global_data_size);
     }
 
     const uint64_t* target_address = (const uint64_t*)((uint64_t)_global_data + symbol_offset);
     return (uint64_t)target_address;
 }
 
-bool
-data_relocation_bounds_check_function(void* user_context, uint64_t addr, uint64_t size)
-{
-    (void)user_context; // unused
-    if ((uint64_t)_global_data <= addr && (addr + size) <= ((uint64_t)_global_data + _global_data_size)) {
-        return true;
-    }
-    return false;
-}
-
 uint64_t
 do_map_relocation(
     void* user_context,
@@ -126,7 +119,7 @@ do_map_relocation(
     uint64_t symbol_size)
 {
     struct bpf_map_def map_definition = *(struct bpf_map_def*)(map_data + symbol_offset);
-    (void)user_context;  // unused
+    struct ubpf_vm* vm = user_context;
     (void)symbol_offset; // unused
     (void)map_data_size; // unused
 
@@ -159,23 +152,12 @@ do_map_relocation(
     _map_entries[_map_entries_count].map_definition = map_definition;
     _map_entries[_map_entries_count].map_name = strdup(symbol_name);
     _map_entries[_map_entries_count].array = calloc(map_definition.max_entries, map_definition.value_size);
+    ubpf_register_memory_region(
+        vm, _map_entries[_map_entries_count].array, map_definition.max_entries * map_definition.value_size);
 
     return (uint64_t)&_map_entries[_map_entries_count++];
 }
 
-bool
-map_relocation_bounds_check_function(void* user_context, uint64_t addr, uint64_t size)
-{
-    (void)user_context;
-    for (int index = 0; index < _map_entries_count; index++) {
-        if (addr >= (uint64_t)_map_entries[index].array &&
-            addr + size <= (uint64_t)_map_entries[index].array + _map_entries[index].map_definition.max_entries *
-                                                                     _map_entries[index].map_definition.value_size) {
-            return true;
-        }
-    }
-    return false;
-}
 /**
  * @brief The handler to determine the stack usage of local functions.
  *
@@ -266,10 +248,15 @@ main(int argc, char** argv)
     }
 
     const char* code_filename = argv[optind];
-    size_t code_len;
-    void* code = readfile(code_filename, 1024 * 1024, &code_len);
-    if (code == NULL) {
-        return 1;
+    size_t code_len = 0;
+    void* code = NULL;
+    // ELF files (other than stdin) are loaded from their path, without reading them into a buffer.
+    bool elf_file = strcmp(code_filename, "-") != 0 && is_elf_file(code_filename);
+    if (!elf_file) {
+        code = readfile(code_filename, 1024 * 1024, &code_len);
+        if (code == NULL) {
+            return 1;
+        }
     }
 
     size_t mem_len = 0;
@@ -287,12 +274,12 @@ main(int argc, char** argv)
         return 1;
     }
 
+    // The relocated data and maps are registered as memory regions (with the VM given as
+    // the relocation's user context) so that the program's accesses to them pass bounds checks.
     if (data_relocation) {
-        ubpf_register_data_relocation(vm, NULL, do_data_relocation);
-        ubpf_register_data_bounds_check(vm, NULL, data_relocation_bounds_check_function);
+        ubpf_register_data_relocation(vm, vm, do_data_relocation);
     } else {
-        ubpf_register_data_relocation(vm, NULL, do_map_relocation);
-        ubpf_register_data_bounds_check(vm, NULL, map_relocation_bounds_check_function);
+        ubpf_register_data_relocation(vm, vm, do_map_relocation);
     }
 
     if (ubpf_set_pointer_secret(vm, secret) != 0) {
@@ -315,7 +302,9 @@ main(int argc, char** argv)
     int rv;
 load:
 #if defined(UBPF_HAS_ELF_H)
-    if (elf) {
+    if (elf_file) {
+        rv = ubpf_load_elf_file(vm, code_filename, main_function_name, &errmsg);
+    } else if (elf) {
         rv = ubpf_load_elf_ex(vm, code, code_len, main_function_name, &errmsg);
     } else {
 #endif
@@ -409,6 +398,24 @@ readfile(const char* path, size_t maxlen, size_t* len)
     return (void*)data;
 }
 
+static bool
+is_elf_file(const char* path)
+{
+#if defined(UBPF_HAS_ELF_H)
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+    char magic[SELFMAG];
+    bool elf = fread(magic, 1, SELFMAG, file) == SELFMAG && !memcmp(magic, ELFMAG, SELFMAG);
+    fclose(file);
+    return elf;
+#else
+    (void)path;
+    return false;
+#endif
+}
+
 #ifndef __GLIBC__
 void*
 memfrob(void* s, size_t n)
@@ -0,0 +1,600 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+// This file contains the parsing of BTF (the BPF Type Format) and the resolution of CO-RE
+// ("compile once, run everywhere") relocations. A CO-RE relocation names a field of a type
+// of the program's BTF (e.g., ctx->flow.dst_port) by an access string of member and array
+// indexes; it is resolved by finding the type of the same name in the host's BTF and the
+// members of the same names in it, so that the program follows the host's layout of the
+// type rather than the one that it was compiled against.
+
+#include "ubpf_int.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define BTF_MAGIC 0xeb9f
+#define BTF_VERSION 1
+
+// The kinds of types.
+#define BTF_KIND_INT 1
+#define BTF_KIND_PTR 2
+#define BTF_KIND_ARRAY 3
+#define BTF_KIND_STRUCT 4
+#define BTF_KIND_UNION 5
+#define BTF_KIND_ENUM 6
+#define BTF_KIND_FWD 7
+#define BTF_KIND_TYPEDEF 8
+#define BTF_KIND_VOLATILE 9
+#define BTF_KIND_CONST 10
+#define BTF_KIND_RESTRICT 11
+#define BTF_KIND_FUNC 12
+#define BTF_KIND_FUNC_PROTO 13
+#define BTF_KIND_VAR 14
+#define BTF_KIND_DATASEC 15
+#define BTF_KIND_FLOAT 16
+#define BTF_KIND_DECL_TAG 17
+#define BTF_KIND_TYPE_TAG 18
+#define BTF_KIND_ENUM64 19
+
+// Types refer to each other, so bound the chains that are followed (in case of a cycle).
+#define MAX_TYPE_DEPTH 32
+#define MAX_CORE_ACCESSES 64
+
+struct btf_header
+{
+    uint16_t magic;
+    uint8_t version;
+    uint8_t flags;
+    uint32_t hdr_len;
+    uint32_t type_off; ///< Relative to the end of the header, like str_off.
+    uint32_t type_len;
+    uint32_t str_off;
+    uint32_t str_len;
+};
+
+struct btf_type
+{
+    uint32_t name_off;
+    uint32_t info; ///< The number of members (bits 0-15), the kind (bits 24-28) and the kind flag (bit 31).
+    uint32_t size_or_type;
+};
+
+struct btf_array
+{
+    uint32_t type;
+    uint32_t index_type;
+    uint32_t nelems;
+};
+
+struct btf_member
+{
+    uint32_t name_off;
+    uint32_t type;
+    uint32_t offset; ///< In bits or, with the kind flag, the bit offset (bits 0-23) and bitfield size (bits 24-31).
+};
+
+struct ubpf_btf
+{
+    uint8_t* copy; ///< The data, if the BTF was copied.
+    const char* strings;
+    uint32_t strings_size;
+    const struct btf_type** types; ///< By type ID; void (0) has no entry.
+    uint32_t num_types;            ///< Including void.
+};
+
+static uint32_t
+btf_kind(const struct btf_type* type)
+{
+    return (type->info >> 24) & 0x1f;
+}
+
+static uint32_t
+btf_vlen(const struct btf_type* type)
+{
+    return type->info & 0xffff;
+}
+
+static bool
+btf_kind_flag(const struct btf_type* type)
+{
+    return type->info >> 31;
+}
+
+/**
+ * @brief The size of the data that follows the type, which depends on its kind.
+ *
+ * @return The size or -1 if the kind is unknown.
+ */
+static int64_t
+btf_type_extra_size(const struct btf_type* type)
+{
+    switch (btf_kind(type)) {
+    case BTF_KIND_INT:
+        return sizeof(uint32_t);
+    case BTF_KIND_ARRAY:
+        return sizeof(struct btf_array);
+    case BTF_KIND_STRUCT:
+    case BTF_KIND_UNION:
+        return (int64_t)btf_vlen(type) * sizeof(struct btf_member);
+    case BTF_KIND_ENUM:
+        return (int64_t)btf_vlen(type) * 2 * sizeof(uint32_t);
+    case BTF_KIND_ENUM64:
+        return (int64_t)btf_vlen(type) * 3 * sizeof(uint32_t);
+    case BTF_KIND_FUNC_PROTO:
+        return (int64_t)btf_vlen(type) * 2 * sizeof(uint32_t);
+    case BTF_KIND_VAR:
+    case BTF_KIND_DECL_TAG:
+        return sizeof(uint32_t);
+    case BTF_KIND_DATASEC:
+        return (int64_t)btf_vlen(type) * 3 * sizeof(uint32_t);
+    case BTF_KIND_PTR:
+    case BTF_KIND_FWD:
+    case BTF_KIND_TYPEDEF:
+    case BTF_KIND_VOLATILE:
+    case BTF_KIND_CONST:
+    case BTF_KIND_RESTRICT:
+    case BTF_KIND_FUNC:
+    case BTF_KIND_FLOAT:
+    case BTF_KIND_TYPE_TAG:
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+struct ubpf_btf*
+ubpf_btf_parse(const void* data, size_t size, bool copy, char** errmsg)
+{
+    struct btf_header header;
+    if (size < sizeof(header)) {
+        *errmsg = ubpf_error("the BTF is too short");
+        return NULL;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != BTF_MAGIC || header.version != BTF_VERSION || header.hdr_len < sizeof(header) ||
+        header.hdr_len > size || (uint64_t)header.type_off + header.type_len > size - header.hdr_len ||
+        (uint64_t)header.str_off + header.str_len > size - header.hdr_len || header.type_off % 4 != 0 ||
+        header.type_len % 4 != 0) {
+        *errmsg = ubpf_error("the BTF header is malformed");
+        return NULL;
+    }
+
+    struct ubpf_btf* btf = calloc(1, sizeof(struct ubpf_btf));
+    if (!btf) {
+        *errmsg = ubpf_error("failed to allocate memory for the BTF");
+        return NULL;
+    }
+    if (copy) {
+        btf->copy = malloc(size);
+        if (!btf->copy) {
+            *errmsg = ubpf_error("failed to allocate memory for the BTF");
+            ubpf_btf_free(btf);
+            return NULL;
+        }
+        memcpy(btf->copy, data, size);
+        data = btf->copy;
+    }
+
+    const uint8_t* base = (const uint8_t*)data + header.hdr_len;
+    btf->strings = (const char*)base + header.str_off;
+    btf->strings_size = header.str_len;
+    if (!btf->strings_size || btf->strings[0] != '\0' || btf->strings[btf->strings_size - 1] != '\0') {
+        *errmsg = ubpf_error("the BTF string section is malformed");
+        ubpf_btf_free(btf);
+        return NULL;
+    }
+
+    // Each type takes at least a btf_type, which bounds the number of types.
+    btf->types = calloc(header.type_len / sizeof(struct btf_type) + 1, sizeof(struct btf_type*));
+    if (!btf->types) {
+        *errmsg = ubpf_error("failed to allocate memory for the BTF");
+        ubpf_btf_free(btf);
+        return NULL;
+    }
+    btf->num_types = 1;
+    uint64_t offset = 0;
+    while (offset < header.type_len) {
+        const struct btf_type* type = (const struct btf_type*)(base + header.type_off + offset);
+        int64_t extra_size = 0;
+        if (header.type_len - offset < sizeof(struct btf_type) || (extra_size = btf_type_extra_size(type)) < 0 ||
+            (uint64_t)extra_size > header.type_len - offset - sizeof(struct btf_type) ||
+            type->name_off >= btf->strings_size) {
+            *errmsg = ubpf_error("BTF type %u is malformed", btf->num_types);
+            ubpf_btf_free(btf);
+            return NULL;
+        }
+        btf->types[btf->num_types++] = type;
+        offset += sizeof(struct btf_type) + extra_size;
+    }
+    return btf;
+}
+
+void
+ubpf_btf_free(struct ubpf_btf* btf)
+{
+    if (!btf) {
+        return;
+    }
+    free(btf->types);
+    free(btf->copy);
+    free(btf);
+}
+
+const char*
+ubpf_btf_string(const struct ubpf_btf* btf, uint32_t offset)
+{
+    return offset < btf->strings_size ? btf->strings + offset : NULL;
+}
+
+static const struct btf_type*
+btf_type_by_id(const struct ubpf_btf* btf, uint32_t id)
+{
+    return id && id < btf->num_types ? btf->types[id] : NULL;
+}
+
+/**
+ * @brief Follow the typedefs and the qualifiers (const, volatile, ...) of a type.
+ *
+ * @return The ID of the underlying type or 0 (void) if there is none.
+ */
+static uint32_t
+btf_skip_modifiers(const struct ubpf_btf* btf, uint32_t id)
+{
+    for (int depth = 0; depth < MAX_TYPE_DEPTH; depth++) {
+        const struct btf_type* type = btf_type_by_id(btf, id);
+        if (!type) {
+            return 0;
+        }
+        switch (btf_kind(type)) {
+        case BTF_KIND_TYPEDEF:
+        case BTF_KIND_VOLATILE:
+        case BTF_KIND_CONST:
+        case BTF_KIND_RESTRICT:
+        case BTF_KIND_TYPE_TAG:
+            id = type->size_or_type;
+            break;
+        default:
+            return id;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief The size of a type, in bytes (0 if it has none, e.g., void or a function).
+ */
+static uint64_t
+btf_type_size(const struct ubpf_btf* btf, uint32_t id)
+{
+    uint64_t count = 1;
+    for (int depth = 0; depth < MAX_TYPE_DEPTH; depth++) {
+        const struct btf_type* type = btf_type_by_id(btf, btf_skip_modifiers(btf, id));
+        if (!type) {
+            return 0;
+        }
+        switch (btf_kind(type)) {
+        case BTF_KIND_INT:
+        case BTF_KIND_STRUCT:
+        case BTF_KIND_UNION:
+        case BTF_KIND_ENUM:
+        case BTF_KIND_ENUM64:
+        case BTF_KIND_FLOAT:
+            return count * type->size_or_type;
+        case BTF_KIND_PTR:
+            return count * sizeof(uint64_t);
+        case BTF_KIND_ARRAY: {
+            const struct btf_array* array = (const struct btf_array*)(type + 1);
+            if (array->nelems && count > UINT32_MAX) {
+                return 0;
+            }
+            count *= array->nelems;
+            id = array->type;
+            break;
+        }
+        default:
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief The class of a type for CO-RE: the kinds that a field may change between without
+ * breaking the programs that access it (e.g., an int that becomes an enum) share a class.
+ */
+static uint32_t
+core_kind_class(const struct btf_type* type)
+{
+    switch (btf_kind(type)) {
+    case BTF_KIND_INT:
+    case BTF_KIND_ENUM:
+    case BTF_KIND_ENUM64:
+        return BTF_KIND_INT;
+    case BTF_KIND_FWD:
+        return BTF_KIND_STRUCT;
+    default:
+        return btf_kind(type);
+    }
+}
+
+/**
+ * @brief Whether two names are the same but for a "___flavor" suffix, which lets a program
+ * declare several versions of a type.
+ */
+static bool
+core_names_match(const char* local, const char* target)
+{
+    const char* flavor = strstr(local, "___");
+    size_t length = flavor ? (size_t)(flavor - local) : strlen(local);
+    const char* target_flavor = strstr(target, "___");
+    size_t target_length = target_flavor ? (size_t)(target_flavor - target) : strlen(target);
+    return length == target_length && !memcmp(local, target, length);
+}
+
+/**
+ * @brief A field named by a CO-RE access string, as a path that can be followed in another BTF:
+ * the names of the members (without the anonymous structs and unions that hold them) and the
+ * array indexes.
+ */
+struct core_spec
+{
+    uint32_t root;
+    uint32_t num_accesses;
+    struct
+    {
+        const char* name; ///< The name of the member or NULL for an array index.
+        uint32_t index;
+    } accesses[MAX_CORE_ACCESSES];
+    uint32_t field_type;
+    uint64_t bit_offset;
+    uint32_t bitfield_size; ///< 0 unless the field is a bitfield.
+};
+
+static void
+member_position(const struct btf_type* type, const struct btf_member* member, uint64_t* bit_offset, uint32_t* bitfield)
+{
+    if (btf_kind_flag(type)) {
+        *bit_offset += member->offset & 0xffffff;
+        *bitfield = member->offset >> 24;
+    } else {
+        *bit_offset += member->offset;
+        *bitfield = 0;
+    }
+}
+
+/**
+ * @brief Find the member of a struct or union by name, looking into its anonymous members (whose
+ * members are accessed as its own), and add its offset to *bit_offset.
+ */
+static const struct btf_member*
+find_member(
+    const struct ubpf_btf* btf, uint32_t id, const char* name, uint64_t* bit_offset, uint32_t* bitfield, int depth)
+{
+    const struct btf_type* type = btf_type_by_id(btf, btf_skip_modifiers(btf, id));
+    if (!type || (btf_kind(type) != BTF_KIND_STRUCT && btf_kind(type) != BTF_KIND_UNION) || depth >= MAX_TYPE_DEPTH) {
+        return NULL;
+    }
+    const struct btf_member* members = (const struct btf_member*)(type + 1);
+    for (uint32_t i = 0; i < btf_vlen(type); i++) {
+        const char* member_name = ubpf_btf_string(btf, members[i].name_off);
+        uint64_t member_offset = *bit_offset;
+        member_position(type, &members[i], &member_offset, bitfield);
+        if (member_name && *member_name) {
+            if (!strcmp(member_name, name)) {
+                *bit_offset = member_offset;
+                return &members[i];
+            }
+            continue;
+        }
+        const struct btf_member* found = find_member(btf, members[i].type, name, &member_offset, bitfield, depth + 1);
+        if (found) {
+            *bit_offset = member_offset;
+            return found;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Follow an access string through the program's types.
+ */
+static int
+core_local_spec(const struct ubpf_btf* btf, uint32_t type_id, const char* access, struct core_spec* spec, char** errmsg)
+{
+    memset(spec, 0, sizeof(*spec));
+    spec->root = btf_skip_modifiers(btf, type_id);
+    if (!btf_type_by_id(btf, spec->root)) {
+        *errmsg = ubpf_error("CO-RE relocation of bad type %u", type_id);
+        return -1;
+    }
+
+    uint32_t current = spec->root;
+    const char* cursor = access;
+    while (*cursor) {
+        char* end;
+        unsigned long index = strtoul(cursor, &end, 10);
+        if (end == cursor || (*end && *end != ':') || index > UINT32_MAX || spec->num_accesses == MAX_CORE_ACCESSES) {
+            *errmsg = ubpf_error("bad CO-RE access string %s", access);
+            return -1;
+        }
+        cursor = *end ? end + 1 : end;
+
+        if (spec->num_accesses == 0) {
+            // The first index is into an array of the root type (as through a pointer to it).
+            spec->bit_offset = index * btf_type_size(btf, spec->root) * 8;
+            spec->accesses[spec->num_accesses++].index = index;
+            continue;
+        }
+
+        const struct btf_type* type = btf_type_by_id(btf, btf_skip_modifiers(btf, current));
+        if (type && (btf_kind(type) == BTF_KIND_STRUCT || btf_kind(type) == BTF_KIND_UNION) &&
+            index < btf_vlen(type)) {
+            const struct btf_member* member = (const struct btf_member*)(type + 1) + index;
+            member_position(type, member, &spec->bit_offset, &spec->bitfield_size);
+            current = member->type;
+            const char* name = ubpf_btf_string(btf, member->name_off);
+            if (name && *name) {
+                spec->accesses[spec->num_accesses].name = name;
+                spec->accesses[spec->num_accesses++].index = index;
+            } else if (!*cursor) {
+                *errmsg = ubpf_error("CO-RE relocation of an anonymous member (%s)", access);
+                return -1;
+            }
+        } else if (type && btf_kind(type) == BTF_KIND_ARRAY) {
+            const struct btf_array* array = (const struct btf_array*)(type + 1);
+            if (array->nelems && index >= array->nelems) {
+                *errmsg = ubpf_error("bad CO-RE access string %s", access);
+                return -1;
+            }
+            spec->bit_offset += index * btf_type_size(btf, array->type) * 8;
+            spec->bitfield_size = 0;
+            current = array->type;
+            spec->accesses[spec->num_accesses++].index = index;
+        } else {
+            *errmsg = ubpf_error("bad CO-RE access string %s", access);
+            return -1;
+        }
+    }
+    if (!spec->num_accesses) {
+        *errmsg = ubpf_error("bad CO-RE access string %s", access);
+        return -1;
+    }
+    spec->field_type = current;
+    return 0;
+}
+
+/**
+ * @brief Follow the path of a local spec through a type of the host's BTF.
+ *
+ * @return Whether the host's type has the field (of a compatible kind).
+ */
+static bool
+core_target_spec(
+    const struct ubpf_btf* local_btf,
+    const struct core_spec* local,
+    const struct ubpf_btf* btf,
+    uint32_t root,
+    struct core_spec* spec)
+{
+    memset(spec, 0, sizeof(*spec));
+    spec->root = root;
+    spec->bit_offset = local->accesses[0].index * btf_type_size(btf, root) * 8;
+
+    uint32_t current = root;
+    for (uint32_t i = 1; i < local->num_accesses; i++) {
+        if (local->accesses[i].name) {
+            const struct btf_member* member =
+                find_member(btf, current, local->accesses[i].name, &spec->bit_offset, &spec->bitfield_size, 0);
+            if (!member) {
+                return false;
+            }
+            current = member->type;
+            continue;
+        }
+        const struct btf_type* type = btf_type_by_id(btf, btf_skip_modifiers(btf, current));
+        if (!type || btf_kind(type) != BTF_KIND_ARRAY) {
+            return false;
+        }
+        const struct btf_array* array = (const struct btf_array*)(type + 1);
+        if (array->nelems && local->accesses[i].index >= array->nelems) {
+            return false;
+        }
+        spec->bit_offset += local->accesses[i].index * btf_type_size(btf, array->type) * 8;
+        spec->bitfield_size = 0;
+        current = array->type;
+    }
+    spec->field_type = current;
+
+    const struct btf_type* local_field = btf_type_by_id(local_btf, btf_skip_modifiers(local_btf, local->field_type));
+    const struct btf_type* target_field = btf_type_by_id(btf, btf_skip_modifiers(btf, current));
+    return local_field && target_field && core_kind_class(local_field) == core_kind_class(target_field);
+}
+
+static uint64_t
+core_value(const struct ubpf_btf* btf, const struct core_spec* spec, uint32_t kind)
+{
+    switch (kind) {
+    case UBPF_CORE_FIELD_BYTE_OFFSET:
+        return spec->bit_offset / 8;
+    case UBPF_CORE_FIELD_BYTE_SIZE:
+        return btf_type_size(btf, spec->field_type);
+    case UBPF_CORE_TYPE_SIZE:
+        return btf_type_size(btf, spec->root);
+    default:
+        return 1;
+    }
+}
+
+int
+ubpf_btf_resolve_core_relocation(
+    const struct ubpf_btf* local_btf,
+    const struct ubpf_btf* target_btf,
+    uint32_t type_id,
+    const char* access,
+    uint32_t kind,
+    struct ubpf_core_result* result,
+    char** errmsg)
+{
+    if (kind != UBPF_CORE_FIELD_BYTE_OFFSET && kind != UBPF_CORE_FIELD_BYTE_SIZE && kind != UBPF_CORE_FIELD_EXISTS &&
+        kind != UBPF_CORE_TYPE_EXISTS && kind != UBPF_CORE_TYPE_SIZE) {
+        *errmsg = ubpf_error("unsupported CO-RE relocation kind %u", kind);
+        return -1;
+    }
+    bool field = kind <= UBPF_CORE_FIELD_EXISTS;
+
+    struct core_spec local;
+    if (core_local_spec(local_btf, type_id, access, &local, errmsg) < 0) {
+        return -1;
+    }
+    if (field && local.num_accesses < 2) {
+        *errmsg = ubpf_error("CO-RE field relocation without a field (%s)", access);
+        return -1;
+    }
+    if (kind == UBPF_CORE_FIELD_BYTE_OFFSET && (local.bitfield_size || local.bit_offset % 8)) {
+        *errmsg = ubpf_error("CO-RE relocation of the offset of a bitfield (%s)", access);
+        return -1;
+    }
+    const struct btf_type* root = btf_type_by_id(local_btf, local.root);
+    const char* root_name = ubpf_btf_string(local_btf, root->name_off);
+    if (!root_name || !*root_name) {
+        *errmsg = ubpf_error("CO-RE relocation of an anonymous type");
+        return -1;
+    }
+
+    result->local_value = core_value(local_btf, &local, kind);
+    result->local_size = btf_type_size(local_btf, local.field_type);
+    result->exists = false;
+
+    // The host's type is the first one of the same kind and name that has the field.
+    for (uint32_t id = 1; id < target_btf->num_types && !result->exists; id++) {
+        const struct btf_type* candidate = target_btf->types[id];
+        const char* name = ubpf_btf_string(target_btf, candidate->name_off);
+        if (btf_kind(candidate) != btf_kind(root) || !name || !core_names_match(root_name, name)) {
+            continue;
+        }
+        struct core_spec target;
+        if (!field) {
+            memset(&target, 0, sizeof(target));
+            target.root = id;
+        } else if (!core_target_spec(local_btf, &local, target_btf, id, &target)) {
+            continue;
+        }
+        if (kind == UBPF_CORE_FIELD_BYTE_OFFSET && (target.bitfield_size || target.bit_offset % 8)) {
+            *errmsg = ubpf_error("CO-RE relocation of a field that is a bitfield in the host BTF (%s)", access);
+            return -1;
+        }
+        result->exists = true;
+        result->target_value = core_value(target_btf, &target, kind);
+        result->target_size = btf_type_size(target_btf, target.field_type);
+    }
+
+    if (!result->exists) {
+        if (kind != UBPF_CORE_FIELD_EXISTS && kind != UBPF_CORE_TYPE_EXISTS) {
+            *errmsg = ubpf_error("CO-RE relocation of %s (access %s) has no match in the host BTF", root_name, access);
+            return -1;
+        }
+        result->target_value = 0;
+        result->target_size = 0;
+    }
+    return 0;
+}
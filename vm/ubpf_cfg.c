@@ -0,0 +1,119 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include "ubpf_int.h"
+#include <stdlib.h>
+
+// This file contains the analysis of the control flow graph of a program that finds
+// the most instructions that the program can execute, if the graph has no cycles.
+// Programs for which it finds a bound run without termination checks.
+
+enum cfg_visit_state
+{
+    CFG_UNVISITED = 0,
+    CFG_ON_PATH,
+    CFG_DONE,
+};
+
+/**
+ * @brief Find the instructions to which control can pass after the instruction at the given PC.
+ *
+ * For a call to a local function, the first successor is the function and the second one the
+ * instruction to which it returns.
+ *
+ * @return The number of successors (0, 1 or 2).
+ */
+static int
+cfg_successors(const struct ebpf_inst* insts, uint32_t pc, uint32_t successors[2])
+{
+    struct ebpf_inst inst = insts[pc];
+    uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+
+    if (inst.opcode == EBPF_OP_LDDW) {
+        successors[0] = pc + 2;
+        return 1;
+    }
+    if (cls != EBPF_CLS_JMP && cls != EBPF_CLS_JMP32) {
+        successors[0] = pc + 1;
+        return 1;
+    }
+    switch (inst.opcode) {
+    case EBPF_OP_EXIT:
+        return 0;
+    case EBPF_OP_JA:
+        successors[0] = pc + 1 + inst.offset;
+        return 1;
+    case EBPF_OP_CALL:
+        if (inst.src != 1) {
+            successors[0] = pc + 1;
+            return 1;
+        }
+        successors[0] = pc + 1 + inst.imm;
+        successors[1] = pc + 1;
+        return 2;
+    default:
+        successors[0] = pc + 1;
+        successors[1] = pc + 1 + inst.offset;
+        return 2;
+    }
+}
+
+uint32_t
+ubpf_calculate_instruction_bound(const struct ebpf_inst* insts, uint32_t num_insts)
+{
+    uint32_t bound = 0;
+    uint8_t* state = calloc(num_insts, sizeof(state[0]));
+    uint64_t* longest = calloc(num_insts, sizeof(longest[0]));
+    uint32_t* path = calloc(num_insts, sizeof(path[0]));
+    if (!num_insts || !state || !longest || !path) {
+        goto exit;
+    }
+
+    // Walk the graph depth first from the entry point. A successor that is on the path from the
+    // entry point closes a cycle (a loop or a recursion). Once all of its successors are done,
+    // the longest run from an instruction is known: a local call runs the function and then
+    // continues after the call, any other instruction continues on one of its successors.
+    uint32_t depth = 0;
+    path[depth++] = 0;
+    state[0] = CFG_ON_PATH;
+    while (depth > 0) {
+        uint32_t pc = path[depth - 1];
+        uint32_t successors[2] = {0, 0};
+        int num_successors = cfg_successors(insts, pc, successors);
+        bool descended = false;
+        for (int i = 0; i < num_successors && !descended; i++) {
+            // Falling off the end of the program is left to the checked interpreter to report.
+            if (successors[i] >= num_insts || state[successors[i]] == CFG_ON_PATH) {
+                goto exit;
+            }
+            if (state[successors[i]] == CFG_UNVISITED) {
+                state[successors[i]] = CFG_ON_PATH;
+                path[depth++] = successors[i];
+                descended = true;
+            }
+        }
+        if (descended) {
+            continue;
+        }
+
+        uint64_t length = 0;
+        if (insts[pc].opcode == EBPF_OP_CALL && insts[pc].src == 1) {
+            length = longest[successors[0]] + longest[successors[1]];
+        } else {
+            for (int i = 0; i < num_successors; i++) {
+                length = longest[successors[i]] > length ? longest[successors[i]] : length;
+            }
+        }
+        // Every instruction (an lddw included) counts once against the instruction limit.
+        longest[pc] = length + 1 < UINT32_MAX ? length + 1 : UINT32_MAX;
+        state[pc] = CFG_DONE;
+        depth--;
+    }
+    bound = (uint32_t)longest[0];
+
+exit:
+    free(state);
+    free(longest);
+    free(path);
+    return bound;
+}
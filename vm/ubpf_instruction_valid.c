@@ -659,7 +659,7 @@ static ubpf_inst_filter_t _ubpf_instruction_filter[] = {
     {
         .opcode = EBPF_OP_CALL,
         .source_lower_bound = BPF_REG_0,
-        .source_upper_bound = BPF_REG_1, // Only supports up to local calls aka 1.
+        .source_upper_bound = BPF_REG_2, // Helper (0), local (1) and kfunc (2) calls.
         .immediate_lower_bound = INT32_MIN,
         .immediate_upper_bound = INT32_MAX,
     },
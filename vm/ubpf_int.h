@@ -39,6 +39,25 @@ typedef enum
     UBPF_JIT_COMPILE_FAILURE,
 } upbf_jit_result_t;
 
+enum UnwindRuleKind
+{
+    UnwindCfa,           ///< The CFA is dwarf_register + cfa_offset.
+    UnwindSavedRegister, ///< The caller's dwarf_register is saved at CFA - cfa_offset.
+};
+
+/**
+ * @brief A rule of the DWARF call frame information for JIT'd code. A rule applies from
+ * its offset (in the JIT'd code) until a later rule of the same kind (for the same
+ * register) replaces it.
+ */
+struct ubpf_jit_unwind_rule
+{
+    uint32_t offset;
+    uint8_t kind;
+    uint8_t dwarf_register;
+    uint16_t cfa_offset;
+};
+
 struct ubpf_jit_result
 {
     uint32_t external_dispatcher_offset;
@@ -46,6 +65,25 @@ struct ubpf_jit_result
     upbf_jit_result_t compile_result;
     enum JitMode jit_mode;
     char* errmsg;
+    /* The offset of the JIT'd code for each eBPF instruction and the rules that
+     * describe how to unwind through the JIT'd code. Only retained (and owned by
+     * the result) when the VM describes its JIT'd code to perf or debuggers.
+     */
+    uint32_t* pc_locs;
+    struct ubpf_jit_unwind_rule* unwind_rules;
+    uint32_t num_unwind_rules;
+    /* Whether the JIT'd code was compiled with StaticDispatch and, if so, whether it
+     * calls helpers through the external dispatcher.
+     */
+    bool static_dispatch;
+    bool static_dispatcher;
+    /* The instruction limit that was in effect when the code was JIT'd (and that it enforces). */
+    int instruction_limit;
+    /* Whether the JIT'd code collects runtime statistics and measures the latency of helpers. */
+    bool runtime_stats;
+    bool helper_latency;
+    /* Whether the JIT'd code counts the runs of the basic blocks for the profiler. */
+    bool profiling;
 };
 
 typedef enum
@@ -53,15 +91,72 @@ typedef enum
     UBPF_STACK_USAGE_UNKNOWN = 0,
     UBPF_STACK_USAGE_CUSTOM,
     UBPF_STACK_USAGE_DEFAULT,
+    UBPF_STACK_USAGE_INFERRED,
 } ubpf_stack_usage_calculation_status_t;
 
 struct ubpf_stack_usage
 {
+    uint16_t pc; // The PC of the first instruction of the local function.
     ubpf_stack_usage_calculation_status_t stack_usage_calculated;
     uint16_t stack_usage;
 };
 
-#define MAX_EXT_FUNCS 64
+/**
+ * @brief A registered helper (see ubpf_register), in the VM's hash table of helpers by ID.
+ */
+struct ubpf_helper
+{
+    uint32_t id;
+    bool registered; ///< Whether the entry is used (its function may still be NULL).
+    const char* name;
+    extended_external_helper_t function;
+};
+
+/**
+ * @brief A range of memory, [start, end), that eBPF programs may access in addition
+ * to their context memory and stack (see ubpf_register_memory_region).
+ */
+struct ubpf_memory_region
+{
+    uintptr_t start;
+    uintptr_t end;
+};
+
+/**
+ * @brief A function that programs call by BTF ID (see ubpf_register_kfunc).
+ */
+struct ubpf_kfunc
+{
+    uint32_t btf_id;
+    const char* name;
+    extended_external_helper_t function;
+};
+
+/**
+ * @brief The read-only data sections (.rodata) of an ELF object. They are instantiated once, when
+ * the object is linked, and shared by every VM that loads one of its programs.
+ */
+struct ubpf_shared_data
+{
+    int32_t references; ///< The object and the VMs that use the instance.
+    uint8_t* data;
+    size_t size;
+    bool mapped; ///< Whether data was mapped (and made read-only) rather than allocated.
+};
+
+struct ubpf_trace;
+
+/**
+ * @brief A variant of the interpreter (see ubpf_exec_with_trace).
+ */
+typedef int (*ubpf_interpreter_fn)(
+    const struct ubpf_vm* vm,
+    void* mem,
+    size_t mem_len,
+    uint64_t* bpf_return_value,
+    uint8_t* stack_start,
+    size_t stack_length,
+    struct ubpf_trace* trace);
 
 struct ubpf_vm
 {
@@ -72,16 +167,26 @@ struct ubpf_vm
     size_t jitter_buffer_size;
     struct ubpf_jit_result jitted_result;
 
-    extended_external_helper_t* ext_funcs;
+    struct ubpf_helper* helpers; ///< Open addressing by ID; the capacity is a power of 2 (or 0).
+    uint32_t num_helpers;
+    uint32_t helpers_capacity;
+    extended_external_helper_t* helper_table; ///< The helpers that the program calls, by the offset of the calls.
+    uint32_t* helper_table_ids;               ///< The ID of the helper in each slot of the helper table.
+    uint32_t helper_table_size;
     bool* int_funcs;
-    const char** ext_func_names;
+    struct ubpf_kfunc* kfuncs; ///< Sorted by BTF ID.
+    uint32_t num_kfuncs;
+    extended_external_helper_t* kfunc_targets; ///< The kfuncs that the program calls, by the offset of the calls.
+    uint32_t num_kfunc_targets;
 
-    struct ubpf_stack_usage* local_func_stack_usage;
+    struct ubpf_stack_usage* local_func_stack_usage; // One entry per local function, sorted by PC.
+    uint32_t num_local_funcs;
     void* stack_usage_calculator_cookie;
     stack_usage_calculator_t stack_usage_calculator;
 
     external_function_dispatcher_t dispatcher;
     external_function_validate_t dispatcher_validate;
+    enum DispatchStrategy dispatch_strategy;
 
     bool bounds_check_enabled;
     bool undefined_behavior_check_enabled;
@@ -106,9 +211,29 @@ struct ubpf_vm
     void* data_relocation_user_data;
     ubpf_bounds_check bounds_check_function;
     void* bounds_check_user_data;
+    struct ubpf_memory_region* memory_regions; ///< Sorted by start address; regions never overlap.
+    int num_memory_regions;
+    int memory_regions_capacity;
     int instruction_limit;
+    uint32_t instruction_bound; ///< The most instructions that the program can execute (0 if unknown).
     void* debug_function_context; ///< Context pointer that is passed to the debug function.
     ubpf_debug_fn debug_function; ///< Debug function that is called before each instruction.
+    ubpf_interpreter_fn interpreter; ///< The variant of the interpreter that performs the checks that are enabled.
+    bool profiling_enabled;       ///< Whether the basic-block profiler is enabled (see ubpf_toggle_profiling).
+    uint64_t* profile_counts;     ///< The number of times that control entered the basic block at each PC.
+    bool* profile_block_starts;   ///< Whether the instruction at each PC begins a basic block.
+    unsigned int jit_perf_outputs; ///< The JitPerfOutput(s) written for JIT'd code.
+    char* jit_perf_name;          ///< The name of the program in the perf output.
+    void* jit_debug_entry;        ///< The registration of the JIT'd code with debuggers (if any).
+    bool runtime_stats_enabled;   ///< Whether runtime statistics are collected (see ubpf_toggle_runtime_stats).
+    struct ubpf_runtime_stats_registry* runtime_stats; ///< The per-thread runtime statistics (once enabled).
+    bool helper_latency_enabled; ///< Whether the latency of helpers is measured (see ubpf_toggle_helper_latency).
+    bool replay_only;            ///< Whether the VM only replays traces (see ubpf_toggle_replay_only).
+    uint64_t program_hash;       ///< Identifies the loaded program in execution traces.
+    uint8_t* data_sections;      ///< The instance of the writable data sections (.data and .bss) of the program.
+    size_t data_sections_size;
+    struct ubpf_shared_data* read_only_data; ///< The read-only data sections that the program shares.
+    struct ubpf_btf* host_btf; ///< The host's types, against which CO-RE relocations are resolved.
 #ifdef DEBUG
     uint64_t* regs;
 #endif
@@ -183,6 +308,123 @@ char*
 ubpf_error(const char* fmt, ...);
 unsigned int
 ubpf_lookup_registered_function(struct ubpf_vm* vm, const char* name);
+
+/**
+ * @brief Find the helper registered with the given ID (or NULL if none is).
+ */
+const struct ubpf_helper*
+ubpf_find_helper(const struct ubpf_vm* vm, uint32_t id);
+
+/**
+ * @brief Find the kfunc with the given BTF ID (or NULL if none is registered).
+ */
+const struct ubpf_kfunc*
+ubpf_find_kfunc(const struct ubpf_vm* vm, uint32_t btf_id);
+
+/**
+ * @brief Find the kfunc with the given name (or NULL if none is registered).
+ */
+const struct ubpf_kfunc*
+ubpf_lookup_registered_kfunc(const struct ubpf_vm* vm, const char* name);
+
+/**
+ * @brief Like ubpf_load, but the instructions are stored in the given buffer (which holds them)
+ * instead of a copy. The VM takes ownership of the buffer (which must come from malloc), even if
+ * the load fails.
+ */
+int
+ubpf_load_in_place(struct ubpf_vm* vm, struct ebpf_inst* insts, uint32_t code_len, char** errmsg);
+
+/**
+ * @brief Take a reference to an instance of read-only data sections.
+ */
+void
+ubpf_shared_data_acquire(struct ubpf_shared_data* shared);
+
+/**
+ * @brief Drop a reference to an instance of read-only data sections, which is freed with its
+ * last reference.
+ */
+void
+ubpf_shared_data_release(struct ubpf_shared_data* shared);
+
+/**
+ * @brief Release the data sections that were instantiated for the program of a VM (if any).
+ *
+ * @param[in,out] vm The VM whose data sections are released.
+ */
+void
+ubpf_release_data_sections(struct ubpf_vm* vm);
+
+/**
+ * @brief Parsed BTF (see ubpf_btf.c).
+ */
+struct ubpf_btf;
+
+/**
+ * @brief Parse BTF (the contents of a .BTF section).
+ *
+ * @param[in] data The BTF.
+ * @param[in] size The size of the BTF.
+ * @param[in] copy Whether to copy the BTF (otherwise, it must outlive the parsed BTF).
+ * @param[out] errmsg The error message, if any.
+ * @return The parsed BTF or NULL on failure. It should be freed with ubpf_btf_free.
+ */
+struct ubpf_btf*
+ubpf_btf_parse(const void* data, size_t size, bool copy, char** errmsg);
+
+void
+ubpf_btf_free(struct ubpf_btf* btf);
+
+/**
+ * @brief Get a string of the BTF by its offset (or NULL if the offset is out of bounds).
+ */
+const char*
+ubpf_btf_string(const struct ubpf_btf* btf, uint32_t offset);
+
+// The kinds of CO-RE relocations that can be resolved (with the numbering of .BTF.ext).
+#define UBPF_CORE_FIELD_BYTE_OFFSET 0
+#define UBPF_CORE_FIELD_BYTE_SIZE 1
+#define UBPF_CORE_FIELD_EXISTS 2
+#define UBPF_CORE_TYPE_EXISTS 8
+#define UBPF_CORE_TYPE_SIZE 9
+
+/**
+ * @brief The value of a CO-RE relocation for the program's types (which the instruction holds)
+ * and for the host's.
+ */
+struct ubpf_core_result
+{
+    uint64_t local_value;
+    uint64_t target_value;
+    uint64_t local_size; ///< The size of the field (or type) in the program's types.
+    uint64_t target_size;
+    bool exists; ///< Whether the host's types have the field (or type).
+};
+
+/**
+ * @brief Resolve a CO-RE relocation against the host's BTF.
+ *
+ * @param[in] local_btf The program's BTF.
+ * @param[in] target_btf The host's BTF.
+ * @param[in] type_id The type (of the program's BTF) of the relocation.
+ * @param[in] access The access string of the relocation (e.g., "0:1:2").
+ * @param[in] kind The kind of the relocation (one of UBPF_CORE_*).
+ * @param[out] result The value of the relocation.
+ * @param[out] errmsg The error message, if any.
+ * @retval 0 Success.
+ * @retval -1 Failure.
+ */
+int
+ubpf_btf_resolve_core_relocation(
+    const struct ubpf_btf* local_btf,
+    const struct ubpf_btf* target_btf,
+    uint32_t type_id,
+    const char* access,
+    uint32_t kind,
+    struct ubpf_core_result* result,
+    char** errmsg);
+
 uint64_t
 ubpf_dispatch_to_external_helper(
     uint64_t p0, uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, const struct ubpf_vm* vm, unsigned int idx);
@@ -207,6 +449,319 @@ ubpf_fetch_instruction(const struct ubpf_vm* vm, uint16_t pc);
 void
 ubpf_store_instruction(const struct ubpf_vm* vm, uint16_t pc, struct ebpf_inst inst);
 
+/**
+ * @brief The runtime statistics collected by one thread. The helper call counters come
+ * first so that JIT'd code can address them with small offsets.
+ */
+struct ubpf_runtime_stats_block
+{
+    uint64_t helper_calls[UBPF_RUNTIME_STATS_HELPERS]; ///< By slot in the program's table of helpers.
+    uint64_t run_count;
+    uint64_t run_ticks;
+    uint64_t error_count;
+    uint64_t exit_codes[UBPF_RUNTIME_STATS_EXIT_CODES];
+    struct ubpf_helper_latency_histogram* helper_latency; ///< One per helper (once a helper's latency is measured).
+    const void* owner; ///< The thread that updates the block.
+    struct ubpf_runtime_stats_block* next;
+};
+
+/**
+ * @brief Read the counter with which runs are timed.
+ *
+ * @return The current value of the counter (the timestamp counter on x86-64 and the virtual
+ * counter on Arm64).
+ */
+uint64_t
+ubpf_runtime_stats_ticks(void);
+
+/**
+ * @brief Get the calling thread's block of runtime statistics at the start of a run.
+ *
+ * @param[in] vm The VM whose program runs (with runtime statistics enabled).
+ * @return The block (never NULL).
+ */
+struct ubpf_runtime_stats_block*
+ubpf_runtime_stats_enter(const struct ubpf_vm* vm);
+
+/**
+ * @brief Account for a run that completed.
+ *
+ * @param[in,out] block The block returned by ubpf_runtime_stats_enter.
+ * @param[in] start_ticks The value of ubpf_runtime_stats_ticks at the start of the run.
+ * @param[in] result The value that the program returned.
+ */
+void
+ubpf_runtime_stats_exit(struct ubpf_runtime_stats_block* block, uint64_t start_ticks, uint64_t result);
+
+/**
+ * @brief Account for a run that failed.
+ *
+ * @param[in,out] block The block returned by ubpf_runtime_stats_enter.
+ * @param[in] start_ticks The value of ubpf_runtime_stats_ticks at the start of the run.
+ */
+void
+ubpf_runtime_stats_fail(struct ubpf_runtime_stats_block* block, uint64_t start_ticks);
+
+/**
+ * @brief Account for the latency of a call to a helper that just returned.
+ *
+ * @param[in,out] block The block returned by ubpf_runtime_stats_enter.
+ * @param[in] index The slot of the helper in the program's table of helpers.
+ * @param[in] start_ticks The value of ubpf_runtime_stats_ticks before the call.
+ */
+void
+ubpf_runtime_stats_helper_latency(struct ubpf_runtime_stats_block* block, unsigned int index, uint64_t start_ticks);
+
+/**
+ * @brief Clear the helper statistics of a VM, whose slots are those of a program that is
+ * being unloaded.
+ *
+ * @param[in,out] vm The VM whose helper statistics are cleared.
+ */
+void
+ubpf_runtime_stats_reset_helpers(struct ubpf_vm* vm);
+
+/**
+ * @brief Get the memory used by the runtime statistics of a VM.
+ *
+ * @param[in] vm The VM whose statistics are measured.
+ * @return The size, in bytes, of its registry and of the blocks of its threads.
+ */
+size_t
+ubpf_runtime_stats_size(const struct ubpf_vm* vm);
+
+/**
+ * @brief Release the runtime statistics of a VM.
+ *
+ * @param[in,out] vm The VM whose statistics are released.
+ */
+void
+ubpf_runtime_stats_release(struct ubpf_vm* vm);
+
+/**
+ * @brief The state of a run that records or replays an execution trace (see ubpf_trace.c).
+ */
+struct ubpf_trace
+{
+    uint8_t* buffer;
+    size_t size;
+    bool replaying;
+    bool failed;           ///< The buffer is full (recording) or the replay diverged from the trace.
+    size_t value_offset;   ///< The offset of the next value in the buffer.
+    size_t value_end;      ///< The end of the values (replaying).
+    const uint8_t* branches; ///< The branch directions (replaying).
+    uint64_t branch_count; ///< The number of branches recorded or replayed so far.
+    /// The lowest byte used by the branch directions (recording) or their number (replaying).
+    uint64_t branch_limit;
+    uintptr_t stack_start; ///< The stack of the run.
+    uintptr_t stack_end;
+    /// The bytes of the stack that the run stored since it last called a helper (one bit each), whose contents the
+    /// run itself determines.
+    uint8_t stack_stored[UBPF_EBPF_STACK_SIZE / 8];
+};
+
+/**
+ * @brief Run the program in the interpreter, optionally recording or replaying a trace.
+ *
+ * @param[in] vm The VM whose program runs.
+ * @param[in] mem The memory to pass to the program.
+ * @param[in] mem_len The length of the memory.
+ * @param[out] bpf_return_value The value of r0 when the program exits.
+ * @param[in] stack_start The stack of the program.
+ * @param[in] stack_length The size of the stack.
+ * @param[in,out] trace The trace to record or replay (or NULL).
+ * @retval 0 Success.
+ * @retval -1 Failure.
+ */
+int
+ubpf_exec_with_trace(
+    const struct ubpf_vm* vm,
+    void* mem,
+    size_t mem_len,
+    uint64_t* bpf_return_value,
+    uint8_t* stack_start,
+    size_t stack_length,
+    struct ubpf_trace* trace);
+
+/**
+ * @brief Compute the hash that identifies a program in execution traces.
+ *
+ * @param[in] insts The instructions of the program.
+ * @param[in] num_insts The number of instructions.
+ * @return The hash.
+ */
+uint64_t
+ubpf_trace_program_hash(const struct ebpf_inst* insts, uint32_t num_insts);
+
+/**
+ * @brief Load a value from memory, recording it (or, when replaying, taking it from the trace)
+ * unless the run stored it on the stack since it last called a helper.
+ */
+uint64_t
+ubpf_trace_load(struct ubpf_trace* trace, uint64_t address, size_t size);
+
+/**
+ * @brief Determine whether the run accesses the memory at the given address itself (a replay
+ * only accesses its stack and takes the values that it loads from elsewhere from the trace).
+ */
+bool
+ubpf_trace_accesses_memory(const struct ubpf_trace* trace, uint64_t address);
+
+/**
+ * @brief Note that the run stores to memory (marking the bytes that it stores on the stack).
+ *
+ * @return True if the run accesses the memory itself (see ubpf_trace_accesses_memory).
+ */
+bool
+ubpf_trace_store(struct ubpf_trace* trace, uint64_t address, size_t size);
+
+/**
+ * @brief Determine whether an atomic operation updates the memory at the given address itself (a
+ * replay only updates the bytes of its stack that the run stored since it last called a helper
+ * and takes the value that the operation fetched from elsewhere from the trace).
+ */
+bool
+ubpf_trace_updates_memory(const struct ubpf_trace* trace, uint64_t address, size_t size);
+
+/**
+ * @brief Record the value that an atomic operation fetched (unless the run stored it on the stack
+ * since it last called a helper).
+ */
+void
+ubpf_trace_record_fetch(struct ubpf_trace* trace, uint64_t address, size_t size, uint64_t value);
+
+/**
+ * @brief Record the value that a helper returned (unless replaying). Since the helper may have
+ * written to the stack, the run no longer determines the contents of any of it.
+ */
+void
+ubpf_trace_record_helper(struct ubpf_trace* trace, uint64_t value);
+
+/**
+ * @brief Take the next value (that a helper returned or an atomic operation fetched) from the
+ * trace that is replayed.
+ */
+uint64_t
+ubpf_trace_replay_value(struct ubpf_trace* trace, size_t size);
+
+/**
+ * @brief Record the direction of a conditional branch (or, when replaying, check it).
+ *
+ * @return False if the replay diverged from the trace; true, otherwise.
+ */
+bool
+ubpf_trace_branch(struct ubpf_trace* trace, bool taken);
+
+/**
+ * @brief Find the most instructions that a (validated) program can execute in one run, counting
+ * each instruction as the interpreter does against the instruction limit.
+ *
+ * @param[in] insts The instructions of the program.
+ * @param[in] num_insts The number of instructions.
+ * @return The bound (saturated at UINT32_MAX) or 0 if the program's control flow graph has a
+ * cycle (a loop or a recursion), can fall off the end of the program or could not be analyzed.
+ */
+uint32_t
+ubpf_calculate_instruction_bound(const struct ebpf_inst* insts, uint32_t num_insts);
+
+/**
+ * @brief Determine whether the program loaded in the VM is known to finish within the VM's
+ * instruction limit (if any), so that it can run without termination checks.
+ */
+static inline bool
+ubpf_program_terminates(const struct ubpf_vm* vm)
+{
+    return vm->instruction_bound != 0 &&
+           (vm->instruction_limit == 0 ||
+            (vm->instruction_limit > 0 && vm->instruction_bound <= (uint32_t)vm->instruction_limit));
+}
+
+/**
+ * @brief Pick the variant of the interpreter that performs only the checks that the VM's settings call for. It must
+ * be called whenever one of them (or the loaded program) changes.
+ *
+ * @param[in,out] vm The VM whose interpreter is picked.
+ */
+void
+ubpf_select_interpreter(struct ubpf_vm* vm);
+
+/**
+ * @brief Allocate the basic-block profiler's counters for the program loaded in the VM
+ * and determine where its basic blocks begin.
+ *
+ * @param[in,out] vm The VM whose program is profiled.
+ * @return True if the counters were allocated; false, otherwise.
+ */
+bool
+ubpf_profile_allocate(struct ubpf_vm* vm);
+
+/**
+ * @brief Release the basic-block profiler's counters.
+ *
+ * @param[in,out] vm The VM whose counters are released.
+ */
+void
+ubpf_profile_release(struct ubpf_vm* vm);
+
+/**
+ * @brief Write the disassembly of an instruction (in the syntax of the assembler in
+ * the ubpf Python package) to a stream.
+ *
+ * @param[in] stream The stream to which the disassembly is written.
+ * @param[in] inst The instruction.
+ * @param[in] next The instruction that follows inst (used for the upper half of an LDDW).
+ */
+void
+ubpf_disassemble_instruction(FILE* stream, struct ebpf_inst inst, struct ebpf_inst next);
+
+/**
+ * @brief Describe newly JIT'd code to perf (and debuggers) according to the VM's JitPerfOutput(s).
+ *
+ * @param[in,out] vm The VM whose program was JIT'd.
+ * @param[in] code The (final location of the) JIT'd code.
+ * @param[in] code_size The size of the JIT'd code.
+ * @param[in] result The result of the translation (with the retained PC locations and unwind rules).
+ * @return True if every output was written; false, otherwise.
+ */
+bool
+ubpf_jit_perf_record(struct ubpf_vm* vm, const uint8_t* code, size_t code_size, const struct ubpf_jit_result* result);
+
+/**
+ * @brief Withdraw the description of the VM's JIT'd code from debuggers before the code is released.
+ *
+ * @param[in,out] vm The VM whose JIT'd code is released.
+ */
+void
+ubpf_jit_perf_release(struct ubpf_vm* vm);
+
+/**
+ * @brief Register JIT'd code with debuggers through the GDB JIT compilation interface.
+ *
+ * @param[in,out] vm The VM whose program was JIT'd.
+ * @param[in] code The (final location of the) JIT'd code.
+ * @param[in] code_size The size of the JIT'd code.
+ * @param[in] result The result of the translation (with the retained PC locations and unwind rules).
+ * @return True if the code was registered; false, otherwise.
+ */
+bool
+ubpf_jit_gdb_register(struct ubpf_vm* vm, const uint8_t* code, size_t code_size, const struct ubpf_jit_result* result);
+
+/**
+ * @brief Unregister the VM's JIT'd code (if it is registered) from debuggers.
+ *
+ * @param[in,out] vm The VM whose JIT'd code is released.
+ */
+void
+ubpf_jit_gdb_unregister(struct ubpf_vm* vm);
+
+/**
+ * @brief Release the PC locations and unwind rules retained by the result of a translation.
+ *
+ * @param[in,out] result The result of the translation.
+ */
+void
+ubpf_jit_release_debug_info(struct ubpf_jit_result* result);
+
 uint16_t
 ubpf_stack_usage_for_local_func(const struct ubpf_vm* vm, uint16_t pc);
 
@@ -229,6 +784,27 @@ ubpf_instruction_has_fallthrough(const struct ebpf_inst inst)
     return inst.opcode != EBPF_OP_EXIT;
 }
 
+/**
+ * @brief Determine whether an eBPF instruction is a jump to itself or to an earlier instruction.
+ *
+ * Backward jumps are the only way (other than local calls) that an eBPF program
+ * can execute the same instruction more than once.
+ *
+ * @return True if the inst is a backward jump; false, otherwise.
+ */
+static inline bool
+ubpf_instruction_is_backward_jump(const struct ebpf_inst inst)
+{
+    uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+    if (cls != EBPF_CLS_JMP && cls != EBPF_CLS_JMP32) {
+        return false;
+    }
+    if (inst.opcode == EBPF_OP_CALL || inst.opcode == EBPF_OP_EXIT) {
+        return false;
+    }
+    return inst.offset < 0;
+}
+
 // If either GNU C or Clang
 #if defined(__GNUC__) || defined(__clang__)
 #define UBPF_ATOMIC_ADD_FETCH(ptr, val) __sync_fetch_and_add(ptr, val)
@@ -34,6 +34,7 @@ int
 ubpf_translate_ex(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, char** errmsg, enum JitMode jit_mode)
 {
     struct ubpf_jit_result jit_result = vm->jit_translate(vm, buffer, size, jit_mode);
+    ubpf_jit_release_debug_info(&vm->jitted_result);
     vm->jitted_result = jit_result;
     if (jit_result.errmsg) {
         *errmsg = jit_result.errmsg;
@@ -41,6 +42,16 @@ ubpf_translate_ex(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, char** errm
     return jit_result.compile_result == UBPF_JIT_COMPILE_SUCCESS ? 0 : -1;
 }
 
+void
+ubpf_jit_release_debug_info(struct ubpf_jit_result* result)
+{
+    free(result->pc_locs);
+    result->pc_locs = NULL;
+    free(result->unwind_rules);
+    result->unwind_rules = NULL;
+    result->num_unwind_rules = 0;
+}
+
 int
 ubpf_translate(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, char** errmsg)
 {
@@ -53,6 +64,9 @@ ubpf_translate_null(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, enum JitM
     struct ubpf_jit_result compile_result;
     compile_result.compile_result = UBPF_JIT_COMPILE_FAILURE;
     compile_result.external_dispatcher_offset = 0;
+    compile_result.pc_locs = NULL;
+    compile_result.unwind_rules = NULL;
+    compile_result.num_unwind_rules = 0;
 
     /* NULL JIT target - just returns an error. */
     UNUSED_PARAMETER(vm);
@@ -113,12 +127,27 @@ ubpf_compile_ex(struct ubpf_vm* vm, char** errmsg, enum JitMode mode)
     uint8_t* buffer = NULL;
     size_t jitted_size;
 
+    // Not even code that was JIT'd before the VM was restricted to replaying traces may run.
+    if (vm->replay_only) {
+        *errmsg = ubpf_error("this VM only replays traces");
+        return NULL;
+    }
+
+    // The JIT'd code can be reused unless it was compiled for other settings. Whether (and how) it enforces the
+    // instruction limit depends on the limit, and the runtime statistics and the profile are only collected by code
+    // that was compiled with them.
     if (vm->jitted && vm->jitted_result.compile_result == UBPF_JIT_COMPILE_SUCCESS &&
-        vm->jitted_result.jit_mode == mode) {
+        vm->jitted_result.jit_mode == mode &&
+        vm->jitted_result.static_dispatch == (vm->dispatch_strategy == StaticDispatch) &&
+        vm->jitted_result.instruction_limit == vm->instruction_limit &&
+        vm->jitted_result.runtime_stats == vm->runtime_stats_enabled &&
+        vm->jitted_result.helper_latency == vm->helper_latency_enabled &&
+        vm->jitted_result.profiling == vm->profiling_enabled) {
         return vm->jitted;
     }
 
     if (vm->jitted) {
+        ubpf_jit_perf_release(vm);
         munmap(vm->jitted, vm->jitted_size);
         vm->jitted = NULL;
         vm->jitted_size = 0;
@@ -158,6 +187,11 @@ ubpf_compile_ex(struct ubpf_vm* vm, char** errmsg, enum JitMode mode)
     vm->jitted = jitted;
     vm->jitted_size = jitted_size;
 
+    if (vm->jit_perf_outputs && !ubpf_jit_perf_record(vm, jitted, jitted_size, &vm->jitted_result)) {
+        vm->error_printf(stderr, "Warning: Could not describe the JIT'd code to perf.\n");
+    }
+    ubpf_jit_release_debug_info(&vm->jitted_result);
+
 out:
     free(buffer);
     if (jitted && vm->jitted == NULL) {
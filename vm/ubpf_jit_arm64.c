@@ -77,7 +77,7 @@ enum Registers
 };
 
 // Callee saved registers - this must be a multiple of two because of how we save the stack later on.
-static enum Registers callee_saved_registers[] = {R19, R20, R21, R22, R23, R24, R25, R26};
+static enum Registers callee_saved_registers[] = {R19, R20, R21, R22, R23, R24, R25, R26, R27, R28};
 // Caller saved registers (and parameter registers)
 // static enum Registers caller_saved_registers[] = {R0, R1, R2, R3, R4};
 // Temp register for immediate generation
@@ -88,6 +88,10 @@ static enum Registers temp_div_register = R25;
 static enum Registers offset_register = R26;
 // Special register for external dispatcher context.
 static enum Registers VOLATILE_CTXT = R26;
+// Remaining instruction budget (for programs that need one).
+static enum Registers budget_register = R27;
+// The thread's runtime statistics (when the VM collects runtime statistics).
+static enum Registers runtime_stats_register = R28;
 
 // Number of eBPF registers
 #define REGISTER_MAP_SIZE 11
@@ -100,6 +104,8 @@ static enum Registers VOLATILE_CTXT = R26;
 //              r24         Temp - used for generating 32-bit immediates
 //              r25         Temp - used for modulous calculations
 //              r26         Temp - used for large load/store offsets
+//              r27         Remaining instruction budget
+//              r28         Runtime statistics
 //
 // Note that the AArch64 ABI uses r0 both for function parameters and result.  We use r5 to hold
 // the result during the function and do an extra final move at the end of the function to copy the
@@ -360,14 +366,18 @@ emit_unconditionalbranch_immediate(
     struct jit_state* state, enum UnconditionalBranchImmediateOpcode op, struct PatchableTarget target)
 {
     uint32_t source_offset = state->offset;
-    struct patchable_relative* table = state->jumps;
+    struct patchable_relative** table = &state->jumps;
     int* num_jumps = &state->num_jumps;
+    int* capacity = &state->jumps_capacity;
     if (op == UBR_BL && !target.is_special) {
-        table = state->local_calls;
+        table = &state->local_calls;
         num_jumps = &state->num_local_calls;
+        capacity = &state->local_calls_capacity;
     }
 
-    emit_patchable_relative(table, state->offset, target, (*num_jumps)++);
+    if (!emit_patchable_relative(table, num_jumps, capacity, state->offset, target)) {
+        state->jit_status = OutOfMemory;
+    }
     emit_instruction(state, op);
 
     return source_offset;
@@ -405,7 +415,9 @@ static uint32_t
 emit_conditionalbranch_immediate(struct jit_state* state, enum Condition cond, struct PatchableTarget target)
 {
     uint32_t source_offset = state->offset;
-    emit_patchable_relative(state->jumps, state->offset, target, state->num_jumps++);
+    if (!emit_patchable_relative(&state->jumps, &state->num_jumps, &state->jumps_capacity, state->offset, target)) {
+        state->jit_status = OutOfMemory;
+    }
     emit_instruction(state, BR_Bcond | (0 << 5) | cond);
     return source_offset;
 }
@@ -540,20 +552,51 @@ emit_movewide_immediate(struct jit_state* state, bool sixty_four, enum Registers
  * Postcondition:  The runtime stack pointer is 16-byte aligned.
  */
 static void
-emit_jit_prologue(struct jit_state* state, size_t ubpf_stack_size)
+emit_jit_prologue(struct jit_state* state, struct ubpf_vm* vm, size_t ubpf_stack_size)
 {
+    /* The DWARF numbers of the general purpose registers match their encodings (SP is 31). */
+    record_unwind_cfa(state, SP, 0);
     emit_addsub_immediate(state, true, AS_SUB, SP, SP, 16);
+    record_unwind_cfa(state, SP, 16);
     emit_loadstorepair_immediate(state, LSP_STPX, R29, R30, SP, 0);
+    record_unwind_saved_register(state, R29, 16);
+    record_unwind_saved_register(state, R30, 8);
 
     state->stack_size = _countof(callee_saved_registers) * 8;
+    uint32_t frame_size = state->stack_size + 16;
     emit_addsub_immediate(state, true, AS_SUB, SP, SP, state->stack_size);
+    record_unwind_cfa(state, SP, frame_size);
     /* Save callee saved registers */
     unsigned i;
     for (i = 0; i < _countof(callee_saved_registers); i += 2) {
         emit_loadstorepair_immediate(
             state, LSP_STPX, callee_saved_registers[i], callee_saved_registers[i + 1], SP, (i) * 8);
+        record_unwind_saved_register(state, callee_saved_registers[i], frame_size - i * 8);
+        record_unwind_saved_register(state, callee_saved_registers[i + 1], frame_size - (i + 1) * 8);
     }
     emit_addsub_immediate(state, true, AS_ADD, R29, SP, 0);
+    /* R29 does not change (until the epilogue restores it), wherever the eBPF program moves SP. */
+    record_unwind_cfa(state, R29, frame_size);
+
+    /* Get the thread's runtime statistics and note the time at which the run starts (in a
+     * 16-byte slot just below R29, whose upper half holds the time at which the current call
+     * to a helper started). */
+    if (vm->runtime_stats_enabled) {
+        emit_addsub_immediate(state, true, AS_SUB, SP, SP, 16);
+        emit_addsub_immediate(state, true, AS_SUB, SP, SP, 32);
+        emit_loadstorepair_immediate(state, LSP_STPX, R0, R1, SP, 0);
+        emit_loadstorepair_immediate(state, LSP_STPX, R2, R3, SP, 16);
+        emit_movewide_immediate(state, true, R0, (uint64_t)(uintptr_t)vm);
+        emit_movewide_immediate(state, true, temp_register, (uint64_t)(uintptr_t)ubpf_runtime_stats_enter);
+        emit_unconditionalbranch_register(state, BR_BLR, temp_register);
+        emit_logical_register(state, true, LOG_ORR, runtime_stats_register, RZ, R0);
+        emit_loadstorepair_immediate(state, LSP_LDPX, R0, R1, SP, 0);
+        emit_loadstorepair_immediate(state, LSP_LDPX, R2, R3, SP, 16);
+        emit_addsub_immediate(state, true, AS_ADD, SP, SP, 32);
+        /* mrs temp_register, cntvct_el0 */
+        emit_instruction(state, 0xd53be040 | temp_register);
+        emit_loadstore_immediate(state, LS_STRX, temp_register, SP, 0);
+    }
 
     if (state->jit_mode == BasicJitMode) {
         /* Setup UBPF frame pointer. */
@@ -567,6 +610,11 @@ emit_jit_prologue(struct jit_state* state, size_t ubpf_stack_size)
     /* Copy R0 to the volatile context for safe keeping. */
     emit_logical_register(state, true, LOG_ORR, VOLATILE_CTXT, RZ, R0);
 
+    /* Initialize the instruction budget (if the program needs one). */
+    if (state->budget_charges) {
+        emit_movewide_immediate(state, true, budget_register, (int64_t)state->instruction_budget);
+    }
+
     DECLARE_PATCHABLE_SPECIAL_TARGET(exit_tgt, Exit);
     DECLARE_PATCHABLE_SPECIAL_TARGET(enter_tgt, Enter);
     emit_unconditionalbranch_immediate(state, UBR_BL, enter_tgt);
@@ -575,7 +623,7 @@ emit_jit_prologue(struct jit_state* state, size_t ubpf_stack_size)
 }
 
 static void
-emit_jit_epilogue(struct jit_state* state)
+emit_jit_epilogue(struct jit_state* state, struct ubpf_vm* vm)
 {
     state->exit_loc = state->offset;
 
@@ -584,6 +632,19 @@ emit_jit_epilogue(struct jit_state* state)
         emit_logical_register(state, true, LOG_ORR, R0, RZ, map_register(0));
     }
 
+    /* Account for the run in the runtime statistics (keeping the result in temp_div_register,
+     * which the call preserves). */
+    if (vm->runtime_stats_enabled) {
+        emit_addsub_immediate(state, true, AS_SUB, SP, R29, 16);
+        emit_loadstore_immediate(state, LS_LDRX, R1, SP, 0);
+        emit_logical_register(state, true, LOG_ORR, temp_div_register, RZ, R0);
+        emit_logical_register(state, true, LOG_ORR, R2, RZ, R0);
+        emit_logical_register(state, true, LOG_ORR, R0, RZ, runtime_stats_register);
+        emit_movewide_immediate(state, true, temp_register, (uint64_t)(uintptr_t)ubpf_runtime_stats_exit);
+        emit_unconditionalbranch_register(state, BR_BLR, temp_register);
+        emit_logical_register(state, true, LOG_ORR, R0, RZ, temp_div_register);
+    }
+
     /* We could be anywhere in the stack if we excepted. Get our head right. */
     emit_addsub_immediate(state, true, AS_ADD, SP, R29, 0);
 
@@ -596,23 +657,30 @@ emit_jit_epilogue(struct jit_state* state)
     emit_addsub_immediate(state, true, AS_ADD, SP, SP, state->stack_size);
 
     emit_loadstorepair_immediate(state, LSP_LDPX, R29, R30, SP, 0);
+    record_unwind_cfa(state, SP, 16);
     emit_addsub_immediate(state, true, AS_ADD, SP, SP, 16);
+    record_unwind_cfa(state, SP, 0);
 
     emit_unconditionalbranch_register(state, BR_RET, R30);
+    /* The code that follows the epilogue runs in the frame of the eBPF program. */
+    record_unwind_cfa(state, R29, state->stack_size + 16);
 }
 
 static void
-emit_dispatched_external_helper_call(struct jit_state* state, struct ubpf_vm* vm, unsigned int idx)
+emit_dispatched_external_helper_call(struct jit_state* state, struct ubpf_vm* vm, unsigned int idx, unsigned int slot)
 {
-    UNUSED_PARAMETER(vm);
-
     /*
      * There are two paths through the function:
      * 1. There is an external dispatcher registered. If so, we prioritize that.
      * 2. We fall back to the regular registered helper.
      * See translate and emit_dispatched_external_helper_call in ubpf_jit_x86_64.c for additional
-     * details.
+     * details. With StaticDispatch, only the path for the configuration registered at compile
+     * time is emitted.
      */
+    bool check_dispatcher = vm->dispatch_strategy == DynamicDispatch;
+    bool use_dispatcher = vm->dispatcher != NULL;
+    uint32_t external_dispatcher_jump_source = 0;
+    uint32_t no_dispatcher_jump_source = 0;
 
     uint32_t stack_movement = align_to(8, 16);
     emit_addsub_immediate(state, true, AS_SUB, SP, SP, stack_movement);
@@ -620,50 +688,63 @@ emit_dispatched_external_helper_call(struct jit_state* state, struct ubpf_vm* vm
 
     // Determine whether to call it through a dispatcher or by index and then load up the address
     // of that function.
-    DECLARE_PATCHABLE_SPECIAL_TARGET(external_dispatcher_pt, ExternalDispatcher);
-    emit_loadstore_literal(state, LS_LDRL, temp_register, external_dispatcher_pt);
-
-    // Check whether temp_register is empty.
-    emit_addsub_immediate(state, true, AS_SUBS, temp_register, temp_register, 0);
-
-    // Jump to the call if we are ready to roll (because we are using an external dispatcher).
     DECLARE_PATCHABLE_REGULAR_EBPF_TARGET(default_tgt, 0);
-    uint32_t external_dispatcher_jump_source = emit_conditionalbranch_immediate(state, COND_NE, default_tgt);
+    if (check_dispatcher || use_dispatcher) {
+        DECLARE_PATCHABLE_SPECIAL_TARGET(external_dispatcher_pt, ExternalDispatcher);
+        emit_loadstore_literal(state, LS_LDRL, temp_register, external_dispatcher_pt);
+    }
 
-    // We are not ready to roll. In other words, we are going to load the helper function address by index.
-    emit_movewide_immediate(state, true, R5, idx);
-    emit_movewide_immediate(state, true, R6, 3);
-    emit_dataprocessing_twosource(state, true, DP2_LSLV, R5, R5, R6);
+    if (check_dispatcher) {
+        // Check whether temp_register is empty.
+        emit_addsub_immediate(state, true, AS_SUBS, temp_register, temp_register, 0);
 
-    emit_movewide_immediate(state, true, temp_register, 0);
-    DECLARE_PATCHABLE_SPECIAL_TARGET(load_helper_tgt, LoadHelperTable);
-    emit_adr(state, load_helper_tgt, temp_register);
-    emit_addsub_register(state, true, AS_ADD, temp_register, temp_register, R5);
-    emit_loadstore_immediate(state, LS_LDRX, temp_register, temp_register, 0);
+        // Jump to the call if we are ready to roll (because we are using an external dispatcher).
+        external_dispatcher_jump_source = emit_conditionalbranch_immediate(state, COND_NE, default_tgt);
+    }
 
-    // Add the implicit 6th parameter (the context)
-    emit_logical_register(state, true, LOG_ORR, R5, RZ, VOLATILE_CTXT);
+    if (check_dispatcher || !use_dispatcher) {
+        // We are not ready to roll. In other words, we are going to load the helper function address by its
+        // slot in the helper table.
+        emit_movewide_immediate(state, true, R5, slot);
+        emit_movewide_immediate(state, true, R6, 3);
+        emit_dataprocessing_twosource(state, true, DP2_LSLV, R5, R5, R6);
+
+        emit_movewide_immediate(state, true, temp_register, 0);
+        DECLARE_PATCHABLE_SPECIAL_TARGET(load_helper_tgt, LoadHelperTable);
+        emit_adr(state, load_helper_tgt, temp_register);
+        emit_addsub_register(state, true, AS_ADD, temp_register, temp_register, R5);
+        emit_loadstore_immediate(state, LS_LDRX, temp_register, temp_register, 0);
+
+        // Add the implicit 6th parameter (the context)
+        emit_logical_register(state, true, LOG_ORR, R5, RZ, VOLATILE_CTXT);
+    }
 
-    // And now we, too, are ready to roll. So, let's jump around the code that sets up the additional
-    // parameters for the external dispatcher. We will end up at the call site where both paths
-    // will rendezvous.
-    uint32_t no_dispatcher_jump_source = emit_unconditionalbranch_immediate(state, UBR_B, default_tgt);
+    if (check_dispatcher) {
+        // And now we, too, are ready to roll. So, let's jump around the code that sets up the additional
+        // parameters for the external dispatcher. We will end up at the call site where both paths
+        // will rendezvous.
+        no_dispatcher_jump_source = emit_unconditionalbranch_immediate(state, UBR_B, default_tgt);
 
-    // Mark the landing spot for the jump around the code that sets up a call to a helper function
-    // when no external dispatcher is present.
-    emit_jump_target(state, external_dispatcher_jump_source);
+        // Mark the landing spot for the jump around the code that sets up a call to a helper function
+        // when no external dispatcher is present.
+        emit_jump_target(state, external_dispatcher_jump_source);
+    }
 
-    // ... set up the final two arguments for the external dispatcher.
+    if (check_dispatcher || use_dispatcher) {
+        // ... set up the final two arguments for the external dispatcher.
 
-    // The index of the helper to be invoked.
-    emit_movewide_immediate(state, true, R5, idx);
+        // The index of the helper to be invoked.
+        emit_movewide_immediate(state, true, R5, idx);
 
-    // The context.
-    // Use a sneaky way to copy the context register into the R6 register (as the final parameter).
-    emit_logical_register(state, true, LOG_ORR, R6, RZ, VOLATILE_CTXT);
+        // The context.
+        // Use a sneaky way to copy the context register into the R6 register (as the final parameter).
+        emit_logical_register(state, true, LOG_ORR, R6, RZ, VOLATILE_CTXT);
+    }
 
-    // Mark the landing spot for the jump around the external-dispatcher-argument-setup code.
-    emit_jump_target(state, no_dispatcher_jump_source);
+    if (check_dispatcher) {
+        // Mark the landing spot for the jump around the external-dispatcher-argument-setup code.
+        emit_jump_target(state, no_dispatcher_jump_source);
+    }
 
     // Both paths meet here -- all that's left is to call!
     emit_unconditionalbranch_register(state, BR_BLR, temp_register);
@@ -678,6 +759,99 @@ emit_dispatched_external_helper_call(struct jit_state* state, struct ubpf_vm* vm
     emit_addsub_immediate(state, true, AS_ADD, SP, SP, stack_movement);
 }
 
+/* Call a kfunc directly: its address is known when the program is compiled, so the call goes
+ * through neither the external dispatcher nor the helper table.
+ */
+static void
+emit_kfunc_call(struct jit_state* state, extended_external_helper_t kfunc)
+{
+    uint32_t stack_movement = align_to(8, 16);
+    emit_addsub_immediate(state, true, AS_SUB, SP, SP, stack_movement);
+    emit_loadstore_immediate(state, LS_STRX, R30, SP, 0);
+
+    emit_movewide_immediate(state, true, temp_register, (uint64_t)kfunc);
+    // Add the implicit 6th parameter (the context), like for a helper.
+    emit_logical_register(state, true, LOG_ORR, R5, RZ, VOLATILE_CTXT);
+    emit_unconditionalbranch_register(state, BR_BLR, temp_register);
+
+    enum Registers dest = map_register(0);
+    if (dest != R0) {
+        emit_logical_register(state, true, LOG_ORR, dest, RZ, R0);
+    }
+
+    emit_loadstore_immediate(state, LS_LDRX, R30, SP, 0);
+    emit_addsub_immediate(state, true, AS_ADD, SP, SP, stack_movement);
+}
+
+/* Charge the given number of instructions against the program's instruction budget and
+ * terminate the program if the budget is exhausted. Clobbers the flags (and, for large
+ * charges, temp_register).
+ */
+static void
+emit_instruction_budget_charge(struct jit_state* state, uint32_t charge)
+{
+    if (charge < 0x1000) {
+        emit_addsub_immediate(state, true, AS_SUBS, budget_register, budget_register, charge);
+    } else {
+        emit_movewide_immediate(state, true, temp_register, charge);
+        emit_addsub_register(state, true, AS_SUBS, budget_register, budget_register, temp_register);
+    }
+    DECLARE_PATCHABLE_SPECIAL_TARGET(budget_exhausted_tgt, BudgetExhausted);
+    emit_conditionalbranch_immediate(state, COND_LT, budget_exhausted_tgt);
+}
+
+/* Count a call to the helper with the given slot in the thread's runtime statistics. Clobbers
+ * temp_register and temp_div_register.
+ */
+static void
+emit_runtime_stats_helper_call(struct jit_state* state, unsigned int idx)
+{
+    emit_addsub_immediate(state, true, AS_ADD, temp_div_register, runtime_stats_register, idx * sizeof(uint64_t));
+    emit_loadstore_immediate(state, LS_LDRX, temp_register, temp_div_register, 0);
+    emit_addsub_immediate(state, true, AS_ADD, temp_register, temp_register, 1);
+    emit_loadstore_immediate(state, LS_STRX, temp_register, temp_div_register, 0);
+}
+
+/* Note the time at which a call to a helper starts. Clobbers temp_register. */
+static void
+emit_helper_latency_start(struct jit_state* state)
+{
+    /* mrs temp_register, cntvct_el0 */
+    emit_instruction(state, 0xd53be040 | temp_register);
+    emit_loadstore_immediate(state, LS_STRX, temp_register, R29, -8);
+}
+
+/* Account for the latency of the call to the helper with the given slot (which just
+ * returned). Preserves the result (in the register mapped to eBPF r0) and R30.
+ */
+static void
+emit_helper_latency_end(struct jit_state* state, unsigned int idx)
+{
+    emit_addsub_immediate(state, true, AS_SUB, SP, SP, 16);
+    emit_loadstore_immediate(state, LS_STRX, R30, SP, 0);
+    emit_logical_register(state, true, LOG_ORR, temp_div_register, RZ, map_register(0));
+    emit_logical_register(state, true, LOG_ORR, R0, RZ, runtime_stats_register);
+    emit_movewide_immediate(state, true, R1, idx);
+    emit_loadstore_immediate(state, LS_LDRX, R2, R29, -8);
+    emit_movewide_immediate(state, true, temp_register, (uint64_t)(uintptr_t)ubpf_runtime_stats_helper_latency);
+    emit_unconditionalbranch_register(state, BR_BLR, temp_register);
+    emit_logical_register(state, true, LOG_ORR, map_register(0), RZ, temp_div_register);
+    emit_loadstore_immediate(state, LS_LDRX, R30, SP, 0);
+    emit_addsub_immediate(state, true, AS_ADD, SP, SP, 16);
+}
+
+/* Increment the basic-block profiler's counter at the given address. Clobbers temp_register
+ * and temp_div_register.
+ */
+static void
+emit_profile_counter_increment(struct jit_state* state, uint64_t* counter)
+{
+    emit_movewide_immediate(state, true, temp_register, (uint64_t)(uintptr_t)counter);
+    emit_loadstore_immediate(state, LS_LDRX, temp_div_register, temp_register, 0);
+    emit_addsub_immediate(state, true, AS_ADD, temp_div_register, temp_div_register, 1);
+    emit_loadstore_immediate(state, LS_STRX, temp_div_register, temp_register, 0);
+}
+
 static void
 emit_local_call(struct jit_state* state, uint32_t target_pc)
 {
@@ -724,13 +898,13 @@ emit_dispatched_external_helper_address(struct jit_state* state, uint64_t dispat
     return helper_address;
 }
 
+/* Emit the table of the helpers that the program calls (see resolve_helper_call in ubpf_vm.c). */
 static uint32_t
 emit_helper_table(struct jit_state* state, struct ubpf_vm* vm)
 {
-
     uint32_t helper_table_address_target = state->offset;
-    for (int i = 0; i < MAX_EXT_FUNCS; i++) {
-        emit_bytes(state, &vm->ext_funcs[i], sizeof(uint64_t));
+    for (uint32_t i = 0; i < vm->helper_table_size; i++) {
+        emit_bytes(state, &vm->helper_table[i], sizeof(uint64_t));
     }
     return helper_table_address_target;
 }
@@ -1015,7 +1189,11 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
 {
     int i;
 
-    emit_jit_prologue(state, UBPF_EBPF_STACK_SIZE);
+    if (calculate_instruction_budget_charges(state, vm, errmsg) < 0) {
+        return -1;
+    }
+
+    emit_jit_prologue(state, vm, UBPF_EBPF_STACK_SIZE);
 
     for (i = 0; i < vm->num_insts; i++) {
 
@@ -1065,6 +1243,14 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
 
         state->pc_locs[i] = state->offset;
 
+        if (vm->profiling_enabled && vm->profile_counts && vm->profile_block_starts[i]) {
+            emit_profile_counter_increment(state, &vm->profile_counts[i]);
+        }
+
+        if (state->budget_charges && state->budget_charges[i]) {
+            emit_instruction_budget_charge(state, state->budget_charges[i]);
+        }
+
         enum Registers dst = map_register(inst.dst);
         enum Registers src = map_register(inst.src);
         uint8_t opcode = inst.opcode;
@@ -1219,7 +1405,19 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
         case EBPF_OP_CALL: {
             DECLARE_PATCHABLE_SPECIAL_TARGET(exit_tgt, Exit);
             if (inst.src == 0) {
-                emit_dispatched_external_helper_call(state, vm, inst.imm);
+                // The statistics are kept by the helper's slot in the program's table of helpers.
+                uint16_t helper_slot = (uint16_t)inst.offset;
+                bool measure_latency = vm->helper_latency_enabled && helper_slot < UBPF_RUNTIME_STATS_HELPERS;
+                if (vm->runtime_stats_enabled && helper_slot < UBPF_RUNTIME_STATS_HELPERS) {
+                    emit_runtime_stats_helper_call(state, helper_slot);
+                }
+                if (measure_latency) {
+                    emit_helper_latency_start(state);
+                }
+                emit_dispatched_external_helper_call(state, vm, inst.imm, (uint16_t)inst.offset);
+                if (measure_latency) {
+                    emit_helper_latency_end(state, helper_slot);
+                }
                 if (inst.imm == vm->unwind_stack_extension_index) {
                     emit_addsub_immediate(state, true, AS_SUBS, RZ, map_register(0), 0);
                     emit_conditionalbranch_immediate(state, COND_EQ, exit_tgt);
@@ -1227,6 +1425,8 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
             } else if (inst.src == 1) {
                 uint32_t call_target = i + inst.imm + 1;
                 emit_local_call(state, call_target);
+            } else if (inst.src == 2) {
+                emit_kfunc_call(state, vm->kfunc_targets[(uint16_t)inst.offset]);
             } else {
                 emit_unconditionalbranch_immediate(state, UBR_B, exit_tgt);
             }
@@ -1299,20 +1499,8 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
 
     if (state->jit_status != NoError) {
         switch (state->jit_status) {
-        case TooManyJumps: {
-            *errmsg = ubpf_error("Too many jump instructions.");
-            break;
-        }
-        case TooManyLoads: {
-            *errmsg = ubpf_error("Too many load instructions.");
-            break;
-        }
-        case TooManyLeas: {
-            *errmsg = ubpf_error("Too many LEA calculations.");
-            break;
-        }
-        case TooManyLocalCalls: {
-            *errmsg = ubpf_error("Too many local calls.");
+        case OutOfMemory: {
+            *errmsg = ubpf_error("Could not allocate space needed to JIT compile eBPF program");
             break;
         }
         case UnexpectedInstruction: {
@@ -1336,7 +1524,13 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
         return -1;
     }
 
-    emit_jit_epilogue(state);
+    /* A program that exhausts its instruction budget returns UINT64_MAX (through the epilogue). */
+    if (state->budget_charges) {
+        state->budget_exhausted_loc = state->offset;
+        emit_movewide_immediate(state, true, map_register(0), UINT64_MAX);
+    }
+
+    emit_jit_epilogue(state, vm);
 
     state->dispatcher_loc = emit_dispatched_external_helper_address(state, (uint64_t)vm->dispatcher);
     state->helper_table_loc = emit_helper_table(state, vm);
@@ -1411,12 +1605,14 @@ resolve_jumps(struct jit_state* state)
         int32_t target_loc;
 
         if (jump.target.is_special) {
-            // Jumps to special targets Exit and Enter are the only
+            // Jumps to special targets Exit, Enter and BudgetExhausted are the only
             // valid options.
             if (jump.target.target.special == Exit) {
                 target_loc = state->exit_loc;
             } else if (jump.target.target.special == Enter) {
                 target_loc = state->entry_loc;
+            } else if (jump.target.target.special == BudgetExhausted) {
+                target_loc = state->budget_exhausted_loc;
             } else {
                 target_loc = -1;
                 return false;
@@ -1506,7 +1702,7 @@ ubpf_jit_update_dispatcher_arm64(
     UNUSED_PARAMETER(vm);
     uint64_t jit_upper_bound = (uint64_t)buffer + size;
     void* dispatcher_address = (void*)((uint64_t)buffer + offset);
-    if ((uint64_t)dispatcher_address + sizeof(void*) < jit_upper_bound) {
+    if ((uint64_t)dispatcher_address + sizeof(void*) <= jit_upper_bound) {
         memcpy(dispatcher_address, &new_dispatcher, sizeof(void*));
         return true;
     }
@@ -1527,7 +1723,7 @@ ubpf_jit_update_helper_arm64(
     uint64_t jit_upper_bound = (uint64_t)buffer + size;
 
     void* dispatcher_address = (void*)((uint64_t)buffer + offset + (8 * idx));
-    if ((uint64_t)dispatcher_address + sizeof(void*) < jit_upper_bound) {
+    if ((uint64_t)dispatcher_address + sizeof(void*) <= jit_upper_bound) {
         memcpy(dispatcher_address, &new_helper, sizeof(void*));
         return true;
     }
@@ -1540,7 +1736,8 @@ ubpf_translate_arm64(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, enum Jit
     struct jit_state state;
     struct ubpf_jit_result compile_result;
 
-    if (initialize_jit_state_result(&state, &compile_result, buffer, *size, jit_mode, &compile_result.errmsg) < 0) {
+    if (initialize_jit_state_result(
+            &state, &compile_result, buffer, *size, vm->num_insts, jit_mode, &compile_result.errmsg) < 0) {
         goto out;
     }
 
@@ -1554,9 +1751,18 @@ ubpf_translate_arm64(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, enum Jit
     }
 
     compile_result.compile_result = UBPF_JIT_COMPILE_SUCCESS;
+    if (vm->jit_perf_outputs) {
+        retain_jit_debug_info(&state, &compile_result);
+    }
     *size = state.offset;
     compile_result.external_dispatcher_offset = state.dispatcher_loc;
     compile_result.external_helper_offset = state.helper_table_loc;
+    compile_result.static_dispatch = vm->dispatch_strategy == StaticDispatch;
+    compile_result.static_dispatcher = compile_result.static_dispatch && vm->dispatcher != NULL;
+    compile_result.instruction_limit = vm->instruction_limit;
+    compile_result.runtime_stats = vm->runtime_stats_enabled;
+    compile_result.helper_latency = vm->helper_latency_enabled;
+    compile_result.profiling = vm->profiling_enabled;
 
 out:
     release_jit_state_result(&state, &compile_result);
@@ -0,0 +1,566 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+// This file contains the support for the GDB JIT compilation interface (see "JIT Compilation
+// Interface" in the GDB manual). Each JIT'd program is registered as an in-memory ELF object
+// whose .text section is (the address range of) the JIT'd code. The object carries a symbol
+// for the program, a .debug_line table that maps the JIT'd code to eBPF PCs and an .eh_frame
+// section with the call frame information that the JIT recorded for its prologue and epilogue.
+
+#include "ubpf_int.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+#include <elf.h>
+
+enum jit_actions
+{
+    JIT_NOACTION = 0,
+    JIT_REGISTER_FN,
+    JIT_UNREGISTER_FN
+};
+
+struct jit_code_entry
+{
+    struct jit_code_entry* next_entry;
+    struct jit_code_entry* prev_entry;
+    const char* symfile_addr;
+    uint64_t symfile_size;
+};
+
+struct jit_descriptor
+{
+    uint32_t version;
+    uint32_t action_flag;
+    struct jit_code_entry* relevant_entry;
+    struct jit_code_entry* first_entry;
+};
+
+// GDB sets a breakpoint in __jit_debug_register_code and reads __jit_debug_descriptor when
+// the breakpoint is hit. Both are weak so that a process that embeds other JITs that implement
+// the interface has a single copy of each.
+void __attribute__((weak, noinline))
+__jit_debug_register_code(void);
+
+void __attribute__((weak, noinline))
+__jit_debug_register_code(void)
+{
+    __asm__ __volatile__("" ::: "memory");
+}
+
+struct jit_descriptor __attribute__((weak)) __jit_debug_descriptor = {1, JIT_NOACTION, NULL, NULL};
+
+// Serializes the updates to the list of registered code entries.
+static int jit_debug_lock = 0;
+
+static void
+lock_jit_debug_descriptor(void)
+{
+    while (__atomic_exchange_n(&jit_debug_lock, 1, __ATOMIC_ACQUIRE)) {
+    }
+}
+
+static void
+unlock_jit_debug_descriptor(void)
+{
+    __atomic_store_n(&jit_debug_lock, 0, __ATOMIC_RELEASE);
+}
+
+#if defined(__x86_64__)
+#define ELF_MACHINE EM_X86_64
+#define DWARF_RETURN_ADDRESS_COLUMN 16
+#else
+#define ELF_MACHINE EM_AARCH64
+#define DWARF_RETURN_ADDRESS_COLUMN 30
+#endif
+
+#define DW_TAG_compile_unit 0x11
+#define DW_CHILDREN_no 0
+#define DW_AT_name 0x03
+#define DW_AT_stmt_list 0x10
+#define DW_AT_low_pc 0x11
+#define DW_AT_high_pc 0x12
+#define DW_FORM_addr 0x01
+#define DW_FORM_data4 0x06
+#define DW_FORM_string 0x08
+
+#define DW_LNS_copy 1
+#define DW_LNS_advance_pc 2
+#define DW_LNS_advance_line 3
+#define DW_LNE_end_sequence 1
+#define DW_LNE_set_address 2
+
+#define DW_CFA_nop 0x00
+#define DW_CFA_advance_loc4 0x04
+#define DW_CFA_def_cfa 0x0c
+#define DW_CFA_offset 0x80
+#define DW_EH_PE_udata4 0x03
+#define DW_EH_PE_textrel 0x20
+
+// The DWARF data alignment factor of the call frame information (saved registers are 8-byte aligned).
+#define DATA_ALIGNMENT 8
+
+enum elf_section
+{
+    SectionNull,
+    SectionText,
+    SectionEhFrame,
+    SectionDebugAbbrev,
+    SectionDebugInfo,
+    SectionDebugLine,
+    SectionSymtab,
+    SectionStrtab,
+    SectionShstrtab,
+    SectionCount,
+};
+
+static const char* section_names[SectionCount] = {
+    "", ".text", ".eh_frame", ".debug_abbrev", ".debug_info", ".debug_line", ".symtab", ".strtab", ".shstrtab"};
+
+/**
+ * @brief A growable buffer in which the ELF object is built.
+ */
+struct elf_buffer
+{
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+    bool failed;
+};
+
+static void
+append(struct elf_buffer* buffer, const void* data, size_t size)
+{
+    if (buffer->failed) {
+        return;
+    }
+    if (buffer->size + size > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 1024;
+        while (capacity < buffer->size + size) {
+            capacity *= 2;
+        }
+        uint8_t* data = realloc(buffer->data, capacity);
+        if (!data) {
+            buffer->failed = true;
+            return;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+static void
+append_u8(struct elf_buffer* buffer, uint8_t value)
+{
+    append(buffer, &value, sizeof(value));
+}
+
+static void
+append_u16(struct elf_buffer* buffer, uint16_t value)
+{
+    append(buffer, &value, sizeof(value));
+}
+
+static void
+append_u32(struct elf_buffer* buffer, uint32_t value)
+{
+    append(buffer, &value, sizeof(value));
+}
+
+static void
+append_u64(struct elf_buffer* buffer, uint64_t value)
+{
+    append(buffer, &value, sizeof(value));
+}
+
+static void
+append_string(struct elf_buffer* buffer, const char* string)
+{
+    append(buffer, string, strlen(string) + 1);
+}
+
+static void
+append_uleb128(struct elf_buffer* buffer, uint64_t value)
+{
+    do {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        append_u8(buffer, byte | (value ? 0x80 : 0));
+    } while (value);
+}
+
+static void
+append_sleb128(struct elf_buffer* buffer, int64_t value)
+{
+    bool more = true;
+    while (more) {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        more = !((value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40)));
+        append_u8(buffer, byte | (more ? 0x80 : 0));
+    }
+}
+
+static void
+append_padding(struct elf_buffer* buffer, size_t alignment, uint8_t padding)
+{
+    while (buffer->size % alignment) {
+        append_u8(buffer, padding);
+    }
+}
+
+// Fill in a (length) field that was appended before the data that it describes.
+static void
+patch_u32(struct elf_buffer* buffer, size_t offset, uint32_t value)
+{
+    if (!buffer->failed) {
+        memcpy(buffer->data + offset, &value, sizeof(value));
+    }
+}
+
+/**
+ * @brief Write a CIE and an FDE that covers all of the JIT'd code with the JIT's unwind rules.
+ */
+static void
+write_eh_frame(struct elf_buffer* buffer, size_t code_size, const struct ubpf_jit_result* result)
+{
+    size_t cie_start = buffer->size;
+    append_u32(buffer, 0); // Length (patched below).
+    append_u32(buffer, 0); // CIE id.
+    append_u8(buffer, 1);  // Version.
+    append_string(buffer, "zR");
+    append_uleb128(buffer, 1); // Code alignment factor.
+    append_sleb128(buffer, -DATA_ALIGNMENT);
+    append_u8(buffer, DWARF_RETURN_ADDRESS_COLUMN);
+    append_uleb128(buffer, 1); // Augmentation data length.
+    // The FDE describes its code relative to the start of the .text section (the JIT'd code).
+    append_u8(buffer, DW_EH_PE_textrel | DW_EH_PE_udata4);
+    append_padding(buffer, sizeof(uint64_t), DW_CFA_nop);
+    patch_u32(buffer, cie_start, (uint32_t)(buffer->size - cie_start - sizeof(uint32_t)));
+
+    size_t fde_start = buffer->size;
+    append_u32(buffer, 0); // Length (patched below).
+    append_u32(buffer, (uint32_t)(buffer->size - cie_start));
+    append_u32(buffer, 0); // Initial location.
+    append_u32(buffer, (uint32_t)code_size);
+    append_uleb128(buffer, 0); // Augmentation data length.
+    uint32_t location = 0;
+    for (uint32_t i = 0; i < result->num_unwind_rules; i++) {
+        const struct ubpf_jit_unwind_rule* rule = &result->unwind_rules[i];
+        if (rule->offset > location) {
+            append_u8(buffer, DW_CFA_advance_loc4);
+            append_u32(buffer, rule->offset - location);
+            location = rule->offset;
+        }
+        if (rule->kind == UnwindCfa) {
+            append_u8(buffer, DW_CFA_def_cfa);
+            append_uleb128(buffer, rule->dwarf_register);
+            append_uleb128(buffer, rule->cfa_offset);
+        } else {
+            append_u8(buffer, DW_CFA_offset | rule->dwarf_register);
+            append_uleb128(buffer, rule->cfa_offset / DATA_ALIGNMENT);
+        }
+    }
+    append_padding(buffer, sizeof(uint64_t), DW_CFA_nop);
+    patch_u32(buffer, fde_start, (uint32_t)(buffer->size - fde_start - sizeof(uint32_t)));
+    append_u32(buffer, 0); // Terminator.
+}
+
+static void
+write_debug_abbrev(struct elf_buffer* buffer)
+{
+    append_uleb128(buffer, 1);
+    append_uleb128(buffer, DW_TAG_compile_unit);
+    append_u8(buffer, DW_CHILDREN_no);
+    append_uleb128(buffer, DW_AT_name);
+    append_uleb128(buffer, DW_FORM_string);
+    append_uleb128(buffer, DW_AT_low_pc);
+    append_uleb128(buffer, DW_FORM_addr);
+    append_uleb128(buffer, DW_AT_high_pc);
+    append_uleb128(buffer, DW_FORM_addr);
+    append_uleb128(buffer, DW_AT_stmt_list);
+    append_uleb128(buffer, DW_FORM_data4);
+    append_uleb128(buffer, 0);
+    append_uleb128(buffer, 0);
+    append_uleb128(buffer, 0);
+}
+
+static void
+write_debug_info(struct elf_buffer* buffer, const char* file_name, const uint8_t* code, size_t code_size)
+{
+    size_t start = buffer->size;
+    append_u32(buffer, 0); // Length (patched below).
+    append_u16(buffer, 2); // DWARF version.
+    append_u32(buffer, 0); // Offset of the abbreviations.
+    append_u8(buffer, sizeof(uint64_t));
+    append_uleb128(buffer, 1); // The compile unit.
+    append_string(buffer, file_name);
+    append_u64(buffer, (uint64_t)(uintptr_t)code);
+    append_u64(buffer, (uint64_t)(uintptr_t)(code + code_size));
+    append_u32(buffer, 0); // Offset of the line table.
+    patch_u32(buffer, start, (uint32_t)(buffer->size - start - sizeof(uint32_t)));
+}
+
+/**
+ * @brief Write a line table in which line N of the file holds the eBPF instruction at PC N - 1.
+ */
+static void
+write_debug_line(
+    struct elf_buffer* buffer, const struct ubpf_vm* vm, const char* file_name, const uint8_t* code, size_t code_size,
+    const uint32_t* pc_locs)
+{
+    static const uint8_t standard_opcode_lengths[] = {0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1};
+
+    size_t start = buffer->size;
+    append_u32(buffer, 0); // Length (patched below).
+    append_u16(buffer, 2); // DWARF version.
+    size_t header_start = buffer->size;
+    append_u32(buffer, 0); // Header length (patched below).
+    append_u8(buffer, 1);  // Minimum instruction length.
+    append_u8(buffer, 1);  // Default is_stmt.
+    append_u8(buffer, (uint8_t)-5); // Line base.
+    append_u8(buffer, 14);          // Line range.
+    append_u8(buffer, sizeof(standard_opcode_lengths) + 1);
+    append(buffer, standard_opcode_lengths, sizeof(standard_opcode_lengths));
+    append_u8(buffer, 0); // No include directories.
+    append_string(buffer, file_name);
+    append_uleb128(buffer, 0); // Directory.
+    append_uleb128(buffer, 0); // Modification time.
+    append_uleb128(buffer, 0); // Length.
+    append_u8(buffer, 0);      // End of the file names.
+    patch_u32(buffer, header_start, (uint32_t)(buffer->size - header_start - sizeof(uint32_t)));
+
+    // The prologue is attributed to the first instruction.
+    append_u8(buffer, 0);
+    append_uleb128(buffer, 1 + sizeof(uint64_t));
+    append_u8(buffer, DW_LNE_set_address);
+    append_u64(buffer, (uint64_t)(uintptr_t)code);
+    append_u8(buffer, DW_LNS_copy);
+
+    uint32_t location = 0;
+    uint32_t line = 1;
+    for (uint32_t pc = 0; pc_locs && pc < vm->num_insts; pc++) {
+        if (pc_locs[pc] > location) {
+            append_u8(buffer, DW_LNS_advance_pc);
+            append_uleb128(buffer, pc_locs[pc] - location);
+            location = pc_locs[pc];
+        }
+        if (pc + 1 != line) {
+            append_u8(buffer, DW_LNS_advance_line);
+            append_sleb128(buffer, (int64_t)pc + 1 - line);
+            line = pc + 1;
+        }
+        append_u8(buffer, DW_LNS_copy);
+        // The second half of an LDDW has no code of its own.
+        if (ubpf_fetch_instruction(vm, pc).opcode == EBPF_OP_LDDW) {
+            pc++;
+        }
+    }
+    append_u8(buffer, DW_LNS_advance_pc);
+    append_uleb128(buffer, code_size - location);
+    append_u8(buffer, 0);
+    append_uleb128(buffer, 1);
+    append_u8(buffer, DW_LNE_end_sequence);
+    patch_u32(buffer, start, (uint32_t)(buffer->size - start - sizeof(uint32_t)));
+}
+
+static void
+write_symtab(struct elf_buffer* buffer, size_t code_size)
+{
+    Elf64_Sym symbols[3] = {0};
+    // The name of the file symbol and the program symbol are the first and second strings of .strtab.
+    symbols[1].st_name = 1;
+    symbols[1].st_info = ELF64_ST_INFO(STB_LOCAL, STT_FILE);
+    symbols[1].st_shndx = SHN_ABS;
+    symbols[2].st_name = 1 + strlen("ubpf") + 1;
+    symbols[2].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+    symbols[2].st_shndx = SectionText;
+    symbols[2].st_size = code_size;
+    append(buffer, symbols, sizeof(symbols));
+}
+
+/**
+ * @brief Build the ELF object that describes the JIT'd code.
+ *
+ * @return The ELF object (in a buffer that the caller must free) or NULL on failure.
+ */
+static uint8_t*
+build_elf_object(
+    const struct ubpf_vm* vm, const uint8_t* code, size_t code_size, const struct ubpf_jit_result* result, size_t* size)
+{
+    struct elf_buffer buffer = {0};
+    Elf64_Shdr headers[SectionCount] = {0};
+
+    size_t file_name_size = strlen(vm->jit_perf_name) + strlen(".ebpf") + 1;
+    char* file_name = malloc(file_name_size);
+    if (!file_name) {
+        return NULL;
+    }
+    snprintf(file_name, file_name_size, "%s.ebpf", vm->jit_perf_name);
+
+    Elf64_Ehdr header = {0};
+    append(&buffer, &header, sizeof(header));
+
+    for (int section = SectionText; section < SectionCount; section++) {
+        append_padding(&buffer, sizeof(uint64_t), 0);
+        size_t start = buffer.size;
+        switch (section) {
+        case SectionText:
+            // The code itself is not part of the object: the section describes the JIT'd code in place.
+            headers[section].sh_type = SHT_NOBITS;
+            headers[section].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+            headers[section].sh_addr = (uint64_t)(uintptr_t)code;
+            headers[section].sh_addralign = 16;
+            break;
+        case SectionEhFrame:
+            write_eh_frame(&buffer, code_size, result);
+            headers[section].sh_type = SHT_PROGBITS;
+            headers[section].sh_flags = SHF_ALLOC;
+            headers[section].sh_addralign = sizeof(uint64_t);
+            break;
+        case SectionDebugAbbrev:
+            write_debug_abbrev(&buffer);
+            headers[section].sh_type = SHT_PROGBITS;
+            break;
+        case SectionDebugInfo:
+            write_debug_info(&buffer, file_name, code, code_size);
+            headers[section].sh_type = SHT_PROGBITS;
+            break;
+        case SectionDebugLine:
+            write_debug_line(&buffer, vm, file_name, code, code_size, result->pc_locs);
+            headers[section].sh_type = SHT_PROGBITS;
+            break;
+        case SectionSymtab:
+            write_symtab(&buffer, code_size);
+            headers[section].sh_type = SHT_SYMTAB;
+            headers[section].sh_link = SectionStrtab;
+            headers[section].sh_info = 2; // The index of the first global symbol.
+            headers[section].sh_entsize = sizeof(Elf64_Sym);
+            headers[section].sh_addralign = sizeof(uint64_t);
+            break;
+        case SectionStrtab:
+            append_u8(&buffer, 0);
+            append_string(&buffer, "ubpf");
+            append(&buffer, "ubpf:", strlen("ubpf:"));
+            append_string(&buffer, vm->jit_perf_name);
+            headers[section].sh_type = SHT_STRTAB;
+            break;
+        case SectionShstrtab:
+            for (int name = 0; name < SectionCount; name++) {
+                headers[name].sh_name = (uint32_t)(buffer.size - start);
+                append_string(&buffer, section_names[name]);
+            }
+            headers[section].sh_type = SHT_STRTAB;
+            break;
+        }
+        headers[section].sh_offset = start;
+        headers[section].sh_size = section == SectionText ? code_size : buffer.size - start;
+        if (!headers[section].sh_addralign) {
+            headers[section].sh_addralign = 1;
+        }
+    }
+    free(file_name);
+
+    append_padding(&buffer, sizeof(uint64_t), 0);
+    memcpy(header.e_ident, ELFMAG, SELFMAG);
+    header.e_ident[EI_CLASS] = ELFCLASS64;
+    header.e_ident[EI_DATA] = ELFDATA2LSB;
+    header.e_ident[EI_VERSION] = EV_CURRENT;
+    header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    header.e_type = ET_REL;
+    header.e_machine = ELF_MACHINE;
+    header.e_version = EV_CURRENT;
+    header.e_shoff = buffer.size;
+    header.e_ehsize = sizeof(header);
+    header.e_shentsize = sizeof(Elf64_Shdr);
+    header.e_shnum = SectionCount;
+    header.e_shstrndx = SectionShstrtab;
+    append(&buffer, headers, sizeof(headers));
+
+    if (buffer.failed) {
+        free(buffer.data);
+        return NULL;
+    }
+    memcpy(buffer.data, &header, sizeof(header));
+    *size = buffer.size;
+    return buffer.data;
+}
+
+bool
+ubpf_jit_gdb_register(struct ubpf_vm* vm, const uint8_t* code, size_t code_size, const struct ubpf_jit_result* result)
+{
+    ubpf_jit_gdb_unregister(vm);
+
+    struct jit_code_entry* entry = calloc(1, sizeof(*entry));
+    if (!entry) {
+        return false;
+    }
+    size_t symfile_size = 0;
+    entry->symfile_addr = (const char*)build_elf_object(vm, code, code_size, result, &symfile_size);
+    entry->symfile_size = symfile_size;
+    if (!entry->symfile_addr) {
+        free(entry);
+        return false;
+    }
+
+    lock_jit_debug_descriptor();
+    entry->next_entry = __jit_debug_descriptor.first_entry;
+    if (entry->next_entry) {
+        entry->next_entry->prev_entry = entry;
+    }
+    __jit_debug_descriptor.first_entry = entry;
+    __jit_debug_descriptor.relevant_entry = entry;
+    __jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+    __jit_debug_register_code();
+    unlock_jit_debug_descriptor();
+
+    vm->jit_debug_entry = entry;
+    return true;
+}
+
+void
+ubpf_jit_gdb_unregister(struct ubpf_vm* vm)
+{
+    struct jit_code_entry* entry = vm->jit_debug_entry;
+    if (!entry) {
+        return;
+    }
+
+    lock_jit_debug_descriptor();
+    if (entry->prev_entry) {
+        entry->prev_entry->next_entry = entry->next_entry;
+    } else {
+        __jit_debug_descriptor.first_entry = entry->next_entry;
+    }
+    if (entry->next_entry) {
+        entry->next_entry->prev_entry = entry->prev_entry;
+    }
+    __jit_debug_descriptor.relevant_entry = entry;
+    __jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+    __jit_debug_register_code();
+    unlock_jit_debug_descriptor();
+
+    free((void*)entry->symfile_addr);
+    free(entry);
+    vm->jit_debug_entry = NULL;
+}
+#else
+bool
+ubpf_jit_gdb_register(struct ubpf_vm* vm, const uint8_t* code, size_t code_size, const struct ubpf_jit_result* result)
+{
+    UNUSED_PARAMETER(vm);
+    UNUSED_PARAMETER(code);
+    UNUSED_PARAMETER(code_size);
+    UNUSED_PARAMETER(result);
+    return false;
+}
+
+void
+ubpf_jit_gdb_unregister(struct ubpf_vm* vm)
+{
+    UNUSED_PARAMETER(vm);
+}
+#endif
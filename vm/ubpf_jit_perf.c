@@ -0,0 +1,329 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+// This file contains the support for describing JIT'd programs to the Linux perf tool:
+// entries in the perf map (/tmp/perf-<pid>.map) that name the JIT'd code and records in
+// a jitdump file (see tools/perf/Documentation/jitdump-specification.txt in the Linux
+// sources) that also carry the code and a table mapping native addresses to eBPF PCs.
+
+#define _GNU_SOURCE
+#include "ubpf_int.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JITDUMP_CODE_LOAD 0
+#define JITDUMP_CODE_DEBUG_INFO 2
+
+struct jitdump_file_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+};
+
+struct jitdump_record_header
+{
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+};
+
+struct jitdump_code_load
+{
+    struct jitdump_record_header header;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+    // Followed by the (NUL-terminated) name of the code and the code itself.
+};
+
+struct jitdump_debug_info
+{
+    struct jitdump_record_header header;
+    uint64_t code_addr;
+    uint64_t nr_entry;
+    // Followed by nr_entry jitdump_debug_entry records.
+};
+
+struct jitdump_debug_entry
+{
+    uint64_t code_addr;
+    uint32_t line;
+    uint32_t discrim;
+    // Followed by the (NUL-terminated) name of the source file.
+};
+
+enum jitdump_state
+{
+    JitdumpUninitialized,
+    JitdumpInitializing,
+    JitdumpReady,
+    JitdumpFailed,
+};
+
+static int jitdump_state = JitdumpUninitialized;
+static int jitdump_fd = -1;
+static uint64_t jitdump_code_index = 0;
+
+static uint64_t
+perf_timestamp(void)
+{
+    // perf record must be given -k 1 (CLOCK_MONOTONIC) to correlate its samples with these timestamps.
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static const char*
+jitdump_directory(void)
+{
+    const char* directory = getenv("JITDUMPDIR");
+    return directory ? directory : "/tmp";
+}
+
+/**
+ * @brief Create this process' jitdump file (once).
+ *
+ * perf record notices the jitdump file because the file is mmap'd executable; perf
+ * inject --jit then finds it through that mapping.
+ *
+ * @return True if the jitdump file can be written; false, otherwise.
+ */
+static bool
+jitdump_open(void)
+{
+    int expected = JitdumpUninitialized;
+    if (__atomic_compare_exchange_n(
+            &jitdump_state, &expected, JitdumpInitializing, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/jit-%d.dump", jitdump_directory(), (int)getpid());
+        int fd = open(path, O_CREAT | O_TRUNC | O_RDWR | O_APPEND | O_CLOEXEC, 0666);
+
+        struct jitdump_file_header header = {
+            .magic = JITDUMP_MAGIC,
+            .version = JITDUMP_VERSION,
+            .total_size = sizeof(header),
+#if defined(__x86_64__)
+            .elf_mach = EM_X86_64,
+#elif defined(__aarch64__)
+            .elf_mach = EM_AARCH64,
+#endif
+            .pid = (uint32_t)getpid(),
+            .timestamp = perf_timestamp(),
+        };
+
+        bool ready = fd >= 0 && write(fd, &header, sizeof(header)) == sizeof(header) &&
+                     mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0) != MAP_FAILED;
+        if (ready) {
+            jitdump_fd = fd;
+        } else if (fd >= 0) {
+            close(fd);
+        }
+        __atomic_store_n(&jitdump_state, ready ? JitdumpReady : JitdumpFailed, __ATOMIC_RELEASE);
+    }
+
+    while ((expected = __atomic_load_n(&jitdump_state, __ATOMIC_ACQUIRE)) == JitdumpInitializing) {
+    }
+    return expected == JitdumpReady;
+}
+
+/**
+ * @brief Write a listing of the program's instructions (one per line, so that line N
+ * holds the instruction at PC N - 1) for perf annotate to show next to the JIT'd code.
+ *
+ * @param[in] vm The VM whose program is listed.
+ * @param[in] path The path of the listing.
+ * @return True if the listing was written; false, otherwise.
+ */
+static bool
+write_listing(const struct ubpf_vm* vm, const char* path)
+{
+    FILE* listing = fopen(path, "w");
+    if (!listing) {
+        return false;
+    }
+    for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        struct ebpf_inst next = {0};
+        if (inst.opcode == EBPF_OP_LDDW && pc + 1 < vm->num_insts) {
+            next = ubpf_fetch_instruction(vm, pc + 1);
+        }
+        ubpf_disassemble_instruction(listing, inst, next);
+        fprintf(listing, "\n");
+        if (inst.opcode == EBPF_OP_LDDW) {
+            fprintf(listing, "; (second half of lddw)\n");
+            pc++;
+        }
+    }
+    return fclose(listing) == 0;
+}
+
+static bool
+jitdump_record(const struct ubpf_vm* vm, const uint8_t* code, size_t code_size, const uint32_t* pc_locs)
+{
+    if (!jitdump_open()) {
+        return false;
+    }
+
+    uint64_t code_index = __atomic_fetch_add(&jitdump_code_index, 1, __ATOMIC_RELAXED);
+    char listing_path[4096];
+    snprintf(
+        listing_path,
+        sizeof(listing_path),
+        "%s/ubpf-%d-%llu-%s.ebpf",
+        jitdump_directory(),
+        (int)getpid(),
+        (unsigned long long)code_index,
+        vm->jit_perf_name);
+    size_t listing_path_size = strlen(listing_path) + 1;
+    size_t name_size = strlen(vm->jit_perf_name) + strlen("ubpf:") + 1;
+
+    // The debug info record (which must precede the code it describes) ...
+    size_t num_entries = 0;
+    if (pc_locs && write_listing(vm, listing_path)) {
+        num_entries = vm->num_insts;
+    }
+    size_t debug_info_size =
+        sizeof(struct jitdump_debug_info) + num_entries * (sizeof(struct jitdump_debug_entry) + listing_path_size);
+    // ... and the code load record.
+    size_t code_load_size = sizeof(struct jitdump_code_load) + name_size + code_size;
+
+    uint8_t* records = calloc(1, debug_info_size + code_load_size);
+    if (!records) {
+        return false;
+    }
+
+    uint64_t timestamp = perf_timestamp();
+    uint8_t* cursor = records;
+    size_t written_entries = 0;
+    if (num_entries) {
+        cursor += sizeof(struct jitdump_debug_info);
+        for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+            struct jitdump_debug_entry entry = {
+                .code_addr = (uint64_t)(uintptr_t)(code + pc_locs[pc]),
+                .line = pc + 1,
+            };
+            memcpy(cursor, &entry, sizeof(entry));
+            memcpy(cursor + sizeof(entry), listing_path, listing_path_size);
+            cursor += sizeof(entry) + listing_path_size;
+            written_entries++;
+            if (ubpf_fetch_instruction(vm, pc).opcode == EBPF_OP_LDDW) {
+                pc++;
+            }
+        }
+        struct jitdump_debug_info debug_info = {
+            .header = {JITDUMP_CODE_DEBUG_INFO, (uint32_t)(cursor - records), timestamp},
+            .code_addr = (uint64_t)(uintptr_t)code,
+            .nr_entry = written_entries,
+        };
+        memcpy(records, &debug_info, sizeof(debug_info));
+    }
+
+    struct jitdump_code_load code_load = {
+        .header = {JITDUMP_CODE_LOAD, (uint32_t)code_load_size, timestamp},
+        .pid = (uint32_t)getpid(),
+        .tid = (uint32_t)syscall(SYS_gettid),
+        .vma = (uint64_t)(uintptr_t)code,
+        .code_addr = (uint64_t)(uintptr_t)code,
+        .code_size = code_size,
+        .code_index = code_index,
+    };
+    memcpy(cursor, &code_load, sizeof(code_load));
+    cursor += sizeof(code_load);
+    cursor += snprintf((char*)cursor, name_size, "ubpf:%s", vm->jit_perf_name) + 1;
+    memcpy(cursor, code, code_size);
+    cursor += code_size;
+
+    // A single write to a file opened with O_APPEND keeps concurrent records intact.
+    size_t total_size = cursor - records;
+    bool success = write(jitdump_fd, records, total_size) == (ssize_t)total_size;
+    free(records);
+    return success;
+}
+
+static bool
+perf_map_record(const struct ubpf_vm* vm, const uint8_t* code, size_t code_size)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    FILE* map = fopen(path, "a");
+    if (!map) {
+        return false;
+    }
+    fprintf(map, "%llx %zx ubpf:%s\n", (unsigned long long)(uintptr_t)code, code_size, vm->jit_perf_name);
+    return fclose(map) == 0;
+}
+#endif
+
+int
+ubpf_set_jit_perf_output(struct ubpf_vm* vm, unsigned int outputs, const char* name)
+{
+#if !defined(__linux__)
+    // perf reads its map and jitdump files only on Linux.
+    if (outputs & (JitPerfMap | JitPerfDump)) {
+        return -1;
+    }
+#endif
+#if !(defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__)))
+    // The JIT'd code is only described to the GDB JIT interface as an ELF object for the JITs on Linux (see
+    // ubpf_jit_gdb.c).
+    if (outputs & JitGdbInterface) {
+        return -1;
+    }
+#endif
+    if (!name) {
+        name = "program";
+    }
+    size_t name_size = strlen(name) + 1;
+    char* name_copy = malloc(name_size);
+    if (!name_copy) {
+        return -1;
+    }
+    memcpy(name_copy, name, name_size);
+    free(vm->jit_perf_name);
+    vm->jit_perf_name = name_copy;
+    vm->jit_perf_outputs = outputs;
+    return 0;
+}
+
+bool
+ubpf_jit_perf_record(struct ubpf_vm* vm, const uint8_t* code, size_t code_size, const struct ubpf_jit_result* result)
+{
+    bool success = true;
+#if defined(__linux__)
+    if (vm->jit_perf_outputs & JitPerfMap) {
+        success &= perf_map_record(vm, code, code_size);
+    }
+    if (vm->jit_perf_outputs & JitPerfDump) {
+        success &= jitdump_record(vm, code, code_size, result->pc_locs);
+    }
+#endif
+    if (vm->jit_perf_outputs & JitGdbInterface) {
+        success &= ubpf_jit_gdb_register(vm, code, code_size, result);
+    }
+    return success;
+}
+
+void
+ubpf_jit_perf_release(struct ubpf_vm* vm)
+{
+    ubpf_jit_gdb_unregister(vm);
+}
@@ -29,6 +29,7 @@ initialize_jit_state_result(
     struct ubpf_jit_result* compile_result,
     uint8_t* buffer,
     uint32_t size,
+    uint32_t num_insts,
     enum JitMode jit_mode,
     char** errmsg)
 {
@@ -36,24 +37,41 @@ initialize_jit_state_result(
     compile_result->errmsg = NULL;
     compile_result->external_dispatcher_offset = 0;
     compile_result->jit_mode = jit_mode;
+    compile_result->pc_locs = NULL;
+    compile_result->unwind_rules = NULL;
+    compile_result->num_unwind_rules = 0;
+    compile_result->static_dispatch = false;
+    compile_result->static_dispatcher = false;
+    compile_result->instruction_limit = 0;
+    compile_result->runtime_stats = false;
+    compile_result->helper_latency = false;
+    compile_result->profiling = false;
 
     state->offset = 0;
     state->size = size;
     state->buf = buffer;
-    state->pc_locs = calloc(UBPF_MAX_INSTS + 1, sizeof(state->pc_locs[0]));
-    state->jumps = calloc(UBPF_MAX_INSTS, sizeof(state->jumps[0]));
-    state->loads = calloc(UBPF_MAX_INSTS, sizeof(state->loads[0]));
-    state->leas = calloc(UBPF_MAX_INSTS, sizeof(state->leas[0]));
-    state->local_calls = calloc(UBPF_MAX_INSTS, sizeof(state->local_calls[0]));
+    state->pc_locs = calloc(num_insts + 1, sizeof(state->pc_locs[0]));
+    state->jumps = NULL;
+    state->loads = NULL;
+    state->leas = NULL;
+    state->local_calls = NULL;
     state->num_jumps = 0;
     state->num_loads = 0;
     state->num_leas = 0;
     state->num_local_calls = 0;
+    state->jumps_capacity = 0;
+    state->loads_capacity = 0;
+    state->leas_capacity = 0;
+    state->local_calls_capacity = 0;
     state->jit_status = NoError;
     state->jit_mode = jit_mode;
     state->bpf_function_prolog_size = 0;
+    state->budget_exhausted_loc = 0;
+    state->budget_charges = NULL;
+    state->instruction_budget = 0;
+    state->num_unwind_rules = 0;
 
-    if (!state->pc_locs || !state->jumps || !state->loads || !state->leas) {
+    if (!state->pc_locs) {
         *errmsg = ubpf_error("Could not allocate space needed to JIT compile eBPF program");
         return -1;
     }
@@ -75,27 +93,105 @@ release_jit_state_result(struct jit_state* state, struct ubpf_jit_result* compil
     state->leas = NULL;
     free(state->local_calls);
     state->local_calls = NULL;
+    free(state->budget_charges);
+    state->budget_charges = NULL;
 }
 
-void
-emit_patchable_relative(struct patchable_relative* table,
-    uint32_t offset, struct PatchableTarget target, size_t index)
+int
+calculate_instruction_budget_charges(struct jit_state* state, const struct ubpf_vm* vm, char** errmsg)
 {
-    struct patchable_relative* jump = &table[index];
+    state->budget_charges = NULL;
+    state->instruction_budget = vm->instruction_limit;
+
+    // A program that cannot execute more instructions than the limit needs no budget.
+    if (!vm->instruction_limit || ubpf_program_terminates(vm)) {
+        return 0;
+    }
+
+    bool needs_budget = false;
+    for (uint32_t pc = 0; pc < vm->num_insts && !needs_budget; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        if (inst.opcode == EBPF_OP_LDDW) {
+            pc++;
+        } else if (inst.opcode == EBPF_OP_CALL) {
+            needs_budget = inst.src == 1;
+        } else if (ubpf_instruction_is_backward_jump(inst)) {
+            needs_budget = true;
+        }
+    }
+
+    if (!needs_budget) {
+        return 0;
+    }
+
+    uint32_t* charges = calloc(vm->num_insts, sizeof(charges[0]));
+    uint32_t* function_lengths = calloc(vm->num_insts, sizeof(function_lengths[0]));
+    if (!charges || !function_lengths) {
+        free(charges);
+        free(function_lengths);
+        *errmsg = ubpf_error("Could not allocate space needed to JIT compile eBPF program");
+        return -1;
+    }
+
+    // A local function extends until the next one begins.
+    uint32_t next_function_start = vm->num_insts;
+    for (int pc = vm->num_insts - 1; pc >= 0; pc--) {
+        if (pc == 0 || vm->int_funcs[pc]) {
+            function_lengths[pc] = next_function_start - pc;
+            next_function_start = pc;
+        }
+    }
+
+    for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        if (inst.opcode == EBPF_OP_LDDW) {
+            pc++;
+        } else if (inst.opcode == EBPF_OP_CALL && inst.src == 1) {
+            charges[pc] = 1 + function_lengths[pc + inst.imm + 1];
+        } else if (ubpf_instruction_is_backward_jump(inst)) {
+            charges[pc] = -inst.offset;
+        }
+    }
+
+    free(function_lengths);
+    state->budget_charges = charges;
+    return 0;
+}
+
+bool
+emit_patchable_relative(
+    struct patchable_relative** table, int* num_entries, int* capacity, uint32_t offset, struct PatchableTarget target)
+{
+    if (*num_entries == *capacity) {
+        int new_capacity = *capacity ? *capacity * 2 : 16;
+        struct patchable_relative* new_table = realloc(*table, new_capacity * sizeof(struct patchable_relative));
+        if (!new_table) {
+            return false;
+        }
+        *table = new_table;
+        *capacity = new_capacity;
+    }
+
+    struct patchable_relative* jump = &(*table)[(*num_entries)++];
     jump->offset_loc = offset;
     jump->target = target;
+    return true;
 }
 
 void
 note_load(struct jit_state* state, struct PatchableTarget target)
 {
-    emit_patchable_relative(state->loads, state->offset, target, state->num_loads++);
+    if (!emit_patchable_relative(&state->loads, &state->num_loads, &state->loads_capacity, state->offset, target)) {
+        state->jit_status = OutOfMemory;
+    }
 }
 
 void
 note_lea(struct jit_state* state, struct PatchableTarget target)
 {
-    emit_patchable_relative(state->leas, state->offset, target, state->num_leas++);
+    if (!emit_patchable_relative(&state->leas, &state->num_leas, &state->leas_capacity, state->offset, target)) {
+        state->jit_status = OutOfMemory;
+    }
 }
 
 void
@@ -117,3 +213,48 @@ emit_jump_target(struct jit_state* state, uint32_t jump_src)
 
     modify_patchable_relatives_target(state->jumps, state->num_jumps, jump_src, pt);
 }
+
+/**
+ * @brief Append a rule to the call frame information of the JIT'd code at the current offset.
+ */
+static void
+record_unwind_rule(struct jit_state* state, enum UnwindRuleKind kind, uint8_t dwarf_register, uint32_t cfa_offset)
+{
+    // The prologue and epilogue of both JITs need far fewer rules than the table holds.
+    if (state->num_unwind_rules == UBPF_MAX_UNWIND_RULES) {
+        return;
+    }
+    struct ubpf_jit_unwind_rule* rule = &state->unwind_rules[state->num_unwind_rules++];
+    rule->offset = state->offset;
+    rule->kind = kind;
+    rule->dwarf_register = dwarf_register;
+    rule->cfa_offset = cfa_offset;
+}
+
+void
+record_unwind_cfa(struct jit_state* state, uint8_t dwarf_register, uint32_t cfa_offset)
+{
+    record_unwind_rule(state, UnwindCfa, dwarf_register, cfa_offset);
+}
+
+void
+record_unwind_saved_register(struct jit_state* state, uint8_t dwarf_register, uint32_t cfa_offset)
+{
+    record_unwind_rule(state, UnwindSavedRegister, dwarf_register, cfa_offset);
+}
+
+void
+retain_jit_debug_info(struct jit_state* state, struct ubpf_jit_result* compile_result)
+{
+    compile_result->pc_locs = state->pc_locs;
+    state->pc_locs = NULL;
+
+    compile_result->unwind_rules = calloc(state->num_unwind_rules, sizeof(compile_result->unwind_rules[0]));
+    if (compile_result->unwind_rules) {
+        memcpy(
+            compile_result->unwind_rules,
+            state->unwind_rules,
+            state->num_unwind_rules * sizeof(compile_result->unwind_rules[0]));
+        compile_result->num_unwind_rules = state->num_unwind_rules;
+    }
+}
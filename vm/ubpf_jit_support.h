@@ -31,10 +31,7 @@
 enum JitProgress
 {
     NoError,
-    TooManyJumps,
-    TooManyLoads,
-    TooManyLeas,
-    TooManyLocalCalls,
+    OutOfMemory,
     NotEnoughSpace,
     UnexpectedInstruction,
     UnknownInstruction
@@ -58,6 +55,7 @@ enum SpecialTarget
     Retpoline,
     ExternalDispatcher,
     LoadHelperTable,
+    BudgetExhausted,
 };
 
 struct RegularTarget
@@ -116,12 +114,15 @@ struct patchable_relative
     struct PatchableTarget target;
 };
 
+/* The maximum number of call frame information rules recorded for JIT'd code. */
+#define UBPF_MAX_UNWIND_RULES 32
+
 struct jit_state
 {
     uint8_t* buf;
     uint32_t offset;
     uint32_t size;
-    uint32_t* pc_locs;
+    uint32_t* pc_locs; /* One entry per eBPF instruction (and one past the end). */
     uint32_t exit_loc;
     uint32_t entry_loc;
     uint32_t unwind_loc;
@@ -144,8 +145,22 @@ struct jit_state
      * registered handler. See commentary in ubpf_jit_x86_64.c.
      */
     uint32_t helper_table_loc;
+    /* The offset (from the start of the JIT'd code) to the code that
+     * terminates the program when it exceeds its instruction budget.
+     */
+    uint32_t budget_exhausted_loc;
+    /* The number of instructions to charge against the instruction budget
+     * when control reaches each eBPF PC. NULL when the program does not
+     * need an instruction budget (see calculate_instruction_budget_charges).
+     */
+    uint32_t* budget_charges;
+    /* The instruction limit with which the instruction budget is initialized. */
+    int instruction_budget;
     enum JitProgress jit_status;
     enum JitMode jit_mode;
+    /* The patchable relative tables grow as entries are emitted (see
+     * emit_patchable_relative) so that their size tracks the program.
+     */
     struct patchable_relative* jumps;
     struct patchable_relative* loads;
     struct patchable_relative* leas;
@@ -154,8 +169,17 @@ struct jit_state
     int num_loads;
     int num_leas;
     int num_local_calls;
+    int jumps_capacity;
+    int loads_capacity;
+    int leas_capacity;
+    int local_calls_capacity;
     uint32_t stack_size;
     size_t bpf_function_prolog_size; // Count of bytes emitted at the start of the function.
+    /* The rules that describe how to unwind through the JIT'd code (recorded while the
+     * prologue and epilogue are emitted; see record_unwind_cfa).
+     */
+    struct ubpf_jit_unwind_rule unwind_rules[UBPF_MAX_UNWIND_RULES];
+    int num_unwind_rules;
 };
 
 int
@@ -164,24 +188,82 @@ initialize_jit_state_result(
     struct ubpf_jit_result* compile_result,
     uint8_t* buffer,
     uint32_t size,
+    uint32_t num_insts,
     enum JitMode jit_mode,
     char** errmsg);
 
 void
 release_jit_state_result(struct jit_state* state, struct ubpf_jit_result* compile_result);
 
+/** @brief Record that, from the current offset, the canonical frame address (CFA) of the
+ * JIT'd code's frame is the value of a register plus an offset.
+ *
+ * @param[in,out] state The JIT state.
+ * @param[in] dwarf_register The DWARF number of the register.
+ * @param[in] cfa_offset The offset.
+ */
+void
+record_unwind_cfa(struct jit_state* state, uint8_t dwarf_register, uint32_t cfa_offset);
+
+/** @brief Record that, from the current offset, the caller's value of a register is saved
+ * in the JIT'd code's frame.
+ *
+ * @param[in,out] state The JIT state.
+ * @param[in] dwarf_register The DWARF number of the register.
+ * @param[in] cfa_offset The location of the saved value below the CFA (a multiple of 8).
+ */
+void
+record_unwind_saved_register(struct jit_state* state, uint8_t dwarf_register, uint32_t cfa_offset);
+
+/** @brief Transfer the PC locations and unwind rules of a successful translation to its
+ * result so that the JIT'd code can be described to perf and debuggers.
+ *
+ * @param[in,out] state The JIT state.
+ * @param[out] compile_result The result of the translation.
+ */
+void
+retain_jit_debug_info(struct jit_state* state, struct ubpf_jit_result* compile_result);
+
+/** @brief Determine where JIT'd code must charge the VM's instruction budget.
+ *
+ * An eBPF program can only execute an instruction more than once by transferring control
+ * backward (a jump whose target is at or before the jump) or by calling a local function.
+ * Those are the only places where JIT'd code maintains the instruction budget: a backward
+ * jump is charged the length of the straight-line code it closes (from its target through
+ * the jump itself) and a local call is charged the length of the called function. A program
+ * that contains neither is loop free and JIT'd without a budget, as is a program that cannot
+ * execute more instructions than the limit (see ubpf_calculate_instruction_bound).
+ *
+ * The result is conservative: JIT'd code may exhaust its budget before the interpreter would
+ * exceed the same limit, but never executes (significantly) more instructions than the limit.
+ *
+ * @param[in,out] state The JIT state whose budget_charges and instruction_budget are set.
+ * @param[in] vm The VM whose loaded program and instruction limit are analyzed.
+ * @param[out] errmsg The error message, if there is an error.
+ * @retval 0 Success (state->budget_charges is NULL when no budget is needed).
+ * @retval -1 Failure.
+ */
+int
+calculate_instruction_budget_charges(struct jit_state* state, const struct ubpf_vm* vm, char** errmsg);
+
 /** @brief Add an entry to the given patchable relative table.
  *
  * Emitting an entry into the patchable relative table means that resolution of the target
  * address can be postponed until all the instructions are emitted. Note: This function does
  * not emit any instructions -- it simply updates metadata to guide resolution after code generation.
  * 
- * @param[in] table The relative patchable table to update.
+ * The table is grown as necessary.
+ *
+ * @param[in,out] table The relative patchable table to update.
+ * @param[in,out] num_entries The number of entries in the _table_.
+ * @param[in,out] capacity The number of entries for which the _table_ has space.
  * @param[in] offset The offset in the JIT'd code where the to-be-resolved target begins.
- * @param[in] index A spot in the _table_ to add/update according to the given parameters.
+ * @param[in] target The target to which the entry will be resolved.
+ * @return True if the entry was added, false if the table could not be grown.
  */
-void
-emit_patchable_relative(struct patchable_relative* table, uint32_t offset, struct PatchableTarget target, size_t index);
+bool
+emit_patchable_relative(
+    struct patchable_relative** table, int* num_entries, int* capacity, uint32_t offset, struct PatchableTarget target);
 
 void
 note_load(struct jit_state* state, struct PatchableTarget target);
@@ -57,6 +57,19 @@
 
 #define VOLATILE_CTXT 11
 
+// The DWARF numbers of the registers (for the call frame information of the JIT'd code).
+static const uint8_t dwarf_registers[] = {0, 2, 1, 3, 7, 6, 4, 5, 8, 9, 10, 11, 12, 13, 14, 15};
+#define DWARF_RETURN_ADDRESS 16
+
+// The (RBP-relative) location of the remaining instruction budget for programs that need one.
+#define INSTRUCTION_BUDGET_SLOT (-8)
+// The (RBP-relative) locations of the thread's runtime statistics, of the time at which
+// the run started and of the time at which the current call to a helper started (when the
+// VM collects runtime statistics).
+#define RUNTIME_STATS_BLOCK_SLOT (-16)
+#define RUNTIME_STATS_START_SLOT (-24)
+#define RUNTIME_STATS_HELPER_START_SLOT (-32)
+
 enum operand_size
 {
     S8,
@@ -189,12 +202,11 @@ emit_4byte_offset_placeholder(struct jit_state* state)
 static uint32_t
 emit_jump_address_reloc(struct jit_state* state, struct PatchableTarget target)
 {
-    if (state->num_jumps == UBPF_MAX_INSTS) {
-        state->jit_status = TooManyJumps;
+    uint32_t target_address_offset = state->offset;
+    if (!emit_patchable_relative(&state->jumps, &state->num_jumps, &state->jumps_capacity, state->offset, target)) {
+        state->jit_status = OutOfMemory;
         return 0;
     }
-    uint32_t target_address_offset = state->offset;
-    emit_patchable_relative(state->jumps, state->offset, target, state->num_jumps++);
     emit_4byte_offset_placeholder(state);
     return target_address_offset;
 }
@@ -202,12 +214,12 @@ emit_jump_address_reloc(struct jit_state* state, struct PatchableTarget target)
 static uint32_t
 emit_local_call_address_reloc(struct jit_state* state, struct PatchableTarget target)
 {
-    if (state->num_local_calls == UBPF_MAX_INSTS) {
-        state->jit_status = TooManyLocalCalls;
+    uint32_t target_address_offset = state->offset;
+    if (!emit_patchable_relative(
+            &state->local_calls, &state->num_local_calls, &state->local_calls_capacity, state->offset, target)) {
+        state->jit_status = OutOfMemory;
         return 0;
     }
-    uint32_t target_address_offset = state->offset;
-    emit_patchable_relative(state->local_calls, state->offset, target, state->num_local_calls++);
     emit_4byte_offset_placeholder(state);
     return target_address_offset;
 }
@@ -439,11 +451,6 @@ emit_load_imm(struct jit_state* state, int dst, int64_t imm)
 static uint32_t
 emit_rip_relative_load(struct jit_state* state, int dst, struct PatchableTarget load_tgt)
 {
-    if (state->num_loads == UBPF_MAX_INSTS) {
-        state->jit_status = TooManyLoads;
-        return 0;
-    }
-
     emit_rex(state, 1, 0, 0, 0);
     emit1(state, 0x8b);
     emit_modrm(state, 0, dst, 0x05);
@@ -458,11 +465,6 @@ emit_rip_relative_load(struct jit_state* state, int dst, struct PatchableTarget
 static void
 emit_rip_relative_lea(struct jit_state* state, int lea_dst_reg, struct PatchableTarget lea_tgt)
 {
-    if (state->num_leas == UBPF_MAX_INSTS) {
-        state->jit_status = TooManyLeas;
-        return;
-    }
-
     // lea dst, [rip + HELPER TABLE ADDRESS]
     emit_rex(state, 1, 1, 0, 0);
     emit1(state, 0x8d);
@@ -545,96 +547,12 @@ emit_pause(struct jit_state* state)
     emit1(state, 0x90);
 }
 
+/**
+ * @brief Pass the context as the 6th argument of a helper (or kfunc).
+ */
 static inline void
-emit_dispatched_external_helper_call(struct jit_state* state, unsigned int idx)
+emit_helper_context_argument(struct jit_state* state)
 {
-    /*
-     * Note: We do *not* have to preserve any x86-64 registers here ...
-     * ... according to the SystemV ABI: rbx (eBPF6),
-     *                                   r13 (eBPF7),
-     *                                   r14 (eBPF8),
-     *                                   r15 (eBPF9), and
-     *                                   rbp (eBPF10) are all preserved.
-     * ... according to the Windows ABI: r15 (eBPF6)
-     *                                   rdi (eBPF7),
-     *                                   rsi (eBPF8),
-     *                                   rbx (eBPF9), and
-     *                                   rbp (eBPF10) are all preserved.
-     *
-     * When we enter here, our stack is 16-byte aligned. Keep
-     * it that way!
-     */
-
-    /*
-     * There are two things that could happen:
-     * 1. The user has registered an external dispatcher and we need to
-     *    send control there to invoke an external helper.
-     * 2. The user is relying on the default dispatcher to pass control
-     *    to the registered external helper.
-     * To determine which action to take, we will first consider the 8
-     * bytes at TARGET_PC_EXTERNAL_DISPATCHER. If those 8 bytes have an
-     * address, that represents the address of the user-registered external
-     * dispatcher and we pass control there. That function signature looks like
-     * uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, unsigned int index, void* cookie
-     * so we make sure that the arguments are done properly depending on the abi.
-     *
-     * If there is no external dispatcher registered, the user is expected
-     * to have registered a handler with us for the helper with index idx.
-     * There is a table of MAX_ function pointers starting at TARGET_LOAD_HELPER_TABLE.
-     * Each of those functions has a signature that looks like
-     * uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, void* cookie
-     * We load the appropriate function pointer by using idx to index it and then
-     * make sure that the arguments are set properly depending on the abi.
-     */
-
-    // Save register where volatile context is stored.
-    emit_push(state, VOLATILE_CTXT);
-    emit_push(state, VOLATILE_CTXT);
-    // ^^ Stack is aligned here.
-
-#if defined(_WIN32)
-    /* Because we may need 24 bytes on the stack but at least 16, we have to take 32
-     * to keep alignment happy. We may ultimately need it all, but we certainly
-     * need 16! Later, though, there is a push that always happens (MARKER2), so
-     * we only allocate 24 here.
-     */
-    emit_alu64_imm32(state, 0x81, 5, RSP, 3 * sizeof(uint64_t));
-#endif
-
-    DECLARE_PATCHABLE_TARGET(rip_rel_tgt);
-    rip_rel_tgt.is_special = true;
-    rip_rel_tgt.target.special = ExternalDispatcher;
-    emit_rip_relative_load(state, RAX, rip_rel_tgt);
-
-    // cmp rax, 0
-    emit_cmp_imm32(state, RAX, 0);
-    // jne skip_default_dispatcher_label
-    DECLARE_PATCHABLE_TARGET(default_jmp_tgt);
-    default_jmp_tgt.is_special = false;
-    default_jmp_tgt.target.regular.ebpf_target_pc = 0;
-    uint32_t skip_default_dispatcher_source = emit_jcc(state, 0x85, default_jmp_tgt);
-
-    // Default dispatcher:
-
-    // Load the address of the helper function from the table.
-    // mov rax, idx
-    emit_alu32(state, 0xc7, 0, RAX);
-    emit4(state, idx);
-    // shl rax, 3 (i.e., multiply the index by 8 because addresses are that size on x86-64)
-    emit_alu64_imm8(state, 0xc1, 4, RAX, 3);
-
-    // lea r10, [rip + HELPER TABLE ADDRESS]
-    DECLARE_PATCHABLE_TARGET(rip_rel_load_helper_tgt);
-    rip_rel_load_helper_tgt.is_special = true;
-    rip_rel_load_helper_tgt.target.special = LoadHelperTable;
-    // emit_rip_relative_lea(state, R10, TARGET_LOAD_HELPER_TABLE);
-    emit_rip_relative_lea(state, R10, rip_rel_load_helper_tgt);
-
-    // add rax, r10
-    emit_alu64(state, 0x01, R10, RAX);
-    // load rax, [rax]
-    emit_load(state, S64, RAX, RAX, 0);
-
     // There is no index for the registered helper function. They just get
     // 5 arguments and a context, which becomes the 6th argument to the function ...
 #if defined(_WIN32)
@@ -649,15 +567,34 @@ emit_dispatched_external_helper_call(struct jit_state* state, unsigned int idx)
     // and goes in R9 on SystemV.
     emit_mov(state, VOLATILE_CTXT, R9);
 #endif
+}
 
-    // jmp call_label
-    uint32_t skip_external_dispatcher_source = emit_jmp(state, default_jmp_tgt);
+/**
+ * @brief Load the address of the helper in the given slot of the helper table into RAX
+ * and pass the context as its 6th argument.
+ */
+static inline void
+emit_helper_table_call_setup(struct jit_state* state, unsigned int slot)
+{
+    // lea r10, [rip + HELPER TABLE ADDRESS]
+    DECLARE_PATCHABLE_TARGET(rip_rel_load_helper_tgt);
+    rip_rel_load_helper_tgt.is_special = true;
+    rip_rel_load_helper_tgt.target.special = LoadHelperTable;
+    emit_rip_relative_lea(state, R10, rip_rel_load_helper_tgt);
 
-    // External dispatcher:
+    // load rax, [r10 + slot * 8] (addresses are 8 bytes on x86-64)
+    emit_load(state, S64, R10, RAX, slot * sizeof(uint64_t));
 
-    // skip_default_dispatcher_label:
-    emit_jump_target(state, skip_default_dispatcher_source);
+    emit_helper_context_argument(state);
+}
 
+/**
+ * @brief Pass the index of the helper and the context to the external dispatcher (whose
+ * address is already in RAX) as its 6th and 7th arguments.
+ */
+static inline void
+emit_external_dispatcher_call_setup(struct jit_state* state, unsigned int idx)
+{
     // Using an external dispatcher. They get a total of 7 arguments. The
     // 6th argument is the index of the function to call which ...
 
@@ -686,16 +623,41 @@ emit_dispatched_external_helper_call(struct jit_state* state, unsigned int idx)
     // and goes in R9 on SystemV.
     emit_load_imm(state, R9, (uint64_t)idx);
     // And the 7th is already spilled to the stack in the right spot because
-    // we wanted to save it -- cool (see MARKER1, above).
+    // we wanted to save it -- cool (see emit_dispatched_external_helper_call).
 
     // Intentional no-op for 7th argument.
 #endif
+}
 
-    // Control flow converges for call:
+/**
+ * @brief Save the context register and make room for the arguments of a call to a helper (or
+ * kfunc), whose address and 6th (and, for the dispatcher, 7th) argument are set up next.
+ */
+static inline void
+emit_external_call_prologue(struct jit_state* state)
+{
+    // Save register where volatile context is stored.
+    emit_push(state, VOLATILE_CTXT);
+    emit_push(state, VOLATILE_CTXT);
+    // ^^ Stack is aligned here.
 
-    // call_label:
-    emit_jump_target(state, skip_external_dispatcher_source);
+#if defined(_WIN32)
+    /* Because we may need 24 bytes on the stack but at least 16, we have to take 32
+     * to keep alignment happy. We may ultimately need it all, but we certainly
+     * need 16! Later, though, there is a push that always happens (MARKER2), so
+     * we only allocate 24 here.
+     */
+    emit_alu64_imm32(state, 0x81, 5, RSP, 3 * sizeof(uint64_t));
+#endif
+}
 
+/**
+ * @brief Call the helper (or kfunc) whose address is in RAX and restore the stack and the
+ * context register.
+ */
+static inline void
+emit_external_call_epilogue(struct jit_state* state)
+{
 #if defined(_WIN32)
     /* Windows x64 ABI spills 5th parameter to stack (MARKER2) */
     emit_push(state, map_register(5));
@@ -738,6 +700,116 @@ emit_dispatched_external_helper_call(struct jit_state* state, unsigned int idx)
     emit_pop(state, VOLATILE_CTXT); // Restore register where volatile context is stored.
 }
 
+static inline void
+emit_dispatched_external_helper_call(struct jit_state* state, struct ubpf_vm* vm, unsigned int idx, unsigned int slot)
+{
+    /*
+     * Note: We do *not* have to preserve any x86-64 registers here ...
+     * ... according to the SystemV ABI: rbx (eBPF6),
+     *                                   r13 (eBPF7),
+     *                                   r14 (eBPF8),
+     *                                   r15 (eBPF9), and
+     *                                   rbp (eBPF10) are all preserved.
+     * ... according to the Windows ABI: r15 (eBPF6)
+     *                                   rdi (eBPF7),
+     *                                   rsi (eBPF8),
+     *                                   rbx (eBPF9), and
+     *                                   rbp (eBPF10) are all preserved.
+     *
+     * When we enter here, our stack is 16-byte aligned. Keep
+     * it that way!
+     */
+
+    /*
+     * There are two things that could happen:
+     * 1. The user has registered an external dispatcher and we need to
+     *    send control there to invoke an external helper.
+     * 2. The user is relying on the default dispatcher to pass control
+     *    to the registered external helper.
+     * To determine which action to take, we will first consider the 8
+     * bytes at TARGET_PC_EXTERNAL_DISPATCHER. If those 8 bytes have an
+     * address, that represents the address of the user-registered external
+     * dispatcher and we pass control there. That function signature looks like
+     * uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, unsigned int index, void* cookie
+     * so we make sure that the arguments are done properly depending on the abi.
+     *
+     * If there is no external dispatcher registered, the user is expected
+     * to have registered a handler with us for the helper with index idx.
+     * There is a table of function pointers (one per helper that the program
+     * calls) starting at TARGET_LOAD_HELPER_TABLE, in which the helper has the
+     * given slot. Each of those functions has a signature that looks like
+     * uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, void* cookie
+     * We load the appropriate function pointer by using slot to index it and then
+     * make sure that the arguments are set properly depending on the abi.
+     *
+     * With StaticDispatch, the choice is made now (based on whether a dispatcher
+     * is registered) and only the code for the chosen path is emitted.
+     */
+    bool check_dispatcher = vm->dispatch_strategy == DynamicDispatch;
+    bool use_dispatcher = vm->dispatcher != NULL;
+    uint32_t skip_default_dispatcher_source = 0;
+    uint32_t skip_external_dispatcher_source = 0;
+
+    emit_external_call_prologue(state);
+
+    DECLARE_PATCHABLE_TARGET(default_jmp_tgt);
+    default_jmp_tgt.is_special = false;
+    default_jmp_tgt.target.regular.ebpf_target_pc = 0;
+
+    if (check_dispatcher || use_dispatcher) {
+        DECLARE_PATCHABLE_TARGET(rip_rel_tgt);
+        rip_rel_tgt.is_special = true;
+        rip_rel_tgt.target.special = ExternalDispatcher;
+        emit_rip_relative_load(state, RAX, rip_rel_tgt);
+    }
+
+    if (check_dispatcher) {
+        // cmp rax, 0
+        emit_cmp_imm32(state, RAX, 0);
+        // jne skip_default_dispatcher_label
+        skip_default_dispatcher_source = emit_jcc(state, 0x85, default_jmp_tgt);
+    }
+
+    if (check_dispatcher || !use_dispatcher) {
+        // Default dispatcher:
+        emit_helper_table_call_setup(state, slot);
+    }
+
+    if (check_dispatcher) {
+        // jmp call_label
+        skip_external_dispatcher_source = emit_jmp(state, default_jmp_tgt);
+
+        // skip_default_dispatcher_label:
+        emit_jump_target(state, skip_default_dispatcher_source);
+    }
+
+    if (check_dispatcher || use_dispatcher) {
+        // External dispatcher:
+        emit_external_dispatcher_call_setup(state, idx);
+    }
+
+    if (check_dispatcher) {
+        // call_label:
+        emit_jump_target(state, skip_external_dispatcher_source);
+    }
+
+    // Control flow converges for call:
+    emit_external_call_epilogue(state);
+}
+
+/**
+ * @brief Call a kfunc directly: its address is known when the program is compiled, so the call
+ * goes through neither the external dispatcher nor the helper table.
+ */
+static inline void
+emit_kfunc_call(struct jit_state* state, extended_external_helper_t kfunc)
+{
+    emit_external_call_prologue(state);
+    emit_load_imm(state, RAX, (uint64_t)kfunc);
+    emit_helper_context_argument(state);
+    emit_external_call_epilogue(state);
+}
+
 #define X64_ALU_ADD 0x01
 #define X64_ALU_OR 0x09
 #define X64_ALU_AND 0x21
@@ -1120,6 +1192,161 @@ emit_muldivmod(struct jit_state* state, uint8_t opcode, int src, int dst, int32_
         emit_pop(state, RAX);
     }
 }
+/**
+ * @brief Emit code that charges the given number of instructions against the program's
+ * instruction budget and terminates the program if the budget is exhausted.
+ *
+ * Note: The charge clobbers the flags so it must be emitted before any comparison
+ * whose result is consumed by the instruction's own jump.
+ *
+ * @param[in] state The JIT state.
+ * @param[in] charge The number of instructions to charge.
+ */
+static inline void
+emit_instruction_budget_charge(struct jit_state* state, uint32_t charge)
+{
+    // sub qword [rbp + INSTRUCTION_BUDGET_SLOT], charge
+    emit_basic_rex(state, 1, 0, RBP);
+    emit1(state, 0x81);
+    emit_modrm_and_displacement(state, 5, RBP, INSTRUCTION_BUDGET_SLOT);
+    emit4(state, charge);
+
+    // jl budget_exhausted
+    DECLARE_PATCHABLE_SPECIAL_TARGET(budget_exhausted_tgt, BudgetExhausted);
+    emit_jcc(state, 0x8c, budget_exhausted_tgt);
+}
+
+/* Call the C function at the given address (with the arguments already in place). Clobbers RAX. */
+static void
+emit_call_function(struct jit_state* state, void* function)
+{
+    emit_load_imm(state, RAX, (int64_t)(uintptr_t)function);
+#ifndef UBPF_DISABLE_RETPOLINES
+    DECLARE_PATCHABLE_SPECIAL_TARGET(retpoline_tgt, Retpoline);
+    emit_call(state, retpoline_tgt);
+#else
+    /* callq *%rax */
+    emit1(state, 0xff);
+    emit1(state, 0xd0);
+#endif
+}
+
+// The stack space (beyond the pushed registers) needed around a call to a C function.
+#if defined(_WIN32)
+#define RUNTIME_STATS_CALL_SPACE (8 + 4 * sizeof(uint64_t)) // Alignment and home register space.
+#else
+#define RUNTIME_STATS_CALL_SPACE 8 // Alignment.
+#endif
+
+/* Get the thread's block of runtime statistics and note the time at which the run starts.
+ * Must follow the setup of the frame (and preserves the registers that hold the arguments
+ * of the program).
+ */
+static void
+emit_runtime_stats_enter(struct jit_state* state, struct ubpf_vm* vm)
+{
+    emit_push(state, map_register(BPF_REG_1));
+    emit_push(state, map_register(BPF_REG_2));
+    emit_push(state, VOLATILE_CTXT);
+    emit_alu64_imm32(state, 0x81, 5, RSP, RUNTIME_STATS_CALL_SPACE);
+
+    emit_load_imm(state, platform_parameter_registers[0], (int64_t)(uintptr_t)vm);
+    emit_call_function(state, ubpf_runtime_stats_enter);
+    emit_store(state, S64, RAX, RBP, RUNTIME_STATS_BLOCK_SLOT);
+
+    // rdtsc; shl rdx, 32; or rax, rdx
+    emit1(state, 0x0f);
+    emit1(state, 0x31);
+    emit_alu64_imm8(state, 0xc1, 4, RDX, 32);
+    emit_alu64(state, 0x09, RDX, RAX);
+    emit_store(state, S64, RAX, RBP, RUNTIME_STATS_START_SLOT);
+
+    emit_alu64_imm32(state, 0x81, 0, RSP, RUNTIME_STATS_CALL_SPACE);
+    emit_pop(state, VOLATILE_CTXT);
+    emit_pop(state, map_register(BPF_REG_2));
+    emit_pop(state, map_register(BPF_REG_1));
+}
+
+/* Account for the run (whose result is in RAX). Must follow the restoration of RSP from RBP. */
+static void
+emit_runtime_stats_exit(struct jit_state* state)
+{
+    emit_load(state, S64, RBP, platform_parameter_registers[0], RUNTIME_STATS_BLOCK_SLOT);
+    emit_load(state, S64, RBP, platform_parameter_registers[1], RUNTIME_STATS_START_SLOT);
+    emit_mov(state, RAX, platform_parameter_registers[2]);
+    emit_push(state, RAX);
+    emit_alu64_imm32(state, 0x81, 5, RSP, RUNTIME_STATS_CALL_SPACE);
+    emit_call_function(state, ubpf_runtime_stats_exit);
+    emit_alu64_imm32(state, 0x81, 0, RSP, RUNTIME_STATS_CALL_SPACE);
+    emit_pop(state, RAX);
+}
+
+/* Count a call to the helper with the given slot in the thread's runtime statistics.
+ * Clobbers RCX (which is free at the start of an instruction).
+ */
+static void
+emit_runtime_stats_helper_call(struct jit_state* state, unsigned int idx)
+{
+    emit_load(state, S64, RBP, RCX, RUNTIME_STATS_BLOCK_SLOT);
+    // inc qword [rcx + idx * 8]
+    emit_basic_rex(state, 1, 0, RCX);
+    emit1(state, 0xff);
+    emit_modrm_and_displacement(state, 0, RCX, idx * sizeof(uint64_t));
+}
+
+/* Note the time at which a call to a helper starts. Clobbers RAX and RCX (which are free at
+ * the start of the call instruction).
+ */
+static void
+emit_helper_latency_start(struct jit_state* state)
+{
+    // rdtsc clobbers RDX (which holds one of the helper's arguments).
+    emit_mov(state, RDX, RCX);
+    emit1(state, 0x0f);
+    emit1(state, 0x31);
+    emit_alu64_imm8(state, 0xc1, 4, RDX, 32);
+    emit_alu64(state, 0x09, RDX, RAX);
+    emit_store(state, S64, RAX, RBP, RUNTIME_STATS_HELPER_START_SLOT);
+    emit_mov(state, RCX, RDX);
+}
+
+/* Account for the latency of the call to the helper with the given slot (which just
+ * returned). Preserves the result in RAX and the helper context.
+ */
+static void
+emit_helper_latency_end(struct jit_state* state, unsigned int idx)
+{
+    // The stack is 16-byte aligned at the call and still is after these two pushes.
+    emit_push(state, RAX);
+    emit_push(state, VOLATILE_CTXT);
+    emit_load(state, S64, RBP, platform_parameter_registers[0], RUNTIME_STATS_BLOCK_SLOT);
+    emit_load_imm(state, platform_parameter_registers[1], idx);
+    emit_load(state, S64, RBP, platform_parameter_registers[2], RUNTIME_STATS_HELPER_START_SLOT);
+#if defined(_WIN32)
+    emit_alu64_imm32(state, 0x81, 5, RSP, 4 * sizeof(uint64_t));
+#endif
+    emit_call_function(state, ubpf_runtime_stats_helper_latency);
+#if defined(_WIN32)
+    emit_alu64_imm32(state, 0x81, 0, RSP, 4 * sizeof(uint64_t));
+#endif
+    emit_pop(state, VOLATILE_CTXT);
+    emit_pop(state, RAX);
+}
+
+/* Increment the basic-block profiler's counter at the given address. Clobbers RCX (which,
+ * like for shifts, is free at the start of an instruction; R11 holds the helper context).
+ */
+static void
+emit_profile_counter_increment(struct jit_state* state, uint64_t* counter)
+{
+    // movabs rcx, counter
+    emit_load_imm(state, RCX, (int64_t)(uintptr_t)counter);
+    // inc qword [rcx]
+    emit_basic_rex(state, 1, 0, RCX);
+    emit1(state, 0xff);
+    emit_modrm_and_displacement(state, 0, RCX, 0);
+}
+
 static inline void
 emit_local_call(struct ubpf_vm* vm, struct jit_state* state, uint32_t ebpf_target_pc)
 {
@@ -1175,13 +1402,15 @@ emit_dispatched_external_helper_address(struct jit_state* state, struct ubpf_vm*
     return external_helper_address_target;
 }
 
+/**
+ * @brief Emit the table of the helpers that the program calls (see resolve_helper_call in ubpf_vm.c).
+ */
 static uint32_t
 emit_helper_table(struct jit_state* state, struct ubpf_vm* vm)
 {
-
     uint32_t helper_table_address_target = state->offset;
-    for (int i = 0; i < MAX_EXT_FUNCS; i++) {
-        emit8(state, (uint64_t)vm->ext_funcs[i]);
+    for (uint32_t i = 0; i < vm->helper_table_size; i++) {
+        emit8(state, (uint64_t)vm->helper_table[i]);
     }
     return helper_table_address_target;
 }
@@ -1263,10 +1492,11 @@ ubpf_set_register_offset(int x)
  *                                ...
  *                                CODE
  *                                External Helper External Dispatcher Function Pointer (8 bytes, maybe NULL)
- *                                External Helper Function Pointer Idx 0 (8 bytes, maybe NULL)
- *                                External Helper Function Pointer Idx 1 (8 bytes, maybe NULL)
+ *                                External Helper Function Pointer Slot 0 (8 bytes, maybe NULL)
+ *                                External Helper Function Pointer Slot 1 (8 bytes, maybe NULL)
  *                                ...
- *                                External Helper Function Pointer Idx MAX_EXT_FUNCS-1 (8 bytes, maybe NULL)
+ *                                External Helper Function Pointer Slot N-1 (8 bytes, maybe NULL)
+ *                                (one slot per helper that the program calls)
  * state->buffer + state->offset:
  *
  * 2. Invariants
@@ -1283,11 +1513,22 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
 {
     int i;
 
+    if (calculate_instruction_budget_charges(state, vm, errmsg) < 0) {
+        return -1;
+    }
+
     (void)platform_volatile_registers;
+    /* On entry, the CFA is just above the return address. */
+    record_unwind_cfa(state, dwarf_registers[RSP], 8);
+    record_unwind_saved_register(state, DWARF_RETURN_ADDRESS, 8);
+
     /* Save platform non-volatile registers */
     for (i = 0; i < _countof(platform_nonvolatile_registers); i++) {
         emit_push(state, platform_nonvolatile_registers[i]);
+        record_unwind_cfa(state, dwarf_registers[RSP], 8 * (i + 2));
+        record_unwind_saved_register(state, dwarf_registers[platform_nonvolatile_registers[i]], 8 * (i + 2));
     }
+    uint32_t frame_size = 8 * (_countof(platform_nonvolatile_registers) + 1);
 
     /* Move first platform parameter register into register 1 */
     if (map_register(1) != platform_parameter_registers[0]) {
@@ -1311,12 +1552,30 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
      */
     if (!(_countof(platform_nonvolatile_registers) % 2)) {
         emit_alu64_imm32(state, 0x81, 5, RSP, 0x8);
+        frame_size += 8;
+        record_unwind_cfa(state, dwarf_registers[RSP], frame_size);
     }
 
     /*
      * Let's set RBP to RSP so that we can restore RSP later!
      */
     emit_mov(state, RSP, RBP);
+    /* RBP does not change (until the epilogue restores it), wherever the eBPF program moves RSP. */
+    record_unwind_cfa(state, dwarf_registers[RBP], frame_size);
+
+    /*
+     * If the program needs an instruction budget, reserve a slot for it (16 bytes
+     * to maintain alignment) just below RBP and fill it with the instruction limit.
+     * Runtime statistics need two more slots (and another 16 bytes).
+     */
+    if (vm->runtime_stats_enabled) {
+        emit_alu64_imm32(state, 0x81, 5, RSP, 32);
+    } else if (state->budget_charges) {
+        emit_alu64_imm32(state, 0x81, 5, RSP, 16);
+    }
+    if (state->budget_charges) {
+        emit_store_imm32(state, S64, RBP, INSTRUCTION_BUDGET_SLOT, state->instruction_budget);
+    }
 
     /* Configure eBPF program stack space */
     if (state->jit_mode == BasicJitMode) {
@@ -1333,6 +1592,10 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
         emit_alu64(state, 0x01, platform_parameter_registers[3], map_register(BPF_REG_10));
     }
 
+    if (vm->runtime_stats_enabled) {
+        emit_runtime_stats_enter(state, vm);
+    }
+
 #if defined(_WIN32)
     /* Windows x64 ABI requires home register space */
     /* Allocate home register space - 4 registers */
@@ -1427,6 +1690,14 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
         }
         state->pc_locs[i] = state->offset;
 
+        if (vm->profiling_enabled && vm->profile_counts && vm->profile_block_starts[i]) {
+            emit_profile_counter_increment(state, &vm->profile_counts[i]);
+        }
+
+        if (state->budget_charges && state->budget_charges[i]) {
+            emit_instruction_budget_charge(state, state->budget_charges[i]);
+        }
+
         switch (inst.opcode) {
         case EBPF_OP_ADD_IMM:
             emit_alu32_imm32(state, 0x81, 0, dst, inst.imm);
@@ -1774,8 +2045,20 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
         case EBPF_OP_CALL:
             /* We reserve RCX for shifts */
             if (inst.src == 0) {
+                // The statistics are kept by the helper's slot in the program's table of helpers.
+                uint16_t helper_slot = (uint16_t)inst.offset;
+                bool measure_latency = vm->helper_latency_enabled && helper_slot < UBPF_RUNTIME_STATS_HELPERS;
+                if (vm->runtime_stats_enabled && helper_slot < UBPF_RUNTIME_STATS_HELPERS) {
+                    emit_runtime_stats_helper_call(state, helper_slot);
+                }
+                if (measure_latency) {
+                    emit_helper_latency_start(state);
+                }
                 emit_mov(state, RCX_ALT, RCX);
-                emit_dispatched_external_helper_call(state, inst.imm);
+                emit_dispatched_external_helper_call(state, vm, inst.imm, (uint16_t)inst.offset);
+                if (measure_latency) {
+                    emit_helper_latency_end(state, helper_slot);
+                }
                 if (inst.imm == vm->unwind_stack_extension_index) {
                     emit_cmp_imm32(state, map_register(BPF_REG_0), 0);
                     DECLARE_PATCHABLE_TARGET(exit_tgt);
@@ -1786,6 +2069,9 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
             } else if (inst.src == 1) {
                 target_pc = i + inst.imm + 1;
                 emit_local_call(vm, state, target_pc);
+            } else if (inst.src == 2) {
+                emit_mov(state, RCX_ALT, RCX);
+                emit_kfunc_call(state, vm->kfunc_targets[(uint16_t)inst.offset]);
             }
             break;
         case EBPF_OP_EXIT:
@@ -1945,20 +2231,8 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
 
     if (state->jit_status != NoError) {
         switch (state->jit_status) {
-        case TooManyJumps: {
-            *errmsg = ubpf_error("Too many jump instructions");
-            break;
-        }
-        case TooManyLoads: {
-            *errmsg = ubpf_error("Too many load instructions");
-            break;
-        }
-        case TooManyLeas: {
-            *errmsg = ubpf_error("Too many LEA calculations");
-            break;
-        }
-        case TooManyLocalCalls: {
-            *errmsg = ubpf_error("Too many local calls");
+        case OutOfMemory: {
+            *errmsg = ubpf_error("Could not allocate space needed to JIT compile eBPF program");
             break;
         }
         case UnexpectedInstruction: {
@@ -1982,6 +2256,12 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
         return -1;
     }
 
+    /* A program that exhausts its instruction budget returns UINT64_MAX (through the epilogue). */
+    if (state->budget_charges) {
+        state->budget_exhausted_loc = state->offset;
+        emit_load_imm(state, map_register(BPF_REG_0), -1);
+    }
+
     /* Epilogue */
     state->exit_loc = state->offset;
 
@@ -1993,6 +2273,10 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
     /* Deallocate stack space by restoring RSP from RBP. */
     emit_mov(state, RBP, RSP);
 
+    if (vm->runtime_stats_enabled) {
+        emit_runtime_stats_exit(state);
+    }
+
     if (!(_countof(platform_nonvolatile_registers) % 2)) {
         emit_alu64_imm32(state, 0x81, 0, RSP, 0x8);
     }
@@ -2001,8 +2285,11 @@ translate(struct ubpf_vm* vm, struct jit_state* state, char** errmsg)
     for (i = 0; i < _countof(platform_nonvolatile_registers); i++) {
         emit_pop(state, platform_nonvolatile_registers[_countof(platform_nonvolatile_registers) - i - 1]);
     }
+    record_unwind_cfa(state, dwarf_registers[RSP], 8);
 
     emit1(state, 0xc3); /* ret */
+    /* The code that follows the epilogue runs in the frame of the eBPF program. */
+    record_unwind_cfa(state, dwarf_registers[RBP], frame_size);
 
     state->retpoline_loc = emit_retpoline(state);
     state->dispatcher_loc = emit_dispatched_external_helper_address(state, vm);
@@ -2022,11 +2309,13 @@ resolve_patchable_relatives(struct jit_state* state)
         bool is_near = false;
 
         if (jump.target.is_special) {
-            // There are only two special targets for jumps: Exit and Retpoline.
+            // There are only three special targets for jumps: Exit, Retpoline and BudgetExhausted.
             if (jump.target.target.special == Exit) {
                 target_loc = state->exit_loc;
             } else if (jump.target.target.special == Retpoline) {
                 target_loc = state->retpoline_loc;
+            } else if (jump.target.target.special == BudgetExhausted) {
+                target_loc = state->budget_exhausted_loc;
             } else {
                 target_loc = -1;
                 return false;
@@ -2129,7 +2418,8 @@ ubpf_translate_x86_64(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, enum Ji
     struct jit_state state;
     struct ubpf_jit_result compile_result;
 
-    if (initialize_jit_state_result(&state, &compile_result, buffer, *size, jit_mode, &compile_result.errmsg) < 0) {
+    if (initialize_jit_state_result(
+            &state, &compile_result, buffer, *size, vm->num_insts, jit_mode, &compile_result.errmsg) < 0) {
         goto out;
     }
 
@@ -2143,9 +2433,18 @@ ubpf_translate_x86_64(struct ubpf_vm* vm, uint8_t* buffer, size_t* size, enum Ji
     }
 
     compile_result.compile_result = UBPF_JIT_COMPILE_SUCCESS;
+    if (vm->jit_perf_outputs) {
+        retain_jit_debug_info(&state, &compile_result);
+    }
     compile_result.external_dispatcher_offset = state.dispatcher_loc;
     compile_result.external_helper_offset = state.helper_table_loc;
     compile_result.jit_mode = jit_mode;
+    compile_result.static_dispatch = vm->dispatch_strategy == StaticDispatch;
+    compile_result.static_dispatcher = compile_result.static_dispatch && vm->dispatcher != NULL;
+    compile_result.instruction_limit = vm->instruction_limit;
+    compile_result.runtime_stats = vm->runtime_stats_enabled;
+    compile_result.helper_latency = vm->helper_latency_enabled;
+    compile_result.profiling = vm->profiling_enabled;
     *size = state.offset;
 
 out:
@@ -2160,7 +2459,7 @@ ubpf_jit_update_dispatcher_x86_64(
     UNUSED_PARAMETER(vm);
     uint64_t jit_upper_bound = (uint64_t)buffer + size;
     void* dispatcher_address = (void*)((uint64_t)buffer + offset);
-    if ((uint64_t)dispatcher_address + sizeof(void*) < jit_upper_bound) {
+    if ((uint64_t)dispatcher_address + sizeof(void*) <= jit_upper_bound) {
         memcpy(dispatcher_address, &new_dispatcher, sizeof(void*));
         return true;
     }
@@ -2181,7 +2480,7 @@ ubpf_jit_update_helper_x86_64(
     uint64_t jit_upper_bound = (uint64_t)buffer + size;
 
     void* dispatcher_address = (void*)((uint64_t)buffer + offset + (8 * idx));
-    if ((uint64_t)dispatcher_address + sizeof(void*) < jit_upper_bound) {
+    if ((uint64_t)dispatcher_address + sizeof(void*) <= jit_upper_bound) {
         memcpy(dispatcher_address, &new_helper, sizeof(void*));
         return true;
     }
@@ -27,7 +27,13 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "ubpf_int.h"
 
 #if defined(UBPF_HAS_ELF_H)
@@ -38,8 +44,6 @@
 #endif
 #endif
 
-#define MAX_SECTIONS 32
-
 #ifndef EM_BPF
 #define EM_BPF 247
 #endif
@@ -76,6 +80,7 @@ struct relocated_function
     uint64_t native_section_start;
     Elf64_Xword size;
     uint64_t landed;
+    uint32_t index; /* Its index in the symbol table order. */
 };
 
 static const void*
@@ -90,27 +95,700 @@ bounds_check(bounds* bounds, uint64_t offset, uint64_t size)
 const int MAIN_SECTION_INDEX = 0;
 const int TEXT_SECTION_INDEX = 1;
 
-int
-section_idx_from_name(const char** section_names, int length, const char* needle)
+static int
+compare_function_addresses(const void* a, const void* b)
 {
-    for (int i = 0; i < length; i++) {
-        if (!strcmp(section_names[i], needle)) {
-            return i;
+    const struct relocated_function* first = *(const struct relocated_function* const*)a;
+    const struct relocated_function* second = *(const struct relocated_function* const*)b;
+    if (first->shdr != second->shdr) {
+        return (uintptr_t)first->shdr < (uintptr_t)second->shdr ? -1 : 1;
+    }
+    if (first->native_section_start != second->native_section_start) {
+        return first->native_section_start < second->native_section_start ? -1 : 1;
+    }
+    return first->index < second->index ? -1 : first->index > second->index;
+}
+
+/*
+ * In the functions sorted by section and start, find the last function of the section that
+ * starts at or before the offset (or NULL).
+ */
+static struct relocated_function*
+find_function_before(struct relocated_function** by_address, uint count, const Elf64_Shdr* shdr, uint64_t offset)
+{
+    uint low = 0;
+    uint high = count;
+    while (low < high) {
+        uint middle = low + (high - low) / 2;
+        const struct relocated_function* function = by_address[middle];
+        if ((uintptr_t)function->shdr < (uintptr_t)shdr ||
+            (function->shdr == shdr && function->native_section_start <= offset)) {
+            low = middle + 1;
+        } else {
+            high = middle;
         }
     }
+    if (low == 0 || by_address[low - 1]->shdr != shdr) {
+        return NULL;
+    }
+    /* Of the functions that start at the same offset, return the first one. */
+    while (low > 1 && by_address[low - 2]->shdr == shdr &&
+           by_address[low - 2]->native_section_start == by_address[low - 1]->native_section_start) {
+        low--;
+    }
+    return by_address[low - 1];
+}
+
+/*
+ * An open-addressing hash table from the names of the helpers registered in a VM to their
+ * IDs, which resolves the helper relocations of a load without comparing each name with
+ * every registered name. Its size is a power of 2, at least twice the number of helpers.
+ */
+struct helper_name_table
+{
+    const char** names;
+    unsigned int* indexes;
+    uint32_t size;
+};
+
+static uint32_t
+hash_name(const char* name)
+{
+    // FNV-1a.
+    uint32_t hash = 0x811c9dc5;
+    for (; *name; name++) {
+        hash = (hash ^ (uint8_t)*name) * 0x01000193;
+    }
+    return hash;
+}
+
+static bool
+build_helper_name_table(const struct ubpf_vm* vm, struct helper_name_table* table)
+{
+    table->size = 16;
+    while (table->size < 2 * vm->num_helpers) {
+        table->size *= 2;
+    }
+    table->names = calloc(table->size, sizeof(const char*));
+    table->indexes = calloc(table->size, sizeof(unsigned int));
+    if (!table->names || !table->indexes) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < vm->helpers_capacity; i++) {
+        const struct ubpf_helper* helper = &vm->helpers[i];
+        if (!helper->registered || !helper->name) {
+            continue;
+        }
+        uint32_t slot = hash_name(helper->name) & (table->size - 1);
+        while (table->names[slot] && strcmp(table->names[slot], helper->name)) {
+            slot = (slot + 1) & (table->size - 1);
+        }
+        /* Like ubpf_lookup_registered_function, resolve a name to its lowest ID. */
+        if (!table->names[slot] || helper->id < table->indexes[slot]) {
+            table->names[slot] = helper->name;
+            table->indexes[slot] = helper->id;
+        }
+    }
+    return true;
+}
+
+static unsigned int
+lookup_helper_name(const struct helper_name_table* table, const char* name)
+{
+    uint32_t slot = hash_name(name) & (table->size - 1);
+    while (table->names[slot]) {
+        if (!strcmp(table->names[slot], name)) {
+            return table->indexes[slot];
+        }
+        slot = (slot + 1) & (table->size - 1);
+    }
     return -1;
 }
 
-int
-ubpf_load_elf_ex(struct ubpf_vm* vm, const void* elf, size_t elf_size, const char* main_function_name, char** errmsg)
+static void
+free_helper_name_table(struct helper_name_table* table)
+{
+    if (table) {
+        free(table->names);
+        free(table->indexes);
+        free(table);
+    }
+}
+
+/*
+ * A function of the object, in the order in which it lands in the linked program.
+ */
+struct ubpf_elf_function
+{
+    char* name;
+    char* section_name;
+    uint64_t landed;    /* The index of its first instruction in the linked program. */
+    uint64_t num_insts;
+    bool default_main;  /* Whether it is at the start of the .text section. */
+};
+
+/* The spot of a function that is not part of the linked program. */
+#define FUNCTION_NOT_LANDED UINT64_MAX
+
+/*
+ * A local call, whose offset depends on where its function and its target land.
+ */
+struct ubpf_elf_call
+{
+    uint32_t caller;
+    uint32_t target;
+    uint64_t offset; /* The index of the call instruction within the caller. */
+};
+
+/*
+ * A reference (by a LDDW instruction) to the data sections that the library manages, whose
+ * address is only known once they are instantiated for a VM.
+ */
+struct ubpf_elf_data_reference
+{
+    uint32_t function;
+    uint64_t offset;  /* The index of the LDDW instruction within the function. */
+    uint32_t section; /* The index of the referenced section in the ELF file. */
+    bool read_only;   /* Whether it refers to the read-only data sections (or to the writable ones). */
+    uint64_t target;  /* The offset of the referenced data within the instance of its sections. */
+};
+
+struct ubpf_elf_object
+{
+    struct ebpf_inst* insts; /* Every function, relocated, in the order of the symbol table. */
+    uint64_t num_insts;
+    struct ubpf_elf_function* functions;
+    uint32_t num_functions;
+    struct ubpf_elf_call* calls;
+    uint32_t num_calls;
+    struct ubpf_elf_data_reference* data_references;
+    uint32_t num_data_references;
+    uint8_t* data_image; /* The initial contents of the writable data sections of each VM. */
+    size_t data_image_size;
+    struct ubpf_shared_data* read_only_data;
+};
+
+/*
+ * Whether a section holds data that a program may refer to: .data, .rodata (and its string
+ * sections) and .bss.
+ */
+static bool
+is_data_section(const Elf64_Shdr* shdr)
+{
+    return (shdr->sh_type == SHT_PROGBITS || shdr->sh_type == SHT_NOBITS) && (shdr->sh_flags & SHF_ALLOC) &&
+           !(shdr->sh_flags & SHF_EXECINSTR);
+}
+
+/*
+ * Lay out the data sections that the program refers to, each at an offset aligned for the widest
+ * access: the writable ones in the image from which the instance of each VM is copied and the
+ * read-only ones in a single instance, which the VMs share (and which is made read-only where the
+ * platform can map memory). Then make the targets of the references offsets within the instances.
+ */
+static int
+layout_data_sections(const section* sections, int section_count, struct ubpf_elf_object* object, char** errmsg)
+{
+    int result = -1;
+    struct ubpf_shared_data* shared = NULL;
+    uint64_t* data_offsets = malloc(section_count * sizeof(uint64_t));
+    if (!data_offsets) {
+        *errmsg = ubpf_error("failed to allocate memory for the data sections");
+        return -1;
+    }
+    for (int i = 0; i < section_count; i++) {
+        data_offsets[i] = UINT64_MAX;
+    }
+    for (uint32_t i = 0; i < object->num_data_references; i++) {
+        data_offsets[object->data_references[i].section] = 0;
+    }
+
+    uint64_t sizes[2] = {0, 0}; /* Writable, read-only. */
+    for (int i = 0; i < section_count; i++) {
+        if (data_offsets[i] == UINT64_MAX) {
+            continue;
+        }
+        uint64_t* size = &sizes[!(sections[i].shdr->sh_flags & SHF_WRITE)];
+        data_offsets[i] = (*size + 7) & ~(uint64_t)7;
+        if (data_offsets[i] + sections[i].size < data_offsets[i] || data_offsets[i] + sections[i].size > SIZE_MAX) {
+            *errmsg = ubpf_error("the data sections are too large");
+            goto error;
+        }
+        *size = data_offsets[i] + sections[i].size;
+    }
+
+    if (sizes[0]) {
+        object->data_image = calloc(1, sizes[0]);
+        if (!object->data_image) {
+            *errmsg = ubpf_error("failed to allocate memory for the data sections");
+            goto error;
+        }
+        object->data_image_size = sizes[0];
+    }
+
+    if (sizes[1]) {
+        shared = calloc(1, sizeof(struct ubpf_shared_data));
+        if (!shared) {
+            *errmsg = ubpf_error("failed to allocate memory for the data sections");
+            goto error;
+        }
+        shared->references = 1;
+        shared->size = sizes[1];
+        object->read_only_data = shared;
+        void* data = mmap(NULL, shared->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        shared->mapped = data != MAP_FAILED;
+        shared->data = shared->mapped ? data : calloc(1, shared->size);
+        if (!shared->data) {
+            *errmsg = ubpf_error("failed to allocate memory for the data sections");
+            goto error;
+        }
+    }
+
+    for (int i = 0; i < section_count; i++) {
+        const Elf64_Shdr* shdr = sections[i].shdr;
+        if (data_offsets[i] == UINT64_MAX || shdr->sh_type == SHT_NOBITS || !sections[i].size) {
+            continue;
+        }
+        uint8_t* instance = shdr->sh_flags & SHF_WRITE ? object->data_image : shared->data;
+        memcpy(instance + data_offsets[i], sections[i].data, sections[i].size);
+    }
+
+    if (shared && shared->mapped && mprotect(shared->data, shared->size, PROT_READ) < 0) {
+        *errmsg = ubpf_error("failed to protect the read-only data sections");
+        goto error;
+    }
+
+    for (uint32_t i = 0; i < object->num_data_references; i++) {
+        object->data_references[i].target += data_offsets[object->data_references[i].section];
+    }
+    result = 0;
+
+error:
+    free(data_offsets);
+    return result;
+}
+
+/*
+ * Find the instructions at which the registers may hold values from more than one path: the
+ * targets of jumps and the starts of functions.
+ */
+static bool*
+find_join_points(const struct ubpf_elf_object* object)
+{
+    bool* joins = calloc(object->num_insts ? object->num_insts : 1, sizeof(bool));
+    if (!joins) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < object->num_functions; i++) {
+        if (object->functions[i].landed < object->num_insts) {
+            joins[object->functions[i].landed] = true;
+        }
+    }
+    for (uint64_t pc = 0; pc < object->num_insts; pc++) {
+        struct ebpf_inst inst = object->insts[pc];
+        uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+        if (inst.opcode == EBPF_OP_LDDW) {
+            pc++;
+        } else if (
+            (cls == EBPF_CLS_JMP || cls == EBPF_CLS_JMP32) && inst.opcode != EBPF_OP_CALL &&
+            inst.opcode != EBPF_OP_EXIT) {
+            int64_t target = (int64_t)pc + 1 + inst.offset;
+            if (target >= 0 && (uint64_t)target < object->num_insts) {
+                joins[target] = true;
+            }
+        }
+    }
+    return joins;
+}
+
+/*
+ * Specialize the program for the contents of the read-only data sections, which cannot change:
+ * in the straight-line code that follows the LDDW of an address in them, replace each load from
+ * that address (plus the constant offset of the load) with a move of the value that it would
+ * load, so that neither engine touches memory for it. The LDDW stays, since the program may use
+ * the address otherwise.
+ */
+static int
+fold_read_only_loads(struct ubpf_elf_object* object, char** errmsg)
+{
+    const struct ubpf_shared_data* shared = object->read_only_data;
+    if (!shared) {
+        return 0;
+    }
+    bool* joins = find_join_points(object);
+    if (!joins) {
+        *errmsg = ubpf_error("failed to allocate memory for the linked program");
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < object->num_data_references; i++) {
+        const struct ubpf_elf_data_reference* reference = &object->data_references[i];
+        if (!reference->read_only) {
+            continue;
+        }
+        uint64_t pc = object->functions[reference->function].landed + reference->offset;
+        uint8_t address_register = object->insts[pc].dst;
+        for (pc += 2; pc < object->num_insts && !joins[pc]; pc++) {
+            struct ebpf_inst* inst = &object->insts[pc];
+            uint8_t cls = inst->opcode & EBPF_CLS_MASK;
+            if (cls == EBPF_CLS_JMP || cls == EBPF_CLS_JMP32 ||
+                (cls == EBPF_CLS_STX && (inst->opcode & EBPF_MODE_ATOMIC) == EBPF_MODE_ATOMIC)) {
+                /* A call or an atomic operation may change registers other than its destination. */
+                break;
+            }
+
+            size_t size = 0;
+            switch (inst->opcode) {
+            case EBPF_OP_LDXB:
+                size = 1;
+                break;
+            case EBPF_OP_LDXH:
+                size = 2;
+                break;
+            case EBPF_OP_LDXW:
+                size = 4;
+                break;
+            case EBPF_OP_LDXDW:
+                size = 8;
+                break;
+            }
+            int64_t address = (int64_t)reference->target + inst->offset;
+            if (size && inst->src == address_register && address >= 0 && (uint64_t)address + size <= shared->size) {
+                /* Like the interpreter's unaligned loads, this assumes a little-endian host. */
+                uint64_t value = 0;
+                memcpy(&value, shared->data + address, size);
+                uint8_t dst = inst->dst;
+                if (value <= UINT32_MAX) {
+                    /* A 32-bit move zero-extends its immediate, like the load. */
+                    *inst = (struct ebpf_inst){.opcode = EBPF_OP_MOV_IMM, .dst = dst, .imm = (int32_t)value};
+                } else if ((int64_t)value == (int32_t)value) {
+                    *inst = (struct ebpf_inst){.opcode = EBPF_OP_MOV64_IMM, .dst = dst, .imm = (int32_t)value};
+                }
+            }
+
+            if ((cls == EBPF_CLS_ALU || cls == EBPF_CLS_ALU64 || cls == EBPF_CLS_LDX || cls == EBPF_CLS_LD) &&
+                inst->dst == address_register) {
+                break;
+            }
+            if (inst->opcode == EBPF_OP_LDDW) {
+                pc++;
+            }
+        }
+    }
+    free(joins);
+    return 0;
+}
+
+/*
+ * Instantiate the data sections of the object for the VM and point the references to them (in
+ * the linked program, whose functions landed at the given spots or, if landed is NULL, where
+ * they landed in the object) at the instances. The references of the functions that were not
+ * linked (FUNCTION_NOT_LANDED) are skipped.
+ */
+static int
+instantiate_data_sections(
+    const struct ubpf_elf_object* object,
+    struct ubpf_vm* vm,
+    struct ebpf_inst* insts,
+    const uint64_t* landed,
+    char** errmsg)
+{
+    if (!object->num_data_references) {
+        return 0;
+    }
+    if (vm->insts) {
+        *errmsg = ubpf_error(
+            "code has already been loaded into this VM. Use ubpf_unload_code() if you need to reuse this VM");
+        return -1;
+    }
+
+    if (object->data_image_size) {
+        vm->data_sections = malloc(object->data_image_size);
+        if (!vm->data_sections) {
+            *errmsg = ubpf_error("failed to allocate memory for the data sections");
+            return -1;
+        }
+        memcpy(vm->data_sections, object->data_image, object->data_image_size);
+        vm->data_sections_size = object->data_image_size;
+    }
+    if (object->read_only_data) {
+        ubpf_shared_data_acquire(object->read_only_data);
+        vm->read_only_data = object->read_only_data;
+    }
+
+    for (uint32_t i = 0; i < object->num_data_references; i++) {
+        const struct ubpf_elf_data_reference* reference = &object->data_references[i];
+        if (landed && landed[reference->function] == FUNCTION_NOT_LANDED) {
+            continue;
+        }
+        uint64_t index =
+            (landed ? landed[reference->function] : object->functions[reference->function].landed) + reference->offset;
+        /* An empty section has no instance. */
+        uint8_t* instance = reference->read_only ? (vm->read_only_data ? vm->read_only_data->data : NULL)
+                                                 : vm->data_sections;
+        uint64_t address = (uint64_t)(uintptr_t)(instance + reference->target);
+        insts[index].imm = (uint32_t)address;
+        insts[index + 1].imm = (uint32_t)(address >> 32);
+    }
+    return 0;
+}
+
+static char*
+copy_string(const char* string)
+{
+    size_t length = strlen(string) + 1;
+    char* copy = malloc(length);
+    if (copy) {
+        memcpy(copy, string, length);
+    }
+    return copy;
+}
+
+/*
+ * The header of the .BTF.ext section, which holds (among other things) the CO-RE relocations,
+ * grouped by the section of the instructions to which they apply.
+ */
+struct btf_ext_header
+{
+    uint16_t magic;
+    uint8_t version;
+    uint8_t flags;
+    uint32_t hdr_len;
+    uint32_t func_info_off; /* Relative to the end of the header, like the other offsets. */
+    uint32_t func_info_len;
+    uint32_t line_info_off;
+    uint32_t line_info_len;
+    uint32_t core_relo_off;
+    uint32_t core_relo_len;
+};
+
+struct btf_ext_core_relocation
+{
+    uint32_t insn_off; /* The offset of the instruction in its section. */
+    uint32_t type_id;
+    uint32_t access_str_off;
+    uint32_t kind;
+};
+
+/*
+ * Replace the value of a CO-RE relocation for the program's types, which the compiler put in the
+ * instruction, with its value for the host's types.
+ */
+static int
+patch_core_relocation(
+    struct ebpf_inst* inst, uint64_t insts_left, uint32_t kind, const struct ubpf_core_result* result, char** errmsg)
+{
+    uint8_t cls = inst->opcode & EBPF_CLS_MASK;
+    if (inst->opcode == EBPF_OP_LDDW) {
+        if (insts_left < 2 || (uint32_t)inst->imm != (uint32_t)result->local_value || inst[1].imm != 0) {
+            *errmsg = ubpf_error("CO-RE relocation does not match its instruction");
+            return -1;
+        }
+        inst[0].imm = (uint32_t)result->target_value;
+        inst[1].imm = (uint32_t)(result->target_value >> 32);
+    } else if ((cls == EBPF_CLS_ALU || cls == EBPF_CLS_ALU64) && !(inst->opcode & EBPF_SRC_REG)) {
+        if (inst->imm != (int64_t)result->local_value) {
+            *errmsg = ubpf_error("CO-RE relocation does not match its instruction");
+            return -1;
+        }
+        if (result->target_value > INT32_MAX) {
+            *errmsg =
+                ubpf_error("CO-RE relocation value %" PRIu64 " does not fit in the instruction", result->target_value);
+            return -1;
+        }
+        inst->imm = (int32_t)result->target_value;
+    } else if (cls == EBPF_CLS_LDX || cls == EBPF_CLS_ST || cls == EBPF_CLS_STX) {
+        if (kind != UBPF_CORE_FIELD_BYTE_OFFSET || inst->offset != (int64_t)result->local_value) {
+            *errmsg = ubpf_error("CO-RE relocation does not match its instruction");
+            return -1;
+        }
+        if (result->target_value > INT16_MAX) {
+            *errmsg =
+                ubpf_error("CO-RE relocation value %" PRIu64 " does not fit in the instruction", result->target_value);
+            return -1;
+        }
+        /* An access to the whole field must keep accessing the whole field. */
+        static const uint64_t access_sizes[] = {4, 2, 1, 8};
+        uint64_t access_size = access_sizes[(inst->opcode >> 3) & 3];
+        if (access_size == result->local_size && result->target_size != result->local_size) {
+            *errmsg = ubpf_error(
+                "CO-RE relocation of a field whose size changed from %" PRIu64 " to %" PRIu64,
+                result->local_size,
+                result->target_size);
+            return -1;
+        }
+        inst->offset = (int16_t)result->target_value;
+    } else {
+        *errmsg = ubpf_error("CO-RE relocation of an unsupported instruction (opcode 0x%02x)", inst->opcode);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Apply the CO-RE relocations of the .BTF.ext section: the instructions that access types of
+ * the program's BTF (.BTF) are adjusted to the layout of the host's types (see ubpf_register_btf).
+ */
+static int
+apply_core_relocations(
+    const struct ubpf_vm* vm,
+    const section* sections,
+    int section_count,
+    const char* strtab_data,
+    int strtab_size,
+    struct relocated_function** functions_by_address,
+    uint total_functions,
+    char** errmsg)
+{
+    const section* btf_section = NULL;
+    const section* ext_section = NULL;
+    for (int i = 0; i < section_count; i++) {
+        if (sections[i].shdr->sh_name >= strtab_size) {
+            continue;
+        }
+        const char* name = strtab_data + sections[i].shdr->sh_name;
+        if (!strcmp(name, ".BTF")) {
+            btf_section = &sections[i];
+        } else if (!strcmp(name, ".BTF.ext")) {
+            ext_section = &sections[i];
+        }
+    }
+
+    struct btf_ext_header header = {0};
+    if (!ext_section) {
+        return 0;
+    }
+    if (ext_section->size < offsetof(struct btf_ext_header, func_info_off)) {
+        *errmsg = ubpf_error("the .BTF.ext section is malformed");
+        return -1;
+    }
+    memcpy(&header, ext_section->data, ext_section->size < sizeof(header) ? ext_section->size : sizeof(header));
+    if (header.magic != 0xeb9f || header.hdr_len > ext_section->size) {
+        *errmsg = ubpf_error("the .BTF.ext section is malformed");
+        return -1;
+    }
+    if (header.hdr_len < sizeof(header) || !header.core_relo_len) {
+        /* Only function and line information, which the loader does not need. */
+        return 0;
+    }
+    uint64_t records_size = ext_section->size - header.hdr_len;
+    if ((uint64_t)header.core_relo_off + header.core_relo_len > records_size ||
+        header.core_relo_len < sizeof(uint32_t)) {
+        *errmsg = ubpf_error("the .BTF.ext section is malformed");
+        return -1;
+    }
+    if (!btf_section) {
+        *errmsg = ubpf_error("the ELF file has CO-RE relocations but no .BTF section");
+        return -1;
+    }
+    if (!vm->host_btf) {
+        *errmsg = ubpf_error("the ELF file has CO-RE relocations but no host BTF is registered");
+        return -1;
+    }
+    struct ubpf_btf* btf = ubpf_btf_parse(btf_section->data, btf_section->size, false, errmsg);
+    if (!btf) {
+        return -1;
+    }
+
+    int result = -1;
+    const uint8_t* relocations = (const uint8_t*)ext_section->data + header.hdr_len + header.core_relo_off;
+    uint32_t record_size;
+    memcpy(&record_size, relocations, sizeof(record_size));
+    if (record_size < sizeof(struct btf_ext_core_relocation)) {
+        *errmsg = ubpf_error("the .BTF.ext section is malformed");
+        goto error;
+    }
+    uint64_t offset = sizeof(record_size);
+    while (offset < header.core_relo_len) {
+        uint32_t block[2]; /* The name of the section and the number of relocations. */
+        if (header.core_relo_len - offset < sizeof(block)) {
+            *errmsg = ubpf_error("the .BTF.ext section is malformed");
+            goto error;
+        }
+        memcpy(block, relocations + offset, sizeof(block));
+        offset += sizeof(block);
+        if ((uint64_t)block[1] * record_size > header.core_relo_len - offset) {
+            *errmsg = ubpf_error("the .BTF.ext section is malformed");
+            goto error;
+        }
+
+        const char* section_name = ubpf_btf_string(btf, block[0]);
+        const Elf64_Shdr* shdr = NULL;
+        for (int i = 0; section_name && i < section_count && !shdr; i++) {
+            const Elf64_Shdr* candidate = sections[i].shdr;
+            if (candidate->sh_type == SHT_PROGBITS && candidate->sh_flags == (SHF_ALLOC | SHF_EXECINSTR) &&
+                candidate->sh_name < strtab_size && !strcmp(strtab_data + candidate->sh_name, section_name)) {
+                shdr = candidate;
+            }
+        }
+        if (!shdr) {
+            *errmsg = ubpf_error("CO-RE relocations of an unknown section");
+            goto error;
+        }
+
+        for (uint32_t i = 0; i < block[1]; i++, offset += record_size) {
+            struct btf_ext_core_relocation relocation;
+            memcpy(&relocation, relocations + offset, sizeof(relocation));
+            struct relocated_function* function =
+                find_function_before(functions_by_address, total_functions, shdr, relocation.insn_off);
+            if (!function || relocation.insn_off % sizeof(struct ebpf_inst) != 0 ||
+                relocation.insn_off >= function->native_section_start + function->size) {
+                *errmsg = ubpf_error("CO-RE relocation of an instruction outside of the functions");
+                goto error;
+            }
+            const char* access = ubpf_btf_string(btf, relocation.access_str_off);
+            if (!access) {
+                *errmsg = ubpf_error("CO-RE relocation with a bad access string");
+                goto error;
+            }
+
+            struct ubpf_core_result value;
+            if (ubpf_btf_resolve_core_relocation(
+                    btf, vm->host_btf, relocation.type_id, access, relocation.kind, &value, errmsg) < 0) {
+                goto error;
+            }
+            uint64_t index = (relocation.insn_off - function->native_section_start) / sizeof(struct ebpf_inst);
+            struct ebpf_inst* inst = (struct ebpf_inst*)function->linked_data + index;
+            uint64_t insts_left = function->size / sizeof(struct ebpf_inst) - index;
+            if (patch_core_relocation(inst, insts_left, relocation.kind, &value, errmsg) < 0) {
+                goto error;
+            }
+        }
+    }
+    result = 0;
+
+error:
+    ubpf_btf_free(btf);
+    return result;
+}
+
+/*
+ * Parse the ELF file, which is only read (in place), and link all of its functions into the
+ * object, in the order of the symbol table except that, if main_first is set, the main function
+ * (see ubpf_elf_object_find_program) lands first. Data and helper relocations are resolved
+ * against the VM; local calls are resolved for that order and recorded so that
+ * ubpf_elf_object_load can move them.
+ */
+static int
+link_object(
+    struct ubpf_vm* vm,
+    const void* elf,
+    size_t elf_size,
+    bool main_first,
+    const char* main_function_name,
+    struct ubpf_elf_object* object,
+    char** errmsg)
 {
     bounds b = {.base = elf, .size = elf_size};
-    void* linked_program = NULL;
     int section_count = -1;
     int i;
     uint total_functions = 0;
-    int load_success = -1;
     struct relocated_function** relocated_functions = NULL;
+    struct relocated_function** functions_by_address = NULL;
+    struct helper_name_table* helper_names = NULL;
+    uint32_t max_data_references = 0;
+    section* sections = NULL;
+    int result = -1;
 
     const Elf64_Ehdr* ehdr = bounds_check(&b, 0, sizeof(*ehdr));
     if (!ehdr) {
@@ -153,7 +831,8 @@ ubpf_load_elf_ex(struct ubpf_vm* vm, const void* elf, size_t elf_size, const cha
         goto error;
     }
 
-    if (ehdr->e_shnum > MAX_SECTIONS) {
+    /* There is no limit on the number of sections, besides what the file can hold. */
+    if ((uint64_t)ehdr->e_shnum * sizeof(Elf64_Shdr) > elf_size) {
         *errmsg = ubpf_error("too many sections");
         goto error;
     }
@@ -161,7 +840,11 @@ ubpf_load_elf_ex(struct ubpf_vm* vm, const void* elf, size_t elf_size, const cha
     section_count = ehdr->e_shnum;
 
     /* Parse section headers into an array */
-    section sections[MAX_SECTIONS];
+    sections = calloc(section_count ? section_count : 1, sizeof(section));
+    if (!sections) {
+        *errmsg = ubpf_error("could not allocate memory for the sections");
+        goto error;
+    }
     uint64_t current_section_header_offset = ehdr->e_shoff;
     for (i = 0; i < section_count; i++) {
         const Elf64_Shdr* shdr = bounds_check(&b, current_section_header_offset, sizeof(Elf64_Ehdr*));
@@ -171,8 +854,9 @@ ubpf_load_elf_ex(struct ubpf_vm* vm, const void* elf, size_t elf_size, const cha
         }
         current_section_header_offset += ehdr->e_shentsize;
 
-        const void* data = bounds_check(&b, shdr->sh_offset, shdr->sh_size);
-        if (!data) {
+        /* A .bss section occupies no space in the file. */
+        const void* data = NULL;
+        if (shdr->sh_type != SHT_NOBITS && !(data = bounds_check(&b, shdr->sh_offset, shdr->sh_size))) {
             *errmsg = ubpf_error("bad section offset or size");
             goto error;
         }
@@ -221,17 +905,18 @@ ubpf_load_elf_ex(struct ubpf_vm* vm, const void* elf, size_t elf_size, const cha
      * Be conservative and assume that each of the symbols represents a function.
      */
     relocated_functions = (struct relocated_function**)calloc(total_symbols, sizeof(struct relocated_function*));
+    object->functions = calloc(total_symbols, sizeof(struct ubpf_elf_function));
 
-    if (relocated_functions == NULL) {
+    if (relocated_functions == NULL || object->functions == NULL) {
         *errmsg = ubpf_error("could not allocate memory for storing information about relocated functions");
         goto error;
     }
 
-    total_functions = 1;
     for (uint64_t i = 0; i < total_symbols; i++) {
         const Elf64_Sym* sym = symbols + i;
 
-        if (ELF64_ST_TYPE(sym->st_info) != STT_FUNC) {
+        /* Undefined functions (helpers and kfuncs) are resolved by the relocations that call them. */
+        if (ELF64_ST_TYPE(sym->st_info) != STT_FUNC || sym->st_shndx == SHN_UNDEF) {
             continue;
         }
 
@@ -246,14 +931,25 @@ ubpf_load_elf_ex(struct ubpf_vm* vm, const void* elf, size_t elf_size, const cha
         }
         rf.name = strtab_data + sym->st_name;
 
-        if (sym->st_shndx > section_count) {
+        if (sym->st_shndx >= section_count) {
             *errmsg = ubpf_error("a function symbol contained a bad section index");
             goto error;
         }
         rf.shdr = sections[sym->st_shndx].shdr;
 
         if (rf.shdr->sh_type != SHT_PROGBITS || rf.shdr->sh_flags != (SHF_ALLOC | SHF_EXECINSTR)) {
-            *errmsg = ubpf_error("function symbol %s points to a non-executable section", sym->st_name);
+            *errmsg = ubpf_error("function symbol %s points to a non-executable section", rf.name);
+            goto error;
+        }
+
+        if (rf.shdr->sh_name >= strtab_size) {
+            *errmsg = ubpf_error("a function symbol's section contained a bad name");
+            goto error;
+        }
+
+        if (sym->st_size % sizeof(struct ebpf_inst) != 0 || sym->st_value > sections[sym->st_shndx].size ||
+            sym->st_size > sections[sym->st_shndx].size - sym->st_value) {
+            *errmsg = ubpf_error("function symbol %s has a bad offset or size", rf.name);
             goto error;
         }
 
@@ -261,49 +957,85 @@ ubpf_load_elf_ex(struct ubpf_vm* vm, const void* elf, size_t elf_size, const cha
 
         rf.size = sym->st_size;
         rf.native_section_start = sym->st_value;
+        rf.index = total_functions;
 
         linked_program_size += rf.size;
 
-        bool is_main_function = (main_function_name && !strcmp(rf.name, main_function_name));
-        /*
-         * When the user did not give us a main function, we assume that the function at the beginning
-         * of the .text section is the main function.
-         */
-        bool is_default_main_function =
-            (!main_function_name && !strcmp(strtab_data + rf.shdr->sh_name, ".text") && rf.native_section_start == 0);
-
-        struct relocated_function* rfp = NULL;
-        if (is_main_function || is_default_main_function) {
-            rfp = relocated_functions[0] = (struct relocated_function*)calloc(1, sizeof(struct relocated_function));
-        } else {
-            rfp = relocated_functions[total_functions++] =
-                (struct relocated_function*)calloc(1, sizeof(struct relocated_function));
-        }
+        struct relocated_function* rfp = relocated_functions[total_functions] =
+            (struct relocated_function*)calloc(1, sizeof(struct relocated_function));
         if (rfp == NULL) {
             *errmsg = ubpf_error("could not allocate space to store metadata about a relocated function");
             goto error;
         }
         memcpy(rfp, &rf, sizeof(struct relocated_function));
+
+        struct ubpf_elf_function* function = &object->functions[total_functions++];
+        object->num_functions = total_functions;
+        function->name = copy_string(rf.name);
+        function->section_name = copy_string(strtab_data + rf.shdr->sh_name);
+        if (!function->name || !function->section_name) {
+            *errmsg = ubpf_error("could not allocate space to store metadata about a relocated function");
+            goto error;
+        }
+        function->num_insts = rf.size / 8;
+        /*
+         * When the user does not give us a main function, we assume that the function at the beginning
+         * of the .text section is the main function.
+         */
+        function->default_main = !strcmp(function->section_name, ".text") && rf.native_section_start == 0;
     }
 
-    if (!relocated_functions[0]) {
-        *errmsg = ubpf_error("%s function not found.", main_function_name);
-        goto error;
+    /*
+     * Functions land in the order of the symbol table, except for the main function (if asked
+     * for), since execution starts at the first instruction.
+     */
+    int main_function_idx = -1;
+    if (main_first) {
+        main_function_idx = ubpf_elf_object_find_program(object, main_function_name);
+        if (main_function_idx < 0) {
+            *errmsg = ubpf_error("%s function not found.", main_function_name);
+            goto error;
+        }
+    }
+    uint64_t current_landing_spot = 0;
+    for (int i = -1; i < (int)total_functions; i++) {
+        int function_idx = i < 0 ? main_function_idx : i;
+        if (function_idx < 0 || (i >= 0 && i == main_function_idx)) {
+            continue;
+        }
+        relocated_functions[function_idx]->landed = current_landing_spot / 8;
+        object->functions[function_idx].landed = current_landing_spot / 8;
+        current_landing_spot += relocated_functions[function_idx]->size;
     }
 
-    linked_program = (char*)calloc(linked_program_size, sizeof(char));
-    if (!linked_program) {
+    object->insts = calloc(linked_program_size, sizeof(char));
+    uint64_t max_calls = total_symbols + 1;
+    object->calls = calloc(max_calls, sizeof(struct ubpf_elf_call));
+    if (!object->insts || !object->calls) {
         *errmsg = ubpf_error("failed to allocate memory for the linked program");
         goto error;
     }
+    object->num_insts = linked_program_size / 8;
 
-    uint64_t current_landing_spot = 0;
     for (uint i = 0; i < total_functions; i++) {
-        memcpy(
-            linked_program + current_landing_spot, relocated_functions[i]->native_data, relocated_functions[i]->size);
-        relocated_functions[i]->landed = current_landing_spot / 8;
-        relocated_functions[i]->linked_data = linked_program + current_landing_spot;
-        current_landing_spot += relocated_functions[i]->size;
+        void* linked_data = (uint8_t*)object->insts + relocated_functions[i]->landed * 8;
+        memcpy(linked_data, relocated_functions[i]->native_data, relocated_functions[i]->size);
+        relocated_functions[i]->linked_data = linked_data;
+    }
+
+    /* Index the functions by section and start, to find the function of each relocation. */
+    functions_by_address = calloc(total_functions ? total_functions : 1, sizeof(struct relocated_function*));
+    if (!functions_by_address) {
+        *errmsg = ubpf_error("could not allocate memory for storing information about relocated functions");
+        goto error;
+    }
+    memcpy(functions_by_address, relocated_functions, total_functions * sizeof(struct relocated_function*));
+    qsort(functions_by_address, total_functions, sizeof(struct relocated_function*), compare_function_addresses);
+
+    if (apply_core_relocations(
+            vm, sections, section_count, strtab_data, strtab_size, functions_by_address, total_functions, errmsg) <
+        0) {
+        goto error;
     }
 
     /* Process each relocation section */
@@ -315,8 +1047,13 @@ ubpf_load_elf_ex(struct ubpf_vm* vm, const void* elf, size_t elf_size, const cha
         }
 
         /* the sh_info field is the index of the section to which these relocations apply. */
-        int relo_applies_to_section = relo_section->shdr->sh_info;
-        int relo_symtab_idx = relo_section->shdr->sh_link;
+        uint32_t relo_applies_to_section = relo_section->shdr->sh_info;
+        uint32_t relo_symtab_idx = relo_section->shdr->sh_link;
+
+        if (relo_applies_to_section >= section_count) {
+            *errmsg = ubpf_error("bad relocation section index");
+            goto error;
+        }
 
         /* Right now the loader only handles relocations that are applied to an executable section. */
         if (sections[relo_applies_to_section].shdr->sh_type != SHT_PROGBITS ||
@@ -360,15 +1097,11 @@ ubpf_load_elf_ex(struct ubpf_vm* vm, const void* elf, size_t elf_size, const cha
              * table entry on its own.
              */
 
-            struct relocated_function* source_function = NULL;
-
-            for (uint i = 0; i < total_functions; i++) {
-                if (sections[relo_applies_to_section].shdr == relocated_functions[i]->shdr &&
-                    relocation.r_offset >= relocated_functions[i]->native_section_start &&
-                    relocation.r_offset < relocated_functions[i]->native_section_start + relocated_functions[i]->size) {
-                    source_function = relocated_functions[i];
-                    break;
-                }
+            struct relocated_function* source_function = find_function_before(
+                functions_by_address, total_functions, sections[relo_applies_to_section].shdr, relocation.r_offset);
+            if (source_function &&
+                relocation.r_offset >= source_function->native_section_start + source_function->size) {
+                source_function = NULL;
             }
 
             if (!source_function) {
@@ -382,11 +1115,6 @@ ubpf_load_elf_ex(struct ubpf_vm* vm, const void* elf, size_t elf_size, const cha
             uint64_t applies_to_inst_index =
                 source_function->landed + ((relocation.r_offset - source_function->native_section_start) / 8);
 
-            if (!source_function) {
-                *errmsg = ubpf_error("an instruction with relocation is not in a function");
-                goto error;
-            }
-
             switch (ELF64_R_TYPE(relocation.r_info)) {
             case R_BPF_64_64: {
                 if (relocation.r_offset + 8 > sections[relo_applies_to_section].size) {
@@ -394,12 +1122,15 @@ ubpf_load_elf_ex(struct ubpf_vm* vm, const void* elf, size_t elf_size, const cha
                     goto error;
                 }
 
-                if (relo_sym.st_shndx > section_count) {
+                if (relo_sym.st_shndx >= section_count) {
                     *errmsg = ubpf_error("bad R_BPF_64_64 relocation section index");
                     goto error;
                 }
                 section* map = &sections[relo_sym.st_shndx];
-                if (map->shdr->sh_type != SHT_PROGBITS || map->shdr->sh_flags != (SHF_ALLOC | SHF_WRITE)) {
+                /* Without a data relocation function, the library instantiates the data sections itself. */
+                bool managed = !vm->data_relocation_function;
+                if (managed ? !is_data_section(map->shdr)
+                            : map->shdr->sh_type != SHT_PROGBITS || map->shdr->sh_flags != (SHF_ALLOC | SHF_WRITE)) {
                     *errmsg = ubpf_error("bad R_BPF_64_64 relocation section");
                     goto error;
                 }
@@ -419,9 +1150,32 @@ ubpf_load_elf_ex(struct ubpf_vm* vm, const void* elf, size_t elf_size, const cha
                     goto error;
                 }
 
-                if (!vm->data_relocation_function) {
-                    *errmsg = ubpf_error("R_BPF_64_64 data relocation function not set");
-                    goto error;
+                if (managed) {
+                    /* The addend (e.g., the offset of a string in .rodata.str1.1) is in the instruction. */
+                    uint64_t target = relo_sym.st_value + (uint32_t)applies_to_inst->imm;
+                    if (target > map->size) {
+                        *errmsg = ubpf_error("bad R_BPF_64_64 relocation addend");
+                        goto error;
+                    }
+
+                    if (object->num_data_references == max_data_references) {
+                        max_data_references = max_data_references ? max_data_references * 2 : 8;
+                        struct ubpf_elf_data_reference* references = realloc(
+                            object->data_references, max_data_references * sizeof(struct ubpf_elf_data_reference));
+                        if (!references) {
+                            *errmsg = ubpf_error("failed to allocate memory for the linked program");
+                            goto error;
+                        }
+                        object->data_references = references;
+                    }
+                    object->data_references[object->num_data_references++] = (struct ubpf_elf_data_reference){
+                        .function = source_function->index,
+                        .offset = applies_to_inst_index - source_function->landed,
+                        .section = relo_sym.st_shndx,
+                        .read_only = !(map->shdr->sh_flags & SHF_WRITE),
+                        .target = target, /* Until the sections are laid out. */
+                    };
+                    break;
                 }
 
                 uint64_t imm = vm->data_relocation_function(
@@ -436,38 +1190,70 @@ ubpf_load_elf_ex(struct ubpf_vm* vm, const void* elf, size_t elf_size, const cha
                 break;
             }
             case R_BPF_64_32: {
-                if (applies_to_inst->src == 1) {
+                if (applies_to_inst->src == 1 && relo_sym.st_shndx != SHN_UNDEF) {
                     // Perform local function call relocation.
                     int target_function_in_section_idx = relo_sym.st_shndx;
 
                     uint offset_in_target_section = (applies_to_inst->imm + 1) * 8;
 
                     struct relocated_function* target_function = NULL;
-                    for (uint i = 0; i < total_functions; i++) {
-                        if (sections[target_function_in_section_idx].shdr == relocated_functions[i]->shdr &&
-                            offset_in_target_section == relocated_functions[i]->native_section_start) {
-                            target_function = relocated_functions[i];
-                            break;
-                        }
+                    if (target_function_in_section_idx < section_count) {
+                        target_function = find_function_before(
+                            functions_by_address,
+                            total_functions,
+                            sections[target_function_in_section_idx].shdr,
+                            offset_in_target_section);
                     }
-                    if (!target_function) {
+                    if (!target_function || target_function->native_section_start != offset_in_target_section) {
                         *errmsg = ubpf_error("relocated target of a function call does not point to a known function");
                         goto error;
                     }
 
+                    if (object->num_calls == max_calls) {
+                        struct ubpf_elf_call* calls =
+                            realloc(object->calls, max_calls * 2 * sizeof(struct ubpf_elf_call));
+                        if (!calls) {
+                            *errmsg = ubpf_error("failed to allocate memory for the linked program");
+                            goto error;
+                        }
+                        object->calls = calls;
+                        max_calls *= 2;
+                    }
+                    object->calls[object->num_calls++] = (struct ubpf_elf_call){
+                        .caller = source_function->index,
+                        .target = target_function->index,
+                        .offset = applies_to_inst_index - source_function->landed,
+                    };
+
                     applies_to_inst->imm = target_function->landed - (applies_to_inst_index + 1);
                 } else {
                     // Perform helper function relocation.
                     // Note: This is a uBPF specific relocation type and is not part of the ELF specification.
                     // It is used to perform resolution from helper function name to helper function id.
                     const char* section_name = strtab_data + relo_sym.st_name;
-                    unsigned int imm = ubpf_lookup_registered_function(vm, section_name);
-                    if (imm == -1) {
+                    if (!helper_names) {
+                        helper_names = calloc(1, sizeof(struct helper_name_table));
+                        if (!helper_names || !build_helper_name_table(vm, helper_names)) {
+                            *errmsg = ubpf_error("could not allocate memory for the helper names");
+                            goto error;
+                        }
+                    }
+                    unsigned int imm = lookup_helper_name(helper_names, section_name);
+                    if (imm != -1) {
+                        applies_to_inst->src = 0;
+                        applies_to_inst->imm = imm;
+                        break;
+                    }
+
+                    // A function that is not a helper may be a kfunc, which is called by its BTF ID.
+                    const struct ubpf_kfunc* kfunc = ubpf_lookup_registered_kfunc(vm, section_name);
+                    if (!kfunc) {
                         *errmsg = ubpf_error("function '%s' not found", section_name);
                         goto error;
                     }
-
-                    applies_to_inst->imm = imm;
+                    applies_to_inst->src = 2;
+                    applies_to_inst->offset = 0;
+                    applies_to_inst->imm = kfunc->btf_id;
                 }
                 break;
             }
@@ -480,10 +1266,12 @@ ubpf_load_elf_ex(struct ubpf_vm* vm, const void* elf, size_t elf_size, const cha
         }
     }
 
-    /*
-     * We got this far -- we'll set a provisional success value.
-     */
-    load_success = 1;
+    if (object->num_data_references && (layout_data_sections(sections, section_count, object, errmsg) < 0 ||
+                                        fold_read_only_loads(object, errmsg) < 0)) {
+        goto error;
+    }
+
+    result = 0;
 
 error:
     for (uint i = 0; i < total_functions; i++) {
@@ -492,12 +1280,210 @@ error:
         }
     }
     free(relocated_functions);
+    free(functions_by_address);
+    free_helper_name_table(helper_names);
+    free(sections);
+    return result;
+}
+
+struct ubpf_elf_object*
+ubpf_elf_object_open(struct ubpf_vm* vm, const void* elf, size_t elf_len, char** errmsg)
+{
+    *errmsg = NULL;
+    struct ubpf_elf_object* object = calloc(1, sizeof(struct ubpf_elf_object));
+    if (!object) {
+        *errmsg = ubpf_error("failed to allocate memory for the ELF object");
+        return NULL;
+    }
+    if (link_object(vm, elf, elf_len, false, NULL, object, errmsg) < 0) {
+        ubpf_elf_object_close(object);
+        return NULL;
+    }
+    return object;
+}
+
+void
+ubpf_elf_object_close(struct ubpf_elf_object* object)
+{
+    if (!object) {
+        return;
+    }
+    for (uint32_t i = 0; i < object->num_functions; i++) {
+        free(object->functions[i].name);
+        free(object->functions[i].section_name);
+    }
+    free(object->functions);
+    free(object->calls);
+    free(object->data_references);
+    free(object->data_image);
+    ubpf_shared_data_release(object->read_only_data);
+    free(object->insts);
+    free(object);
+}
+
+int
+ubpf_elf_object_program_count(const struct ubpf_elf_object* object)
+{
+    return object->num_functions;
+}
+
+const char*
+ubpf_elf_object_program_name(const struct ubpf_elf_object* object, int index)
+{
+    if (index < 0 || index >= (int)object->num_functions) {
+        return NULL;
+    }
+    return object->functions[index].name;
+}
+
+const char*
+ubpf_elf_object_program_section(const struct ubpf_elf_object* object, int index)
+{
+    if (index < 0 || index >= (int)object->num_functions) {
+        return NULL;
+    }
+    return object->functions[index].section_name;
+}
+
+int
+ubpf_elf_object_find_program(const struct ubpf_elf_object* object, const char* name)
+{
+    for (uint32_t i = 0; i < object->num_functions; i++) {
+        const struct ubpf_elf_function* function = &object->functions[i];
+        if (name ? !strcmp(function->name, name) : function->default_main) {
+            return i;
+        }
+    }
+    if (!name) {
+        return -1;
+    }
+    /* Like SEC("xdp"), a section name names the function at the start of the section. */
+    for (uint32_t i = 0; i < object->num_functions; i++) {
+        const struct ubpf_elf_function* function = &object->functions[i];
+        if (!strcmp(function->section_name, name) &&
+            (i == 0 || strcmp(object->functions[i - 1].section_name, name) != 0)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int
+ubpf_elf_object_load(const struct ubpf_elf_object* object, struct ubpf_vm* vm, int index, char** errmsg)
+{
+    *errmsg = NULL;
+    if (index < 0 || index >= (int)object->num_functions) {
+        *errmsg = ubpf_error("program %d not found", index);
+        return -1;
+    }
+
+    uint64_t* landed = malloc(object->num_functions * sizeof(uint64_t));
+    if (!landed) {
+        *errmsg = ubpf_error("failed to allocate memory for the linked program");
+        return -1;
+    }
+
+    /* Only the program and the functions that it calls (directly or not) are loaded. */
+    for (uint32_t i = 0; i < object->num_functions; i++) {
+        landed[i] = FUNCTION_NOT_LANDED;
+    }
+    landed[index] = 0;
+    bool reached_more = true;
+    while (reached_more) {
+        reached_more = false;
+        for (uint32_t i = 0; i < object->num_calls; i++) {
+            const struct ubpf_elf_call* call = &object->calls[i];
+            if (landed[call->caller] != FUNCTION_NOT_LANDED && landed[call->target] == FUNCTION_NOT_LANDED) {
+                landed[call->target] = 0;
+                reached_more = true;
+            }
+        }
+    }
+
+    /*
+     * Execution starts at the first instruction, so the program lands in front of the functions
+     * that it calls (which keep their order).
+     */
+    const struct ubpf_elf_function* main_function = &object->functions[index];
+    uint64_t num_insts = main_function->num_insts;
+    for (uint32_t i = 0; i < object->num_functions; i++) {
+        if (i != (uint32_t)index && landed[i] != FUNCTION_NOT_LANDED) {
+            landed[i] = num_insts;
+            num_insts += object->functions[i].num_insts;
+        }
+    }
+
+    uint32_t code_len = num_insts * sizeof(struct ebpf_inst);
+    if (main_function->landed == 0 && num_insts == object->num_insts && !object->num_data_references) {
+        /*
+         * The program starts the linked program and calls all of it, whose local calls are
+         * already resolved. The VM still gets a copy, since it rewrites its instructions.
+         */
+        free(landed);
+        return ubpf_load(vm, object->insts, code_len, errmsg);
+    }
+
+    struct ebpf_inst* insts = malloc(code_len);
+    if (!insts) {
+        free(landed);
+        *errmsg = ubpf_error("failed to allocate memory for the linked program");
+        return -1;
+    }
+    for (uint32_t i = 0; i < object->num_functions; i++) {
+        const struct ubpf_elf_function* function = &object->functions[i];
+        if (landed[i] != FUNCTION_NOT_LANDED) {
+            memcpy(
+                insts + landed[i], object->insts + function->landed, function->num_insts * sizeof(struct ebpf_inst));
+        }
+    }
+
+    for (uint32_t i = 0; i < object->num_calls; i++) {
+        const struct ubpf_elf_call* call = &object->calls[i];
+        if (landed[call->caller] == FUNCTION_NOT_LANDED) {
+            continue;
+        }
+        uint64_t call_index = landed[call->caller] + call->offset;
+        insts[call_index].imm = landed[call->target] - (call_index + 1);
+    }
+
+    int result = instantiate_data_sections(object, vm, insts, landed, errmsg);
+    free(landed);
+    if (result < 0) {
+        free(insts);
+        return result;
+    }
+    /* The VM takes the linked program over, rather than a copy of it. */
+    result = ubpf_load_in_place(vm, insts, code_len, errmsg);
+    if (result < 0 && object->num_data_references) {
+        ubpf_release_data_sections(vm);
+    }
+    return result;
+}
+
+int
+ubpf_load_elf_ex(struct ubpf_vm* vm, const void* elf, size_t elf_size, const char* main_function_name, char** errmsg)
+{
+    *errmsg = NULL;
+    struct ubpf_elf_object* object = calloc(1, sizeof(struct ubpf_elf_object));
+    if (!object) {
+        *errmsg = ubpf_error("failed to allocate memory for the ELF object");
+        return -1;
+    }
 
-    if (load_success > 0) {
-        load_success = ubpf_load(vm, linked_program, linked_program_size, errmsg);
+    /* Link the main function first, straight into the buffer that the VM keeps. */
+    int result = link_object(vm, elf, elf_size, true, main_function_name, object, errmsg);
+    if (result == 0) {
+        result = instantiate_data_sections(object, vm, object->insts, NULL, errmsg);
+    }
+    if (result == 0) {
+        result = ubpf_load_in_place(vm, object->insts, object->num_insts * sizeof(struct ebpf_inst), errmsg);
+        object->insts = NULL;
+        if (result < 0 && object->num_data_references) {
+            ubpf_release_data_sections(vm);
+        }
     }
-    free(linked_program);
-    return load_success;
+    ubpf_elf_object_close(object);
+    return result;
 }
 
 int
@@ -506,4 +1492,66 @@ ubpf_load_elf(struct ubpf_vm* vm, const void* elf, size_t elf_size, char** errms
     return ubpf_load_elf_ex(vm, elf, elf_size, NULL, errmsg);
 }
 
+int
+ubpf_load_elf_fd(struct ubpf_vm* vm, int fd, const char* main_function_name, char** errmsg)
+{
+    *errmsg = NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        *errmsg = ubpf_error("failed to get the size of the ELF file: %s", strerror(errno));
+        return -1;
+    }
+    if (st.st_size <= 0) {
+        *errmsg = ubpf_error("not enough data for ELF header");
+        return -1;
+    }
+    size_t elf_size = (size_t)st.st_size;
+
+    /*
+     * The file is only read, so map it (rather than copy it) where possible: its pages are then
+     * shared with the page cache and only the ones that the loader touches are faulted in.
+     */
+    void* elf = mmap(NULL, elf_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    bool mapped = elf != MAP_FAILED;
+    if (!mapped) {
+        elf = malloc(elf_size);
+        if (!elf) {
+            *errmsg = ubpf_error("failed to allocate memory for the ELF file");
+            return -1;
+        }
+        size_t offset = 0;
+        while (offset < elf_size) {
+            ssize_t rv = pread(fd, (uint8_t*)elf + offset, elf_size - offset, offset);
+            if (rv <= 0) {
+                *errmsg = ubpf_error("failed to read the ELF file: %s", rv < 0 ? strerror(errno) : "end of file");
+                free(elf);
+                return -1;
+            }
+            offset += rv;
+        }
+    }
+
+    int result = ubpf_load_elf_ex(vm, elf, elf_size, main_function_name, errmsg);
+
+    if (mapped) {
+        munmap(elf, elf_size);
+    } else {
+        free(elf);
+    }
+    return result;
+}
+
+int
+ubpf_load_elf_file(struct ubpf_vm* vm, const char* path, const char* main_function_name, char** errmsg)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        *errmsg = ubpf_error("failed to open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    int result = ubpf_load_elf_fd(vm, fd, main_function_name, errmsg);
+    close(fd);
+    return result;
+}
+
 #endif
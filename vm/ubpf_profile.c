@@ -0,0 +1,257 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include "ubpf_int.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+// This file contains the basic-block profiler: the identification of basic blocks,
+// the counters that the interpreter and the JIT'd code increment when control enters
+// a basic block and the report of the hottest blocks.
+
+/**
+ * @brief Determine whether an instruction transfers control somewhere other than
+ * (or in addition to) the next instruction. The instruction after such an instruction
+ * begins a basic block.
+ */
+static bool
+ends_basic_block(struct ebpf_inst inst)
+{
+    uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+    if (cls != EBPF_CLS_JMP && cls != EBPF_CLS_JMP32) {
+        return false;
+    }
+    // Calls to helpers return to the next instruction without executing any
+    // other instruction of the program.
+    return inst.opcode != EBPF_OP_CALL || inst.src == 1;
+}
+
+bool
+ubpf_profile_allocate(struct ubpf_vm* vm)
+{
+    vm->profile_counts = calloc(vm->num_insts, sizeof(vm->profile_counts[0]));
+    vm->profile_block_starts = calloc(vm->num_insts, sizeof(vm->profile_block_starts[0]));
+    if (!vm->profile_counts || !vm->profile_block_starts) {
+        ubpf_profile_release(vm);
+        return false;
+    }
+
+    vm->profile_block_starts[0] = true;
+    for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+        struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+        if (inst.opcode == EBPF_OP_LDDW) {
+            pc++;
+            continue;
+        }
+        if (!ends_basic_block(inst)) {
+            continue;
+        }
+        if (pc + 1 < vm->num_insts) {
+            vm->profile_block_starts[pc + 1] = true;
+        }
+        if (inst.opcode == EBPF_OP_CALL) {
+            vm->profile_block_starts[pc + inst.imm + 1] = true;
+        } else if (inst.opcode != EBPF_OP_EXIT) {
+            vm->profile_block_starts[pc + inst.offset + 1] = true;
+        }
+    }
+    return true;
+}
+
+void
+ubpf_profile_release(struct ubpf_vm* vm)
+{
+    free(vm->profile_counts);
+    vm->profile_counts = NULL;
+    free(vm->profile_block_starts);
+    vm->profile_block_starts = NULL;
+}
+
+int
+ubpf_toggle_profiling(struct ubpf_vm* vm, bool enable)
+{
+    if (enable && vm->insts && !vm->profile_counts && !ubpf_profile_allocate(vm)) {
+        return -1;
+    }
+    vm->profiling_enabled = enable;
+    ubpf_select_interpreter(vm);
+    return 0;
+}
+
+void
+ubpf_reset_profile(struct ubpf_vm* vm)
+{
+    if (vm->profile_counts) {
+        memset(vm->profile_counts, 0, vm->num_insts * sizeof(vm->profile_counts[0]));
+    }
+}
+
+int
+ubpf_get_profile_count(const struct ubpf_vm* vm, uint16_t pc, uint64_t* count)
+{
+    if (!vm->profile_counts || pc >= vm->num_insts || !vm->profile_block_starts[pc]) {
+        return -1;
+    }
+    *count = vm->profile_counts[pc];
+    return 0;
+}
+
+void
+ubpf_disassemble_instruction(FILE* stream, struct ebpf_inst inst, struct ebpf_inst next)
+{
+    static const char* alu_ops[16] = {
+        "add", "sub", "mul", "div", "or", "and", "lsh", "rsh", "neg", "mod", "xor", "mov", "arsh", NULL, NULL, NULL};
+    static const char* jmp_ops[16] = {
+        "ja", "jeq", "jgt", "jge", "jset", "jne", "jsgt", "jsge", "call", "exit", "jlt", "jle", "jslt", "jsle", NULL, NULL};
+    static const char* sizes[4] = {"w", "h", "b", "dw"};
+
+    uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+    uint8_t op = inst.opcode >> 4;
+    bool source_register = inst.opcode & EBPF_SRC_REG;
+    const char* size = sizes[(inst.opcode >> 3) & 3];
+    const char* suffix = (cls == EBPF_CLS_ALU || cls == EBPF_CLS_JMP32) ? "32" : "";
+
+    switch (cls) {
+    case EBPF_CLS_ALU:
+    case EBPF_CLS_ALU64:
+        if (op == 0xd) {
+            fprintf(stream, "%s%d %%r%d", source_register ? "be" : "le", inst.imm, inst.dst);
+        } else if (!alu_ops[op]) {
+            fprintf(stream, "unknown 0x%02x", inst.opcode);
+        } else if (op == 0x8) {
+            fprintf(stream, "%s%s %%r%d", alu_ops[op], suffix, inst.dst);
+        } else if (source_register) {
+            fprintf(stream, "%s%s %%r%d, %%r%d", alu_ops[op], suffix, inst.dst, inst.src);
+        } else {
+            fprintf(stream, "%s%s %%r%d, %#x", alu_ops[op], suffix, inst.dst, inst.imm);
+        }
+        break;
+    case EBPF_CLS_JMP:
+    case EBPF_CLS_JMP32:
+        if (!jmp_ops[op]) {
+            fprintf(stream, "unknown 0x%02x", inst.opcode);
+        } else if (inst.opcode == EBPF_OP_EXIT) {
+            fprintf(stream, "exit");
+        } else if (inst.opcode == EBPF_OP_CALL) {
+            fprintf(stream, "call%s %#x", inst.src == 1 ? " local" : inst.src == 2 ? " kfunc" : "", inst.imm);
+        } else if (op == 0x0) {
+            fprintf(stream, "ja%s %+d", suffix, inst.offset);
+        } else if (source_register) {
+            fprintf(stream, "%s%s %%r%d, %%r%d, %+d", jmp_ops[op], suffix, inst.dst, inst.src, inst.offset);
+        } else {
+            fprintf(stream, "%s%s %%r%d, %#x, %+d", jmp_ops[op], suffix, inst.dst, inst.imm, inst.offset);
+        }
+        break;
+    case EBPF_CLS_LD:
+        if (inst.opcode == EBPF_OP_LDDW) {
+            fprintf(
+                stream, "lddw %%r%d, %#" PRIx64, inst.dst, ((uint64_t)(uint32_t)next.imm << 32) | (uint32_t)inst.imm);
+        } else {
+            fprintf(stream, "unknown 0x%02x", inst.opcode);
+        }
+        break;
+    case EBPF_CLS_LDX:
+        fprintf(stream, "ldx%s %%r%d, [%%r%d%+d]", size, inst.dst, inst.src, inst.offset);
+        break;
+    case EBPF_CLS_ST:
+        fprintf(stream, "st%s [%%r%d%+d], %#x", size, inst.dst, inst.offset, inst.imm);
+        break;
+    case EBPF_CLS_STX:
+        if ((inst.opcode & 0xe0) == EBPF_MODE_ATOMIC) {
+            fprintf(stream, "atomic%s [%%r%d%+d], %%r%d, %#x", size, inst.dst, inst.offset, inst.src, inst.imm);
+        } else {
+            fprintf(stream, "stx%s [%%r%d%+d], %%r%d", size, inst.dst, inst.offset, inst.src);
+        }
+        break;
+    }
+}
+
+struct profiled_block
+{
+    uint16_t start;
+    uint16_t end; // One past the last instruction of the block.
+    uint64_t count;
+    uint64_t instructions;
+};
+
+static int
+compare_profiled_blocks(const void* a, const void* b)
+{
+    const struct profiled_block* left = a;
+    const struct profiled_block* right = b;
+    if (left->instructions != right->instructions) {
+        return left->instructions < right->instructions ? 1 : -1;
+    }
+    return (int)left->start - (int)right->start;
+}
+
+int
+ubpf_dump_profile(const struct ubpf_vm* vm, FILE* stream, uint32_t max_blocks)
+{
+    if (!vm->profile_counts) {
+        return -1;
+    }
+
+    uint32_t num_blocks = 0;
+    for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+        num_blocks += vm->profile_block_starts[pc];
+    }
+
+    struct profiled_block* blocks = calloc(num_blocks, sizeof(*blocks));
+    if (!blocks) {
+        return -1;
+    }
+
+    uint64_t total_instructions = 0;
+    uint32_t block = 0;
+    for (uint32_t pc = 0; pc < vm->num_insts; pc++) {
+        if (vm->profile_block_starts[pc]) {
+            blocks[block].start = pc;
+            blocks[block].count = vm->profile_counts[pc];
+            block++;
+        }
+        // The two halves of an LDDW count as a single instruction.
+        if (ubpf_fetch_instruction(vm, pc).opcode == EBPF_OP_LDDW) {
+            pc++;
+        }
+        blocks[block - 1].end = pc + 1;
+        blocks[block - 1].instructions += blocks[block - 1].count;
+        total_instructions += blocks[block - 1].count;
+    }
+
+    qsort(blocks, num_blocks, sizeof(*blocks), compare_profiled_blocks);
+
+    if (max_blocks == 0 || max_blocks > num_blocks) {
+        max_blocks = num_blocks;
+    }
+
+    fprintf(stream, "%" PRIu64 " instructions executed in %u basic blocks\n", total_instructions, num_blocks);
+    for (block = 0; block < max_blocks && blocks[block].count; block++) {
+        const struct profiled_block* b = &blocks[block];
+        fprintf(
+            stream,
+            "\nblock %u-%u: %" PRIu64 " entries, %" PRIu64 " instructions (%.1f%%)\n",
+            b->start,
+            b->end - 1,
+            b->count,
+            b->instructions,
+            100.0 * b->instructions / total_instructions);
+        for (uint32_t pc = b->start; pc < b->end; pc++) {
+            struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc);
+            struct ebpf_inst next = {0};
+            if (inst.opcode == EBPF_OP_LDDW && pc + 1 < vm->num_insts) {
+                next = ubpf_fetch_instruction(vm, pc + 1);
+            }
+            fprintf(stream, "  %5u: ", pc);
+            ubpf_disassemble_instruction(stream, inst, next);
+            fprintf(stream, "\n");
+            if (inst.opcode == EBPF_OP_LDDW) {
+                pc++;
+            }
+        }
+    }
+
+    free(blocks);
+    return 0;
+}
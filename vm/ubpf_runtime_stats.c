@@ -0,0 +1,545 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+// This file contains the runtime statistics of a VM: the number of runs of the program, the
+// time they took, the number of calls to each helper, a histogram of the exit codes and
+// (optionally) histograms of the latency of each helper. The helpers are counted by their slot
+// in the program's table of helpers (see resolve_helper_call), which maps back to their IDs. Each thread that runs the program
+// updates its own block of counters (so that threads do not contend for the counters); a
+// snapshot sums the blocks of all threads. The blocks of a thread that exits are adopted by
+// the next thread that starts to run the program, so a VM has at most one block per thread
+// that runs it concurrently.
+
+#include "ubpf_int.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define UBPF_THREAD_LOCAL __declspec(thread)
+#else
+#define UBPF_THREAD_LOCAL _Thread_local
+#endif
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(_MSC_VER)
+#include <x86intrin.h>
+#endif
+
+struct ubpf_runtime_stats_registry
+{
+    uint64_t id; ///< Never reused (unlike the address of a VM), so it can key the per-thread cache.
+    volatile long lock;
+    struct ubpf_runtime_stats_block* blocks;
+};
+
+// The number of (VM, block) pairs that each thread remembers.
+#define RUNTIME_STATS_CACHE_SIZE 4
+
+struct runtime_stats_cache_entry
+{
+    uint64_t id;
+    struct ubpf_runtime_stats_block* block;
+};
+
+/**
+ * @brief The identity of a thread that runs programs with runtime statistics: the owner of its
+ * blocks. When the thread exits, the identity (and with it, the blocks) passes to another thread.
+ */
+struct runtime_stats_thread
+{
+    struct runtime_stats_thread* next_free;
+};
+
+static UBPF_THREAD_LOCAL struct runtime_stats_cache_entry runtime_stats_cache[RUNTIME_STATS_CACHE_SIZE];
+static UBPF_THREAD_LOCAL struct runtime_stats_thread* runtime_stats_current_thread;
+
+// The identities of the threads that have exited (never freed: there are as many as the most
+// threads that ever ran programs with runtime statistics at once).
+static volatile long runtime_stats_threads_lock;
+static struct runtime_stats_thread* free_runtime_stats_threads;
+
+#if defined(_WIN32)
+static INIT_ONCE runtime_stats_once = INIT_ONCE_STATIC_INIT;
+static DWORD runtime_stats_thread_key = FLS_OUT_OF_INDEXES;
+#else
+static pthread_once_t runtime_stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t runtime_stats_thread_key;
+static bool runtime_stats_thread_key_created;
+#endif
+
+static uint64_t next_runtime_stats_id = 1;
+
+// Counts the runs of threads for which no block could be allocated.
+static struct ubpf_runtime_stats_block overflow_block;
+
+// The latency of the calls to one helper (in ticks), with buckets in the style of an HDR
+// histogram: each power of two is split into four buckets of equal width, so that each
+// bucket's width is at most a quarter of its lower bound.
+struct ubpf_helper_latency_histogram
+{
+    uint64_t total_ticks;
+    uint64_t max_ticks;
+    uint64_t buckets[UBPF_HELPER_LATENCY_BUCKETS];
+};
+
+#define LATENCY_SUB_BUCKET_BITS 2
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+
+static void
+acquire_lock(volatile long* lock)
+{
+#if defined(_MSC_VER)
+    while (_InterlockedExchange(lock, 1)) {
+    }
+#else
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+    }
+#endif
+}
+
+static void
+release_lock(volatile long* lock)
+{
+#if defined(_MSC_VER)
+    _InterlockedExchange(lock, 0);
+#else
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+#endif
+}
+
+static void
+lock_registry(struct ubpf_runtime_stats_registry* registry)
+{
+    acquire_lock(&registry->lock);
+}
+
+static void
+unlock_registry(struct ubpf_runtime_stats_registry* registry)
+{
+    release_lock(&registry->lock);
+}
+
+static uint64_t
+monotonic_ns(void)
+{
+    struct timespec now;
+#if defined(_WIN32)
+    timespec_get(&now, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+uint64_t
+ubpf_runtime_stats_ticks(void)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return monotonic_ns();
+#endif
+}
+
+// The point against which the tick counter is calibrated (x86-64 does not report its frequency).
+static uint64_t calibration_ticks;
+static uint64_t calibration_ns;
+
+static uint64_t
+ticks_to_ns(uint64_t ticks)
+{
+#if defined(__aarch64__)
+    uint64_t frequency;
+    __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(frequency));
+    return (uint64_t)((double)ticks * 1e9 / frequency);
+#elif defined(__x86_64__) || defined(_M_X64)
+    uint64_t elapsed_ticks = ubpf_runtime_stats_ticks() - calibration_ticks;
+    uint64_t elapsed_ns = monotonic_ns() - calibration_ns;
+    if (!elapsed_ticks) {
+        return 0;
+    }
+    return (uint64_t)((double)ticks * elapsed_ns / elapsed_ticks);
+#else
+    return ticks;
+#endif
+}
+
+/**
+ * @brief Hand the identity of an exiting thread over to the next thread that needs one.
+ */
+#if defined(_WIN32)
+static void WINAPI
+#else
+static void
+#endif
+release_runtime_stats_thread(void* value)
+{
+    struct runtime_stats_thread* thread = value;
+    // Should the thread run a program from here on (e.g., in another destructor), it starts afresh.
+    runtime_stats_current_thread = NULL;
+    memset(runtime_stats_cache, 0, sizeof(runtime_stats_cache));
+    acquire_lock(&runtime_stats_threads_lock);
+    thread->next_free = free_runtime_stats_threads;
+    free_runtime_stats_threads = thread;
+    release_lock(&runtime_stats_threads_lock);
+}
+
+/**
+ * @brief Calibrate the tick counter and create the key whose destructor releases the identity
+ * of a thread (once per process).
+ */
+#if defined(_WIN32)
+static BOOL CALLBACK
+initialize_runtime_stats(PINIT_ONCE once, void* parameter, void** context)
+{
+    UNUSED_PARAMETER(once);
+    UNUSED_PARAMETER(parameter);
+    UNUSED_PARAMETER(context);
+    calibration_ns = monotonic_ns();
+    calibration_ticks = ubpf_runtime_stats_ticks();
+    runtime_stats_thread_key = FlsAlloc(release_runtime_stats_thread);
+    return TRUE;
+}
+#else
+static void
+initialize_runtime_stats(void)
+{
+    calibration_ns = monotonic_ns();
+    calibration_ticks = ubpf_runtime_stats_ticks();
+    runtime_stats_thread_key_created =
+        pthread_key_create(&runtime_stats_thread_key, release_runtime_stats_thread) == 0;
+}
+#endif
+
+/**
+ * @brief Get the identity of the calling thread, adopting that of a thread that has exited if
+ * there is one.
+ *
+ * @return The identity or NULL if it could not be allocated.
+ */
+static struct runtime_stats_thread*
+current_runtime_stats_thread(void)
+{
+    if (runtime_stats_current_thread) {
+        return runtime_stats_current_thread;
+    }
+
+    acquire_lock(&runtime_stats_threads_lock);
+    struct runtime_stats_thread* thread = free_runtime_stats_threads;
+    if (thread) {
+        free_runtime_stats_threads = thread->next_free;
+    }
+    release_lock(&runtime_stats_threads_lock);
+    if (!thread) {
+        thread = calloc(1, sizeof(*thread));
+        if (!thread) {
+            return NULL;
+        }
+    }
+
+    // Without a destructor, the identity (and the blocks that it owns) is never handed over.
+#if defined(_WIN32)
+    if (runtime_stats_thread_key != FLS_OUT_OF_INDEXES) {
+        FlsSetValue(runtime_stats_thread_key, thread);
+    }
+#else
+    if (runtime_stats_thread_key_created) {
+        pthread_setspecific(runtime_stats_thread_key, thread);
+    }
+#endif
+    runtime_stats_current_thread = thread;
+    return thread;
+}
+
+static unsigned int
+latency_bucket(uint64_t ticks)
+{
+    if (ticks < LATENCY_SUB_BUCKETS) {
+        return (unsigned int)ticks;
+    }
+    unsigned int msb = 63;
+    while (!(ticks >> msb)) {
+        msb--;
+    }
+    unsigned int bucket = (msb - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS +
+                          ((ticks >> (msb - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+    return bucket < UBPF_HELPER_LATENCY_BUCKETS ? bucket : UBPF_HELPER_LATENCY_BUCKETS - 1;
+}
+
+// The largest number of ticks counted in the given bucket.
+static uint64_t
+latency_bucket_limit(unsigned int bucket)
+{
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    if (bucket == UBPF_HELPER_LATENCY_BUCKETS - 1) {
+        return UINT64_MAX;
+    }
+    unsigned int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    uint64_t lower = (uint64_t)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) << shift;
+    return lower + ((uint64_t)1 << shift) - 1;
+}
+
+int
+ubpf_toggle_runtime_stats(struct ubpf_vm* vm, bool enable)
+{
+    if (enable && !vm->runtime_stats) {
+        vm->runtime_stats = calloc(1, sizeof(*vm->runtime_stats));
+        if (!vm->runtime_stats) {
+            return -1;
+        }
+        vm->runtime_stats->id = UBPF_ATOMIC_ADD_FETCH(&next_runtime_stats_id, 1);
+#if defined(_WIN32)
+        InitOnceExecuteOnce(&runtime_stats_once, initialize_runtime_stats, NULL, NULL);
+#else
+        pthread_once(&runtime_stats_once, initialize_runtime_stats);
+#endif
+    }
+    vm->runtime_stats_enabled = enable;
+    if (!enable) {
+        vm->helper_latency_enabled = false;
+    }
+    return 0;
+}
+
+int
+ubpf_toggle_helper_latency(struct ubpf_vm* vm, bool enable)
+{
+    if (enable && ubpf_toggle_runtime_stats(vm, true) != 0) {
+        return -1;
+    }
+    vm->helper_latency_enabled = enable;
+    return 0;
+}
+
+struct ubpf_runtime_stats_block*
+ubpf_runtime_stats_enter(const struct ubpf_vm* vm)
+{
+    struct ubpf_runtime_stats_registry* registry = vm->runtime_stats;
+    struct runtime_stats_cache_entry* entry = &runtime_stats_cache[registry->id % RUNTIME_STATS_CACHE_SIZE];
+    if (entry->id == registry->id) {
+        return entry->block;
+    }
+    struct runtime_stats_thread* thread = current_runtime_stats_thread();
+    if (!thread) {
+        return &overflow_block;
+    }
+
+    lock_registry(registry);
+    struct ubpf_runtime_stats_block* block = registry->blocks;
+    while (block && block->owner != thread) {
+        block = block->next;
+    }
+    if (!block) {
+        block = calloc(1, sizeof(*block));
+        if (block) {
+            block->owner = thread;
+            block->next = registry->blocks;
+            registry->blocks = block;
+        }
+    }
+    unlock_registry(registry);
+
+    if (!block) {
+        return &overflow_block;
+    }
+    entry->id = registry->id;
+    entry->block = block;
+    return block;
+}
+
+void
+ubpf_runtime_stats_exit(struct ubpf_runtime_stats_block* block, uint64_t start_ticks, uint64_t result)
+{
+    block->run_count++;
+    block->run_ticks += ubpf_runtime_stats_ticks() - start_ticks;
+    block->exit_codes[result < UBPF_RUNTIME_STATS_EXIT_CODES - 1 ? result : UBPF_RUNTIME_STATS_EXIT_CODES - 1]++;
+}
+
+void
+ubpf_runtime_stats_fail(struct ubpf_runtime_stats_block* block, uint64_t start_ticks)
+{
+    block->run_count++;
+    block->run_ticks += ubpf_runtime_stats_ticks() - start_ticks;
+    block->error_count++;
+}
+
+void
+ubpf_runtime_stats_helper_latency(struct ubpf_runtime_stats_block* block, unsigned int index, uint64_t start_ticks)
+{
+    uint64_t ticks = ubpf_runtime_stats_ticks() - start_ticks;
+    // The histograms are large, so they are only allocated for the threads that use them
+    // (and never for the block that all threads share).
+    if (!block->helper_latency && block != &overflow_block) {
+        block->helper_latency = calloc(UBPF_RUNTIME_STATS_HELPERS, sizeof(*block->helper_latency));
+    }
+    if (!block->helper_latency || index >= UBPF_RUNTIME_STATS_HELPERS) {
+        return;
+    }
+    struct ubpf_helper_latency_histogram* histogram = &block->helper_latency[index];
+    histogram->total_ticks += ticks;
+    if (ticks > histogram->max_ticks) {
+        histogram->max_ticks = ticks;
+    }
+    histogram->buckets[latency_bucket(ticks)]++;
+}
+
+int
+ubpf_get_runtime_stats(const struct ubpf_vm* vm, struct ubpf_runtime_stats* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    struct ubpf_runtime_stats_registry* registry = vm->runtime_stats;
+    if (!registry) {
+        return -1;
+    }
+
+    // The blocks of other threads are read while those threads may update them: each counter
+    // is consistent but the snapshot as a whole is not atomic.
+    stats->helper_count = vm->helper_table_size;
+    for (uint32_t slot = 0; slot < vm->helper_table_size && slot < UBPF_RUNTIME_STATS_HELPERS; slot++) {
+        const struct ubpf_helper* helper = ubpf_find_helper(vm, vm->helper_table_ids[slot]);
+        stats->helper_ids[slot] = vm->helper_table_ids[slot];
+        stats->helper_names[slot] = helper ? helper->name : NULL;
+    }
+
+    uint64_t run_ticks = 0;
+    lock_registry(registry);
+    for (const struct ubpf_runtime_stats_block* block = registry->blocks; block; block = block->next) {
+        stats->run_count += block->run_count;
+        run_ticks += block->run_ticks;
+        stats->error_count += block->error_count;
+        for (int i = 0; i < UBPF_RUNTIME_STATS_HELPERS; i++) {
+            stats->helper_call_counts[i] += block->helper_calls[i];
+        }
+        for (int i = 0; i < UBPF_RUNTIME_STATS_EXIT_CODES; i++) {
+            stats->exit_code_counts[i] += block->exit_codes[i];
+        }
+    }
+    unlock_registry(registry);
+
+    stats->run_time_ns = ticks_to_ns(run_ticks);
+    return 0;
+}
+
+int
+ubpf_get_helper_latency(const struct ubpf_vm* vm, unsigned int index, struct ubpf_helper_latency* latency)
+{
+    memset(latency, 0, sizeof(*latency));
+    struct ubpf_runtime_stats_registry* registry = vm->runtime_stats;
+    if (!registry) {
+        return -1;
+    }
+    const struct ubpf_helper* helper = ubpf_find_helper(vm, index);
+    latency->name = helper ? helper->name : NULL;
+    uint32_t slot = 0;
+    while (slot < vm->helper_table_size && vm->helper_table_ids[slot] != index) {
+        slot++;
+    }
+
+    uint64_t total_ticks = 0;
+    uint64_t max_ticks = 0;
+    lock_registry(registry);
+    for (const struct ubpf_runtime_stats_block* block = registry->blocks; block; block = block->next) {
+        if (!block->helper_latency || slot >= vm->helper_table_size || slot >= UBPF_RUNTIME_STATS_HELPERS) {
+            continue;
+        }
+        const struct ubpf_helper_latency_histogram* histogram = &block->helper_latency[slot];
+        total_ticks += histogram->total_ticks;
+        if (histogram->max_ticks > max_ticks) {
+            max_ticks = histogram->max_ticks;
+        }
+        for (int i = 0; i < UBPF_HELPER_LATENCY_BUCKETS; i++) {
+            latency->bucket_counts[i] += histogram->buckets[i];
+            latency->call_count += histogram->buckets[i];
+        }
+    }
+    unlock_registry(registry);
+
+    latency->total_ns = ticks_to_ns(total_ticks);
+    latency->max_ns = ticks_to_ns(max_ticks);
+    for (unsigned int i = 0; i < UBPF_HELPER_LATENCY_BUCKETS; i++) {
+        uint64_t limit = latency_bucket_limit(i);
+        latency->bucket_limits_ns[i] = limit == UINT64_MAX ? UINT64_MAX : ticks_to_ns(limit);
+    }
+    return 0;
+}
+
+uint64_t
+ubpf_helper_latency_percentile(const struct ubpf_helper_latency* latency, double percentile)
+{
+    uint64_t threshold = (uint64_t)(percentile / 100 * latency->call_count);
+    uint64_t count = 0;
+    for (int i = 0; i < UBPF_HELPER_LATENCY_BUCKETS; i++) {
+        count += latency->bucket_counts[i];
+        if (count && count >= threshold) {
+            // The limit of the last bucket is unbounded; the slowest call bounds it instead.
+            return latency->bucket_limits_ns[i] < latency->max_ns ? latency->bucket_limits_ns[i] : latency->max_ns;
+        }
+    }
+    return 0;
+}
+
+void
+ubpf_runtime_stats_reset_helpers(struct ubpf_vm* vm)
+{
+    struct ubpf_runtime_stats_registry* registry = vm->runtime_stats;
+    if (!registry) {
+        return;
+    }
+    lock_registry(registry);
+    for (struct ubpf_runtime_stats_block* block = registry->blocks; block; block = block->next) {
+        memset(block->helper_calls, 0, sizeof(block->helper_calls));
+        if (block->helper_latency) {
+            memset(block->helper_latency, 0, UBPF_RUNTIME_STATS_HELPERS * sizeof(block->helper_latency[0]));
+        }
+    }
+    unlock_registry(registry);
+}
+
+size_t
+ubpf_runtime_stats_size(const struct ubpf_vm* vm)
+{
+    struct ubpf_runtime_stats_registry* registry = vm->runtime_stats;
+    if (!registry) {
+        return 0;
+    }
+    size_t size = sizeof(*registry);
+    lock_registry(registry);
+    for (const struct ubpf_runtime_stats_block* block = registry->blocks; block; block = block->next) {
+        size += sizeof(*block);
+        if (block->helper_latency) {
+            size += UBPF_RUNTIME_STATS_HELPERS * sizeof(block->helper_latency[0]);
+        }
+    }
+    unlock_registry(registry);
+    return size;
+}
+
+void
+ubpf_runtime_stats_release(struct ubpf_vm* vm)
+{
+    if (!vm->runtime_stats) {
+        return;
+    }
+    struct ubpf_runtime_stats_block* block = vm->runtime_stats->blocks;
+    while (block) {
+        struct ubpf_runtime_stats_block* next = block->next;
+        free(block->helper_latency);
+        free(block);
+        block = next;
+    }
+    free(vm->runtime_stats);
+    vm->runtime_stats = NULL;
+}
@@ -0,0 +1,296 @@
+// Copyright (c) Microsoft Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+// This file contains the recording and replay of execution traces. A trace holds what a run
+// of the program could not compute by itself: the values that helpers returned and the values
+// that it loaded (or that atomic operations fetched) from memory other than the bytes of its
+// stack that it stored since it last called a helper (which may have written to the stack as
+// well). It also holds the direction of each conditional branch (one bit per branch), against
+// which a replay checks that it follows the same path.
+//
+// The layout of a trace is a header, the values (each as wide as the access that produced
+// it) and the packed branch directions. While recording, the branch directions grow down
+// from the end of the buffer (so that the two logs can share it without knowing their sizes
+// in advance) and are moved after the values when the run ends.
+
+#include "ubpf_int.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_MAGIC 0x52544255 // "UBTR"
+#define TRACE_VERSION 2
+
+struct ubpf_trace_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint64_t program_hash; ///< Identifies the program that was traced.
+    uint64_t mem;          ///< The address of the memory given to the program.
+    uint64_t mem_len;      ///< The length of that memory.
+    int32_t status;        ///< The result of the run (0 or -1).
+    uint32_t reserved2;
+    uint64_t return_value; ///< The value that the program returned (if the run succeeded).
+    uint64_t value_bytes;  ///< The size of the values that follow the header.
+    uint64_t branch_count; ///< The number of branch directions that follow the values.
+};
+
+uint64_t
+ubpf_trace_program_hash(const struct ebpf_inst* insts, uint32_t num_insts)
+{
+    // FNV-1a.
+    uint64_t hash = 0xcbf29ce484222325;
+    const uint8_t* bytes = (const uint8_t*)insts;
+    for (size_t i = 0; i < num_insts * sizeof(insts[0]); i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+static bool
+on_stack(const struct ubpf_trace* trace, uint64_t address)
+{
+    return address >= trace->stack_start && address < trace->stack_end;
+}
+
+/**
+ * @brief Determine whether the run itself stored each of the bytes at the given address since it last called a
+ * helper, so that a replay computes their value as well.
+ */
+static bool
+stored_by_run(const struct ubpf_trace* trace, uint64_t address, size_t size)
+{
+    if (!on_stack(trace, address) || size > trace->stack_end - address) {
+        return false;
+    }
+    for (uint64_t offset = address - trace->stack_start; size > 0; offset++, size--) {
+        if (!(trace->stack_stored[offset / 8] & (1 << (offset % 8)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+record_value(struct ubpf_trace* trace, uint64_t value, size_t size)
+{
+    if (trace->failed || trace->value_offset + size > trace->branch_limit) {
+        trace->failed = true;
+        return;
+    }
+    // Like the interpreter's unaligned loads and stores, this assumes a little-endian host.
+    memcpy(trace->buffer + trace->value_offset, &value, size);
+    trace->value_offset += size;
+}
+
+static uint64_t
+replay_value(struct ubpf_trace* trace, size_t size)
+{
+    uint64_t value = 0;
+    if (trace->failed || trace->value_offset + size > trace->value_end) {
+        trace->failed = true;
+        return 0;
+    }
+    memcpy(&value, trace->buffer + trace->value_offset, size);
+    trace->value_offset += size;
+    return value;
+}
+
+uint64_t
+ubpf_trace_load(struct ubpf_trace* trace, uint64_t address, size_t size)
+{
+    bool stored = stored_by_run(trace, address, size);
+    if (trace->replaying && !stored) {
+        return replay_value(trace, size);
+    }
+    uint64_t value = 0;
+    memcpy(&value, (const void*)(uintptr_t)address, size);
+    if (!trace->replaying && !stored) {
+        record_value(trace, value, size);
+    }
+    return value;
+}
+
+bool
+ubpf_trace_accesses_memory(const struct ubpf_trace* trace, uint64_t address)
+{
+    return !trace->replaying || on_stack(trace, address);
+}
+
+bool
+ubpf_trace_store(struct ubpf_trace* trace, uint64_t address, size_t size)
+{
+    if (on_stack(trace, address) && size <= trace->stack_end - address) {
+        for (uint64_t offset = address - trace->stack_start; size > 0; offset++, size--) {
+            trace->stack_stored[offset / 8] |= (uint8_t)(1 << (offset % 8));
+        }
+    }
+    return ubpf_trace_accesses_memory(trace, address);
+}
+
+bool
+ubpf_trace_updates_memory(const struct ubpf_trace* trace, uint64_t address, size_t size)
+{
+    return !trace->replaying || stored_by_run(trace, address, size);
+}
+
+void
+ubpf_trace_record_fetch(struct ubpf_trace* trace, uint64_t address, size_t size, uint64_t value)
+{
+    if (!trace->replaying && !stored_by_run(trace, address, size)) {
+        record_value(trace, value, size);
+    }
+}
+
+void
+ubpf_trace_record_helper(struct ubpf_trace* trace, uint64_t value)
+{
+    if (!trace->replaying) {
+        record_value(trace, value, sizeof(value));
+    }
+    // The helper may have written to the stack (a replay does not call it).
+    memset(trace->stack_stored, 0, sizeof(trace->stack_stored));
+}
+
+uint64_t
+ubpf_trace_replay_value(struct ubpf_trace* trace, size_t size)
+{
+    return replay_value(trace, size);
+}
+
+bool
+ubpf_trace_branch(struct ubpf_trace* trace, bool taken)
+{
+    uint64_t branch = trace->branch_count;
+    uint8_t bit = (uint8_t)(1 << (branch % 8));
+    if (trace->replaying) {
+        if (trace->failed || branch >= trace->branch_limit) {
+            trace->failed = true;
+            return false;
+        }
+        trace->branch_count++;
+        if (((trace->branches[branch / 8] & bit) != 0) != taken) {
+            trace->failed = true;
+            return false;
+        }
+        return true;
+    }
+
+    if (trace->failed) {
+        return true;
+    }
+    if (branch % 8 == 0) {
+        // Claim another byte (just below the previous one) for the next eight branches.
+        if (trace->branch_limit <= trace->value_offset) {
+            trace->failed = true;
+            return true;
+        }
+        trace->branch_limit--;
+        trace->buffer[trace->branch_limit] = 0;
+    }
+    if (taken) {
+        trace->buffer[trace->branch_limit] |= bit;
+    }
+    trace->branch_count++;
+    return true;
+}
+
+int
+ubpf_exec_traced(
+    const struct ubpf_vm* vm, void* mem, size_t mem_len, uint64_t* bpf_return_value, void* trace, size_t trace_size,
+    size_t* trace_length)
+{
+    uint64_t stack[UBPF_EBPF_STACK_SIZE / sizeof(uint64_t)];
+    struct ubpf_trace_header header = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .program_hash = vm->program_hash,
+        .mem = (uint64_t)(uintptr_t)mem,
+        .mem_len = mem_len,
+    };
+    struct ubpf_trace state = {
+        .buffer = trace,
+        .size = trace_size,
+        .failed = trace_size < sizeof(header),
+        .value_offset = sizeof(header),
+        .branch_limit = trace_size,
+        .stack_start = (uintptr_t)stack,
+        .stack_end = (uintptr_t)stack + sizeof(stack),
+    };
+
+    uint64_t return_value = 0;
+    int result = ubpf_exec_with_trace(vm, mem, mem_len, &return_value, (uint8_t*)stack, sizeof(stack), &state);
+    *bpf_return_value = return_value;
+
+    *trace_length = 0;
+    if (state.failed) {
+        return result;
+    }
+
+    // Move the branch directions (which were stored in reverse order at the end of the
+    // buffer) just after the values and put them in order.
+    uint8_t* buffer = trace;
+    size_t branch_bytes = (state.branch_count + 7) / 8;
+    uint8_t* branches = memmove(buffer + state.value_offset, buffer + state.branch_limit, branch_bytes);
+    for (size_t i = 0; i < branch_bytes / 2; i++) {
+        uint8_t byte = branches[i];
+        branches[i] = branches[branch_bytes - 1 - i];
+        branches[branch_bytes - 1 - i] = byte;
+    }
+
+    header.status = result;
+    header.return_value = return_value;
+    header.value_bytes = state.value_offset - sizeof(header);
+    header.branch_count = state.branch_count;
+    memcpy(buffer, &header, sizeof(header));
+    *trace_length = state.value_offset + branch_bytes;
+    return result;
+}
+
+int
+ubpf_replay_trace(const struct ubpf_vm* vm, const void* trace, size_t trace_length, uint64_t* bpf_return_value)
+{
+    struct ubpf_trace_header header;
+    if (trace_length < sizeof(header)) {
+        vm->error_printf(stderr, "uBPF error: the trace is too short\n");
+        return -1;
+    }
+    memcpy(&header, trace, sizeof(header));
+    if (header.magic != TRACE_MAGIC || header.version != TRACE_VERSION ||
+        header.value_bytes > trace_length - sizeof(header) ||
+        (header.branch_count + 7) / 8 > trace_length - sizeof(header) - header.value_bytes) {
+        vm->error_printf(stderr, "uBPF error: the trace is malformed\n");
+        return -1;
+    }
+    if (!vm->insts || header.program_hash != vm->program_hash) {
+        vm->error_printf(stderr, "uBPF error: the trace was recorded for another program\n");
+        return -1;
+    }
+
+    uint64_t stack[UBPF_EBPF_STACK_SIZE / sizeof(uint64_t)];
+    struct ubpf_trace state = {
+        .buffer = (uint8_t*)trace,
+        .size = trace_length,
+        .replaying = true,
+        .value_offset = sizeof(header),
+        .value_end = sizeof(header) + header.value_bytes,
+        .branches = (const uint8_t*)trace + sizeof(header) + header.value_bytes,
+        .branch_limit = header.branch_count,
+        .stack_start = (uintptr_t)stack,
+        .stack_end = (uintptr_t)stack + sizeof(stack),
+    };
+
+    uint64_t return_value = 0;
+    int result = ubpf_exec_with_trace(
+        vm, (void*)(uintptr_t)header.mem, header.mem_len, &return_value, (uint8_t*)stack, sizeof(stack), &state);
+    if (state.failed || state.value_offset != state.value_end || state.branch_count != state.branch_limit) {
+        vm->error_printf(stderr, "uBPF error: the replay diverged from the trace\n");
+        return -1;
+    }
+    if (result != header.status || (result == 0 && return_value != header.return_value)) {
+        vm->error_printf(stderr, "uBPF error: the replay did not reproduce the result of the trace\n");
+        return -1;
+    }
+    *bpf_return_value = return_value;
+    return result;
+}
@@ -36,8 +36,15 @@
 #define SHIFT_MASK_64_BIT(X) ((X) & 0x3f)
 #define DEFAULT_JITTER_BUFFER_SIZE 65536
 
+// Specialize the interpreter loop for each of its variants (see ubpf_select_interpreter).
+#if defined(_MSC_VER)
+#define UBPF_ALWAYS_INLINE __forceinline
+#else
+#define UBPF_ALWAYS_INLINE inline __attribute__((always_inline))
+#endif
+
 static bool
-validate(const struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg);
+validate(struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg);
 static bool
 bounds_check(
     const struct ubpf_vm* vm,
@@ -48,13 +55,23 @@ bounds_check(
     void* mem,
     size_t mem_len,
     void* stack,
-    size_t stack_len);
+    size_t stack_len,
+    int* memory_region_hint);
 
 bool
 ubpf_toggle_bounds_check(struct ubpf_vm* vm, bool enable)
 {
     bool old = vm->bounds_check_enabled;
     vm->bounds_check_enabled = enable;
+    ubpf_select_interpreter(vm);
+    return old;
+}
+
+bool
+ubpf_toggle_replay_only(struct ubpf_vm* vm, bool enable)
+{
+    bool old = vm->replay_only;
+    vm->replay_only = enable;
     return old;
 }
 
@@ -63,6 +80,7 @@ ubpf_toggle_undefined_behavior_check(struct ubpf_vm* vm, bool enable)
 {
     bool old = vm->undefined_behavior_check_enabled;
     vm->undefined_behavior_check_enabled = enable;
+    ubpf_select_interpreter(vm);
     return old;
 }
 
@@ -83,27 +101,10 @@ ubpf_create(void)
         return NULL;
     }
 
-    vm->ext_funcs = calloc(MAX_EXT_FUNCS, sizeof(*vm->ext_funcs));
-    if (vm->ext_funcs == NULL) {
-        ubpf_destroy(vm);
-        return NULL;
-    }
-
-    vm->ext_func_names = calloc(MAX_EXT_FUNCS, sizeof(*vm->ext_func_names));
-    if (vm->ext_func_names == NULL) {
-        ubpf_destroy(vm);
-        return NULL;
-    }
-
-    vm->local_func_stack_usage = calloc(UBPF_MAX_INSTS, sizeof(struct ubpf_stack_usage));
-    if (vm->local_func_stack_usage == NULL) {
-        ubpf_destroy(vm);
-        return NULL;
-    }
-
     vm->bounds_check_enabled = true;
     vm->undefined_behavior_check_enabled = false;
     vm->error_printf = fprintf;
+    ubpf_select_interpreter(vm);
 
 #if defined(__x86_64__) || defined(_M_X64)
     vm->jit_translate = ubpf_translate_x86_64;
@@ -127,10 +128,12 @@ void
 ubpf_destroy(struct ubpf_vm* vm)
 {
     ubpf_unload_code(vm);
-    free(vm->int_funcs);
-    free(vm->ext_funcs);
-    free(vm->ext_func_names);
-    free(vm->local_func_stack_usage);
+    free(vm->helpers);
+    free(vm->kfuncs);
+    free(vm->jit_perf_name);
+    ubpf_runtime_stats_release(vm);
+    free(vm->memory_regions);
+    ubpf_btf_free(vm->host_btf);
     free(vm);
 }
 
@@ -140,15 +143,82 @@ as_external_function_t(void* f)
     return (external_function_t)f;
 };
 
+/**
+ * @brief Find the entry of the VM's hash table of helpers for the given ID: the one registered
+ * with the ID or else the free entry where it would be added. The table must have a free entry.
+ */
+static struct ubpf_helper*
+helper_entry(const struct ubpf_vm* vm, uint32_t id)
+{
+    uint32_t mask = vm->helpers_capacity - 1;
+    for (uint32_t slot = (id * 0x9e3779b1u) & mask;; slot = (slot + 1) & mask) {
+        struct ubpf_helper* helper = &vm->helpers[slot];
+        if (!helper->registered || helper->id == id) {
+            return helper;
+        }
+    }
+}
+
+const struct ubpf_helper*
+ubpf_find_helper(const struct ubpf_vm* vm, uint32_t id)
+{
+    if (!vm->helpers_capacity) {
+        return NULL;
+    }
+    const struct ubpf_helper* helper = helper_entry(vm, id);
+    return helper->registered ? helper : NULL;
+}
+
+/**
+ * @brief Double the capacity of the VM's hash table of helpers.
+ */
+static bool
+grow_helpers(struct ubpf_vm* vm)
+{
+    struct ubpf_helper* old_helpers = vm->helpers;
+    uint32_t old_capacity = vm->helpers_capacity;
+    uint32_t capacity = old_capacity ? old_capacity * 2 : 16;
+    struct ubpf_helper* helpers = calloc(capacity, sizeof(struct ubpf_helper));
+    if (helpers == NULL) {
+        return false;
+    }
+
+    vm->helpers = helpers;
+    vm->helpers_capacity = capacity;
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        if (old_helpers[i].registered) {
+            *helper_entry(vm, old_helpers[i].id) = old_helpers[i];
+        }
+    }
+    free(old_helpers);
+    return true;
+}
+
 int
 ubpf_register(struct ubpf_vm* vm, unsigned int idx, const char* name, external_function_t fn)
 {
-    if (idx >= MAX_EXT_FUNCS) {
+    // Keep the hash table at most half full.
+    if (!ubpf_find_helper(vm, idx) && (vm->num_helpers + 1) * 2 > vm->helpers_capacity && !grow_helpers(vm)) {
         return -1;
     }
+    struct ubpf_helper* helper = helper_entry(vm, idx);
+    if (!helper->registered) {
+        helper->registered = true;
+        helper->id = idx;
+        vm->num_helpers++;
+    }
+    helper->name = name;
+    helper->function = (extended_external_helper_t)fn;
 
-    vm->ext_funcs[idx] = (extended_external_helper_t)fn;
-    vm->ext_func_names[idx] = name;
+    // Only the helpers that the loaded program calls have a slot in its helper table.
+    uint32_t slot = 0;
+    while (slot < vm->helper_table_size && vm->helper_table_ids[slot] != idx) {
+        slot++;
+    }
+    if (slot == vm->helper_table_size) {
+        return 0;
+    }
+    vm->helper_table[slot] = (extended_external_helper_t)fn;
 
     int success = 0;
 
@@ -161,7 +231,7 @@ ubpf_register(struct ubpf_vm* vm, unsigned int idx, const char* name, external_f
         if (!vm->jit_update_helper(
                 vm,
                 (extended_external_helper_t)fn,
-                idx,
+                slot,
                 (uint8_t*)vm->jitted,
                 vm->jitted_size,
                 vm->jitted_result.external_helper_offset)) {
@@ -180,6 +250,12 @@ int
 ubpf_register_external_dispatcher(
     struct ubpf_vm* vm, external_function_dispatcher_t dispatcher, external_function_validate_t validater)
 {
+    if (vm->jitted_result.compile_result == UBPF_JIT_COMPILE_SUCCESS && vm->jitted_result.static_dispatch &&
+        vm->jitted_result.static_dispatcher != (dispatcher != NULL)) {
+        // The JIT'd code does not check whether there is a dispatcher.
+        return -1;
+    }
+
     vm->dispatcher = dispatcher;
     vm->dispatcher_validate = validater;
 
@@ -204,6 +280,77 @@ ubpf_register_external_dispatcher(
     return success;
 }
 
+/**
+ * @brief Find the index of the first registered kfunc whose BTF ID is not less than the given one.
+ */
+static uint32_t
+kfunc_lower_bound(const struct ubpf_vm* vm, uint32_t btf_id)
+{
+    uint32_t low = 0;
+    uint32_t high = vm->num_kfuncs;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (vm->kfuncs[middle].btf_id < btf_id) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+int
+ubpf_register_kfunc(struct ubpf_vm* vm, uint32_t btf_id, const char* name, external_function_t fn)
+{
+    // The programs that are loaded have already resolved their kfuncs.
+    if (vm->insts || !fn) {
+        return -1;
+    }
+
+    uint32_t index = kfunc_lower_bound(vm, btf_id);
+    if (index == vm->num_kfuncs || vm->kfuncs[index].btf_id != btf_id) {
+        struct ubpf_kfunc* kfuncs = realloc(vm->kfuncs, (vm->num_kfuncs + 1) * sizeof(struct ubpf_kfunc));
+        if (kfuncs == NULL) {
+            return -1;
+        }
+        vm->kfuncs = kfuncs;
+        memmove(&vm->kfuncs[index + 1], &vm->kfuncs[index], (vm->num_kfuncs - index) * sizeof(struct ubpf_kfunc));
+        vm->num_kfuncs++;
+    }
+    vm->kfuncs[index].btf_id = btf_id;
+    vm->kfuncs[index].name = name;
+    vm->kfuncs[index].function = (extended_external_helper_t)fn;
+    return 0;
+}
+
+const struct ubpf_kfunc*
+ubpf_find_kfunc(const struct ubpf_vm* vm, uint32_t btf_id)
+{
+    uint32_t index = kfunc_lower_bound(vm, btf_id);
+    return index < vm->num_kfuncs && vm->kfuncs[index].btf_id == btf_id ? &vm->kfuncs[index] : NULL;
+}
+
+const struct ubpf_kfunc*
+ubpf_lookup_registered_kfunc(const struct ubpf_vm* vm, const char* name)
+{
+    for (uint32_t i = 0; i < vm->num_kfuncs; i++) {
+        if (vm->kfuncs[i].name && !strcmp(vm->kfuncs[i].name, name)) {
+            return &vm->kfuncs[i];
+        }
+    }
+    return NULL;
+}
+
+int
+ubpf_set_dispatch_strategy(struct ubpf_vm* vm, enum DispatchStrategy strategy)
+{
+    if (strategy != DynamicDispatch && strategy != StaticDispatch) {
+        return -1;
+    }
+    vm->dispatch_strategy = strategy;
+    return 0;
+}
+
 int
 ubpf_set_unwind_function_index(struct ubpf_vm* vm, unsigned int idx)
 {
@@ -218,18 +365,96 @@ ubpf_set_unwind_function_index(struct ubpf_vm* vm, unsigned int idx)
 unsigned int
 ubpf_lookup_registered_function(struct ubpf_vm* vm, const char* name)
 {
-    int i;
-    for (i = 0; i < MAX_EXT_FUNCS; i++) {
-        const char* other = vm->ext_func_names[i];
-        if (other && !strcmp(other, name)) {
-            return i;
+    // Resolve a name that several helpers have to the lowest of their IDs.
+    unsigned int id = -1;
+    for (uint32_t i = 0; i < vm->helpers_capacity; i++) {
+        const struct ubpf_helper* helper = &vm->helpers[i];
+        if (helper->registered && helper->name && !strcmp(helper->name, name) && helper->id < id) {
+            id = helper->id;
         }
     }
-    return -1;
+    return id;
 }
 
-int
-ubpf_load(struct ubpf_vm* vm, const void* code, uint32_t code_len, char** errmsg)
+/**
+ * @brief Give the helper that a (validated) call instruction calls a slot in the VM's table of the
+ * helpers that the program calls (unless it has one) and store the slot in the offset of the call.
+ * The immediate keeps the ID of the helper, which is passed to the external dispatcher.
+ */
+static bool
+resolve_helper_call(struct ubpf_vm* vm, struct ebpf_inst* inst)
+{
+    // Programs call few distinct helpers, so the table is searched linearly.
+    uint32_t id = (uint32_t)inst->imm;
+    uint32_t slot = 0;
+    while (slot < vm->helper_table_size && vm->helper_table_ids[slot] != id) {
+        slot++;
+    }
+    if (slot == vm->helper_table_size) {
+        extended_external_helper_t* table =
+            realloc(vm->helper_table, (slot + 1) * sizeof(extended_external_helper_t));
+        if (table == NULL) {
+            return false;
+        }
+        vm->helper_table = table;
+        uint32_t* ids = realloc(vm->helper_table_ids, (slot + 1) * sizeof(uint32_t));
+        if (ids == NULL) {
+            return false;
+        }
+        vm->helper_table_ids = ids;
+
+        // A helper that is not registered (yet) is called through the external dispatcher.
+        const struct ubpf_helper* helper = ubpf_find_helper(vm, id);
+        vm->helper_table[slot] = helper ? helper->function : NULL;
+        vm->helper_table_ids[slot] = id;
+        vm->helper_table_size++;
+    }
+    inst->offset = slot;
+    return true;
+}
+
+/**
+ * @brief Give the kfunc that a (validated) call instruction calls a slot in the VM's table of the
+ * kfuncs that the program calls (unless it has one) and store the slot in the offset of the call.
+ */
+static bool
+resolve_kfunc_call(struct ubpf_vm* vm, struct ebpf_inst* inst, uint16_t** kfunc_slots)
+{
+    if (*kfunc_slots == NULL) {
+        *kfunc_slots = calloc(vm->num_kfuncs + 1, sizeof(uint16_t));
+        if (*kfunc_slots == NULL) {
+            return false;
+        }
+    }
+
+    // A VM that only replays traces may call kfuncs that are not registered.
+    const struct ubpf_kfunc* kfunc = ubpf_find_kfunc(vm, (uint32_t)inst->imm);
+    uint16_t* slot = kfunc ? &(*kfunc_slots)[kfunc - vm->kfuncs] : NULL;
+    if (slot && *slot) {
+        inst->offset = *slot - 1;
+        return true;
+    }
+
+    extended_external_helper_t* targets =
+        realloc(vm->kfunc_targets, (vm->num_kfunc_targets + 1) * sizeof(extended_external_helper_t));
+    if (targets == NULL) {
+        return false;
+    }
+    vm->kfunc_targets = targets;
+    vm->kfunc_targets[vm->num_kfunc_targets] = kfunc ? kfunc->function : NULL;
+    inst->offset = vm->num_kfunc_targets++;
+    if (slot) {
+        *slot = vm->num_kfunc_targets;
+    }
+    return true;
+}
+
+/**
+ * @brief Validate the code and store its instructions in the VM, in the given buffer or (if NULL)
+ * in a new one.
+ */
+static int
+load_code(struct ubpf_vm* vm, const void* code, uint32_t code_len, struct ebpf_inst* storage, char** errmsg)
 {
     const struct ebpf_inst* source_inst = code;
     *errmsg = NULL;
@@ -254,7 +479,7 @@ ubpf_load(struct ubpf_vm* vm, const void* code, uint32_t code_len, char** errmsg
         return -1;
     }
 
-    vm->insts = malloc(code_len);
+    vm->insts = storage ? storage : malloc(code_len);
     if (vm->insts == NULL) {
         *errmsg = ubpf_error("out of memory");
         return -1;
@@ -262,47 +487,115 @@ ubpf_load(struct ubpf_vm* vm, const void* code, uint32_t code_len, char** errmsg
 
     vm->num_insts = code_len / sizeof(vm->insts[0]);
 
+    // Hash the instructions before they are encoded (possibly in place).
+    vm->program_hash = ubpf_trace_program_hash(source_inst, vm->num_insts);
+
+    // The slot (plus one) of each registered kfunc in the table of the kfuncs that the program calls.
+    uint16_t* kfunc_slots = NULL;
+
     vm->int_funcs = (bool*)calloc(vm->num_insts, sizeof(bool));
     if (!vm->int_funcs) {
-        *errmsg = ubpf_error("out of memory");
-        return -1;
+        goto out_of_memory;
     }
 
     for (uint32_t i = 0; i < vm->num_insts; i++) {
+        struct ebpf_inst inst = source_inst[i];
         /* Mark targets of local call instructions. They
          * represent the beginning of local functions and
          * the jitter may need to do something special with
          * them.
          */
-        if (source_inst[i].opcode == EBPF_OP_CALL && source_inst[i].src == 1) {
-            uint32_t target = i + source_inst[i].imm + 1;
+        if (inst.opcode == EBPF_OP_CALL && inst.src == 1) {
+            uint32_t target = i + inst.imm + 1;
             vm->int_funcs[target] = true;
         }
+        /* Resolve calls to kfuncs, whose offset (which must be 0, for the BTF of the host) becomes
+         * the slot of the kfunc in a table of only the kfuncs that the program calls.
+         */
+        if (inst.opcode == EBPF_OP_CALL && inst.src == 0 && !resolve_helper_call(vm, &inst)) {
+            goto out_of_memory;
+        }
+        if (inst.opcode == EBPF_OP_CALL && inst.src == 2 && !resolve_kfunc_call(vm, &inst, &kfunc_slots)) {
+            goto out_of_memory;
+        }
         // Store instructions in the vm.
-        ubpf_store_instruction(vm, i, source_inst[i]);
+        ubpf_store_instruction(vm, i, inst);
+    }
+    free(kfunc_slots);
+    kfunc_slots = NULL;
+
+    if (vm->profiling_enabled && !ubpf_profile_allocate(vm)) {
+        goto out_of_memory;
     }
 
     return 0;
+
+out_of_memory:
+    free(kfunc_slots);
+    *errmsg = ubpf_error("out of memory");
+    // Leave no partially encoded program behind. Storage given by the caller is the caller's to free.
+    if (storage) {
+        vm->insts = NULL;
+        vm->num_insts = 0;
+    }
+    ubpf_unload_code(vm);
+    return -1;
+}
+
+int
+ubpf_load(struct ubpf_vm* vm, const void* code, uint32_t code_len, char** errmsg)
+{
+    return load_code(vm, code, code_len, NULL, errmsg);
+}
+
+int
+ubpf_load_in_place(struct ubpf_vm* vm, struct ebpf_inst* insts, uint32_t code_len, char** errmsg)
+{
+    int result = load_code(vm, insts, code_len, insts, errmsg);
+    if (vm->insts != insts) {
+        free(insts);
+    }
+    return result;
 }
 
 void
 ubpf_unload_code(struct ubpf_vm* vm)
 {
 
-    // Reset the stack usage amounts when code is unloaded.
+    // Reset the per-function metadata when code is unloaded.
     free(vm->local_func_stack_usage);
-    vm->local_func_stack_usage = calloc(UBPF_MAX_INSTS, sizeof(struct ubpf_stack_usage));
+    vm->local_func_stack_usage = NULL;
+    vm->num_local_funcs = 0;
+    free(vm->int_funcs);
+    vm->int_funcs = NULL;
+    free(vm->helper_table);
+    vm->helper_table = NULL;
+    free(vm->helper_table_ids);
+    vm->helper_table_ids = NULL;
+    vm->helper_table_size = 0;
+    free(vm->kfunc_targets);
+    vm->kfunc_targets = NULL;
+    vm->num_kfunc_targets = 0;
+    ubpf_runtime_stats_reset_helpers(vm);
+    ubpf_profile_release(vm);
+    ubpf_jit_release_debug_info(&vm->jitted_result);
+    ubpf_release_data_sections(vm);
 
     if (vm->jitted) {
+        ubpf_jit_perf_release(vm);
         munmap(vm->jitted, vm->jitted_size);
         vm->jitted = NULL;
         vm->jitted_size = 0;
     }
+    // There is no JIT'd code left to update when helpers (or the dispatcher) are registered.
+    vm->jitted_result.compile_result = UBPF_JIT_COMPILE_FAILURE;
     if (vm->insts) {
         free(vm->insts);
         vm->insts = NULL;
         vm->num_insts = 0;
     }
+    vm->instruction_bound = 0;
+    ubpf_select_interpreter(vm);
 }
 
 static uint32_t
@@ -608,7 +901,7 @@ ubpf_validate_shadow_register(const struct ubpf_vm* vm, uint32_t pc, uint16_t* s
     }
 
     if (inst.opcode == EBPF_OP_CALL) {
-        if (inst.src == 0) {
+        if (inst.src == 0 || inst.src == 2) {
             // Mark the return address register as initialized.
             *shadow_registers |= REGISTER_TO_SHADOW_MASK(0);
 
@@ -635,14 +928,45 @@ ubpf_validate_shadow_register(const struct ubpf_vm* vm, uint32_t pc, uint16_t* s
     return true;
 }
 
-int
-ubpf_exec_ex(
+/**
+ * @brief Determine whether an instruction is a conditional branch (whose direction a trace records).
+ */
+static inline bool
+is_conditional_branch(struct ebpf_inst inst)
+{
+    uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+    uint8_t op = inst.opcode & EBPF_JMP_OP_MASK;
+    return (cls == EBPF_CLS_JMP || cls == EBPF_CLS_JMP32) && op != EBPF_MODE_JA && op != EBPF_MODE_CALL &&
+           op != EBPF_MODE_EXIT;
+}
+
+/**
+ * @brief Run the program in the interpreter. Each combination of the checks is a variant of the loop that is
+ * specialized at compile time (see ubpf_select_interpreter), so that the checks that are off cost nothing.
+ *
+ * @param[in,out] trace The trace to record or replay (or NULL). The specialized variants pass NULL, so that
+ * tracing costs nothing either.
+ * @param[in] undefined_behavior_checks Whether to check for reads of uninitialized registers and stack.
+ * @param[in] bounds_checks Whether to check that the program only accesses memory that it may.
+ * @param[in] debug Whether to call the VM's debug function before each instruction.
+ * @param[in] termination_checks Whether to check that the program stays within its instructions and the VM's
+ * instruction limit, which is only unnecessary if the program is known to terminate within the limit.
+ * @param[in] profiling Whether to count the runs of the program's basic blocks.
+ */
+static UBPF_ALWAYS_INLINE int
+ubpf_exec_program(
     const struct ubpf_vm* vm,
     void* mem,
     size_t mem_len,
     uint64_t* bpf_return_value,
     uint8_t* stack_start,
-    size_t stack_length)
+    size_t stack_length,
+    struct ubpf_trace* trace,
+    const bool undefined_behavior_checks,
+    const bool bounds_checks,
+    const bool debug,
+    const bool termination_checks,
+    const bool profiling)
 {
     uint16_t pc = 0;
     const struct ebpf_inst* insts = vm->insts;
@@ -652,17 +976,32 @@ ubpf_exec_ex(
     int return_value = -1;
     void* external_dispatcher_cookie = mem;
     void* shadow_stack = NULL;
+    int memory_region_hint = 0; // The index of the registered memory region that satisfied the last check.
+    struct ubpf_runtime_stats_block* runtime_stats = NULL;
+    uint64_t start_ticks = 0;
+    bool measure_helper_latency = false;
 
     if (!insts) {
         /* Code must be loaded before we can execute */
         return -1;
     }
 
+    if (vm->replay_only && !(trace && trace->replaying)) {
+        vm->error_printf(stderr, "uBPF error: the VM only replays traces\n");
+        return -1;
+    }
+
+    if (vm->runtime_stats_enabled) {
+        runtime_stats = ubpf_runtime_stats_enter(vm);
+        measure_helper_latency = vm->helper_latency_enabled;
+        start_ticks = ubpf_runtime_stats_ticks();
+    }
+
     struct ubpf_stack_frame stack_frames[UBPF_MAX_CALL_DEPTH] = {
         0,
     };
 
-    if (vm->undefined_behavior_check_enabled) {
+    if (undefined_behavior_checks) {
         shadow_stack = calloc(stack_length / 8, 1);
         if (!shadow_stack) {
             return_value = -1;
@@ -689,32 +1028,35 @@ ubpf_exec_ex(
 
     int instruction_limit = vm->instruction_limit;
 
+    // The stack usage of the frame of each function that is called is set when the call is taken.
+    stack_frames[0].stack_usage = ubpf_stack_usage_for_local_func(vm, 0);
+
     while (1) {
         const uint16_t cur_pc = pc;
-        if (pc >= vm->num_insts) {
+        if (termination_checks && pc >= vm->num_insts) {
             return_value = -1;
             goto cleanup;
         }
-        if (vm->instruction_limit && instruction_limit-- <= 0) {
+        if (termination_checks && vm->instruction_limit && instruction_limit-- <= 0) {
             return_value = -1;
             vm->error_printf(stderr, "Error: Instruction limit exceeded.\n");
             goto cleanup;
         }
 
-        if ((pc == 0 || vm->int_funcs[pc]) && stack_frame_index < UBPF_MAX_CALL_DEPTH) {
-            stack_frames[stack_frame_index].stack_usage = ubpf_stack_usage_for_local_func(vm, pc);
+        if (profiling && vm->profile_counts && vm->profile_block_starts[pc]) {
+            vm->profile_counts[pc]++;
         }
 
         struct ebpf_inst inst = ubpf_fetch_instruction(vm, pc++);
 
-        if (!ubpf_validate_shadow_register(vm, cur_pc, &shadow_registers, inst)) {
+        if (undefined_behavior_checks && !ubpf_validate_shadow_register(vm, cur_pc, &shadow_registers, inst)) {
             vm->error_printf(stderr, "Error: Invalid register state at pc %d.\n", cur_pc);
             return_value = -1;
             goto cleanup;
         }
 
         // Invoke the debug function to allow the user to inspect the state of the VM if it is enabled.
-        if (vm->debug_function) {
+        if (debug && vm->debug_function) {
             vm->debug_function(
                 vm->debug_function_context, // The user's context pointer that was passed to ubpf_register_debug_fn.
                 cur_pc,                     // The current instruction pointer.
@@ -925,13 +1267,26 @@ ubpf_exec_ex(
              *
              * Needed since we don't have a verifier yet.
              */
+// When a trace is replayed, the memory other than the stack is not accessed (so it is not checked either).
+#define TRACED_ACCESS(address) (!trace || ubpf_trace_accesses_memory(trace, address))
+#define TRACED_LOAD(size)                                                                  \
+    (trace ? ubpf_trace_load(trace, reg[inst.src] + inst.offset, size)                     \
+           : ubpf_mem_load(reg[inst.src] + inst.offset, size))
+#define TRACED_STORE(size, value)                                                   \
+    do {                                                                            \
+        if (!trace || ubpf_trace_store(trace, reg[inst.dst] + inst.offset, size)) { \
+            ubpf_mem_store(reg[inst.dst] + inst.offset, value, size);               \
+        }                                                                           \
+    } while (0)
 #define BOUNDS_CHECK_LOAD(size)                                                                           \
     do {                                                                                                  \
-        if (!ubpf_check_shadow_stack(                                                                     \
+        if (undefined_behavior_checks &&                                                                  \
+            !ubpf_check_shadow_stack(                                                                     \
                 vm, stack_start, stack_length, shadow_stack, (char*)reg[inst.src] + inst.offset, size)) { \
-                shadow_registers &= ~REGISTER_TO_SHADOW_MASK(inst.dst);                                   \
+            shadow_registers &= ~REGISTER_TO_SHADOW_MASK(inst.dst);                                       \
         }                                                                                                 \
-        if (!bounds_check(                                                                                \
+        if (bounds_checks && TRACED_ACCESS(reg[inst.src] + inst.offset) &&                                \
+            !bounds_check(                                                                                \
                 vm,                                                                                       \
                 (char*)reg[inst.src] + inst.offset,                                                       \
                 size,                                                                                     \
@@ -940,78 +1295,84 @@ ubpf_exec_ex(
                 mem,                                                                                      \
                 mem_len,                                                                                  \
                 stack_start,                                                                              \
-                stack_length)) {                                                                          \
+                stack_length,                                                                             \
+                &memory_region_hint)) {                                                                   \
             return_value = -1;                                                                            \
             goto cleanup;                                                                                 \
         }                                                                                                 \
     } while (0)
-#define BOUNDS_CHECK_STORE(size)                                                                                       \
-    do {                                                                                                               \
-        if (!bounds_check(                                                                                             \
-                vm,                                                                                                    \
-                (char*)reg[inst.dst] + inst.offset,                                                                    \
-                size,                                                                                                  \
-                "store",                                                                                               \
-                cur_pc,                                                                                                \
-                mem,                                                                                                   \
-                mem_len,                                                                                               \
-                stack_start,                                                                                           \
-                stack_length)) {                                                                                       \
-            return_value = -1;                                                                                         \
-            goto cleanup;                                                                                              \
-        }                                                                                                              \
-        ubpf_mark_shadow_stack(vm, stack_start, stack_length, shadow_stack, (char*)reg[inst.dst] + inst.offset, size); \
+#define BOUNDS_CHECK_STORE(size)                                                                        \
+    do {                                                                                                \
+        if (bounds_checks && TRACED_ACCESS(reg[inst.dst] + inst.offset) &&                              \
+            !bounds_check(                                                                              \
+                vm,                                                                                     \
+                (char*)reg[inst.dst] + inst.offset,                                                     \
+                size,                                                                                   \
+                "store",                                                                                \
+                cur_pc,                                                                                 \
+                mem,                                                                                    \
+                mem_len,                                                                                \
+                stack_start,                                                                            \
+                stack_length,                                                                           \
+                &memory_region_hint)) {                                                                 \
+            return_value = -1;                                                                          \
+            goto cleanup;                                                                               \
+        }                                                                                               \
+        if (undefined_behavior_checks) {                                                                \
+            ubpf_mark_shadow_stack(                                                                     \
+                vm, stack_start, stack_length, shadow_stack, (char*)reg[inst.dst] + inst.offset, size); \
+        }                                                                                               \
     } while (0)
 
         case EBPF_OP_LDXW:
             BOUNDS_CHECK_LOAD(4);
-            reg[inst.dst] = ubpf_mem_load(reg[inst.src] + inst.offset, 4);
+            reg[inst.dst] = TRACED_LOAD(4);
             break;
         case EBPF_OP_LDXH:
             BOUNDS_CHECK_LOAD(2);
-            reg[inst.dst] = ubpf_mem_load(reg[inst.src] + inst.offset, 2);
+            reg[inst.dst] = TRACED_LOAD(2);
             break;
         case EBPF_OP_LDXB:
             BOUNDS_CHECK_LOAD(1);
-            reg[inst.dst] = ubpf_mem_load(reg[inst.src] + inst.offset, 1);
+            reg[inst.dst] = TRACED_LOAD(1);
             break;
         case EBPF_OP_LDXDW:
             BOUNDS_CHECK_LOAD(8);
-            reg[inst.dst] = ubpf_mem_load(reg[inst.src] + inst.offset, 8);
+            reg[inst.dst] = TRACED_LOAD(8);
             break;
 
         case EBPF_OP_STW:
             BOUNDS_CHECK_STORE(4);
-            ubpf_mem_store(reg[inst.dst] + inst.offset, inst.imm, 4);
+            TRACED_STORE(4, inst.imm);
             break;
         case EBPF_OP_STH:
             BOUNDS_CHECK_STORE(2);
-            ubpf_mem_store(reg[inst.dst] + inst.offset, inst.imm, 2);
+            TRACED_STORE(2, inst.imm);
             break;
         case EBPF_OP_STB:
             BOUNDS_CHECK_STORE(1);
-            ubpf_mem_store(reg[inst.dst] + inst.offset, inst.imm, 1);
+            TRACED_STORE(1, inst.imm);
             break;
         case EBPF_OP_STDW:
             BOUNDS_CHECK_STORE(8);
-            ubpf_mem_store(reg[inst.dst] + inst.offset, inst.imm, 8);
+            TRACED_STORE(8, inst.imm);
             break;
 
         case EBPF_OP_STXW:
             BOUNDS_CHECK_STORE(4);
-            ubpf_mem_store(reg[inst.dst] + inst.offset, reg[inst.src], 4);
+            TRACED_STORE(4, reg[inst.src]);
             break;
         case EBPF_OP_STXH:
             BOUNDS_CHECK_STORE(2);
-            ubpf_mem_store(reg[inst.dst] + inst.offset, reg[inst.src], 2);
+            TRACED_STORE(2, reg[inst.src]);
             break;
         case EBPF_OP_STXB:
             BOUNDS_CHECK_STORE(1);
-            ubpf_mem_store(reg[inst.dst] + inst.offset, reg[inst.src], 1);
+            TRACED_STORE(1, reg[inst.src]);
             break;
         case EBPF_OP_STXDW:
             BOUNDS_CHECK_STORE(8);
-            ubpf_mem_store(reg[inst.dst] + inst.offset, reg[inst.src], 8);
+            TRACED_STORE(8, reg[inst.src]);
             break;
 
         case EBPF_OP_LDDW:
@@ -1259,13 +1620,31 @@ ubpf_exec_ex(
             // Differentiate between local and external calls -- assume that the
             // program was assembled with the same endianess as the host machine.
             if (inst.src == 0) {
+                // The statistics are kept by the helper's slot in the program's table of helpers.
+                uint16_t helper_slot = (uint16_t)inst.offset;
+                uint64_t helper_start_ticks = 0;
+                if (runtime_stats && helper_slot < UBPF_RUNTIME_STATS_HELPERS) {
+                    runtime_stats->helper_calls[helper_slot]++;
+                    if (measure_helper_latency) {
+                        helper_start_ticks = ubpf_runtime_stats_ticks();
+                    }
+                }
                 // Handle call by address to external function.
-                if (vm->dispatcher != NULL) {
+                if (trace && trace->replaying) {
+                    // A replay takes the value that the helper returned from the trace.
+                    reg[0] = ubpf_trace_replay_value(trace, sizeof(reg[0]));
+                } else if (vm->dispatcher != NULL) {
                     reg[0] =
                         vm->dispatcher(reg[1], reg[2], reg[3], reg[4], reg[5], inst.imm, external_dispatcher_cookie);
                 } else {
-                    reg[0] =
-                        vm->ext_funcs[inst.imm](reg[1], reg[2], reg[3], reg[4], reg[5], external_dispatcher_cookie);
+                    reg[0] = vm->helper_table[(uint16_t)inst.offset](
+                        reg[1], reg[2], reg[3], reg[4], reg[5], external_dispatcher_cookie);
+                }
+                if (measure_helper_latency && helper_slot < UBPF_RUNTIME_STATS_HELPERS) {
+                    ubpf_runtime_stats_helper_latency(runtime_stats, helper_slot, helper_start_ticks);
+                }
+                if (trace) {
+                    ubpf_trace_record_helper(trace, reg[0]);
                 }
                 if (inst.imm == vm->unwind_stack_extension_index && reg[0] == 0) {
                     *bpf_return_value = reg[0];
@@ -1293,11 +1672,21 @@ ubpf_exec_ex(
 
                 stack_frame_index++;
                 pc += inst.imm;
+                if (stack_frame_index < UBPF_MAX_CALL_DEPTH) {
+                    stack_frames[stack_frame_index].stack_usage = ubpf_stack_usage_for_local_func(vm, pc);
+                }
                 break;
             } else if (inst.src == 2) {
-                // Calling external function by BTF ID is not yet supported.
-                return_value = -1;
-                goto cleanup;
+                // The kfunc was resolved to its slot in the table when the program was loaded.
+                if (trace && trace->replaying) {
+                    reg[0] = ubpf_trace_replay_value(trace, sizeof(reg[0]));
+                } else {
+                    reg[0] = vm->kfunc_targets[(uint16_t)inst.offset](
+                        reg[1], reg[2], reg[3], reg[4], reg[5], external_dispatcher_cookie);
+                }
+                if (trace) {
+                    ubpf_trace_record_helper(trace, reg[0]);
+                }
             }
             // Because we have already validated, we can assume that the type code is
             // valid.
@@ -1310,6 +1699,13 @@ ubpf_exec_ex(
             volatile uint64_t* destination = (volatile uint64_t*)(reg[inst.dst] + inst.offset);
             uint64_t value = reg[inst.src];
             uint64_t result;
+            if (trace && !ubpf_trace_updates_memory(trace, (uintptr_t)destination, sizeof(*destination))) {
+                // A replay takes the value that the operation fetched from the trace.
+                if (fetch) {
+                    reg[inst.imm == EBPF_ATOMIC_OP_CMPXCHG ? 0 : fetch_index] = ubpf_trace_replay_value(trace, 8);
+                }
+                break;
+            }
             switch (inst.imm & EBPF_ALU_OP_MASK) {
             case EBPF_ALU_OP_ADD:
                 result = UBPF_ATOMIC_ADD_FETCH(destination, value);
@@ -1338,6 +1734,9 @@ ubpf_exec_ex(
             }
             if (fetch) {
                 reg[fetch_index] = result;
+                if (trace) {
+                    ubpf_trace_record_fetch(trace, (uintptr_t)destination, 8, result);
+                }
             }
         } break;
 
@@ -1350,6 +1749,13 @@ ubpf_exec_ex(
             volatile uint32_t* destination = (volatile uint32_t*)(reg[inst.dst] + inst.offset);
             uint32_t value = u32(reg[inst.src]);
             uint32_t result;
+            if (trace && !ubpf_trace_updates_memory(trace, (uintptr_t)destination, sizeof(*destination))) {
+                // A replay takes the value that the operation fetched from the trace.
+                if (fetch) {
+                    reg[inst.imm == EBPF_ATOMIC_OP_CMPXCHG ? 0 : fetch_index] = ubpf_trace_replay_value(trace, 4);
+                }
+                break;
+            }
             switch (inst.imm & EBPF_ALU_OP_MASK) {
             case EBPF_ALU_OP_ADD:
                 result = UBPF_ATOMIC_ADD_FETCH32(destination, value);
@@ -1378,6 +1784,9 @@ ubpf_exec_ex(
             }
             if (fetch) {
                 reg[fetch_index] = result;
+                if (trace) {
+                    ubpf_trace_record_fetch(trace, (uintptr_t)destination, 4, result);
+                }
             }
         } break;
 
@@ -1389,15 +1798,177 @@ ubpf_exec_ex(
         if (((inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_ALU) && (inst.opcode & EBPF_ALU_OP_MASK) != 0xd0) {
             reg[inst.dst] &= UINT32_MAX;
         }
+        if (trace && is_conditional_branch(inst) && !ubpf_trace_branch(trace, pc != cur_pc + 1)) {
+            return_value = -1;
+            goto cleanup;
+        }
     }
 
 cleanup:
     if (shadow_stack) {
         free(shadow_stack);
     }
+    if (runtime_stats) {
+        if (return_value == 0) {
+            ubpf_runtime_stats_exit(runtime_stats, start_ticks, *bpf_return_value);
+        } else {
+            ubpf_runtime_stats_fail(runtime_stats, start_ticks);
+        }
+    }
     return return_value;
 }
 
+// The checks that a variant of the interpreter performs (the bits of its index in ubpf_interpreter_variants).
+#define UBPF_INTERPRETER_UNDEFINED_BEHAVIOR_CHECKS 0x1
+#define UBPF_INTERPRETER_BOUNDS_CHECKS 0x2
+#define UBPF_INTERPRETER_DEBUG 0x4
+#define UBPF_INTERPRETER_TERMINATION_CHECKS 0x8
+
+#define UBPF_INTERPRETER_VARIANT(checks)                                  \
+    static int ubpf_exec_variant_##checks(                                \
+        const struct ubpf_vm* vm,                                         \
+        void* mem,                                                        \
+        size_t mem_len,                                                   \
+        uint64_t* bpf_return_value,                                       \
+        uint8_t* stack_start,                                             \
+        size_t stack_length,                                              \
+        struct ubpf_trace* trace)                                         \
+    {                                                                     \
+        UNUSED_PARAMETER(trace);                                          \
+        return ubpf_exec_program(                                         \
+            vm,                                                           \
+            mem,                                                          \
+            mem_len,                                                      \
+            bpf_return_value,                                             \
+            stack_start,                                                  \
+            stack_length,                                                 \
+            NULL,                                                         \
+            ((checks) & UBPF_INTERPRETER_UNDEFINED_BEHAVIOR_CHECKS) != 0, \
+            ((checks) & UBPF_INTERPRETER_BOUNDS_CHECKS) != 0,             \
+            ((checks) & UBPF_INTERPRETER_DEBUG) != 0,                     \
+            ((checks) & UBPF_INTERPRETER_TERMINATION_CHECKS) != 0,        \
+            false);                                                       \
+    }
+
+UBPF_INTERPRETER_VARIANT(0)
+UBPF_INTERPRETER_VARIANT(1)
+UBPF_INTERPRETER_VARIANT(2)
+UBPF_INTERPRETER_VARIANT(3)
+UBPF_INTERPRETER_VARIANT(4)
+UBPF_INTERPRETER_VARIANT(5)
+UBPF_INTERPRETER_VARIANT(6)
+UBPF_INTERPRETER_VARIANT(7)
+UBPF_INTERPRETER_VARIANT(8)
+UBPF_INTERPRETER_VARIANT(9)
+UBPF_INTERPRETER_VARIANT(10)
+UBPF_INTERPRETER_VARIANT(11)
+UBPF_INTERPRETER_VARIANT(12)
+UBPF_INTERPRETER_VARIANT(13)
+UBPF_INTERPRETER_VARIANT(14)
+UBPF_INTERPRETER_VARIANT(15)
+
+static const ubpf_interpreter_fn ubpf_interpreter_variants[] = {
+    ubpf_exec_variant_0,
+    ubpf_exec_variant_1,
+    ubpf_exec_variant_2,
+    ubpf_exec_variant_3,
+    ubpf_exec_variant_4,
+    ubpf_exec_variant_5,
+    ubpf_exec_variant_6,
+    ubpf_exec_variant_7,
+    ubpf_exec_variant_8,
+    ubpf_exec_variant_9,
+    ubpf_exec_variant_10,
+    ubpf_exec_variant_11,
+    ubpf_exec_variant_12,
+    ubpf_exec_variant_13,
+    ubpf_exec_variant_14,
+    ubpf_exec_variant_15,
+};
+
+/**
+ * @brief The variant of the interpreter for the runs that are traced or profiled, which reads all of the settings
+ * at run time (a specialized variant for each of them as well would take four times as many copies of the loop).
+ */
+static int
+ubpf_exec_general(
+    const struct ubpf_vm* vm,
+    void* mem,
+    size_t mem_len,
+    uint64_t* bpf_return_value,
+    uint8_t* stack_start,
+    size_t stack_length,
+    struct ubpf_trace* trace)
+{
+    return ubpf_exec_program(
+        vm,
+        mem,
+        mem_len,
+        bpf_return_value,
+        stack_start,
+        stack_length,
+        trace,
+        vm->undefined_behavior_check_enabled,
+        vm->bounds_check_enabled,
+        vm->debug_function != NULL,
+        !ubpf_program_terminates(vm),
+        vm->profiling_enabled);
+}
+
+void
+ubpf_select_interpreter(struct ubpf_vm* vm)
+{
+    if (vm->profiling_enabled) {
+        vm->interpreter = ubpf_exec_general;
+        return;
+    }
+
+    unsigned int checks = 0;
+    if (vm->undefined_behavior_check_enabled) {
+        checks |= UBPF_INTERPRETER_UNDEFINED_BEHAVIOR_CHECKS;
+    }
+    if (vm->bounds_check_enabled) {
+        checks |= UBPF_INTERPRETER_BOUNDS_CHECKS;
+    }
+    if (vm->debug_function) {
+        checks |= UBPF_INTERPRETER_DEBUG;
+    }
+    // A program whose control flow graph has no cycles (validate found the most instructions that it can execute)
+    // needs no checks that it stays within its instructions and the instruction limit.
+    if (!ubpf_program_terminates(vm)) {
+        checks |= UBPF_INTERPRETER_TERMINATION_CHECKS;
+    }
+    vm->interpreter = ubpf_interpreter_variants[checks];
+}
+
+int
+ubpf_exec_with_trace(
+    const struct ubpf_vm* vm,
+    void* mem,
+    size_t mem_len,
+    uint64_t* bpf_return_value,
+    uint8_t* stack_start,
+    size_t stack_length,
+    struct ubpf_trace* trace)
+{
+    if (trace) {
+        return ubpf_exec_general(vm, mem, mem_len, bpf_return_value, stack_start, stack_length, trace);
+    }
+    return vm->interpreter(vm, mem, mem_len, bpf_return_value, stack_start, stack_length, NULL);
+}
+
+int
+ubpf_exec_ex(
+    const struct ubpf_vm* vm,
+    void* mem,
+    size_t mem_len,
+    uint64_t* bpf_return_value,
+    uint8_t* stack_start,
+    size_t stack_length)
+{
+    return vm->interpreter(vm, mem, mem_len, bpf_return_value, stack_start, stack_length, NULL);
+}
+
 int
 ubpf_exec(const struct ubpf_vm* vm, void* mem, size_t mem_len, uint64_t* bpf_return_value)
 {
@@ -1430,14 +2001,190 @@ ubpf_exec(const struct ubpf_vm* vm, void* mem, size_t mem_len, uint64_t* bpf_ret
  */
 static bool check_for_self_contained_sub_programs(const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg);
 
+/**
+ * @brief Determine whether an instruction uses r10 as anything other than the
+ * base address of a memory access. If it does, the frame pointer escapes and
+ * the instruction's function may access its stack through other registers.
+ */
 static bool
-validate(const struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg)
+frame_pointer_escapes(struct ebpf_inst inst)
+{
+    switch (inst.opcode & EBPF_CLS_MASK) {
+    case EBPF_CLS_ALU:
+    case EBPF_CLS_ALU64:
+        return inst.dst == BPF_REG_10 || ((inst.opcode & EBPF_SRC_REG) && inst.src == BPF_REG_10);
+    case EBPF_CLS_JMP:
+    case EBPF_CLS_JMP32:
+        return (inst.opcode & EBPF_SRC_REG) && inst.src == BPF_REG_10;
+    case EBPF_CLS_STX:
+        return inst.src == BPF_REG_10;
+    case EBPF_CLS_LD:
+        return inst.dst == BPF_REG_10;
+    case EBPF_CLS_LDX:
+        return inst.dst == BPF_REG_10;
+    default:
+        return false;
+    }
+}
+
+static int
+compare_local_func_pcs(const void* a, const void* b)
+{
+    const struct ubpf_stack_usage* left = a;
+    const struct ubpf_stack_usage* right = b;
+    return (int)left->pc - (int)right->pc;
+}
+
+/**
+ * @brief Build the VM's table of local functions: one entry, sorted by PC, for the
+ * main function and for every (in bounds) target of a local call.
+ *
+ * @param[in,out] vm The VM whose local function table is built.
+ * @param[in] insts The (not yet validated) program.
+ * @param[in] num_insts The number of instructions in the program.
+ * @param[out] errmsg The error message, if there is an error.
+ * @return True if the table was built, false otherwise.
+ */
+static bool
+build_local_func_table(struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg)
+{
+    uint32_t num_local_funcs = 1;
+    for (uint32_t pc = 0; pc < num_insts; pc++) {
+        if (insts[pc].opcode == EBPF_OP_CALL && insts[pc].src == 1) {
+            num_local_funcs++;
+        }
+    }
+
+    free(vm->local_func_stack_usage);
+    vm->num_local_funcs = 0;
+    vm->local_func_stack_usage = calloc(num_local_funcs, sizeof(struct ubpf_stack_usage));
+    if (vm->local_func_stack_usage == NULL) {
+        *errmsg = ubpf_error("out of memory");
+        return false;
+    }
+
+    struct ubpf_stack_usage* funcs = vm->local_func_stack_usage;
+    num_local_funcs = 1;
+    for (uint32_t pc = 0; pc < num_insts; pc++) {
+        if (insts[pc].opcode == EBPF_OP_CALL && insts[pc].src == 1) {
+            int64_t target = (int64_t)pc + insts[pc].imm + 1;
+            if (target >= 0 && target < num_insts) {
+                funcs[num_local_funcs++].pc = (uint16_t)target;
+            }
+        }
+    }
+
+    qsort(funcs, num_local_funcs, sizeof(funcs[0]), compare_local_func_pcs);
+
+    // Several calls may target the same function.
+    uint32_t unique = 1;
+    for (uint32_t i = 1; i < num_local_funcs; i++) {
+        if (funcs[i].pc != funcs[unique - 1].pc) {
+            funcs[unique++] = funcs[i];
+        }
+    }
+    vm->num_local_funcs = unique;
+    return true;
+}
+
+/**
+ * @brief Find the entry in the VM's table of local functions for the function that
+ * starts at the given PC.
+ *
+ * @param[in] vm The VM whose local function table is searched.
+ * @param[in] pc The PC of the first instruction of the local function.
+ * @return The function's entry or NULL if no local function starts at that PC.
+ */
+static struct ubpf_stack_usage*
+find_local_func(const struct ubpf_vm* vm, uint16_t pc)
+{
+    uint32_t low = 0;
+    uint32_t high = vm->num_local_funcs;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (vm->local_func_stack_usage[mid].pc < pc) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low < vm->num_local_funcs && vm->local_func_stack_usage[low].pc == pc) {
+        return &vm->local_func_stack_usage[low];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Calculate the stack usage of every function in the program from the
+ * r10-relative memory accesses that it performs.
+ *
+ * A function extends from its first instruction to the start of the next function.
+ * Its stack usage is the deepest r10-relative access rounded up to 16 bytes. If the
+ * frame pointer escapes (e.g., it is copied to another register to pass a pointer
+ * to a helper) or the function accesses memory above its frame, the function's
+ * stack usage cannot be inferred and it gets the default size.
+ *
+ * @param[in] vm The VM whose local function table is populated.
+ * @param[in] insts The (not yet validated) program.
+ * @param[in] num_insts The number of instructions in the program.
+ */
+static void
+infer_stack_usage(const struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_insts)
+{
+    for (uint32_t i = 0; i < vm->num_local_funcs; i++) {
+        struct ubpf_stack_usage* func = &vm->local_func_stack_usage[i];
+        uint32_t function_end = i + 1 < vm->num_local_funcs ? vm->local_func_stack_usage[i + 1].pc : num_insts;
+        uint32_t depth = 0;
+        bool escaped = false;
+
+        for (uint32_t pc = func->pc; pc < function_end && !escaped; pc++) {
+            struct ebpf_inst inst = insts[pc];
+            uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+            bool is_access = (cls == EBPF_CLS_LDX && inst.src == BPF_REG_10) ||
+                             ((cls == EBPF_CLS_ST || cls == EBPF_CLS_STX) && inst.dst == BPF_REG_10);
+
+            if (frame_pointer_escapes(inst)) {
+                escaped = true;
+            } else if (is_access) {
+                static const int32_t access_sizes[] = {4, 2, 1, 8};
+                int32_t size = access_sizes[(inst.opcode >> 3) & 3];
+                if (inst.offset + size > 0) {
+                    escaped = true;
+                } else if ((uint32_t)-inst.offset > depth) {
+                    depth = -inst.offset;
+                }
+            }
+
+            if (inst.opcode == EBPF_OP_LDDW) {
+                pc++;
+            }
+        }
+
+        if (escaped) {
+            func->stack_usage_calculated = UBPF_STACK_USAGE_DEFAULT;
+        } else {
+            func->stack_usage_calculated = UBPF_STACK_USAGE_INFERRED;
+            func->stack_usage = (depth + 15) & ~15;
+        }
+    }
+}
+
+static bool
+validate(struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_insts, char** errmsg)
 {
     if (num_insts >= UBPF_MAX_INSTS) {
         *errmsg = ubpf_error("too many instructions (max %u)", UBPF_MAX_INSTS);
         return false;
     }
 
+    if (!build_local_func_table(vm, insts, num_insts, errmsg)) {
+        return false;
+    }
+
+    if (!vm->stack_usage_calculator) {
+        infer_stack_usage(vm, insts, num_insts);
+    }
+
     if (!ubpf_calculate_stack_usage_for_local_func(vm, 0, errmsg)) {
         return false;
     }
@@ -1599,12 +2346,11 @@ validate(const struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_i
 
         case EBPF_OP_CALL:
             if (inst.src == 0) {
-                if (inst.imm < 0) {
-                    *errmsg = ubpf_error("invalid call immediate at PC %d", i);
-                    return false;
-                }
-                if ((vm->dispatcher != NULL && !vm->dispatcher_validate(inst.imm, vm)) ||
-                    (vm->dispatcher == NULL && (inst.imm >= MAX_EXT_FUNCS || !vm->ext_funcs[inst.imm]))) {
+                // Any 32-bit ID may be registered. A VM that only replays traces never calls the helpers.
+                const struct ubpf_helper* helper = ubpf_find_helper(vm, (uint32_t)inst.imm);
+                if (!vm->replay_only &&
+                    ((vm->dispatcher != NULL && !vm->dispatcher_validate(inst.imm, vm)) ||
+                     (vm->dispatcher == NULL && (!helper || !helper->function)))) {
                     *errmsg = ubpf_error("call to nonexistent function %u at PC %d", inst.imm, i);
                     return false;
                 }
@@ -1619,8 +2365,14 @@ validate(const struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_i
                     return false;
                 }
             } else if (inst.src == 2) {
-                *errmsg = ubpf_error("call to external function by BTF ID (at PC %d) is not supported", i);
-                return false;
+                if (inst.offset != 0) {
+                    *errmsg = ubpf_error("call to a kfunc of a module's BTF (at PC %d) is not supported", i);
+                    return false;
+                }
+                if (!vm->replay_only && !ubpf_find_kfunc(vm, (uint32_t)inst.imm)) {
+                    *errmsg = ubpf_error("call to nonexistent kfunc %u at PC %d", inst.imm, i);
+                    return false;
+                }
             } else {
                 *errmsg = ubpf_error("call (at PC %d) contains invalid type value", i);
                 return false;
@@ -1717,7 +2469,58 @@ validate(const struct ubpf_vm* vm, const struct ebpf_inst* insts, uint32_t num_i
     }
 
     // If the program is syntactically valid, check if it consists of self-contained sub-programs.
-    return check_for_self_contained_sub_programs(insts, num_insts, errmsg);
+    if (!check_for_self_contained_sub_programs(insts, num_insts, errmsg)) {
+        return false;
+    }
+
+    vm->instruction_bound = ubpf_calculate_instruction_bound(insts, num_insts);
+    ubpf_select_interpreter(vm);
+    return true;
+}
+
+/**
+ * @brief Find the number of registered memory regions that start at or before the given address.
+ *
+ * Because the regions are sorted and never overlap, the only region that could contain
+ * address is the one just before the returned index.
+ */
+static int
+memory_region_upper_bound(const struct ubpf_vm* vm, uintptr_t address)
+{
+    int low = 0;
+    int high = vm->num_memory_regions;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (vm->memory_regions[middle].start <= address) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static bool
+memory_region_contains(const struct ubpf_vm* vm, uintptr_t access_start, uintptr_t access_end, int* hint)
+{
+    if (vm->num_memory_regions == 0) {
+        return false;
+    }
+
+    // Programs tend to access the same region over and over, so try the last hit first.
+    if (*hint < vm->num_memory_regions) {
+        const struct ubpf_memory_region* region = &vm->memory_regions[*hint];
+        if (access_start >= region->start && access_end <= region->end) {
+            return true;
+        }
+    }
+
+    int index = memory_region_upper_bound(vm, access_start) - 1;
+    if (index < 0 || access_end > vm->memory_regions[index].end) {
+        return false;
+    }
+    *hint = index;
+    return true;
 }
 
 static bool
@@ -1730,7 +2533,8 @@ bounds_check(
     void* mem,
     size_t mem_len,
     void* stack,
-    size_t stack_len)
+    size_t stack_len,
+    int* memory_region_hint)
 {
     if (!vm->bounds_check_enabled)
         return true;
@@ -1766,6 +2570,24 @@ bounds_check(
         return true;
     }
 
+    // Check if the access is within the data sections of the program. The read-only ones may be
+    // shared with other VMs, so they can only be loaded from.
+    uintptr_t data_start = (uintptr_t)vm->data_sections;
+    if (access_start >= data_start && access_end <= data_start + vm->data_sections_size) {
+        return true;
+    }
+    if (vm->read_only_data && strcmp(type, "load") == 0) {
+        uintptr_t read_only_start = (uintptr_t)vm->read_only_data->data;
+        if (access_start >= read_only_start && access_end <= read_only_start + vm->read_only_data->size) {
+            return true;
+        }
+    }
+
+    // Check if the access is within one of the registered memory regions.
+    if (memory_region_contains(vm, access_start, access_end, memory_region_hint)) {
+        return true;
+    }
+
     // The address may be invalid or it may be a region of memory that the caller
     // is aware of but that is not part of the stack or memory.
     // Call any registered bounds check function to determine if the access is valid.
@@ -1889,6 +2711,19 @@ ubpf_register_data_relocation(struct ubpf_vm* vm, void* user_context, ubpf_data_
     return 0;
 }
 
+int
+ubpf_register_btf(struct ubpf_vm* vm, const void* btf, size_t btf_size, char** errmsg)
+{
+    *errmsg = NULL;
+    struct ubpf_btf* parsed = ubpf_btf_parse(btf, btf_size, true, errmsg);
+    if (!parsed) {
+        return -1;
+    }
+    ubpf_btf_free(vm->host_btf);
+    vm->host_btf = parsed;
+    return 0;
+}
+
 int
 ubpf_register_data_bounds_check(struct ubpf_vm* vm, void* user_context, ubpf_bounds_check bounds_check)
 {
@@ -1900,6 +2735,143 @@ ubpf_register_data_bounds_check(struct ubpf_vm* vm, void* user_context, ubpf_bou
     return 0;
 }
 
+int
+ubpf_register_memory_region(struct ubpf_vm* vm, const void* address, size_t size)
+{
+    uintptr_t start = (uintptr_t)address;
+    uintptr_t end = start + size;
+
+    if (size == 0 || end < start) {
+        return -1;
+    }
+
+    // Regions may not overlap: the new region must end before its successor
+    // starts and start after its predecessor ends.
+    int index = memory_region_upper_bound(vm, start);
+    if (index > 0 && vm->memory_regions[index - 1].end > start) {
+        return -1;
+    }
+    if (index < vm->num_memory_regions && vm->memory_regions[index].start < end) {
+        return -1;
+    }
+
+    if (vm->num_memory_regions == vm->memory_regions_capacity) {
+        int new_capacity = vm->memory_regions_capacity ? vm->memory_regions_capacity * 2 : 4;
+        struct ubpf_memory_region* new_regions =
+            realloc(vm->memory_regions, new_capacity * sizeof(struct ubpf_memory_region));
+        if (new_regions == NULL) {
+            return -1;
+        }
+        vm->memory_regions = new_regions;
+        vm->memory_regions_capacity = new_capacity;
+    }
+
+    memmove(
+        &vm->memory_regions[index + 1],
+        &vm->memory_regions[index],
+        (vm->num_memory_regions - index) * sizeof(struct ubpf_memory_region));
+    vm->memory_regions[index].start = start;
+    vm->memory_regions[index].end = end;
+    vm->num_memory_regions++;
+    return 0;
+}
+
+int
+ubpf_unregister_memory_region(struct ubpf_vm* vm, const void* address)
+{
+    uintptr_t start = (uintptr_t)address;
+    int index = memory_region_upper_bound(vm, start) - 1;
+    if (index < 0 || vm->memory_regions[index].start != start) {
+        return -1;
+    }
+
+    memmove(
+        &vm->memory_regions[index],
+        &vm->memory_regions[index + 1],
+        (vm->num_memory_regions - index - 1) * sizeof(struct ubpf_memory_region));
+    vm->num_memory_regions--;
+    return 0;
+}
+
+void
+ubpf_shared_data_acquire(struct ubpf_shared_data* shared)
+{
+    UBPF_ATOMIC_ADD_FETCH32(&shared->references, 1);
+}
+
+void
+ubpf_shared_data_release(struct ubpf_shared_data* shared)
+{
+    if (!shared || UBPF_ATOMIC_ADD_FETCH32(&shared->references, -1) != 1) {
+        return;
+    }
+    if (shared->mapped) {
+        munmap(shared->data, shared->size);
+    } else {
+        free(shared->data);
+    }
+    free(shared);
+}
+
+void
+ubpf_release_data_sections(struct ubpf_vm* vm)
+{
+    free(vm->data_sections);
+    vm->data_sections = NULL;
+    vm->data_sections_size = 0;
+    ubpf_shared_data_release(vm->read_only_data);
+    vm->read_only_data = NULL;
+}
+
+/**
+ * @brief The size of the pages into which the JIT'd code is mapped.
+ */
+static size_t
+ubpf_page_size(void)
+{
+#if defined(_WIN32)
+    return 4096;
+#else
+    long page_size = sysconf(_SC_PAGESIZE);
+    return page_size > 0 ? (size_t)page_size : 4096;
+#endif
+}
+
+int
+ubpf_get_memory_stats(const struct ubpf_vm* vm, struct ubpf_memory_stats* stats)
+{
+    if (stats == NULL) {
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->vm_bytes = sizeof(*vm);
+    stats->instruction_bytes = vm->num_insts * sizeof(vm->insts[0]);
+    stats->int_func_bytes = vm->int_funcs ? vm->num_insts * sizeof(vm->int_funcs[0]) : 0;
+    stats->ext_func_bytes = vm->helpers_capacity * sizeof(vm->helpers[0]) +
+                            vm->helper_table_size * (sizeof(vm->helper_table[0]) + sizeof(vm->helper_table_ids[0]));
+    stats->local_func_bytes = vm->num_local_funcs * sizeof(vm->local_func_stack_usage[0]);
+    if (vm->jitted) {
+        // The code occupies whole pages (whose protection changes apart from the rest of the heap).
+        size_t page_size = ubpf_page_size();
+        stats->jit_bytes = (vm->jitted_size + page_size - 1) / page_size * page_size;
+    }
+    stats->memory_region_table_bytes = vm->memory_regions_capacity * sizeof(vm->memory_regions[0]);
+    stats->data_section_bytes = vm->data_sections_size + (vm->read_only_data ? vm->read_only_data->size : 0);
+    stats->kfunc_bytes =
+        vm->num_kfuncs * sizeof(vm->kfuncs[0]) + vm->num_kfunc_targets * sizeof(vm->kfunc_targets[0]);
+    stats->runtime_stats_bytes = ubpf_runtime_stats_size(vm);
+    stats->total_bytes = stats->vm_bytes + stats->instruction_bytes + stats->int_func_bytes + stats->ext_func_bytes +
+                         stats->ext_func_name_bytes + stats->local_func_bytes + stats->jit_bytes +
+                         stats->memory_region_table_bytes + stats->data_section_bytes + stats->kfunc_bytes +
+                         stats->runtime_stats_bytes;
+
+    for (uint32_t i = 0; i < vm->num_memory_regions; i++) {
+        stats->registered_region_bytes += vm->memory_regions[i].end - vm->memory_regions[i].start;
+    }
+    return 0;
+}
+
 int
 ubpf_set_instruction_limit(struct ubpf_vm* vm, uint32_t limit, uint32_t* previous_limit)
 {
@@ -1907,27 +2879,37 @@ ubpf_set_instruction_limit(struct ubpf_vm* vm, uint32_t limit, uint32_t* previou
         *previous_limit = vm->instruction_limit;
     }
     vm->instruction_limit = limit;
+    ubpf_select_interpreter(vm);
     return 0;
 }
 
+bool
+ubpf_get_instruction_bound(const struct ubpf_vm* vm, uint32_t* bound)
+{
+    *bound = vm->instruction_bound;
+    return vm->instruction_bound != 0;
+}
+
 bool
 ubpf_calculate_stack_usage_for_local_func(const struct ubpf_vm* vm, uint16_t pc, char** errmsg)
 {
-    if (vm->local_func_stack_usage[pc].stack_usage_calculated == UBPF_STACK_USAGE_UNKNOWN) {
-        vm->local_func_stack_usage[pc].stack_usage_calculated = UBPF_STACK_USAGE_DEFAULT;
+    struct ubpf_stack_usage* func = find_local_func(vm, pc);
+    if (func == NULL) {
+        *errmsg = ubpf_error("no local function begins at PC %d", pc);
+        return false;
+    }
+
+    if (func->stack_usage_calculated == UBPF_STACK_USAGE_UNKNOWN) {
+        func->stack_usage_calculated = UBPF_STACK_USAGE_DEFAULT;
         if (vm->stack_usage_calculator) {
-            vm->local_func_stack_usage[pc].stack_usage =
-                (vm->stack_usage_calculator)(vm, pc, vm->stack_usage_calculator_cookie);
-            vm->local_func_stack_usage[pc].stack_usage_calculated = UBPF_STACK_USAGE_CUSTOM;
+            func->stack_usage = (vm->stack_usage_calculator)(vm, pc, vm->stack_usage_calculator_cookie);
+            func->stack_usage_calculated = UBPF_STACK_USAGE_CUSTOM;
         }
     }
 
     // Make sure that it is 16-byte aligned.
     if (ubpf_stack_usage_for_local_func(vm, pc) % 16) {
-        *errmsg = ubpf_error(
-            "local function (at PC %d) has improperly sized stack use (%d)",
-            pc,
-            vm->local_func_stack_usage[pc].stack_usage);
+        *errmsg = ubpf_error("local function (at PC %d) has improperly sized stack use (%d)", pc, func->stack_usage);
         return false;
     }
     return true;
@@ -1936,11 +2918,13 @@ ubpf_calculate_stack_usage_for_local_func(const struct ubpf_vm* vm, uint16_t pc,
 uint16_t
 ubpf_stack_usage_for_local_func(const struct ubpf_vm* vm, uint16_t pc)
 {
-    assert((vm->local_func_stack_usage[pc].stack_usage_calculated != UBPF_STACK_USAGE_UNKNOWN));
+    const struct ubpf_stack_usage* func = find_local_func(vm, pc);
 
+    // A PC at which no local function begins gets the default size.
     uint16_t stack_usage = UBPF_EBPF_LOCAL_FUNCTION_STACK_SIZE;
-    if (vm->local_func_stack_usage[pc].stack_usage_calculated == UBPF_STACK_USAGE_CUSTOM) {
-        stack_usage = vm->local_func_stack_usage[pc].stack_usage;
+    if (func != NULL && (func->stack_usage_calculated == UBPF_STACK_USAGE_CUSTOM ||
+                         func->stack_usage_calculated == UBPF_STACK_USAGE_INFERRED)) {
+        stack_usage = func->stack_usage;
     }
     return stack_usage;
 }
@@ -1962,6 +2946,7 @@ ubpf_register_debug_fn(struct ubpf_vm* vm, void* context, ubpf_debug_fn debug_fu
 
     vm->debug_function = debug_function;
     vm->debug_function_context = context;
+    ubpf_select_interpreter(vm);
     return 0;
 }
 